@@ -0,0 +1,53 @@
+/* middfs-bench-alloc.c -- count heap allocations made by benchmarked code
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * On glibc, malloc(3) and friends are replaced with wrappers that count
+ * calls and forward to glibc's allocator. Elsewhere, allocations aren't
+ * counted and bench_allocs() returns -1.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "bench/middfs-bench.h"
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_llong nallocs;
+
+void *malloc(size_t size) {
+   atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+   return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+   atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+   return __libc_calloc(nmemb, size);
+}
+
+/* NOTE: Every realloc(3) counts, since it may allocate and copy. */
+void *realloc(void *ptr, size_t size) {
+   atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+   return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+   __libc_free(ptr);
+}
+
+int64_t bench_allocs(void) {
+   return atomic_load(&nallocs);
+}
+
+#else
+
+int64_t bench_allocs(void) {
+   return -1;
+}
+
+#endif
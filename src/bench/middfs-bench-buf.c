@@ -0,0 +1,89 @@
+/* middfs-bench-buf.c -- struct buffer benchmarks
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lib/middfs-buf.h"
+
+#include "bench/middfs-bench.h"
+
+#define BENCH_SHIFT 64 /* bytes consumed per buffer_shift() */
+
+struct buf_arg {
+   struct buffer buf;
+   size_t len; /* bytes per operation */
+   int fd;
+};
+
+/* buffer_read() of _len_ bytes from /dev/zero into an empty buffer */
+static void bench_buffer_read(void *arg) {
+   struct buf_arg *a = arg;
+   buffer_empty(&a->buf);
+   bench_sink += buffer_read(a->fd, &a->buf);
+}
+
+/* buffer_write() of a full buffer of _len_ bytes to /dev/null */
+static void bench_buffer_write(void *arg) {
+   struct buf_arg *a = arg;
+   buffer_empty(&a->buf);
+   buffer_advance(&a->buf, a->len);
+   bench_sink += buffer_write(a->fd, &a->buf);
+}
+
+/* buffer_shift() of a small packet out of the front of a full buffer,
+ * as done after deserializing a packet */
+static void bench_buffer_shift(void *arg) {
+   struct buf_arg *a = arg;
+   buffer_empty(&a->buf);
+   buffer_advance(&a->buf, a->len);
+   buffer_shift(&a->buf, BENCH_SHIFT);
+   bench_sink += buffer_used(&a->buf);
+}
+
+/* draining a full buffer in small pieces, as done when a large packet is
+ * written to a socket that accepts little at a time */
+static void bench_buffer_drain(void *arg) {
+   struct buf_arg *a = arg;
+   buffer_empty(&a->buf);
+   buffer_advance(&a->buf, a->len);
+   while (!buffer_isempty(&a->buf)) {
+      buffer_shift(&a->buf, BENCH_SHIFT);
+   }
+}
+
+void bench_buf(void) {
+   static const size_t sizes[] = {4096, 65536, 1 << 20};
+   struct buf_arg arg;
+   int zero_fd, null_fd;
+
+   if ((zero_fd = open("/dev/zero", O_RDONLY)) < 0 ||
+       (null_fd = open("/dev/null", O_WRONLY)) < 0) {
+      perror("open");
+      exit(1);
+   }
+
+   for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+      arg.len = sizes[i];
+      buffer_init(&arg.buf);
+      if (buffer_resize(&arg.buf, arg.len) < 0) {
+         perror("buffer_resize");
+         exit(1);
+      }
+
+      arg.fd = zero_fd;
+      bench_run("buffer_read", arg.len, bench_buffer_read, &arg);
+      arg.fd = null_fd;
+      bench_run("buffer_write", arg.len, bench_buffer_write, &arg);
+      bench_run("buffer_shift", arg.len - BENCH_SHIFT, bench_buffer_shift, &arg);
+      bench_run("buffer_drain", arg.len, bench_buffer_drain, &arg);
+
+      buffer_delete(&arg.buf);
+   }
+
+   close(zero_fd);
+   close(null_fd);
+}
@@ -0,0 +1,101 @@
+/* middfs-bench-codec.c -- checksum and compression benchmarks
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "lib/middfs-crc.h"
+#include "lib/middfs-lz.h"
+
+#include "bench/middfs-bench.h"
+
+
+/* CRC32C */
+
+struct crc_arg {
+   const void *buf;
+   size_t len;
+};
+
+static void bench_crc32c(void *arg) {
+   struct crc_arg *a = arg;
+   bench_sink += crc32c(0, a->buf, a->len);
+}
+
+static void bench_crc32c_sw(void *arg) {
+   struct crc_arg *a = arg;
+   bench_sink += crc32c_sw(0, a->buf, a->len);
+}
+
+static void bench_crc(void) {
+   static const size_t sizes[] = {64, 4096, 65536, 1 << 20};
+   uint8_t *buf = bench_malloc(1 << 20);
+
+   for (size_t i = 0; i < 1 << 20; ++i) {
+      buf[i] = rand();
+   }
+
+   for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); ++i) {
+      struct crc_arg arg = {.buf = buf, .len = sizes[i]};
+      bench_run(crc32c_hw_available() ? "crc32c_hw" : "crc32c", sizes[i], bench_crc32c, &arg);
+      bench_run("crc32c_sw", sizes[i], bench_crc32c_sw, &arg);
+   }
+
+   free(buf);
+}
+
+
+/* LZ */
+
+struct lz_arg {
+   const void *src;
+   size_t srclen;
+   void *dst;
+   size_t dstlen;
+};
+
+static void bench_lz_compress(void *arg) {
+   struct lz_arg *a = arg;
+   bench_sink += lz_compress(a->src, a->srclen, a->dst, a->dstlen);
+}
+
+static void bench_lz_decompress(void *arg) {
+   struct lz_arg *a = arg;
+   bench_sink += lz_decompress(a->src, a->srclen, a->dst, a->dstlen);
+}
+
+static void bench_lz(void) {
+   const size_t len = 1 << 16;
+   char *text = bench_malloc(len);
+   char *comp = bench_malloc(lz_bound(len));
+   char *decomp = bench_malloc(len);
+   ssize_t clen;
+
+   /* CSV-like text */
+   for (size_t i = 0, row = 0; i < len; ++row) {
+      i += snprintf(text + i, len - i, "%zu,user%zu,/home/user%zu/file%zu.c,%zu\n",
+                    row, row % 17, row % 17, row, row * 31 % 1000);
+   }
+
+   if ((clen = lz_compress(text, len, comp, lz_bound(len))) < 0) {
+      fprintf(stderr, "lz_compress: failed\n");
+      exit(1);
+   }
+
+   struct lz_arg carg = {.src = text, .srclen = len, .dst = comp, .dstlen = lz_bound(len)};
+   bench_run("lz_compress", len, bench_lz_compress, &carg);
+   struct lz_arg darg = {.src = comp, .srclen = clen, .dst = decomp, .dstlen = len};
+   bench_run("lz_decompress", len, bench_lz_decompress, &darg);
+
+   free(text);
+   free(comp);
+   free(decomp);
+}
+
+
+void bench_codec(void) {
+   bench_crc();
+   bench_lz();
+}
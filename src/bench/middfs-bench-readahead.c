@@ -0,0 +1,128 @@
+/* middfs-bench-readahead.c -- read-ahead benchmarks
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * A file is read from start to end through the block cache & read-ahead,
+ * as middfs-client reads other clients' files, but from a simulated owner
+ * behind a link of BENCH_LINK_BPS bytes per second with a round trip time of
+ * a few milliseconds. Once read-ahead keeps the link busy, bytes_per_sec
+ * should be close to the link's and about the same for every round trip
+ * time, less the few round trips it takes the window to grow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "lib/middfs-conf.h"
+#include "lib/middfs-intern.h"
+#include "lib/middfs-lz.h"
+#include "lib/middfs-util.h"
+
+#include "client/middfs-client-conf.h"
+#include "client/middfs-client-block.h"
+#include "client/middfs-client-readahead.h"
+
+#include "bench/middfs-bench.h"
+
+#define BENCH_LINK_BPS (256ULL * 1024 * 1024) /* simulated link bandwidth */
+#define BENCH_FILE_SIZE (64 * 1024 * 1024)    /* size of file read */
+#define BENCH_READ_SIZE (128 * 1024)          /* size of the kernel's reads */
+
+/* simulated link, shared by all fetches */
+static struct {
+   pthread_mutex_t lock;
+   uint64_t rtt_ns;  /* round trip time */
+   uint64_t free_ns; /* when the link is done sending what's queued */
+} bench_link = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void bench_sleep_until(uint64_t ns) {
+   uint64_t now = lz_clock_ns();
+
+   if (ns > now) {
+      struct timespec ts = {.tv_sec = (ns - now) / 1000000000,
+                            .tv_nsec = (ns - now) % 1000000000};
+      nanosleep(&ts, NULL);
+   }
+}
+
+/* bench_fetch() -- read from the simulated owner (see block_fetch_f): the
+ * first chunk arrives a round trip after the request, and the rest follow
+ * as fast as the link carries them */
+static ssize_t bench_fetch(const struct rsrc *rsrc, uint64_t handle, const struct iovec *iov,
+                           int iovcnt, off_t offset, block_filled_f filled, void *arg) {
+   uint64_t arrival = lz_clock_ns() + bench_link.rtt_ns;
+   size_t size = 0;
+   size_t nbytes = 0;
+
+   for (int i = 0; i < iovcnt; ++i) {
+      size += iov[i].iov_len;
+   }
+   size = MIN(size, (size_t) (BENCH_FILE_SIZE - MIN(offset, BENCH_FILE_SIZE)));
+
+   bench_sleep_until(arrival); /* the link is free for others meanwhile */
+   while (nbytes < size) {
+      size_t chunk = MIN(size - nbytes, MPKT_STREAM_CHUNK);
+
+      pthread_mutex_lock(&bench_link.lock);
+      bench_link.free_ns = MAX(bench_link.free_ns, arrival) + chunk * 1000000000 / BENCH_LINK_BPS;
+      arrival = bench_link.free_ns;
+      pthread_mutex_unlock(&bench_link.lock);
+
+      bench_sleep_until(arrival);
+      nbytes += chunk; /* contents don't matter */
+      if (filled != NULL) {
+         filled(arg, nbytes);
+      }
+   }
+
+   return nbytes;
+}
+
+struct readahead_arg {
+   struct rsrc rsrc;
+   struct stat sb;
+   char *buf;
+};
+
+/* read file from start to end, starting with a cold cache */
+static void bench_readahead_file(void *arg) {
+   struct readahead_arg *a = arg;
+   struct readahead ra;
+
+   block_cache_invalidate(&a->rsrc, false);
+   readahead_init(&ra);
+   for (off_t off = 0; off < BENCH_FILE_SIZE; off += BENCH_READ_SIZE) {
+      readahead_read(&ra, &a->rsrc, 0, &a->sb, BENCH_READ_SIZE, off, bench_fetch);
+      bench_sink += block_cache_read(&a->rsrc, 0, &a->sb, a->buf, BENCH_READ_SIZE, off,
+                                     bench_fetch);
+   }
+}
+
+void bench_readahead(void) {
+   static const unsigned rtts_ms[] = {1, 4, 16};
+   struct readahead_arg arg = {.rsrc = {.mr_path = "/bench"},
+                               .sb = {.st_size = BENCH_FILE_SIZE},
+                               .buf = bench_malloc(BENCH_READ_SIZE)};
+   char name[64];
+
+   if (conf_put(MIDDFS_CONF_USERNAME "=bench") < 0 ||
+       conf_put(MIDDFS_CONF_HOMEPATH "=/") < 0 ||
+       conf_put(MIDDFS_CONF_SERVERIP "=127.0.0.1") < 0 ||
+       conf_put(MIDDFS_CONF_SERVERPORT "=1") < 0 ||
+       conf_put(MIDDFS_CONF_LOCALPORT "=1") < 0 ||
+       client_conf_init() < 0 ||
+       (arg.rsrc.mr_owner = (char *) intern("owner", strlen("owner"))) == NULL) {
+      perror("bench_readahead");
+      exit(1);
+   }
+
+   for (size_t i = 0; i < sizeof(rtts_ms) / sizeof(*rtts_ms); ++i) {
+      bench_link.rtt_ns = rtts_ms[i] * 1000000ULL;
+      snprintf(name, sizeof(name), "readahead_rtt%ums", rtts_ms[i]);
+      bench_run(name, BENCH_FILE_SIZE, bench_readahead_file, &arg);
+   }
+
+   free(arg.buf);
+}
@@ -0,0 +1,216 @@
+/* middfs-bench-serial.c -- packet (de)serialization benchmarks
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lib/middfs-buf.h"
+#include "lib/middfs-pkt.h"
+#include "lib/middfs-serial.h"
+#include "lib/middfs-arena.h"
+#include "lib/middfs-mem.h"
+
+#include "bench/middfs-bench.h"
+
+#define BENCH_DATA_SIZE 4096 /* payload of read responses & write requests */
+#define BENCH_DIR_COUNT 32   /* entries in directory listings */
+
+struct serial_arg {
+   struct middfs_packet pkt; /* packet to serialize */
+   struct buffer buf;        /* serialized packet */
+   struct arena *arena;      /* arena to deserialize into (may be NULL) */
+};
+
+static void bench_serialize_pkt(void *arg) {
+   struct serial_arg *a = arg;
+   buffer_empty(&a->buf);
+   bench_sink += buffer_serialize(&a->pkt, (serialize_f) serialize_pkt, &a->buf);
+}
+
+static void bench_deserialize_pkt(void *arg) {
+   struct serial_arg *a = arg;
+   struct middfs_packet pkt = {.mpkt_arena = a->arena};
+   int err = 0;
+
+   bench_sink += deserialize_pkt(a->buf.begin, buffer_used(&a->buf), &pkt, &err);
+   if (err) {
+      errno = err;
+      perror("deserialize_pkt");
+      exit(1);
+   }
+   packet_free(&pkt);
+}
+
+/* bench_pkt() -- benchmark serialization & deserialization of _a->pkt_
+ * NOTE: Throughput is always given in terms of the size of the plain packet.
+ */
+static void bench_pkt(const char *type, struct serial_arg *a) {
+   char name[64];
+   size_t len;
+
+   buffer_init(&a->buf);
+   bench_serialize_pkt(a);
+   len = buffer_used(&a->buf);
+
+   snprintf(name, sizeof(name), "serialize_pkt/%s", type);
+   bench_run(name, len, bench_serialize_pkt, a);
+   snprintf(name, sizeof(name), "deserialize_pkt/%s", type);
+   bench_run(name, len, bench_deserialize_pkt, a);
+
+   /* again, into an arena, as done by server_loop() */
+   struct arena arena;
+   arena_init(&arena);
+   a->arena = &arena;
+   snprintf(name, sizeof(name), "deserialize_pkt/%s+arena", type);
+   bench_run(name, len, bench_deserialize_pkt, a);
+   a->arena = NULL;
+   arena_delete(&arena);
+
+   /* again, with the default flags of a client */
+   packet_set_lz(&a->pkt, true, MPKT_F_ACCEPT_LZ);
+   packet_set_crc(&a->pkt, true);
+   bench_serialize_pkt(a);
+   snprintf(name, sizeof(name), "serialize_pkt/%s+crc+lz", type);
+   bench_run(name, len, bench_serialize_pkt, a);
+   snprintf(name, sizeof(name), "deserialize_pkt/%s+crc+lz", type);
+   bench_run(name, len, bench_deserialize_pkt, a);
+   a->pkt.mpkt_flags = 0;
+
+   buffer_delete(&a->buf);
+}
+
+static void bench_requests(char *data) {
+   struct serial_arg a = {.arena = NULL};
+   const struct rsrc rsrc = {.mr_owner = "alice", .mr_path = "/projects/middfs/src/main.c"};
+   const struct rsrc to = {.mr_owner = "alice", .mr_path = "/projects/middfs/src/main.c.bak"};
+
+   for (int type = MREQ_NONE + 1; type < MREQ_NTYPES; ++type) {
+      struct middfs_request *req = &a.pkt.mpkt_un.mpkt_request;
+
+      packet_init(&a.pkt, MPKT_REQUEST);
+      req->mreq_type = type;
+      req->mreq_requester = "bob";
+      req->mreq_rsrc = rsrc;
+      req->mreq_mode = 0644;
+      req->mreq_size = BENCH_DATA_SIZE;
+      req->mreq_to = to;
+      req->mreq_off = 0;
+      req->mreq_data = data;
+
+      bench_pkt(req_type_strs[type], &a);
+   }
+}
+
+static void bench_responses(char *data) {
+   struct serial_arg a = {.arena = NULL};
+   struct middfs_dirent ents[BENCH_DIR_COUNT];
+   char names[BENCH_DIR_COUNT][32];
+
+   for (int i = 0; i < BENCH_DIR_COUNT; ++i) {
+      snprintf(names[i], sizeof(names[i]), "file-%d.txt", i);
+      ents[i].mde_name = names[i];
+      ents[i].mde_mode = 0100644;
+   }
+
+   for (int type = 0; type < MRSP_NTYPES; ++type) {
+      struct middfs_response *rsp = &a.pkt.mpkt_un.mpkt_response;
+
+      packet_init(&a.pkt, MPKT_RESPONSE);
+      response_init(rsp, type);
+      switch (type) {
+      case MRSP_DATA:
+         rsp->mrsp_un.mrsp_data.mdata_buf = data;
+         rsp->mrsp_un.mrsp_data.mdata_nbytes = BENCH_DATA_SIZE;
+         break;
+      case MRSP_STAT:
+         rsp->mrsp_un.mrsp_stat = (struct middfs_stat)
+            {.mstat_mode = 0100644, .mstat_size = 12345, .mstat_blocks = 32,
+             .mstat_blksize = 4096};
+         break;
+      case MRSP_DIR:
+         rsp->mrsp_un.mrsp_dir.mdir_count = BENCH_DIR_COUNT;
+         rsp->mrsp_un.mrsp_dir.mdir_ents = ents;
+         break;
+      case MRSP_ERROR:
+         rsp->mrsp_un.mrsp_error = ENOENT;
+         break;
+      default:
+         break;
+      }
+
+      bench_pkt(rsp_type_strs[type], &a);
+   }
+}
+
+
+/* buffer_serialize() of a read response into a fresh buffer */
+static void bench_buffer_serialize(void *arg) {
+   struct serial_arg *a = arg;
+   struct buffer buf;
+
+   buffer_init(&buf);
+   bench_sink += buffer_serialize(&a->pkt, (serialize_f) serialize_pkt, &buf);
+   buffer_delete(&buf);
+}
+
+static void bench_payloads(void) {
+   const size_t maxlen = 64 << 20;
+   char *data = bench_malloc(maxlen);
+   struct serial_arg a = {.arena = NULL};
+   struct middfs_response *rsp = &a.pkt.mpkt_un.mpkt_response;
+
+   for (size_t i = 0; i < maxlen; ++i) {
+      data[i] = rand();
+   }
+
+   packet_init(&a.pkt, MPKT_RESPONSE);
+   response_init(rsp, MRSP_DATA);
+   rsp->mrsp_un.mrsp_data.mdata_buf = data;
+
+   for (size_t len = 16; len <= maxlen; len *= 4) {
+      rsp->mrsp_un.mrsp_data.mdata_nbytes = len;
+      bench_run("buffer_serialize", len, bench_buffer_serialize, &a);
+   }
+
+   /* reads of FUSE's usual sizes, whose payloads are taken from the pool;
+    * mem_per_op is the memory charged for the payload (see mem_charge()) */
+   for (size_t len = 64 << 10; len <= (1 << 20); len *= 2) {
+      char name[64];
+      struct middfs_packet pkt = {.mpkt_arena = NULL};
+      size_t used;
+      int err = 0;
+
+      rsp->mrsp_un.mrsp_data.mdata_nbytes = len;
+      buffer_init(&a.buf);
+      bench_serialize_pkt(&a);
+      snprintf(name, sizeof(name), "deserialize_pkt/read+%zuk", len >> 10);
+      bench_run(name, len, bench_deserialize_pkt, &a);
+
+      used = mem_used();
+      deserialize_pkt(a.buf.begin, buffer_used(&a.buf), &pkt, &err);
+      printf("{\"bench\": \"%s\", \"bytes\": %zu, \"mem_per_op\": %zu}\n", name, len,
+             mem_used() - used);
+      packet_free(&pkt);
+      buffer_delete(&a.buf);
+   }
+
+   free(data);
+}
+
+void bench_serial(void) {
+   char *data = bench_malloc(BENCH_DATA_SIZE);
+
+   /* source-code-like payload */
+   for (size_t i = 0; i < BENCH_DATA_SIZE; ++i) {
+      data[i] = "int main(void) {\n   return 0;\n}\n"[i % 32];
+   }
+
+   bench_requests(data);
+   bench_responses(data);
+   bench_payloads();
+
+   free(data);
+}
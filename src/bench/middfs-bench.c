@@ -0,0 +1,97 @@
+/* middfs-bench.c -- microbenchmarks for the middfs library
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * usage: middfs-bench [<filter>]
+ * Runs the benchmarks whose names contain _filter_ (all by default) and
+ * prints one JSON object per benchmark on stdout, e.g.
+ *   {"bench": "crc32c_hw", "bytes": 4096, "iters": 131072, "ns_per_op": 1607.3,
+ *    "bytes_per_sec": 2548365277, "allocs_per_op": 0.00}
+ * allocs_per_op is null where allocations can't be counted. Benchmarks of
+ * reads also print the memory charged for each payload, as mem_per_op.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lib/middfs-lz.h"
+
+#include "bench/middfs-bench.h"
+
+#define BENCH_MIN_NS 200000000ULL /* run each benchmark for at least 0.2 s */
+
+volatile uint64_t bench_sink;
+
+static const char *bench_filter = NULL;
+
+/* bench_run() -- time _fn_ and print the results
+ * ARGS:
+ *  - name: name of benchmark
+ *  - bytes: bytes processed per call (0 if not applicable)
+ *  - fn, arg: function to benchmark and its argument
+ */
+void bench_run(const char *name, size_t bytes, bench_f fn, void *arg) {
+   uint64_t iters = 1;
+   uint64_t elapsed;
+   int64_t allocs;
+
+   if (bench_filter != NULL && strstr(name, bench_filter) == NULL) {
+      return;
+   }
+
+   fn(arg); /* warm up */
+
+   for (;;) {
+      int64_t allocs_start = bench_allocs();
+      uint64_t start = lz_clock_ns();
+      for (uint64_t i = 0; i < iters; ++i) {
+         fn(arg);
+      }
+      elapsed = lz_clock_ns() - start;
+      allocs = bench_allocs() - allocs_start;
+
+      if (elapsed >= BENCH_MIN_NS) {
+         break;
+      }
+      iters *= 2;
+   }
+
+   double ns_per_op = (double) elapsed / iters;
+   printf("{\"bench\": \"%s\", \"bytes\": %zu, \"iters\": %llu, \"ns_per_op\": %.1f, "
+          "\"bytes_per_sec\": %.0f, ", name, bytes, (unsigned long long) iters, ns_per_op,
+          bytes ? bytes * 1e9 / ns_per_op : 0.0);
+   if (bench_allocs() < 0) {
+      printf("\"allocs_per_op\": null}\n");
+   } else {
+      printf("\"allocs_per_op\": %.2f}\n", (double) allocs / iters);
+   }
+   fflush(stdout);
+}
+
+/* bench_malloc() -- allocate memory for benchmark setup, or exit */
+void *bench_malloc(size_t size) {
+   void *ptr;
+
+   if ((ptr = malloc(size)) == NULL) {
+      perror("malloc");
+      exit(1);
+   }
+
+   return ptr;
+}
+
+int main(int argc, char *argv[]) {
+   if (argc > 2) {
+      fprintf(stderr, "usage: %s [<filter>]\n", argv[0]);
+      return 1;
+   }
+   bench_filter = argv[1]; /* NULL if absent */
+
+   bench_buf();
+   bench_serial();
+   bench_codec();
+   bench_readahead();
+
+   return 0;
+}
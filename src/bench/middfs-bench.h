@@ -0,0 +1,28 @@
+/* middfs-bench.h -- microbenchmark harness
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_BENCH_H
+#define __MIDDFS_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*bench_f)(void *arg);
+
+/* sink for results, so that benchmarked calls aren't optimized away */
+extern volatile uint64_t bench_sink;
+
+void bench_run(const char *name, size_t bytes, bench_f fn, void *arg);
+void *bench_malloc(size_t size);
+
+/* allocation counting (middfs-bench-alloc.c) */
+int64_t bench_allocs(void);
+
+/* benchmark suites */
+void bench_buf(void);
+void bench_serial(void);
+void bench_codec(void);
+void bench_readahead(void);
+
+#endif
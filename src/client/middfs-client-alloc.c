@@ -0,0 +1,57 @@
+/* middfs-client-alloc.c -- count heap allocations made by each thread
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Used to check that the FUSE operations on the hot path don't allocate
+ * (see print_op_stats()). Only in builds with MIDDFS_COUNT_ALLOCS defined
+ * (`make COUNT_ALLOCS=1') and on glibc are malloc(3) and friends replaced,
+ * as in middfs-bench, with wrappers that count calls and forward to glibc's
+ * allocator; otherwise, client_allocs() returns -1.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "client/middfs-client-ops.h"
+
+#if defined(__GLIBC__) && defined(MIDDFS_COUNT_ALLOCS)
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* per thread, so that an operation only sees its own allocations */
+static _Thread_local int64_t nallocs;
+
+void *malloc(size_t size) {
+   ++nallocs;
+   return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+   ++nallocs;
+   return __libc_calloc(nmemb, size);
+}
+
+/* NOTE: Every realloc(3) counts, since it may allocate and copy. */
+void *realloc(void *ptr, size_t size) {
+   ++nallocs;
+   return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+   __libc_free(ptr);
+}
+
+/* client_allocs() -- number of allocations made by the calling thread */
+int64_t client_allocs(void) {
+   return nallocs;
+}
+
+#else
+
+int64_t client_allocs(void) {
+   return -1;
+}
+
+#endif
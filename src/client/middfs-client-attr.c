@@ -0,0 +1,252 @@
+/* middfs-client-attr.c -- cache of attributes of network files
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * The cache is a fixed-size, set-associative table keyed by owner & path.
+ * Paths are stored in the entries themselves, so neither hits nor misses
+ * allocate; files whose paths are too long simply aren't cached. Within a
+ * set, an expired entry is replaced first, then the least recently used.
+ *
+ * A second table of the same shape remembers the size & mtime each file had
+ * when it was last opened (see attr_cache_reopen()). Its entries never
+ * expire, since they're only compared against fresh attributes.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "client/middfs-client-attr.h"
+#include "client/middfs-client-conf.h"
+
+#define ATTR_CACHE_SETS 512  /* number of sets (power of two) */
+#define ATTR_CACHE_WAYS 8    /* entries per set */
+#define ATTR_PATH_MAX 256    /* longest path cached, including the '\0' */
+
+struct attr_ent {
+   const char *owner;       /* interned; NULL if slot is free */
+   uint32_t hash;           /* of _owner_ & _path_ */
+   uint64_t expires;        /* when _st_ goes stale */
+   uint64_t used;           /* when entry was last looked up */
+   struct stat st;
+   char path[ATTR_PATH_MAX];
+};
+
+static struct {
+   pthread_mutex_t lock;
+   uint64_t gen; /* number of invalidations so far */
+   struct attr_ent ents[ATTR_CACHE_SETS][ATTR_CACHE_WAYS];
+} attr_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+struct attr_open_ent {
+   const char *owner;       /* interned; NULL if slot is free */
+   uint32_t hash;           /* of _owner_ & _path_ */
+   uint64_t used;           /* when file was last opened */
+   off_t size;
+   struct timespec mtime;
+   char path[ATTR_PATH_MAX];
+};
+
+static struct {
+   pthread_mutex_t lock;
+   struct attr_open_ent ents[ATTR_CACHE_SETS][ATTR_CACHE_WAYS];
+} attr_opens = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t attr_clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* attr_hash() -- hash owner & path of resource (FNV-1a) */
+static uint32_t attr_hash(const struct rsrc *rsrc) {
+   uint32_t hash = 2166136261u ^ (uint32_t) ((uintptr_t) rsrc->mr_owner >> 4);
+
+   for (const char *it = rsrc->mr_path; *it != '\0'; ++it) {
+      hash = (hash ^ (unsigned char) *it) * 16777619u;
+   }
+   return hash;
+}
+
+/* attr_find() -- find entry of resource
+ * RETV: the entry; NULL if it isn't cached.
+ * NOTE: Call with _attr_cache.lock_ held.
+ */
+static struct attr_ent *attr_find(const struct rsrc *rsrc, uint32_t hash) {
+   struct attr_ent *set = attr_cache.ents[hash % ATTR_CACHE_SETS];
+
+   for (int i = 0; i < ATTR_CACHE_WAYS; ++i) {
+      if (set[i].owner == rsrc->mr_owner && set[i].hash == hash &&
+          strcmp(set[i].path, rsrc->mr_path) == 0) {
+         return &set[i];
+      }
+   }
+   return NULL;
+}
+
+/* attr_cache_gen() -- get invalidation generation, to pass to
+ * attr_cache_put() along with the attributes fetched after this call */
+uint64_t attr_cache_gen(void) {
+   pthread_mutex_lock(&attr_cache.lock);
+   uint64_t gen = attr_cache.gen;
+   pthread_mutex_unlock(&attr_cache.lock);
+   return gen;
+}
+
+/* attr_cache_get() -- look up attributes of resource
+ * ARGS:
+ *  - rsrc: network resource
+ *  - sb: filled in on a hit
+ * RETV: true on a hit; false on a miss.
+ */
+bool attr_cache_get(const struct rsrc *rsrc, struct stat *sb) {
+   uint32_t hash = attr_hash(rsrc);
+   uint64_t now = attr_clock_ns();
+   struct attr_ent *ent;
+   bool hit = false;
+
+   pthread_mutex_lock(&attr_cache.lock);
+   if ((ent = attr_find(rsrc, hash)) != NULL) {
+      if (now < ent->expires) {
+         *sb = ent->st;
+         ent->used = now;
+         hit = true;
+      } else {
+         ent->owner = NULL; /* expired */
+      }
+   }
+   pthread_mutex_unlock(&attr_cache.lock);
+
+   return hit;
+}
+
+/* attr_cache_put() -- cache attributes of resource
+ * ARGS:
+ *  - rsrc: network resource
+ *  - sb: its attributes
+ *  - gen: attr_cache_gen() from before _sb_ was fetched; if the cache has
+ *         been invalidated since, _sb_ may predate a change and is dropped
+ */
+void attr_cache_put(const struct rsrc *rsrc, const struct stat *sb, uint64_t gen) {
+   double timeout = client_conf_attr_timeout(client_conf(), rsrc);
+   size_t len = strlen(rsrc->mr_path);
+   uint32_t hash = attr_hash(rsrc);
+   uint64_t now = attr_clock_ns();
+   struct attr_ent *ent;
+
+   if (timeout <= 0 || len >= ATTR_PATH_MAX) {
+      return;
+   }
+
+   pthread_mutex_lock(&attr_cache.lock);
+   if (gen == attr_cache.gen) {
+      if ((ent = attr_find(rsrc, hash)) == NULL) {
+         /* replace a free or expired entry, or else the least recently used */
+         struct attr_ent *set = attr_cache.ents[hash % ATTR_CACHE_SETS];
+         for (int i = 0; i < ATTR_CACHE_WAYS; ++i) {
+            if (set[i].owner == NULL || now >= set[i].expires) {
+               ent = &set[i];
+               break;
+            }
+            if (ent == NULL || set[i].used < ent->used) {
+               ent = &set[i];
+            }
+         }
+         ent->owner = rsrc->mr_owner;
+         ent->hash = hash;
+         memcpy(ent->path, rsrc->mr_path, len + 1);
+      }
+      ent->st = *sb;
+      ent->used = now;
+      ent->expires = now + (uint64_t) (timeout * 1e9);
+   }
+   pthread_mutex_unlock(&attr_cache.lock);
+}
+
+/* attr_cache_invalidate() -- drop cached attributes of resource, e.g.
+ *                            after it was written to or renamed
+ * ARGS:
+ *  - rsrc: network resource
+ *  - below: whether to drop the attributes of files below it, too (if
+ *           it is, or may be, a directory)
+ */
+void attr_cache_invalidate(const struct rsrc *rsrc, bool below) {
+   uint32_t hash = attr_hash(rsrc);
+   struct attr_ent *ent;
+
+   pthread_mutex_lock(&attr_cache.lock);
+   ++attr_cache.gen;
+   if ((ent = attr_find(rsrc, hash)) != NULL) {
+      ent->owner = NULL;
+   }
+   if (below) {
+      size_t len = strlen(rsrc->mr_path);
+      if (len > 0 && rsrc->mr_path[len - 1] == '/') {
+         --len; /* owner's directory is "/" */
+      }
+
+      for (int i = 0; i < ATTR_CACHE_SETS; ++i) {
+         for (int j = 0; j < ATTR_CACHE_WAYS; ++j) {
+            ent = &attr_cache.ents[i][j];
+            if (ent->owner == rsrc->mr_owner && strncmp(ent->path, rsrc->mr_path, len) == 0 &&
+                ent->path[len] == '/') {
+               ent->owner = NULL;
+            }
+         }
+      }
+   }
+   pthread_mutex_unlock(&attr_cache.lock);
+}
+
+/* attr_cache_reopen() -- note that resource was opened
+ * ARGS:
+ *  - rsrc: resource
+ *  - sb: its attributes as of the open
+ * RETV: true if it had the same size & mtime when it was last opened, i.e.
+ *       data cached since then is still valid; false otherwise.
+ */
+bool attr_cache_reopen(const struct rsrc *rsrc, const struct stat *sb) {
+   size_t len = strlen(rsrc->mr_path);
+   uint32_t hash = attr_hash(rsrc);
+   struct attr_open_ent *set = attr_opens.ents[hash % ATTR_CACHE_SETS];
+   struct attr_open_ent *ent = NULL;
+   bool unchanged = false;
+
+   if (len >= ATTR_PATH_MAX) {
+      return false;
+   }
+
+   pthread_mutex_lock(&attr_opens.lock);
+   for (int i = 0; i < ATTR_CACHE_WAYS; ++i) {
+      if (set[i].owner == rsrc->mr_owner && set[i].hash == hash &&
+          strcmp(set[i].path, rsrc->mr_path) == 0) {
+         ent = &set[i];
+         unchanged = (ent->size == sb->st_size && ent->mtime.tv_sec == sb->st_mtim.tv_sec &&
+                      ent->mtime.tv_nsec == sb->st_mtim.tv_nsec);
+         break;
+      }
+   }
+   if (ent == NULL) {
+      /* replace a free entry, or else the least recently opened */
+      for (int i = 0; i < ATTR_CACHE_WAYS; ++i) {
+         if (set[i].owner == NULL) {
+            ent = &set[i];
+            break;
+         }
+         if (ent == NULL || set[i].used < ent->used) {
+            ent = &set[i];
+         }
+      }
+      ent->owner = rsrc->mr_owner;
+      ent->hash = hash;
+      memcpy(ent->path, rsrc->mr_path, len + 1);
+   }
+   ent->used = attr_clock_ns();
+   ent->size = sb->st_size;
+   ent->mtime = sb->st_mtim;
+   pthread_mutex_unlock(&attr_opens.lock);
+
+   return unchanged;
+}
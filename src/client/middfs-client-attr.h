@@ -0,0 +1,27 @@
+/* middfs-client-attr.h -- cache of attributes of network files
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_ATTR_H
+#define __MIDDFS_CLIENT_ATTR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "lib/middfs-rsrc.h"
+
+/* Attributes of other clients' files are kept for the lifetime configured
+ * for the mount or for the directory containing them (see
+ * client_conf_attr_timeout()), so that repeated stats don't each cost a
+ * round trip through the server. Changes this client makes are reflected
+ * immediately by invalidating the affected entries; changes made by others
+ * are noticed when the entry expires. */
+
+uint64_t attr_cache_gen(void);
+bool attr_cache_get(const struct rsrc *rsrc, struct stat *sb);
+void attr_cache_put(const struct rsrc *rsrc, const struct stat *sb, uint64_t gen);
+void attr_cache_invalidate(const struct rsrc *rsrc, bool below);
+bool attr_cache_reopen(const struct rsrc *rsrc, const struct stat *sb);
+
+#endif
@@ -0,0 +1,607 @@
+/* middfs-client-block.c -- cache of blocks of network files
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Blocks are replaced according to 2Q (Johnson & Shasha, 1994), so that
+ * reading a large file once doesn't flush the blocks that are read over and
+ * over: a block fetched for the first time enters the FIFO _a1in_; when it
+ * falls off the end of _a1in_, only its key is remembered, in the ring of
+ * ghosts _a1out_; and a block fetched again while its ghost is still there
+ * enters the LRU list _am_, from which it is evicted only by other blocks
+ * that proved to be reused.
+ *
+ * A block being fetched is ``busy'': it is in the hash table, so that
+ * others reading it wait for the fetch rather than issue their own, but on
+ * neither list, so that it can't be evicted. Blocks are allocated as the
+ * cache grows and recycled afterwards, so reads don't allocate once the
+ * cache is full.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lib/middfs-util.h"
+
+#include "client/middfs-client-block.h"
+#include "client/middfs-client-conf.h"
+
+#define BLOCK_BUCKETS 4096  /* hash table size (power of two) */
+#define BLOCK_GHOSTS 4096   /* most ghosts remembered (at most 65535) */
+#define BLOCK_GHOST_BUCKETS 1024 /* ghost hash table size (power of two) */
+#define BLOCK_RUN_MAX 64    /* most blocks fetched at once (one streamed READ) */
+#define BLOCK_GEN_BUCKETS 1024 /* counters of invalidations by file (power of two) */
+
+enum block_state {BLOCK_FREE, BLOCK_BUSY, BLOCK_A1IN, BLOCK_AM};
+
+struct block {
+   struct block *hnext;      /* next in hash chain */
+   struct block *prev, *next; /* neighbours in list (toward head/tail) */
+   enum block_state state;
+   const char *owner;        /* interned */
+   uint32_t fhash;           /* of _owner_ & _path_ */
+   uint64_t hash;            /* of _owner_, _path_ & _index_ */
+   off_t index;              /* offset in file / BLOCK_SIZE */
+   off_t size;               /* size of file when block was fetched */
+   struct timespec mtime;    /* mtime of file when block was fetched */
+   size_t len;               /* bytes of file in _data_ (short at EOF) */
+   char path[BLOCK_PATH_MAX];
+   char data[BLOCK_SIZE];
+};
+
+/* struct block_list -- doubly-linked list, most recently added at head */
+struct block_list {
+   struct block *head;
+   struct block *tail;
+   size_t len;
+};
+
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t fetched;   /* signalled when busy blocks are done */
+   uint64_t gen;             /* number of invalidations of directories so far */
+   /* number of invalidations of files so far, by file hash; files sharing a
+    * counter just see each other's changes */
+   uint64_t fgen[BLOCK_GEN_BUCKETS];
+   size_t nblocks;           /* allocated blocks */
+   struct block_list a1in, am, free;
+   struct block *table[BLOCK_BUCKETS];
+   uint64_t ghosts[BLOCK_GHOSTS]; /* ring of hashes; 0 if unused */
+   size_t ghost_next;        /* next slot of ring to overwrite */
+   /* slots of the ring chained by hash, so that ghosts are found without
+    * scanning the ring; both hold slot + 1, or 0 at the end of a chain */
+   uint16_t ghost_table[BLOCK_GHOST_BUCKETS];
+   uint16_t ghost_chain[BLOCK_GHOSTS];
+} block_cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .fetched = PTHREAD_COND_INITIALIZER};
+
+/* block_fhash() -- hash owner & path of resource (FNV-1a) */
+static uint32_t block_fhash(const struct rsrc *rsrc) {
+   uint32_t hash = 2166136261u ^ (uint32_t) ((uintptr_t) rsrc->mr_owner >> 4);
+
+   for (const char *it = rsrc->mr_path; *it != '\0'; ++it) {
+      hash = (hash ^ (unsigned char) *it) * 16777619u;
+   }
+   return hash;
+}
+
+/* block_hash() -- hash block of file with hash _fhash_; never 0 */
+static uint64_t block_hash(uint32_t fhash, off_t index) {
+   uint64_t hash = ((uint64_t) fhash << 32 | fhash) ^ ((uint64_t) index * 0x9e3779b97f4a7c15ULL);
+   return hash != 0 ? hash : 1;
+}
+
+/* block_gen() -- count invalidations of file with hash _fhash_, including
+ * those of the directories above it
+ * NOTE: Call with _block_cache.lock_ held.
+ */
+static uint64_t block_gen(uint32_t fhash) {
+   return block_cache.gen + block_cache.fgen[fhash % BLOCK_GEN_BUCKETS];
+}
+
+/* block_limit() -- number of blocks that fit in the configured cache size */
+static size_t block_limit(void) {
+   return client_conf()->cache_size / sizeof(struct block);
+}
+
+static void block_list_push(struct block_list *list, struct block *blk) {
+   blk->prev = NULL;
+   blk->next = list->head;
+   if (list->head != NULL) {
+      list->head->prev = blk;
+   } else {
+      list->tail = blk;
+   }
+   list->head = blk;
+   ++list->len;
+}
+
+static void block_list_remove(struct block_list *list, struct block *blk) {
+   if (blk->prev != NULL) {
+      blk->prev->next = blk->next;
+   } else {
+      list->head = blk->next;
+   }
+   if (blk->next != NULL) {
+      blk->next->prev = blk->prev;
+   } else {
+      list->tail = blk->prev;
+   }
+   --list->len;
+}
+
+/* block_list_of() -- list that block in state _state_ is on; NULL if busy */
+static struct block_list *block_list_of(enum block_state state) {
+   switch (state) {
+   case BLOCK_FREE: return &block_cache.free;
+   case BLOCK_A1IN: return &block_cache.a1in;
+   case BLOCK_AM:   return &block_cache.am;
+   default:         return NULL;
+   }
+}
+
+/* NOTE: The following functions must be called with _block_cache.lock_ held. */
+
+/* block_find() -- find cached or busy block of resource */
+static struct block *block_find(const struct rsrc *rsrc, uint64_t hash, off_t index) {
+   for (struct block *blk = block_cache.table[hash % BLOCK_BUCKETS]; blk != NULL;
+        blk = blk->hnext) {
+      if (blk->hash == hash && blk->index == index && blk->owner == rsrc->mr_owner &&
+          strcmp(blk->path, rsrc->mr_path) == 0) {
+         return blk;
+      }
+   }
+   return NULL;
+}
+
+/* block_unhash() -- remove block from hash table */
+static void block_unhash(struct block *blk) {
+   struct block **it = &block_cache.table[blk->hash % BLOCK_BUCKETS];
+
+   while (*it != blk) {
+      it = &(*it)->hnext;
+   }
+   *it = blk->hnext;
+}
+
+/* block_detach() -- take block out of the cache (but not off the free list)
+ * RETV: _blk_
+ */
+static struct block *block_detach(struct block *blk) {
+   struct block_list *list = block_list_of(blk->state);
+
+   if (list != NULL) {
+      block_list_remove(list, blk);
+   }
+   block_unhash(blk);
+   blk->state = BLOCK_BUSY; /* i.e. on no list */
+   return blk;
+}
+
+/* block_release() -- move block to the free list */
+static void block_release(struct block *blk) {
+   block_detach(blk);
+   blk->state = BLOCK_FREE;
+   block_list_push(&block_cache.free, blk);
+}
+
+/* block_ghost_unlink() -- remove ghost in slot _slot_ of the ring from its
+ * hash chain and clear the slot */
+static void block_ghost_unlink(size_t slot) {
+   uint16_t *it = &block_cache.ghost_table[block_cache.ghosts[slot] % BLOCK_GHOST_BUCKETS];
+
+   while (*it != slot + 1) {
+      it = &block_cache.ghost_chain[*it - 1];
+   }
+   *it = block_cache.ghost_chain[slot];
+   block_cache.ghosts[slot] = 0;
+}
+
+/* block_ghost() -- remember that block with hash _hash_ fell off _a1in_ */
+static void block_ghost(uint64_t hash) {
+   size_t nghosts = MIN(MAX(block_limit() / 2, 1), BLOCK_GHOSTS);
+   size_t slot = block_cache.ghost_next++ % nghosts;
+   uint16_t *bucket = &block_cache.ghost_table[hash % BLOCK_GHOST_BUCKETS];
+
+   if (block_cache.ghosts[slot] != 0) {
+      block_ghost_unlink(slot); /* oldest ghost is forgotten */
+   }
+   block_cache.ghosts[slot] = hash;
+   block_cache.ghost_chain[slot] = *bucket;
+   *bucket = slot + 1;
+}
+
+/* block_unghost() -- forget ghost of block with hash _hash_
+ * RETV: whether there was one.
+ */
+static bool block_unghost(uint64_t hash) {
+   for (uint16_t it = block_cache.ghost_table[hash % BLOCK_GHOST_BUCKETS]; it != 0;
+        it = block_cache.ghost_chain[it - 1]) {
+      if (block_cache.ghosts[it - 1] == hash) {
+         block_ghost_unlink(it - 1);
+         return true;
+      }
+   }
+   return false;
+}
+
+/* block_evict() -- evict a cached block
+ * RETV: the block, detached; NULL if there are only busy blocks.
+ */
+static struct block *block_evict(void) {
+   size_t a1in_max = MAX(block_limit() / 4, 1);
+
+   if (block_cache.a1in.tail != NULL &&
+       (block_cache.a1in.len > a1in_max || block_cache.am.tail == NULL)) {
+      struct block *blk = block_detach(block_cache.a1in.tail);
+      block_ghost(blk->hash);
+      return blk;
+   }
+   if (block_cache.am.tail != NULL) {
+      return block_detach(block_cache.am.tail);
+   }
+   return NULL;
+}
+
+/* block_alloc() -- get a block to fetch into, recycling a free one, growing
+ * the cache or evicting one
+ * RETV: the block, detached; NULL if none is available.
+ */
+static struct block *block_alloc(void) {
+   struct block *blk;
+
+   if ((blk = block_cache.free.head) != NULL) {
+      block_list_remove(&block_cache.free, blk);
+      return blk;
+   }
+   if (block_cache.nblocks < block_limit() && (blk = malloc(sizeof(*blk))) != NULL) {
+      ++block_cache.nblocks;
+      return blk;
+   }
+   return block_evict();
+}
+
+/* block_trim() -- shrink the cache to the configured size, in case it was
+ * lowered */
+static void block_trim(void) {
+   size_t limit = block_limit();
+   struct block *blk;
+
+   while (block_cache.nblocks > limit) {
+      if ((blk = block_cache.free.head) != NULL) {
+         block_list_remove(&block_cache.free, blk);
+      } else if ((blk = block_evict()) == NULL) {
+         return; /* the rest are busy */
+      }
+      free(blk);
+      --block_cache.nblocks;
+   }
+}
+
+/* block_valid() -- check whether block is of the file with attributes _sb_ */
+static bool block_valid(const struct block *blk, const struct stat *sb) {
+   return blk->size == sb->st_size && blk->mtime.tv_sec == sb->st_mtim.tv_sec &&
+      blk->mtime.tv_nsec == sb->st_mtim.tv_nsec;
+}
+
+/* block_copy() -- copy data of block at _offset_ into _buf_
+ * RETV: number of bytes copied (0 at end of file).
+ */
+static size_t block_copy(const struct block *blk, char *buf, size_t size, off_t offset) {
+   size_t boff = offset - blk->index * BLOCK_SIZE;
+
+   if (boff >= blk->len) {
+      return 0;
+   }
+   size = MIN(size, blk->len - boff);
+   memcpy(buf, blk->data + boff, size);
+   return size;
+}
+
+/* block_claim() -- claim run of uncached blocks starting at _index_ for the
+ * caller to fetch, marking them busy
+ * ARGS:
+ *  - rsrc, sb: file & its attributes
+ *  - fhash: block_fhash(_rsrc_)
+ *  - index, count: the blocks to claim (as many as possible, from the first)
+ *  - run: where to store the claimed blocks
+ * RETV: number of blocks claimed.
+ */
+static int block_claim(const struct rsrc *rsrc, const struct stat *sb, uint32_t fhash,
+                       off_t index, int count, struct block **run) {
+   size_t len = strlen(rsrc->mr_path);
+   int nrun;
+
+   for (nrun = 0; nrun < count; ++nrun) {
+      uint64_t hash = block_hash(fhash, index + nrun);
+      struct block *blk = block_find(rsrc, hash, index + nrun);
+
+      if (blk != NULL) {
+         if (blk->state == BLOCK_BUSY || block_valid(blk, sb)) {
+            break; /* end of run */
+         }
+         block_release(blk); /* stale */
+      }
+      if ((blk = block_alloc()) == NULL) {
+         break;
+      }
+
+      blk->state = BLOCK_BUSY;
+      blk->owner = rsrc->mr_owner;
+      blk->fhash = fhash;
+      blk->hash = hash;
+      blk->index = index + nrun;
+      blk->size = sb->st_size;
+      blk->mtime = sb->st_mtim;
+      blk->len = 0;
+      memcpy(blk->path, rsrc->mr_path, len + 1);
+      blk->hnext = block_cache.table[hash % BLOCK_BUCKETS];
+      block_cache.table[hash % BLOCK_BUCKETS] = blk;
+      run[nrun] = blk;
+   }
+
+   return nrun;
+}
+
+/* block_publish() -- cache filled run of blocks (or free them, if the fetch
+ * failed or the file was invalidated since block_gen() was _gen_) and wake
+ * up those waiting for them */
+static void block_publish(struct block **run, int nrun, bool ok, uint64_t gen) {
+   for (int i = 0; i < nrun; ++i) {
+      struct block *blk = run[i];
+
+      if (ok && gen == block_gen(blk->fhash)) {
+         blk->state = block_unghost(blk->hash) ? BLOCK_AM : BLOCK_A1IN;
+         block_list_push(block_list_of(blk->state), blk);
+      } else {
+         block_unhash(blk);
+         blk->state = BLOCK_FREE;
+         block_list_push(&block_cache.free, blk);
+      }
+   }
+   pthread_cond_broadcast(&block_cache.fetched);
+}
+
+/* struct block_stream -- run of blocks being prefetched, whose blocks are
+ * cached one by one as the owner's streamed response fills them */
+struct block_stream {
+   struct block **run;
+   int nrun;
+   int ncached; /* blocks of _run_ already published */
+   uint64_t gen; /* block_gen() of the file when _run_ was claimed */
+};
+
+/* block_streamed() -- publish the blocks of a prefetched run that the first
+ * _nbytes_ bytes of the response have filled (see block_filled_f)
+ * NOTE: Called without _block_cache.lock_ held.
+ */
+static void block_streamed(void *arg, size_t nbytes) {
+   struct block_stream *stream = arg;
+   int nfull = MIN(nbytes / BLOCK_SIZE, (size_t) stream->nrun);
+
+   if (nfull > stream->ncached) {
+      pthread_mutex_lock(&block_cache.lock);
+      for (int i = stream->ncached; i < nfull; ++i) {
+         stream->run[i]->len = BLOCK_SIZE;
+      }
+      block_publish(stream->run + stream->ncached, nfull - stream->ncached, true, stream->gen);
+      stream->ncached = nfull;
+      pthread_mutex_unlock(&block_cache.lock);
+   }
+}
+
+/* block_fill() -- fetch claimed run of blocks from the owner
+ * ARGS:
+ *  - rsrc, handle: network resource & its owner's handle (0 if none)
+ *  - run, nrun: blocks claimed with block_claim()
+ *  - fetch: function that reads them
+ *  - stream: if not NULL, blocks are published as they arrive (and aren't
+ *            touched afterwards); otherwise, they stay busy for the caller
+ * RETV: result of _fetch_.
+ * NOTE: Drops _block_cache.lock_ during the fetch.
+ */
+static ssize_t block_fill(const struct rsrc *rsrc, uint64_t handle, struct block **run,
+                          int nrun, block_fetch_f fetch, struct block_stream *stream) {
+   struct iovec iov[BLOCK_RUN_MAX];
+   ssize_t retv;
+
+   for (int i = 0; i < nrun; ++i) {
+      iov[i] = (struct iovec) {.iov_base = run[i]->data, .iov_len = BLOCK_SIZE};
+   }
+
+   pthread_mutex_unlock(&block_cache.lock);
+   retv = fetch(rsrc, handle, iov, nrun, run[0]->index * BLOCK_SIZE,
+                stream != NULL ? block_streamed : NULL, stream);
+   pthread_mutex_lock(&block_cache.lock);
+
+   for (int i = (stream != NULL) ? stream->ncached : 0; i < nrun && retv >= 0; ++i) {
+      run[i]->len = MIN(MAX(retv - (ssize_t) i * BLOCK_SIZE, 0), BLOCK_SIZE);
+   }
+   return retv;
+}
+
+/* block_cacheable() -- check whether resource's blocks may be cached */
+static bool block_cacheable(const struct rsrc *rsrc) {
+   return strlen(rsrc->mr_path) < BLOCK_PATH_MAX && block_limit() > 0;
+}
+
+/* block_cache_read() -- read from network file through the cache
+ * ARGS:
+ *  - rsrc: network resource
+ *  - handle: owner's handle of the open file; 0 if none
+ *  - sb: its current attributes, against which cached blocks are validated
+ *  - buf, size, offset: as for pread(2)
+ *  - fetch: function that reads uncached blocks from the owner
+ * RETV: number of bytes read; -errno on error.
+ */
+ssize_t block_cache_read(const struct rsrc *rsrc, uint64_t handle, const struct stat *sb,
+                         char *buf, size_t size, off_t offset, block_fetch_f fetch) {
+   uint32_t fhash = block_fhash(rsrc);
+   size_t nbytes = 0;
+   ssize_t retv = 0;
+   bool eof = false;
+
+   if (!block_cacheable(rsrc)) {
+      struct iovec iov = {.iov_base = buf, .iov_len = size};
+      return fetch(rsrc, handle, &iov, 1, offset, NULL, NULL);
+   }
+   if (offset >= sb->st_size) {
+      return 0;
+   }
+   size = MIN(size, (size_t) (sb->st_size - offset));
+
+   pthread_mutex_lock(&block_cache.lock);
+   block_trim();
+
+   while (nbytes < size && !eof && retv >= 0) {
+      off_t off = offset + nbytes;
+      off_t index = off / BLOCK_SIZE;
+      struct block *blk = block_find(rsrc, block_hash(fhash, index), index);
+
+      if (blk != NULL && blk->state == BLOCK_BUSY) {
+         pthread_cond_wait(&block_cache.fetched, &block_cache.lock); /* fetch is shared */
+         continue;
+      }
+
+      if (blk != NULL && block_valid(blk, sb)) {
+         /* hit */
+         if (blk->state == BLOCK_AM) {
+            block_list_remove(&block_cache.am, blk);
+            block_list_push(&block_cache.am, blk);
+         }
+         size_t copied = block_copy(blk, buf + nbytes, size - nbytes, off);
+         nbytes += copied;
+         eof = (copied == 0);
+         continue;
+      }
+
+      /* miss: claim the uncached blocks up to the end of the range */
+      struct block *run[BLOCK_RUN_MAX];
+      int count = MIN((offset + size - 1) / BLOCK_SIZE - index + 1, BLOCK_RUN_MAX);
+      int nrun = block_claim(rsrc, sb, fhash, index, count, run);
+      uint64_t gen = block_gen(fhash);
+
+      if (nrun == 0) {
+         /* nothing to fetch into: read the rest without caching it */
+         pthread_mutex_unlock(&block_cache.lock);
+         struct iovec rest = {.iov_base = buf + nbytes, .iov_len = size - nbytes};
+         if ((retv = fetch(rsrc, handle, &rest, 1, off, NULL, NULL)) < 0) {
+            return nbytes > 0 ? (ssize_t) nbytes : retv;
+         }
+         return nbytes + retv;
+      }
+
+      /* copy out the fetched blocks before they can be evicted */
+      if ((retv = block_fill(rsrc, handle, run, nrun, fetch, NULL)) >= 0) {
+         for (int i = 0; i < nrun && !eof && nbytes < size; ++i) {
+            size_t copied = block_copy(run[i], buf + nbytes, size - nbytes, offset + nbytes);
+            nbytes += copied;
+            eof = (copied == 0);
+         }
+      }
+      block_publish(run, nrun, retv >= 0, gen);
+   }
+
+   pthread_mutex_unlock(&block_cache.lock);
+
+   if (retv < 0 && nbytes == 0) {
+      return retv;
+   }
+   return nbytes;
+}
+
+/* block_cache_prefetch() -- fetch uncached blocks of network file into the
+ * cache, e.g. ahead of sequential reads
+ * ARGS: as for block_cache_read(), without a buffer
+ * RETV: 0 on success; -errno on error.
+ * NOTE: Blocks already cached or being fetched are skipped. The rest are
+ *       fetched with one streamed READ per run of up to BLOCK_RUN_MAX
+ *       blocks, and each block is cached as soon as its chunk arrives, so
+ *       that a reader catching up doesn't wait for the whole range.
+ */
+int block_cache_prefetch(const struct rsrc *rsrc, uint64_t handle, const struct stat *sb,
+                         size_t size, off_t offset, block_fetch_f fetch) {
+   uint32_t fhash = block_fhash(rsrc);
+   ssize_t retv = 0;
+
+   if (!block_cacheable(rsrc) || offset >= sb->st_size) {
+      return 0;
+   }
+   size = MIN(size, (size_t) (sb->st_size - offset));
+
+   pthread_mutex_lock(&block_cache.lock);
+   for (off_t index = offset / BLOCK_SIZE, last = (offset + size - 1) / BLOCK_SIZE;
+        index <= last && retv >= 0; ) {
+      struct block *blk = block_find(rsrc, block_hash(fhash, index), index);
+
+      if (blk != NULL && (blk->state == BLOCK_BUSY || block_valid(blk, sb))) {
+         ++index; /* already there, or on its way */
+         continue;
+      }
+
+      struct block *run[BLOCK_RUN_MAX];
+      int nrun = block_claim(rsrc, sb, fhash, index, MIN(last - index + 1, BLOCK_RUN_MAX), run);
+      struct block_stream stream = {.run = run, .nrun = nrun, .gen = block_gen(fhash)};
+
+      if (nrun == 0) {
+         break; /* cache is full of busy blocks */
+      }
+      retv = block_fill(rsrc, handle, run, nrun, fetch, &stream);
+      block_publish(run + stream.ncached, nrun - stream.ncached, retv >= 0, stream.gen);
+      index += nrun;
+   }
+   pthread_mutex_unlock(&block_cache.lock);
+
+   return retv < 0 ? retv : 0;
+}
+
+/* block_cache_gen() -- count changes made by this client to network file
+ * _rsrc_ (or to a directory above it), so that attributes fetched before
+ * the last one can be told apart */
+uint64_t block_cache_gen(const struct rsrc *rsrc) {
+   uint32_t fhash = block_fhash(rsrc);
+   uint64_t gen;
+
+   pthread_mutex_lock(&block_cache.lock);
+   gen = block_gen(fhash);
+   pthread_mutex_unlock(&block_cache.lock);
+   return gen;
+}
+
+/* block_cache_invalidate() -- drop cached blocks of resource, e.g. after it
+ * was written to, truncated or renamed
+ * ARGS:
+ *  - rsrc: network resource
+ *  - below: whether to drop the blocks of files below it, too (if it is, or
+ *           may be, a directory)
+ */
+void block_cache_invalidate(const struct rsrc *rsrc, bool below) {
+   uint32_t fhash = block_fhash(rsrc);
+   size_t len = strlen(rsrc->mr_path);
+   struct block_list *lists[] = {&block_cache.a1in, &block_cache.am};
+
+   if (len > 0 && rsrc->mr_path[len - 1] == '/') {
+      --len; /* owner's directory is "/" */
+   }
+
+   pthread_mutex_lock(&block_cache.lock);
+   /* busy blocks won't be cached */
+   ++block_cache.fgen[fhash % BLOCK_GEN_BUCKETS];
+   if (below) {
+      ++block_cache.gen;
+   }
+   for (int i = 0; i < 2; ++i) {
+      struct block *next;
+      for (struct block *blk = lists[i]->head; blk != NULL; blk = next) {
+         next = blk->next;
+         if (blk->owner != rsrc->mr_owner) {
+            continue;
+         }
+         if ((blk->fhash == fhash && strcmp(blk->path, rsrc->mr_path) == 0) ||
+             (below && strncmp(blk->path, rsrc->mr_path, len) == 0 && blk->path[len] == '/')) {
+            block_release(blk);
+         }
+      }
+   }
+   pthread_mutex_unlock(&block_cache.lock);
+}
@@ -0,0 +1,47 @@
+/* middfs-client-block.h -- cache of blocks of network files
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_BLOCK_H
+#define __MIDDFS_CLIENT_BLOCK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "lib/middfs-rsrc.h"
+#include "lib/middfs-pkt.h"
+
+/* Contents of other clients' files are cached in blocks of BLOCK_SIZE
+ * bytes, up to the configured cache_size, so that rereading a range doesn't
+ * fetch it from the owner again. Each block remembers the size & mtime the
+ * file had when it was fetched and is dropped once the attributes the
+ * file had when it was last opened (see client_rsrc_read()) no longer
+ * match; reads past that size check it again. Changes this client makes
+ * invalidate the file's blocks immediately. */
+
+#define BLOCK_SIZE MPKT_STREAM_CHUNK
+#define BLOCK_PATH_MAX 256 /* longest path cached, including the '\0' */
+
+/* block_filled_f -- told by a fetch that the first _nbytes_ bytes of its
+ * _iov_ have been filled */
+typedef void (*block_filled_f)(void *arg, size_t nbytes);
+
+/* block_fetch_f -- reads _iov_ from the owner's file (through _handle_, if
+ * not 0), starting at _offset_, calling _filled_ (if not NULL) with _arg_
+ * as the data arrives; returns the number of bytes read (short at end of
+ * file) or -errno */
+typedef ssize_t (*block_fetch_f)(const struct rsrc *rsrc, uint64_t handle,
+                                 const struct iovec *iov, int iovcnt, off_t offset,
+                                 block_filled_f filled, void *arg);
+
+ssize_t block_cache_read(const struct rsrc *rsrc, uint64_t handle, const struct stat *sb,
+                         char *buf, size_t size, off_t offset, block_fetch_f fetch);
+int block_cache_prefetch(const struct rsrc *rsrc, uint64_t handle, const struct stat *sb,
+                         size_t size, off_t offset, block_fetch_f fetch);
+void block_cache_invalidate(const struct rsrc *rsrc, bool below);
+uint64_t block_cache_gen(const struct rsrc *rsrc);
+
+#endif
@@ -2,9 +2,375 @@
  * Nicholas Mosier & Tommaso Monaco 2019
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "lib/middfs-util.h"
+#include "lib/middfs-conf.h"
+#include "lib/middfs-intern.h"
+#include "lib/middfs-mem.h"
 
 #include "client/middfs-client-conf.h"
 
+/* Current snapshot. Replaced snapshots are never freed, since readers don't
+ * hold a reference; each reload leaks one small struct. */
+static _Atomic(const struct client_conf *) client_conf_cur;
+
+/* client_conf_str() -- get interned value of string configuration variable
+ * RETV: the value; NULL if it is not set.
+ */
+static const char *client_conf_str(const char *name) {
+   const char *value;
+
+   if ((value = conf_get(name)) == NULL) {
+      fprintf(stderr, "middfs-client: configuration variable ``%s'' is not set\n", name);
+      return NULL;
+   }
+   return intern(value, strlen(value));
+}
+
+/* client_conf_port() -- get value of port configuration variable
+ * RETV: 0 on success; -1 on error.
+ */
+static int client_conf_port(const char *name, uint16_t *port) {
+   int err = 0;
+   unsigned long long value = conf_get_ull(name, &err);
+
+   if (err || value == 0 || value > UINT16_MAX) {
+      fprintf(stderr, "middfs-client: invalid port ``%s''\n", name);
+      return -1;
+   }
+   *port = value;
+   return 0;
+}
+
+/* client_conf_bool() -- get value of boolean configuration variable, or
+ * _def_ if it is not set */
+static bool client_conf_bool(const char *name, bool def) {
+   const char *value = conf_get(name);
+
+   if (value == NULL) {
+      return def;
+   }
+   if (def) {
+      return !(strcmp(value, "0") == 0 || strcmp(value, "off") == 0 || strcmp(value, "no") == 0);
+   } else {
+      return strcmp(value, "1") == 0 || strcmp(value, "on") == 0 || strcmp(value, "yes") == 0;
+   }
+}
+
+/* client_conf_seconds() -- parse a nonnegative number of seconds
+ * ARGS:
+ *  - str, len: the number (not null-terminated)
+ * RETV: the number; -1 if it is invalid.
+ */
+static double client_conf_seconds(const char *str, size_t len) {
+   char buf[32];
+   char *endptr;
+   double value;
+
+   if (len == 0 || len >= sizeof(buf)) {
+      return -1;
+   }
+   memcpy(buf, str, len);
+   buf[len] = '\0';
+
+   value = strtod(buf, &endptr);
+   if (*endptr != '\0' || !(value >= 0)) {
+      return -1;
+   }
+   return value;
+}
+
+/* client_conf_attr_dirs() -- parse per-directory attribute cache lifetimes,
+ * a comma-separated list of ``/<owner>/<path>:<seconds>'' (e.g.
+ * ``/alice/build:0,/bob/photos:60'') */
+static void client_conf_attr_dirs(struct client_conf *conf) {
+   const char *value = conf_get(MIDDFS_CONF_ATTR_TIMEOUT_DIRS);
+
+   conf->nattr_dirs = 0;
+   if (value == NULL) {
+      return;
+   }
+
+   for (const char *ent = value; *ent != '\0'; ent += (*ent == ',')) {
+      size_t len = strcspn(ent, ",");
+      const char *colon = memrchr(ent, ':', len);
+      const char *owner = ent + strspn(ent, "/");
+      size_t owner_len = strcspn(owner, "/:,");
+      const char *path = owner + owner_len;
+      double timeout;
+
+      if (len == 0) {
+         continue; /* e.g. trailing comma */
+      }
+      if (colon == NULL || owner == ent || owner_len == 0 ||
+          (timeout = client_conf_seconds(colon + 1, ent + len - colon - 1)) < 0) {
+         fprintf(stderr, "middfs-client: ignoring invalid entry ``%.*s'' in ``%s''\n",
+                 (int) len, ent, MIDDFS_CONF_ATTR_TIMEOUT_DIRS);
+      } else if (conf->nattr_dirs == CLIENT_CONF_ATTR_DIRS_MAX) {
+         fprintf(stderr, "middfs-client: ignoring ``%.*s'': at most %d entries in ``%s''\n",
+                 (int) len, ent, CLIENT_CONF_ATTR_DIRS_MAX, MIDDFS_CONF_ATTR_TIMEOUT_DIRS);
+      } else {
+         struct client_conf_dir_timeout *dir = &conf->attr_dirs[conf->nattr_dirs];
+         dir->timeout = timeout;
+         dir->len = colon - path;
+         while (dir->len > 0 && path[dir->len - 1] == '/') {
+            --dir->len; /* "/alice/" is the same as "/alice" */
+         }
+         if ((dir->owner = intern(owner, owner_len)) != NULL &&
+             (dir->path = intern(path, dir->len)) != NULL) {
+            ++conf->nattr_dirs;
+         }
+      }
+
+      ent += len;
+   }
+}
+
+/* client_conf_timeout() -- get value of timeout configuration variable, in
+ * seconds, or _def_ if it is not set or invalid */
+static double client_conf_timeout(const char *name, double def) {
+   const char *value;
+   double timeout;
+
+   if ((value = conf_get(name)) == NULL) {
+      return def;
+   }
+   if ((timeout = client_conf_seconds(value, strlen(value))) < 0) {
+      fprintf(stderr, "middfs-client: invalid ``%s''; using %g s\n", name, def);
+      return def;
+   }
+   return timeout;
+}
+
+/* client_conf_size() -- get value of size configuration variable, in bytes,
+ * or _def_ if it is not set or invalid */
+static size_t client_conf_size(const char *name, size_t def) {
+   const char *value;
+   size_t size;
+
+   if ((value = conf_get(name)) == NULL) {
+      return def;
+   }
+   if (parse_size(value, &size) < 0) {
+      fprintf(stderr, "middfs-client: invalid ``%s''; using %zu bytes\n", name, def);
+      return def;
+   }
+   return size;
+}
+
+/* client_conf_count() -- get value of count configuration variable, or _def_
+ * if it is not set or invalid */
+static unsigned client_conf_count(const char *name, unsigned def) {
+   const char *value;
+   char *endptr;
+   unsigned long count;
+
+   if ((value = conf_get(name)) == NULL) {
+      return def;
+   }
+   count = strtoul(value, &endptr, 10);
+   if (*value == '\0' || *endptr != '\0' || count > UINT_MAX) {
+      fprintf(stderr, "middfs-client: invalid ``%s''; using %u\n", name, def);
+      return def;
+   }
+   return count;
+}
+
+/* client_conf_tunables() -- parse the tunables of _conf_ */
+static void client_conf_tunables(struct client_conf *conf) {
+   conf->compression = client_conf_bool(MIDDFS_CONF_COMPRESSION, true);
+   conf->checksums = client_conf_bool(MIDDFS_CONF_CHECKSUMS, true);
+   conf->attr_timeout = client_conf_timeout(MIDDFS_CONF_ATTR_TIMEOUT,
+                                            CLIENT_CONF_ATTR_TIMEOUT_DEFAULT);
+   client_conf_attr_dirs(conf);
+   conf->entry_timeout = client_conf_timeout(MIDDFS_CONF_ENTRY_TIMEOUT,
+                                             CLIENT_CONF_ENTRY_TIMEOUT_DEFAULT);
+   conf->cache_size = client_conf_size(MIDDFS_CONF_CACHE_SIZE, CLIENT_CONF_CACHE_SIZE_DEFAULT);
+   conf->readahead = client_conf_size(MIDDFS_CONF_READAHEAD, CLIENT_CONF_READAHEAD_DEFAULT);
+   conf->writeback = client_conf_bool(MIDDFS_CONF_WRITEBACK, false);
+   conf->max_io = client_conf_size(MIDDFS_CONF_MAX_IO, CLIENT_CONF_MAX_IO_DEFAULT);
+   conf->lease_timeout = client_conf_timeout(MIDDFS_CONF_LEASE_TIMEOUT,
+                                             CLIENT_CONF_LEASE_TIMEOUT_DEFAULT);
+   conf->max_threads = client_conf_count(MIDDFS_CONF_MAX_THREADS, 0);
+   conf->max_idle_threads = client_conf_count(MIDDFS_CONF_MAX_IDLE_THREADS, 0);
+   conf->lowlevel = client_conf_bool(MIDDFS_CONF_LOWLEVEL, true);
+}
+
+/* configuration variables parsed by client_conf_tunables() */
+static const char *const client_conf_tunable_names[] =
+   {MIDDFS_CONF_COMPRESSION, MIDDFS_CONF_CHECKSUMS, MIDDFS_CONF_ATTR_TIMEOUT,
+    MIDDFS_CONF_ATTR_TIMEOUT_DIRS, MIDDFS_CONF_ENTRY_TIMEOUT, MIDDFS_CONF_CACHE_SIZE,
+    MIDDFS_CONF_READAHEAD, MIDDFS_CONF_WRITEBACK, MIDDFS_CONF_MAX_IO,
+    MIDDFS_CONF_LEASE_TIMEOUT, MIDDFS_CONF_MAX_THREADS, MIDDFS_CONF_MAX_IDLE_THREADS,
+    MIDDFS_CONF_LOWLEVEL};
+
+/* client_conf_keep_mounted() -- keep the tunables of _conf_ that only take
+ * effect when mounting as they are in _cur_, warning about changed ones */
+static void client_conf_keep_mounted(struct client_conf *conf, const struct client_conf *cur) {
+#define CLIENT_CONF_KEEP(member, name)                                  \
+   if (conf->member != cur->member) {                                   \
+      fprintf(stderr, "middfs-client: ``%s'' only changes on remount\n", name); \
+      conf->member = cur->member;                                       \
+   }
+   CLIENT_CONF_KEEP(writeback, MIDDFS_CONF_WRITEBACK);
+   CLIENT_CONF_KEEP(max_io, MIDDFS_CONF_MAX_IO);
+   CLIENT_CONF_KEEP(max_threads, MIDDFS_CONF_MAX_THREADS);
+   CLIENT_CONF_KEEP(max_idle_threads, MIDDFS_CONF_MAX_IDLE_THREADS);
+   CLIENT_CONF_KEEP(lowlevel, MIDDFS_CONF_LOWLEVEL);
+#undef CLIENT_CONF_KEEP
+}
+
+/* client_conf_publish() -- make a copy of _conf_ the current snapshot
+ * RETV: 0 on success; -1 on error.
+ */
+static int client_conf_publish(const struct client_conf *conf) {
+   struct client_conf *snapshot;
+
+   if ((snapshot = malloc(sizeof(*snapshot))) == NULL) {
+      return -1;
+   }
+   *snapshot = *conf;
+   atomic_store_explicit(&client_conf_cur, snapshot, memory_order_release);
+   return 0;
+}
+
+/* client_conf_init() -- parse the configuration variables (e.g. after
+ * conf_load()) into the first snapshot
+ * RETV: 0 on success; -1 on error (e.g. if a required variable is missing).
+ */
+int client_conf_init(void) {
+   struct client_conf conf;
+
+   if ((conf.username = client_conf_str(MIDDFS_CONF_USERNAME)) == NULL ||
+       (conf.homepath = client_conf_str(MIDDFS_CONF_HOMEPATH)) == NULL ||
+       (conf.serverip = client_conf_str(MIDDFS_CONF_SERVERIP)) == NULL ||
+       client_conf_port(MIDDFS_CONF_SERVERPORT, &conf.serverport) < 0 ||
+       client_conf_port(MIDDFS_CONF_LOCALPORT, &conf.localport) < 0) {
+      errno = EINVAL;
+      return -1;
+   }
+   client_conf_tunables(&conf);
+
+   return client_conf_publish(&conf);
+}
+
+/* client_conf() -- get current configuration snapshot
+ * NOTE: Lock-free; may be called from any thread after client_conf_init().
+ */
+const struct client_conf *client_conf(void) {
+   return atomic_load_explicit(&client_conf_cur, memory_order_acquire);
+}
+
+/* client_conf_reload() -- reload configuration file and swap in a new
+ * snapshot, with the tunables updated
+ * ARGS:
+ *  - confpath: configuration file (ignored if it doesn't exist)
+ * RETV: 0 on success; -1 on error.
+ * NOTE: Tunables missing from the file get their defaults again. The
+ *       identity & addresses of the client, and the tunables that FUSE
+ *       takes when mounting (e.g. the thread counts), can't change without
+ *       remounting, so they are kept.
+ */
+int client_conf_reload(const char *confpath) {
+   const struct client_conf *cur = client_conf();
+   struct client_conf conf = *cur;
+
+   for (size_t i = 0; i < ARRLEN(client_conf_tunable_names); ++i) {
+      if (conf_unset(client_conf_tunable_names[i]) < 0) {
+         return -1;
+      }
+   }
+   if (access(confpath, R_OK) == 0 && conf_load(confpath) < 0) {
+      return -1;
+   }
+   client_conf_tunables(&conf);
+   client_conf_keep_mounted(&conf, cur);
+
+   if (client_conf_publish(&conf) < 0) {
+      return -1;
+   }
+
+   fprintf(stderr, "middfs-client: reloaded configuration from %s "
+           "(compression=%d, checksums=%d, attr_timeout=%g, entry_timeout=%g)\n", confpath,
+           conf.compression, conf.checksums, conf.attr_timeout, conf.entry_timeout);
+   return 0;
+}
+
+/* client_conf_attr_timeout() -- get lifetime of cached attributes of a
+ * resource: that of the innermost directory containing it that has one,
+ * or else the mount's
+ * RETV: the lifetime, in seconds.
+ */
+double client_conf_attr_timeout(const struct client_conf *conf, const struct rsrc *rsrc) {
+   const struct client_conf_dir_timeout *match = NULL;
+   const char *path = rsrc->mr_path;
+
+   for (int i = 0; i < conf->nattr_dirs; ++i) {
+      const struct client_conf_dir_timeout *dir = &conf->attr_dirs[i];
+      if (dir->owner == rsrc->mr_owner && strncmp(path, dir->path, dir->len) == 0 &&
+          (path[dir->len] == '\0' || path[dir->len] == '/' || dir->len == 0) &&
+          (match == NULL || dir->len > match->len)) {
+         match = dir;
+      }
+   }
+
+   return match ? match->timeout : conf->attr_timeout;
+}
+
+/* client_conf_watcher() -- reload configuration whenever SIGHUP arrives */
+static void *client_conf_watcher(void *arg) {
+   const char *confpath = arg;
+   sigset_t set;
+   int sig;
+
+   sigemptyset(&set);
+   sigaddset(&set, SIGHUP);
+   for (;;) {
+      if (sigwait(&set, &sig) == 0 && client_conf_reload(confpath) < 0) {
+         perror("client_conf_reload");
+      }
+   }
+
+   return NULL;
+}
+
+/* client_conf_sighup() -- never runs, since SIGHUP is blocked and taken by
+ * client_conf_watcher(), but keeps FUSE from installing its own handler,
+ * which would unmount the file system */
+static void client_conf_sighup(int sig) {}
+
+/* client_conf_watch() -- reload configuration on SIGHUP
+ * ARGS:
+ *  - confpath: configuration file, which must stay valid
+ * RETV: 0 on success; -1 on error.
+ * NOTE: Must be called before any other threads are started, so that they
+ *       all inherit the blocked SIGHUP.
+ */
+int client_conf_watch(const char *confpath) {
+   struct sigaction sa = {.sa_handler = client_conf_sighup};
+   sigset_t set;
+   pthread_t thread;
+
+   sigemptyset(&sa.sa_mask);
+   sigemptyset(&set);
+   sigaddset(&set, SIGHUP);
+   if (sigaction(SIGHUP, &sa, NULL) < 0 ||
+       (errno = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0 ||
+       (errno = pthread_create(&thread, NULL, client_conf_watcher, (void *) confpath)) != 0 ||
+       (errno = pthread_detach(thread)) != 0) {
+      return -1;
+   }
+
+   return 0;
+}
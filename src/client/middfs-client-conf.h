@@ -1,15 +1,96 @@
-/* middfs-client-conf.h -- middfs client configuration functions 
+/* middfs-client-conf.h -- middfs client configuration functions
  * Nicholas Mosier & Tommaso Monaco 2019
  */
 
 #ifndef __MIDDFS_CLIENT_CONF_H
 #define __MIDDFS_CLIENT_CONF_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lib/middfs-rsrc.h"
+
 #define MIDDFS_CONF_USERNAME "username"
 #define MIDDFS_CONF_LOCALPORT "localport"
 #define MIDDFS_CONF_SERVERPORT "serverport"
 #define MIDDFS_CONF_MOUNTPOINT "mountpoint"
 #define MIDDFS_CONF_HOMEPATH "homepath"
 #define MIDDFS_CONF_SERVERIP "serverip"
+#define MIDDFS_CONF_COMPRESSION "compression"
+#define MIDDFS_CONF_CHECKSUMS "checksums"
+#define MIDDFS_CONF_ATTR_TIMEOUT "attr_timeout"
+#define MIDDFS_CONF_ATTR_TIMEOUT_DIRS "attr_timeout_dirs"
+#define MIDDFS_CONF_ENTRY_TIMEOUT "entry_timeout"
+#define MIDDFS_CONF_CACHE_SIZE "cache_size"
+#define MIDDFS_CONF_READAHEAD "readahead"
+#define MIDDFS_CONF_WRITEBACK "writeback"
+#define MIDDFS_CONF_MAX_IO "max_io"
+#define MIDDFS_CONF_LEASE_TIMEOUT "lease_timeout"
+#define MIDDFS_CONF_MAX_THREADS "max_threads"
+#define MIDDFS_CONF_MAX_IDLE_THREADS "max_idle_threads"
+#define MIDDFS_CONF_LOWLEVEL "lowlevel"
+
+#define CLIENT_CONF_ATTR_TIMEOUT_DEFAULT 1.0 /* seconds */
+#define CLIENT_CONF_ATTR_DIRS_MAX 16
+#define CLIENT_CONF_ENTRY_TIMEOUT_DEFAULT 1.0 /* seconds */
+#define CLIENT_CONF_CACHE_SIZE_DEFAULT (64 * 1024 * 1024) /* bytes */
+#define CLIENT_CONF_READAHEAD_DEFAULT (4 * 1024 * 1024) /* bytes */
+#define CLIENT_CONF_MAX_IO_DEFAULT (1024 * 1024) /* bytes */
+#define CLIENT_CONF_LEASE_TIMEOUT_DEFAULT 60.0 /* seconds */
+
+/* struct client_conf_dir_timeout -- attribute cache lifetime for the files
+ * at or below a directory, overriding the mount's */
+struct client_conf_dir_timeout {
+   const char *owner; /* interned */
+   const char *path;  /* relative to owner ("" for all of owner's files) */
+   size_t len;        /* length of _path_ */
+   double timeout;    /* seconds */
+};
+
+/* struct client_conf -- snapshot of the client's configuration, parsed once
+ * from the configuration variables so that operations don't look them up.
+ * Snapshots are immutable and read without locking; a reload (on SIGHUP)
+ * swaps in a new one. Strings are interned, so they stay valid across
+ * reloads. */
+struct client_conf {
+   /* identity & addresses -- fixed for the life of the mount */
+   const char *username;
+   const char *homepath;
+   const char *serverip;
+   uint16_t serverport;
+   uint16_t localport;
+
+   /* tunables -- updated on reload, but for _writeback_, _max_io_,
+    * _max_threads_, _max_idle_threads_ & _lowlevel_, which are fixed for the
+    * life of the mount */
+   bool compression; /* compress payloads (default on) */
+   bool checksums;   /* checksum outgoing packets (default on) */
+   double attr_timeout; /* seconds that file attributes are cached (default 1) */
+   struct client_conf_dir_timeout attr_dirs[CLIENT_CONF_ATTR_DIRS_MAX];
+   int nattr_dirs;      /* number of per-directory overrides of _attr_timeout_ */
+   double entry_timeout; /* seconds that directory listings, missing files and
+                          * symbolic link targets are cached (default 1) */
+   size_t cache_size;    /* bytes of other clients' file contents cached
+                          * (default 64M; 0 disables the cache) */
+   size_t readahead;     /* most bytes fetched ahead of sequential reads
+                          * (default 4M; 0 disables read-ahead) */
+   bool writeback;       /* let the kernel cache writes (default off) */
+   size_t max_io;        /* largest read or write the kernel sends in
+                          * writeback mode (default 1M) */
+   double lease_timeout; /* seconds that files opened by others stay open
+                          * here while unused (default 60; 0 disables) */
+   unsigned max_threads;      /* most FUSE worker threads (0: FUSE's default) */
+   unsigned max_idle_threads; /* most idle FUSE worker threads kept (0: FUSE's
+                               * default) */
+   bool lowlevel;        /* serve the kernel through FUSE's low-level
+                          * interface (default on; FUSE 3 only) */
+};
+
+int client_conf_init(void);
+const struct client_conf *client_conf(void);
+int client_conf_reload(const char *confpath);
+int client_conf_watch(const char *confpath);
+double client_conf_attr_timeout(const struct client_conf *conf, const struct rsrc *rsrc);
 
 #endif
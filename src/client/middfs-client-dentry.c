@@ -0,0 +1,386 @@
+/* middfs-client-dentry.c -- cache of names in network directories
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Two fixed-size tables, neither of which allocates:
+ *  - entries: missing files and symbolic link targets, keyed by owner &
+ *    path, in a set-associative table like the attribute cache's;
+ *  - listings: the names in recently read directories, kept as a sorted
+ *    array of hashes. A name whose hash isn't in its directory's listing
+ *    doesn't exist; a name whose hash is may or may not (if two names
+ *    collide), so it is looked up remotely. Directories with too many
+ *    names to fit aren't kept.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "client/middfs-client-dentry.h"
+#include "client/middfs-client-conf.h"
+
+#define DENTRY_CACHE_SETS 128  /* number of sets of entries (power of two) */
+#define DENTRY_CACHE_WAYS 4    /* entries per set */
+#define DENTRY_PATH_MAX 256    /* longest path cached, including the '\0' */
+#define DENTRY_LINK_MAX 256    /* longest link target cached */
+#define DENTRY_DIRS 16         /* number of listings */
+#define DENTRY_DIR_NAMES 1024  /* most names in a listing */
+
+enum dentry_kind {DENT_FREE, DENT_MISSING, DENT_LINK};
+
+struct dentry_ent {
+   enum dentry_kind kind;
+   const char *owner;           /* interned */
+   uint32_t hash;               /* of _owner_ & _path_ */
+   uint64_t expires;
+   uint64_t used;               /* when entry was last looked up */
+   char path[DENTRY_PATH_MAX];
+   size_t linklen;              /* DENT_LINK: length of _link_ */
+   char link[DENTRY_LINK_MAX];  /* DENT_LINK: target (not null-terminated) */
+};
+
+struct dentry_dir {
+   const char *owner;           /* interned; NULL if slot is free */
+   uint64_t expires;
+   uint64_t used;
+   char path[DENTRY_PATH_MAX];
+   size_t nnames;
+   uint32_t names[DENTRY_DIR_NAMES]; /* hashes of names, sorted */
+};
+
+static struct {
+   pthread_mutex_t lock;
+   uint64_t gen; /* number of invalidations so far */
+   struct dentry_ent ents[DENTRY_CACHE_SETS][DENTRY_CACHE_WAYS];
+   struct dentry_dir dirs[DENTRY_DIRS];
+} dentry_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t dentry_clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* dentry_expiry() -- get expiry time of something cached now
+ * RETV: the expiry time; 0 if nothing should be cached.
+ */
+static uint64_t dentry_expiry(uint64_t now) {
+   double timeout = client_conf()->entry_timeout;
+   return (timeout > 0) ? now + (uint64_t) (timeout * 1e9) : 0;
+}
+
+/* dentry_hash() -- hash string (FNV-1a), continuing from _hash_ */
+static uint32_t dentry_hash(uint32_t hash, const char *str, size_t len) {
+   for (size_t i = 0; i < len; ++i) {
+      hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+   }
+   return hash;
+}
+
+static uint32_t dentry_hash_rsrc(const struct rsrc *rsrc) {
+   return dentry_hash(2166136261u ^ (uint32_t) ((uintptr_t) rsrc->mr_owner >> 4),
+                      rsrc->mr_path, strlen(rsrc->mr_path));
+}
+
+static int dentry_hash_cmp(const void *a, const void *b) {
+   uint32_t x = *(const uint32_t *) a;
+   uint32_t y = *(const uint32_t *) b;
+   return (x > y) - (x < y);
+}
+
+/* dentry_sort() -- sort hashes (Shell sort, since qsort(3) may allocate) */
+static void dentry_sort(uint32_t *hashes, size_t n) {
+   for (size_t gap = n / 2; gap > 0; gap /= 2) {
+      for (size_t i = gap; i < n; ++i) {
+         uint32_t hash = hashes[i];
+         size_t j;
+         for (j = i; j >= gap && hashes[j - gap] > hash; j -= gap) {
+            hashes[j] = hashes[j - gap];
+         }
+         hashes[j] = hash;
+      }
+   }
+}
+
+/* dentry_parent_len() -- get length of path of directory containing _path_,
+ * whose last '/' is _slash_ */
+static size_t dentry_parent_len(const char *path, const char *slash) {
+   return (slash == path) ? 1 : slash - path; /* owner's directory is "/" */
+}
+
+/* dentry_below() -- check whether _path_ is _prefix_ or below it */
+static bool dentry_below(const char *path, const char *prefix, size_t len) {
+   return strncmp(path, prefix, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/* dentry_find() -- find entry of resource
+ * RETV: the entry; NULL if there is none.
+ * NOTE: Call with _dentry_cache.lock_ held.
+ */
+static struct dentry_ent *dentry_find(const struct rsrc *rsrc, uint32_t hash) {
+   struct dentry_ent *set = dentry_cache.ents[hash % DENTRY_CACHE_SETS];
+
+   for (int i = 0; i < DENTRY_CACHE_WAYS; ++i) {
+      if (set[i].kind != DENT_FREE && set[i].owner == rsrc->mr_owner && set[i].hash == hash &&
+          strcmp(set[i].path, rsrc->mr_path) == 0) {
+         return &set[i];
+      }
+   }
+   return NULL;
+}
+
+/* dentry_find_dir() -- find listing of directory
+ * ARGS:
+ *  - owner: owner of directory
+ *  - path, len: path of directory (not null-terminated)
+ * RETV: the listing; NULL if there is none.
+ * NOTE: Call with _dentry_cache.lock_ held.
+ */
+static struct dentry_dir *dentry_find_dir(const char *owner, const char *path, size_t len) {
+   for (int i = 0; i < DENTRY_DIRS; ++i) {
+      struct dentry_dir *dir = &dentry_cache.dirs[i];
+      if (dir->owner == owner && strncmp(dir->path, path, len) == 0 && dir->path[len] == '\0') {
+         return dir;
+      }
+   }
+   return NULL;
+}
+
+/* dentry_insert() -- get entry to (re)fill for resource, replacing a free or
+ * expired entry, or else the least recently used
+ * NOTE: Call with _dentry_cache.lock_ held.
+ */
+static struct dentry_ent *dentry_insert(const struct rsrc *rsrc, uint32_t hash, uint64_t now) {
+   struct dentry_ent *set = dentry_cache.ents[hash % DENTRY_CACHE_SETS];
+   struct dentry_ent *ent;
+
+   if ((ent = dentry_find(rsrc, hash)) == NULL) {
+      for (int i = 0; i < DENTRY_CACHE_WAYS; ++i) {
+         if (set[i].kind == DENT_FREE || now >= set[i].expires) {
+            ent = &set[i];
+            break;
+         }
+         if (ent == NULL || set[i].used < ent->used) {
+            ent = &set[i];
+         }
+      }
+      ent->owner = rsrc->mr_owner;
+      ent->hash = hash;
+      strcpy(ent->path, rsrc->mr_path);
+   }
+   ent->used = now;
+   return ent;
+}
+
+/* dentry_gen() -- get invalidation generation, to pass to the dentry_put_*()
+ * functions along with what was fetched after this call */
+uint64_t dentry_gen(void) {
+   pthread_mutex_lock(&dentry_cache.lock);
+   uint64_t gen = dentry_cache.gen;
+   pthread_mutex_unlock(&dentry_cache.lock);
+   return gen;
+}
+
+/* dentry_missing() -- check whether network resource is known not to exist */
+bool dentry_missing(const struct rsrc *rsrc) {
+   const char *slash = strrchr(rsrc->mr_path, '/');
+   uint32_t hash = dentry_hash_rsrc(rsrc);
+   uint64_t now = dentry_clock_ns();
+   struct dentry_ent *ent;
+   struct dentry_dir *dir;
+   bool missing = false;
+
+   pthread_mutex_lock(&dentry_cache.lock);
+
+   if ((ent = dentry_find(rsrc, hash)) != NULL) {
+      if (now >= ent->expires) {
+         ent->kind = DENT_FREE;
+      } else {
+         missing = (ent->kind == DENT_MISSING);
+         ent->used = now;
+         goto done; /* entry overrides listing */
+      }
+   }
+
+   /* look for name in listing of parent directory */
+   if (slash != NULL && slash[1] != '\0' &&
+       (dir = dentry_find_dir(rsrc->mr_owner, rsrc->mr_path,
+                              dentry_parent_len(rsrc->mr_path, slash))) != NULL) {
+      if (now >= dir->expires) {
+         dir->owner = NULL;
+      } else {
+         uint32_t name = dentry_hash(2166136261u, slash + 1, strlen(slash + 1));
+         missing = (bsearch(&name, dir->names, dir->nnames, sizeof(*dir->names),
+                            dentry_hash_cmp) == NULL);
+         dir->used = now;
+      }
+   }
+
+ done:
+   pthread_mutex_unlock(&dentry_cache.lock);
+   return missing;
+}
+
+/* dentry_put_missing() -- remember that network resource doesn't exist
+ * ARGS:
+ *  - rsrc: network resource
+ *  - gen: dentry_gen() from before the resource was found missing; if the
+ *         cache has been invalidated since, it may have been created
+ */
+void dentry_put_missing(const struct rsrc *rsrc, uint64_t gen) {
+   uint32_t hash = dentry_hash_rsrc(rsrc);
+   uint64_t now = dentry_clock_ns();
+   uint64_t expires = dentry_expiry(now);
+
+   if (expires == 0 || strlen(rsrc->mr_path) >= DENTRY_PATH_MAX) {
+      return;
+   }
+
+   pthread_mutex_lock(&dentry_cache.lock);
+   if (gen == dentry_cache.gen) {
+      struct dentry_ent *ent = dentry_insert(rsrc, hash, now);
+      ent->kind = DENT_MISSING;
+      ent->expires = expires;
+   }
+   pthread_mutex_unlock(&dentry_cache.lock);
+}
+
+/* dentry_put_dir() -- remember names in network directory
+ * ARGS:
+ *  - rsrc: network directory
+ *  - mdir: its entries, as returned by readdir
+ *  - gen: dentry_gen() from before the directory was read
+ */
+void dentry_put_dir(const struct rsrc *rsrc, const struct middfs_dir *mdir, uint64_t gen) {
+   uint64_t now = dentry_clock_ns();
+   uint64_t expires = dentry_expiry(now);
+   size_t len = strlen(rsrc->mr_path);
+   struct dentry_dir *dir;
+
+   if (expires == 0 || len >= DENTRY_PATH_MAX || mdir->mdir_count > DENTRY_DIR_NAMES) {
+      return;
+   }
+
+   pthread_mutex_lock(&dentry_cache.lock);
+   if (gen == dentry_cache.gen) {
+      /* replace listing of same directory, a free or expired one, or else
+       * the least recently used */
+      if ((dir = dentry_find_dir(rsrc->mr_owner, rsrc->mr_path, len)) == NULL) {
+         for (int i = 0; i < DENTRY_DIRS; ++i) {
+            struct dentry_dir *it = &dentry_cache.dirs[i];
+            if (it->owner == NULL || now >= it->expires) {
+               dir = it;
+               break;
+            }
+            if (dir == NULL || it->used < dir->used) {
+               dir = it;
+            }
+         }
+         dir->owner = rsrc->mr_owner;
+         memcpy(dir->path, rsrc->mr_path, len + 1);
+      }
+
+      dir->expires = expires;
+      dir->used = now;
+      dir->nnames = mdir->mdir_count;
+      for (size_t i = 0; i < dir->nnames; ++i) {
+         const char *name = mdir->mdir_ents[i].mde_name;
+         dir->names[i] = dentry_hash(2166136261u, name, strlen(name));
+      }
+      dentry_sort(dir->names, dir->nnames);
+   }
+   pthread_mutex_unlock(&dentry_cache.lock);
+}
+
+/* dentry_get_link() -- look up target of network symbolic link
+ * ARGS:
+ *  - rsrc: network resource
+ *  - buf, size: filled in with target (not null-terminated) on a hit
+ * RETV: length of target copied to _buf_ on a hit; -1 on a miss.
+ */
+ssize_t dentry_get_link(const struct rsrc *rsrc, char *buf, size_t size) {
+   uint32_t hash = dentry_hash_rsrc(rsrc);
+   uint64_t now = dentry_clock_ns();
+   struct dentry_ent *ent;
+   ssize_t len = -1;
+
+   pthread_mutex_lock(&dentry_cache.lock);
+   if ((ent = dentry_find(rsrc, hash)) != NULL && ent->kind == DENT_LINK) {
+      if (now >= ent->expires) {
+         ent->kind = DENT_FREE;
+      } else {
+         len = (ent->linklen < size) ? ent->linklen : size;
+         memcpy(buf, ent->link, len);
+         ent->used = now;
+      }
+   }
+   pthread_mutex_unlock(&dentry_cache.lock);
+
+   return len;
+}
+
+/* dentry_put_link() -- remember target of network symbolic link
+ * ARGS:
+ *  - rsrc: network resource
+ *  - target, len: its target (not null-terminated)
+ *  - gen: dentry_gen() from before the link was read
+ */
+void dentry_put_link(const struct rsrc *rsrc, const char *target, size_t len, uint64_t gen) {
+   uint32_t hash = dentry_hash_rsrc(rsrc);
+   uint64_t now = dentry_clock_ns();
+   uint64_t expires = dentry_expiry(now);
+
+   if (expires == 0 || strlen(rsrc->mr_path) >= DENTRY_PATH_MAX || len > DENTRY_LINK_MAX) {
+      return;
+   }
+
+   pthread_mutex_lock(&dentry_cache.lock);
+   if (gen == dentry_cache.gen) {
+      struct dentry_ent *ent = dentry_insert(rsrc, hash, now);
+      ent->kind = DENT_LINK;
+      ent->expires = expires;
+      ent->linklen = len;
+      memcpy(ent->link, target, len);
+   }
+   pthread_mutex_unlock(&dentry_cache.lock);
+}
+
+/* dentry_invalidate() -- forget what is known about the names at or below
+ *                        network resource and in its parent directory,
+ *                        e.g. after it was created or renamed */
+void dentry_invalidate(const struct rsrc *rsrc) {
+   const char *path = rsrc->mr_path;
+   const char *slash = strrchr(path, '/');
+   size_t len = strlen(path);
+
+   if (len > 0 && path[len - 1] == '/') {
+      --len; /* owner's directory is "/" */
+   }
+
+   pthread_mutex_lock(&dentry_cache.lock);
+   ++dentry_cache.gen;
+
+   for (int i = 0; i < DENTRY_CACHE_SETS; ++i) {
+      for (int j = 0; j < DENTRY_CACHE_WAYS; ++j) {
+         struct dentry_ent *ent = &dentry_cache.ents[i][j];
+         if (ent->kind != DENT_FREE && ent->owner == rsrc->mr_owner &&
+             dentry_below(ent->path, path, len)) {
+            ent->kind = DENT_FREE;
+         }
+      }
+   }
+
+   for (int i = 0; i < DENTRY_DIRS; ++i) {
+      struct dentry_dir *dir = &dentry_cache.dirs[i];
+      if (dir->owner == rsrc->mr_owner &&
+          (dentry_below(dir->path, path, len) ||
+           (slash != NULL && strncmp(dir->path, path, dentry_parent_len(path, slash)) == 0 &&
+            dir->path[dentry_parent_len(path, slash)] == '\0'))) {
+         dir->owner = NULL;
+      }
+   }
+
+   pthread_mutex_unlock(&dentry_cache.lock);
+}
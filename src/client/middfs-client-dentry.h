@@ -0,0 +1,30 @@
+/* middfs-client-dentry.h -- cache of names in network directories
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_DENTRY_H
+#define __MIDDFS_CLIENT_DENTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "lib/middfs-rsrc.h"
+#include "lib/middfs-pkt.h"
+
+/* Remembers, for the configured entry_timeout, which of other clients'
+ * files don't exist (from ENOENT replies and from recent listings of the
+ * directories that would contain them) and where their symbolic links
+ * point, so that probes for missing files (``.git'', ``*.swp'', ...) and
+ * repeated readlinks are answered without a round trip. Renames and
+ * creations by this client invalidate the affected names right away. */
+
+uint64_t dentry_gen(void);
+bool dentry_missing(const struct rsrc *rsrc);
+void dentry_put_missing(const struct rsrc *rsrc, uint64_t gen);
+void dentry_put_dir(const struct rsrc *rsrc, const struct middfs_dir *mdir, uint64_t gen);
+ssize_t dentry_get_link(const struct rsrc *rsrc, char *buf, size_t size);
+void dentry_put_link(const struct rsrc *rsrc, const char *target, size_t len, uint64_t gen);
+void dentry_invalidate(const struct rsrc *rsrc);
+
+#endif
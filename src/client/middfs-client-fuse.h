@@ -19,5 +19,6 @@
 #endif
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #endif
@@ -8,14 +8,23 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <limits.h>
 
 #include "lib/middfs-handler.h"
 #include "lib/middfs-conn.h"
 
 #include "client/middfs-client-handler.h"
 #include "client/middfs-client-rsrc.h"
+#include "client/middfs-client-home.h"
+#include "client/middfs-client-pkt.h"
+#include "client/middfs-client-lease.h"
 
 static enum handler_e handle_request(const struct middfs_packet *in_pkt,
+                                     struct middfs_packet *out_pkt,
+                                     struct middfs_stream *stream);
+static int stream_next(struct middfs_stream *stream, struct middfs_response *rsp);
+static void stream_close(struct middfs_stream *stream);
+static enum handler_e response_queue(struct middfs_sockinfo *sockinfo,
                                      struct middfs_packet *out_pkt);
 
 
@@ -39,7 +48,8 @@ static enum handler_e handle_pkt_rd_fin(struct middfs_sockinfo *sockinfo,
      return HS_DEL;
 
   case MPKT_REQUEST:
-     retv = handle_request(in_pkt, &out_pkt);
+     sockinfo->peer_flags = in_pkt->mpkt_flags;
+     retv = handle_request(in_pkt, &out_pkt, &sockinfo->stream);
      break;
      
   default:
@@ -51,10 +61,8 @@ static enum handler_e handle_pkt_rd_fin(struct middfs_sockinfo *sockinfo,
      return HS_DEL;
   }
   
-  /* serialize response packet */
-  if (buffer_serialize(&out_pkt, (serialize_f) serialize_pkt, &sockinfo->out.buf) < 0) {
-    perror("buffer_serialize");
-    return HS_DEL;
+  if (response_queue(sockinfo, &out_pkt) == HS_DEL) {
+     return HS_DEL;
   }
 
   /* Update state of socket for writing response */
@@ -66,9 +74,46 @@ static enum handler_e handle_pkt_rd_fin(struct middfs_sockinfo *sockinfo,
 }
 
 static enum handler_e handle_pkt_wr_fin(struct middfs_sockinfo *sockinfo) {
-  /* Nothing to do except delete socket from list. */
   assert(sockinfo->state == MSS_RSPWR);
-  return HS_DEL;
+
+  /* response complete -- delete socket from list */
+  if (sockinfo->stream.fd < 0) {
+     return HS_DEL;
+  }
+
+  /* queue next chunk of streamed response */
+  struct middfs_packet out_pkt;
+  struct middfs_response *rsp = &out_pkt.mpkt_un.mpkt_response;
+  int err;
+
+  packet_init(&out_pkt, MPKT_RESPONSE);
+  packet_set_lz(&out_pkt, compression_enabled(), sockinfo->peer_flags);
+  packet_set_crc(&out_pkt, checksums_enabled());
+  response_init(rsp, MRSP_DATA);
+  if ((err = stream_next(&sockinfo->stream, rsp)) < 0) {
+     response_error(rsp, -err);
+  }
+
+  return response_queue(sockinfo, &out_pkt);
+}
+
+/* response_queue() -- serialize response into the socket's output buffer
+ * and free it, marking it as continued if a stream is still open.
+ */
+static enum handler_e response_queue(struct middfs_sockinfo *sockinfo,
+                                     struct middfs_packet *out_pkt) {
+  enum handler_e retv = HS_SUC;
+
+  if (sockinfo->stream.fd >= 0) {
+     out_pkt->mpkt_flags |= MPKT_F_MORE;
+  }
+  if (buffer_serialize(out_pkt, (serialize_f) serialize_pkt, &sockinfo->out.buf) < 0) {
+    perror("buffer_serialize");
+    retv = HS_DEL;
+  }
+  response_free(&out_pkt->mpkt_un.mpkt_response);
+
+  return retv;
 }
 
 struct handler_info client_hi =
@@ -86,6 +131,8 @@ static int handle_request_getattr(const char *path, const struct middfs_request
                                   struct middfs_response *rsp);
 static int handle_request_readdir(const char *path, const struct middfs_request *req,
                                   struct middfs_response *rsp);
+static int handle_request_readlink(const char *path, const struct middfs_request *req,
+                                   struct middfs_response *rsp);
 static int handle_request_access(const char *path, const struct middfs_request *req,
                                  struct middfs_response *rsp);
 static int handle_request_open(const char *path, const struct middfs_request *req,
@@ -94,36 +141,70 @@ static int handle_request_truncate(const char *path, const struct middfs_request
                                    struct middfs_response *rsp);
 static int handle_request_rename(const char *path, const struct middfs_request *req,
                                  struct middfs_response *rsp);
+static int handle_request_utimens(const char *path, const struct middfs_request *req,
+                                  struct middfs_response *rsp);
+static int handle_request_fsync(int fd, const struct middfs_request *req,
+                                struct middfs_response *rsp);
 
 static handle_request_f handle_request_fns[MREQ_NTYPES] =
    {[MREQ_READ] = {.fd_f = handle_request_read},
     [MREQ_WRITE] = {.fd_f = handle_request_write},
     [MREQ_GETATTR] = {.path_f = handle_request_getattr},
     [MREQ_READDIR] = {.path_f = handle_request_readdir},
+    [MREQ_READDIRPLUS] = {.path_f = handle_request_readdir},
+    [MREQ_READLINK] = {.path_f = handle_request_readlink},
     [MREQ_ACCESS] = {.path_f = handle_request_access},
     [MREQ_OPEN] = {.path_f = handle_request_open},
     [MREQ_TRUNCATE] = {.path_f = handle_request_truncate},
     [MREQ_RENAME] = {.path_f = handle_request_rename},
+    [MREQ_UTIMENS] = {.path_f = handle_request_utimens},
+    [MREQ_FSYNC] = {.fd_f = handle_request_fsync},
    };
 
 
+/* request_fd() -- get file that read, write or fsync request refers to
+ * ARGS:
+ *  - req: request
+ *  - leased: set to whether the descriptor belongs to the lease named by the
+ *            request (release it with lease_put()) or was opened just for
+ *            the request (close it)
+ * RETV: file descriptor; -errno on error.
+ */
+static int request_fd(const struct middfs_request *req, bool *leased) {
+   int fd;
+
+   if (req->mreq_handle != 0 && (fd = lease_get(req->mreq_handle, req->mreq_requester)) >= 0) {
+      *leased = true;
+      return fd;
+   }
+
+   /* no lease (any longer): open the file, only as far as the request needs */
+   *leased = false;
+   return home_open(req->mreq_rsrc.mr_path, req->mreq_type == MREQ_WRITE ? O_WRONLY : O_RDONLY,
+                    0);
+}
+
 /* handle_request() -- handle a request and queue a response (if necessary).
+ * ARGS:
+ *  - in_pkt: request
+ *  - out_pkt: response
+ *  - stream: opened for READ requests that accept a streamed response and
+ *    whose data doesn't fit in the first chunk
  */
 static enum handler_e handle_request(const struct middfs_packet *in_pkt,
-                                     struct middfs_packet *out_pkt) {
+                                     struct middfs_packet *out_pkt,
+                                     struct middfs_stream *stream) {
    enum handler_e retv = HS_SUC;
    const struct middfs_request *req = &in_pkt->mpkt_un.mpkt_request;
    struct middfs_response *rsp = &out_pkt->mpkt_un.mpkt_response;
-   char *path = NULL;
+   const char *path = req->mreq_rsrc.mr_path; /* relative to home directory */
    int request_status;
 
    /* response packet setup */
-   out_pkt->mpkt_magic = MPKT_MAGIC;
-   out_pkt->mpkt_type = MPKT_RESPONSE;
+   packet_init(out_pkt, MPKT_RESPONSE);
+   packet_set_lz(out_pkt, compression_enabled(), in_pkt->mpkt_flags);
+   packet_set_crc(out_pkt, checksums_enabled());
 
-   /* construct path */
-   path = middfs_localpath_tmp(req->mreq_rsrc.mr_path);
-   
    switch (req->mreq_type) {
    case MREQ_NONE:
       /* Then why the hell did you contact me? */
@@ -135,16 +216,18 @@ static enum handler_e handle_request(const struct middfs_packet *in_pkt,
       /* PATH HANDLERS */
    case MREQ_GETATTR:
    case MREQ_READDIR:
+   case MREQ_READDIRPLUS:
+   case MREQ_READLINK:
    case MREQ_ACCESS:
    case MREQ_OPEN:
    case MREQ_TRUNCATE:      
    case MREQ_RENAME:
+   case MREQ_UTIMENS:
       request_status = handle_request_fns[req->mreq_type].path_f(path, req, rsp);
       break;
      
 
       
-   case MREQ_READLINK:
    case MREQ_MKDIR:
    case MREQ_SYMLINK:
    case MREQ_UNLINK:
@@ -158,22 +241,54 @@ static enum handler_e handle_request(const struct middfs_packet *in_pkt,
       /* FD HANDLERS */
    case MREQ_READ:
    case MREQ_WRITE:
+   case MREQ_FSYNC:
       {
          int fd = -1;
+         bool leased;
          
-         /* open file */
-         if ((fd = open(path, O_RDWR)) < 0) {
-            fprintf(stderr, "open: ``%s'': %s\n", path, strerror(errno));
-            request_status = -errno;
+         /* get leased file, or open it */
+         if ((fd = request_fd(req, &leased)) < 0) {
+            fprintf(stderr, "open: ``%s'': %s\n", path, strerror(-fd));
+            request_status = fd;
+            break;
+         }
+
+         /* stream read response, keeping file open for the remaining chunks
+          * (the stream gets its own descriptor, since the lease may end first) */
+         if (req->mreq_type == MREQ_READ && (in_pkt->mpkt_flags & MPKT_F_ACCEPT_STREAM)) {
+            if (leased) {
+               int lfd = fd;
+               if ((fd = dup(lfd)) < 0) {
+                  fd = -errno;
+               }
+               lease_put(req->mreq_handle);
+               if (fd < 0) {
+                  request_status = fd;
+                  break;
+               }
+            }
+            *stream = (struct middfs_stream) {.fd = fd, .off = req->mreq_off,
+                                              .rem = req->mreq_size};
+            request_status = stream_next(stream, rsp);
             break;
          }
 
          /* call handler */
          request_status = handle_request_fns[req->mreq_type].fd_f(fd, req, rsp);
-         
-         close(fd);
+
+         if (leased) {
+            lease_put(req->mreq_handle);
+         } else {
+            close(fd);
+         }
          break;
       }
+
+   case MREQ_RELEASE:
+      if ((request_status = lease_release(req->mreq_handle, req->mreq_requester)) == 0) {
+         response_init(rsp, MRSP_OK);
+      }
+      break;
             
    default:
       fprintf(stderr, "handle_request: unknown type %d\n", req->mreq_type);
@@ -181,9 +296,6 @@ static enum handler_e handle_request(const struct middfs_packet *in_pkt,
       break;
    }
 
-   /* cleanup */
-   free(path);
-
    if (retv != HS_SUC) {
       return retv;
    }
@@ -201,36 +313,71 @@ static enum handler_e handle_request(const struct middfs_packet *in_pkt,
 
 static int handle_request_read(int fd, const struct middfs_request *req,
                                struct middfs_response *rsp) {
-   char *buf = NULL;
+   struct payload *pl;
 
    /* get read info */
    off_t offset = req->mreq_off;
    size_t size = req->mreq_size;
 
    /* allocate buffer */
-   if ((buf = malloc(size)) == NULL) {
-      perror("malloc");
+   if ((pl = payload_new(size)) == NULL) {
+      perror("payload_new");
       return -errno;
    }
    
    /* read */
    ssize_t bytes_read;
-   if ((bytes_read = pread(fd, buf, size, offset)) < 0) {
-      rsp->mrsp_un.mrsp_error = errno;            
+   if ((bytes_read = pread(fd, pl->pl_data, size, offset)) < 0) {
+      int err = errno;
       perror("pread");
-      free(buf);
-      return -errno;
+      payload_unref(pl);
+      return -err;
    }
    
    /* construct response */
    rsp->mrsp_type = MRSP_DATA;
    struct middfs_data *data = &rsp->mrsp_un.mrsp_data;
-   data->mdata_buf = buf;
+   data->mdata_buf = pl->pl_data;
    data->mdata_nbytes = bytes_read;
+   data->mdata_payload = pl;
    
    return 0;
 }
 
+/* stream_next() -- read the next chunk of a streamed READ response
+ * ARGS:
+ *  - stream: open stream
+ *  - rsp: response to hold the chunk
+ * RETV: 0 on success; negated error code on error.
+ * NOTE: Closes _stream_ after its last chunk or on error.
+ */
+static int stream_next(struct middfs_stream *stream, struct middfs_response *rsp) {
+   struct middfs_request chunk = {.mreq_off = stream->off,
+                                  .mreq_size = MIN(stream->rem, MPKT_STREAM_CHUNK)};
+   int retv;
+
+   if ((retv = handle_request_read(stream->fd, &chunk, rsp)) < 0) {
+      stream_close(stream);
+      return retv;
+   }
+
+   uint64_t nbytes = rsp->mrsp_un.mrsp_data.mdata_nbytes;
+   stream->off += nbytes;
+   stream->rem -= nbytes;
+   if (nbytes < chunk.mreq_size || stream->rem == 0) {
+      stream_close(stream); /* end of file or of requested range */
+   }
+
+   return 0;
+}
+
+static void stream_close(struct middfs_stream *stream) {
+   if (close(stream->fd) < 0) {
+      perror("close");
+   }
+   stream->fd = -1;
+}
+
 static int handle_request_write(int fd, const struct middfs_request *req,
                                 struct middfs_response *rsp) {
    char *buf = req->mreq_data;
@@ -239,11 +386,22 @@ static int handle_request_write(int fd, const struct middfs_request *req,
    off_t offset = req->mreq_off;
    size_t size = req->mreq_size;
 
-   /* write */
+   /* write, all of it (large writes may be split by the filesystem) */
    ssize_t bytes_written;
-   if ((bytes_written = pwrite(fd, buf, size, offset)) < 0) {
-      perror("pwrite");
-      return -errno;
+   while (size > 0) {
+      if ((bytes_written = pwrite(fd, buf, size, offset)) < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("pwrite");
+         return -errno;
+      }
+      if (bytes_written == 0) {
+         return -EIO;
+      }
+      buf += bytes_written;
+      offset += bytes_written;
+      size -= bytes_written;
    }
    
    /* construct response */
@@ -256,18 +414,24 @@ static int handle_request_getattr(const char *path, const struct middfs_request
                                   struct middfs_response *rsp) {
    /* stat file */
    struct stat st;
-   if (stat(path, &st) < 0) {
+   struct home_dir dir;
+   int retv;
+
+   if ((retv = home_lookup(path, &dir)) < 0) {
+      return retv;
+   }
+   if (fstatat(dir.fd, dir.base, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      retv = -errno;
       fprintf(stderr, "stat: ``%s'': %s\n", path, strerror(errno));
-      return -errno;
+   }
+   home_release(&dir);
+   if (retv < 0) {
+      return retv;
    }
 
    /* construct response */
    rsp->mrsp_type = MRSP_STAT;
-   struct middfs_stat *mstat = &rsp->mrsp_un.mrsp_stat;
-   mstat->mstat_mode = st.st_mode;
-   mstat->mstat_size = st.st_size;
-   mstat->mstat_blocks = st.st_blocks;
-   mstat->mstat_blksize = st.st_blksize;
+   stat_init(&rsp->mrsp_un.mrsp_stat, &st);
    
    return 0;
 }
@@ -275,13 +439,20 @@ static int handle_request_getattr(const char *path, const struct middfs_request
 static int handle_request_readdir(const char *path, const struct middfs_request *req,
                                   struct middfs_response *rsp) {
    DIR *dir;
+   int fd;
+   int retv = 0;
 
    rsp->mrsp_type = MRSP_DIR;
 
    /* open directory */
-   if ((dir = opendir(path)) == NULL) {
-      fprintf(stderr, "opendir: ``%s'': %s\n", path, strerror(errno));
-      return -errno;
+   if ((fd = home_open(path, O_RDONLY | O_DIRECTORY, 0)) < 0) {
+      fprintf(stderr, "opendir: ``%s'': %s\n", path, strerror(-fd));
+      return fd;
+   }
+   if ((dir = fdopendir(fd)) == NULL) {
+      retv = -errno;
+      close(fd);
+      return retv;
    }
 
    /* count dirents */
@@ -293,9 +464,11 @@ static int handle_request_readdir(const char *path, const struct middfs_request
    /* allocate list */
    struct middfs_dir *mdir = &rsp->mrsp_un.mrsp_dir;
    mdir->mdir_count = count;
+   mdir->mdir_plus = (req->mreq_type == MREQ_READDIRPLUS);
    if ((mdir->mdir_ents = calloc(count, sizeof(*mdir->mdir_ents))) == NULL) {
       perror("calloc");
-      return -errno;
+      retv = -errno;
+      goto cleanup;
    }
 
    /* rewind dir */
@@ -303,22 +476,78 @@ static int handle_request_readdir(const char *path, const struct middfs_request
 
    /* populate dirents */
    struct dirent *ent;
-   for (struct middfs_dirent *mde = mdir->mdir_ents; (ent = readdir(dir)) != NULL; ++mde) {
+   struct middfs_dirent *mde = mdir->mdir_ents;
+   for (; mde < mdir->mdir_ents + count && (ent = readdir(dir)) != NULL; ++mde) {
       if ((mde->mde_name = strdup(ent->d_name)) == NULL) {
          perror("strdup");
-         return -errno;
+         retv = -errno;
+         goto cleanup;
       }
       mde->mde_mode = ent->d_type << 12; /* convert from dirent mode to stat mode */
+
+      /* readdirplus: attach attributes, unless the entry is already gone */
+      struct stat st;
+      if (mdir->mdir_plus && fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+         mde->mde_mode = st.st_mode;
+         stat_init(&mde->mde_stat, &st);
+      }
    }
+   mdir->mdir_count = mde - mdir->mdir_ents; /* directory may have shrunk */
 
-   return 0;
+ cleanup:
+   closedir(dir);
+   return retv;
 }
 
+static int handle_request_readlink(const char *path, const struct middfs_request *req,
+                                   struct middfs_response *rsp) {
+   size_t size = MIN(req->mreq_size, PATH_MAX); /* don't trust requester */
+   struct home_dir dir;
+   struct payload *pl;
+   ssize_t len;
+   int retv;
+
+   if ((pl = payload_new(size)) == NULL) {
+      perror("payload_new");
+      return -errno;
+   }
+   if ((retv = home_lookup(path, &dir)) < 0) {
+      payload_unref(pl);
+      return retv;
+   }
+   if ((len = readlinkat(dir.fd, dir.base, (char *) pl->pl_data, size)) < 0) {
+      retv = -errno;
+      payload_unref(pl);
+   }
+   home_release(&dir);
+   if (retv < 0) {
+      return retv;
+   }
+
+   /* construct response */
+   rsp->mrsp_type = MRSP_DATA;
+   struct middfs_data *data = &rsp->mrsp_un.mrsp_data;
+   data->mdata_buf = pl->pl_data;
+   data->mdata_nbytes = len;
+   data->mdata_payload = pl;
+
+   return 0;
+}
 
 static int handle_request_access(const char *path, const struct middfs_request *req,
                                  struct middfs_response *rsp) {
-   if (access(path, req->mreq_mode) < 0) {
-      return -errno;
+   struct home_dir dir;
+   int retv;
+
+   if ((retv = home_lookup(path, &dir)) < 0) {
+      return retv;
+   }
+   if (faccessat(dir.fd, dir.base, req->mreq_mode, AT_SYMLINK_NOFOLLOW) < 0) {
+      retv = -errno;
+   }
+   home_release(&dir);
+   if (retv < 0) {
+      return retv;
    }
    response_init(rsp, MRSP_OK);
    return 0;
@@ -328,20 +557,50 @@ static int handle_request_access(const char *path, const struct middfs_request *
 static int handle_request_open(const char *path, const struct middfs_request *req,
                                struct middfs_response *rsp) {
    int fd = -1;
-   int flags = req->mreq_mode;
+   int flags = req->mreq_mode & ~O_APPEND; /* writes carry their offsets */
    int mode = 0666;
+   struct stat st;
    
-   if ((fd = open(path, flags, mode)) < 0) {
-      return -errno;
+   if ((fd = home_open(path, flags, mode)) < 0) {
+      return fd;
+   }
+   if (fstat(fd, &st) < 0) {
+      int err = errno;
+      close(fd);
+      return -err;
+   }
+
+   /* keep file open for the requester's reads & writes, if possible */
+   response_init(rsp, MRSP_HANDLE);
+   stat_init(&rsp->mrsp_un.mrsp_handle.mh_stat, &st);
+   if ((rsp->mrsp_un.mrsp_handle.mh_id = lease_new(fd, req->mreq_requester)) == 0) {
+      close(fd);
    }
-   response_init(rsp, MRSP_OK);
-   close(fd);
    return 0;
 }
 
 static int handle_request_truncate(const char *path, const struct middfs_request *req,
                                    struct middfs_response *rsp) {
-   if (truncate(path, req->mreq_size) < 0) {
+   int fd;
+   int retv = 0;
+
+   if ((fd = home_open(path, O_WRONLY, 0)) < 0) {
+      return fd;
+   }
+   if (ftruncate(fd, req->mreq_size) < 0) {
+      retv = -errno;
+   }
+   close(fd);
+   if (retv < 0) {
+      return retv;
+   }
+   response_init(rsp, MRSP_OK);
+   return 0;
+}
+
+static int handle_request_fsync(int fd, const struct middfs_request *req,
+                                struct middfs_response *rsp) {
+   if ((req->mreq_mode ? fdatasync(fd) : fsync(fd)) < 0) {
       return -errno;
    }
    response_init(rsp, MRSP_OK);
@@ -352,18 +611,42 @@ static int handle_request_rename(const char *path, const struct middfs_request *
                                  struct middfs_response *rsp) {
    int retv = 0;
    const char *from = path;
-   char *to;
+   const char *to = req->mreq_to.mr_path;
+   struct home_dir dir_from, dir_to;
 
-   if ((to = middfs_localpath_tmp(req->mreq_to.mr_path)) == NULL) {
-      perror("middfs_localpath_tmp");
-      return -errno;
+   if ((retv = home_lookup(from, &dir_from)) < 0) {
+      return retv;
+   }
+   if ((retv = home_lookup(to, &dir_to)) < 0) {
+      home_release(&dir_from);
+      return retv;
    }
-   if (rename(from, to) < 0) {
+   if (renameat(dir_from.fd, dir_from.base, dir_to.fd, dir_to.base) < 0) {
       retv = -errno;
       fprintf(stderr, "rename: ``%s'' -> ``%s'': %s\n", from, to, strerror(errno));
    } else {
       response_init(rsp, MRSP_OK);
    }
-   free(to);
+   home_release(&dir_to);
+   home_release(&dir_from);
+   home_invalidate(from);
+   home_invalidate(to);
+   return retv;
+}
+
+static int handle_request_utimens(const char *path, const struct middfs_request *req,
+                                  struct middfs_response *rsp) {
+   int retv = 0;
+   struct home_dir dir;
+
+   if ((retv = home_lookup(path, &dir)) < 0) {
+      return retv;
+   }
+   if (utimensat(dir.fd, dir.base, req->mreq_times, AT_SYMLINK_NOFOLLOW) < 0) {
+      retv = -errno;
+   } else {
+      response_init(rsp, MRSP_OK);
+   }
+   home_release(&dir);
    return retv;
 }
@@ -0,0 +1,367 @@
+/* middfs-client-home.c -- access to files in the client's home directory
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * The home directory is opened once. Files in it are reached with *at()
+ * functions relative to the directory that contains them, whose descriptor
+ * is kept in a small cache, so that neither the home directory's absolute
+ * path nor the file's parent directories are walked again on every request.
+ * ``..'' is rejected up front. On Linux, opens use openat2(2) with
+ * RESOLVE_BENEATH, so that symbolic links are followed only as long as they
+ * stay beneath the home directory; where openat2(2) isn't available, paths
+ * are walked one component at a time with O_NOFOLLOW, so that no symbolic
+ * link is followed at all. The other *at() calls made on a file in its
+ * directory don't follow it if it's a symbolic link, so they act on the
+ * link itself, which is beneath the home directory.
+ *
+ * Cached directories are found by path, so an entry is dropped when the
+ * directory is renamed or removed through middfs (see home_invalidate()).
+ * Changes made behind middfs's back are noticed when the entry expires.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/openat2.h>)
+#  include <sys/syscall.h>
+#  include <linux/openat2.h>
+#  ifdef SYS_openat2
+#   define HOME_HAVE_OPENAT2 1
+#  endif
+# endif
+#endif
+
+#include "client/middfs-client-home.h"
+#include "client/middfs-client-conf.h"
+
+#define HOME_CACHE_LEN 32                /* number of cached directories */
+#define HOME_CACHE_TTL_NS 1000000000ULL  /* lifetime of a cached directory (1 s) */
+
+#ifdef O_PATH
+# define HOME_DIR_FLAGS (O_PATH | O_DIRECTORY)
+#else
+# define HOME_DIR_FLAGS (O_RDONLY | O_DIRECTORY)
+#endif
+
+struct home_ent {
+   char *path;      /* path of directory relative to home; NULL if slot is free */
+   size_t len;      /* length of _path_ */
+   int fd;          /* directory */
+   unsigned refs;   /* number of home_lookup()s not yet released */
+   bool stale;      /* invalidated while in use; dropped on last release */
+   uint64_t opened; /* when _fd_ was opened */
+   uint64_t used;   /* when entry was last looked up */
+};
+
+static struct {
+   pthread_mutex_t lock;
+   int rootfd; /* home directory; -1 until first use */
+   struct home_ent ents[HOME_CACHE_LEN];
+} home = {.lock = PTHREAD_MUTEX_INITIALIZER, .rootfd = -1};
+
+static uint64_t home_clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* home_openat_nofollow() -- open _path_ beneath directory _dirfd_ without
+ *                           following any symbolic links
+ * RETV: file descriptor; -1 on error (errno set; ELOOP or ENOTDIR if _path_
+ *       goes through a symbolic link).
+ * NOTE: _path_ mustn't contain ``..'' (see home_relpath()).
+ */
+static int home_openat_nofollow(int dirfd, const char *path, int flags, mode_t mode) {
+   char buf[PATH_MAX];
+   char *comp, *next;
+   int fd = dirfd;
+   int subfd;
+   int saved_errno;
+
+   if (strlen(path) >= sizeof(buf)) {
+      errno = ENAMETOOLONG;
+      return -1;
+   }
+   strcpy(buf, path);
+
+   /* open each directory along the way, relative to the previous one */
+   comp = buf + strspn(buf, "/");
+   while ((next = strchr(comp, '/')) != NULL) {
+      *next++ = '\0';
+      next += strspn(next, "/");
+      if (*next == '\0') {
+         flags |= O_DIRECTORY; /* trailing slash */
+         break;
+      }
+      subfd = openat(fd, comp, HOME_DIR_FLAGS | O_NOFOLLOW | O_CLOEXEC);
+      saved_errno = errno;
+      if (fd != dirfd) {
+         close(fd);
+      }
+      if (subfd < 0) {
+         errno = saved_errno;
+         return -1;
+      }
+      fd = subfd;
+      comp = next;
+   }
+
+   subfd = openat(fd, (*comp != '\0') ? comp : ".", flags | O_NOFOLLOW | O_CLOEXEC, mode);
+   saved_errno = errno;
+   if (fd != dirfd) {
+      close(fd);
+   }
+   errno = saved_errno;
+   return subfd;
+}
+
+/* home_openat() -- open _path_ beneath directory _dirfd_
+ * RETV: file descriptor; -1 on error (errno set).
+ */
+static int home_openat(int dirfd, const char *path, int flags, mode_t mode) {
+   mode &= 07777; /* FUSE passes the file type, too */
+
+#if HOME_HAVE_OPENAT2
+   struct open_how how = {.flags = flags | O_CLOEXEC,
+                          .mode = (flags & O_CREAT) ? mode : 0,
+                          .resolve = RESOLVE_BENEATH};
+   int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+   if (fd >= 0 || errno != ENOSYS) {
+      return fd;
+   }
+   /* kernel predates openat2(2) */
+#endif
+
+   return home_openat_nofollow(dirfd, path, flags, mode);
+}
+
+/* home_relpath() -- convert path relative to owner (as in a resource) to
+ * path relative to home directory
+ * RETV: relative path ("" for home directory); NULL if _path_ contains a
+ *       ``..'' component.
+ */
+static const char *home_relpath(const char *path) {
+   const char *rel = path + strspn(path, "/");
+
+   for (const char *comp = rel; *comp != '\0'; comp += strspn(comp, "/")) {
+      size_t len = strcspn(comp, "/");
+      if (len == 2 && comp[0] == '.' && comp[1] == '.') {
+         return NULL;
+      }
+      comp += len;
+   }
+
+   return rel;
+}
+
+/* home_rootfd() -- get home directory, opening it on first use
+ * RETV: file descriptor; -1 on error.
+ * NOTE: Call with _home.lock_ held.
+ */
+static int home_rootfd(void) {
+   if (home.rootfd < 0) {
+      const struct client_conf *conf = client_conf();
+      char path[PATH_MAX];
+
+      if (snprintf(path, sizeof(path), "%s/%s", conf->homepath, conf->username)
+          >= (int) sizeof(path)) {
+         errno = ENAMETOOLONG;
+         return -1;
+      }
+      home.rootfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   }
+
+   return home.rootfd;
+}
+
+/* home_ent_drop() -- close directory of cache entry and free its slot */
+static void home_ent_drop(struct home_ent *ent) {
+   close(ent->fd);
+   free(ent->path);
+   memset(ent, 0, sizeof(*ent));
+   ent->fd = -1;
+}
+
+/* home_cache_get() -- get directory from cache, opening it on a miss
+ * ARGS:
+ *  - rel, len: path of directory relative to home (not null-terminated)
+ *  - dir: _fd_ and _slot_ are set
+ * RETV: 0 on success; -errno on error.
+ * NOTE: Call with _home.lock_ held.
+ */
+static int home_cache_get(const char *rel, size_t len, struct home_dir *dir) {
+   uint64_t now = home_clock_ns();
+   struct home_ent *victim = NULL;
+
+   for (int i = 0; i < HOME_CACHE_LEN; ++i) {
+      struct home_ent *ent = &home.ents[i];
+
+      if (ent->path != NULL && !ent->stale && ent->len == len &&
+          memcmp(ent->path, rel, len) == 0) {
+         if (now - ent->opened < HOME_CACHE_TTL_NS) {
+            ++ent->refs; /* hit */
+            ent->used = now;
+            dir->fd = ent->fd;
+            dir->slot = i;
+            return 0;
+         }
+
+         /* expired */
+         if (ent->refs == 0) {
+            home_ent_drop(ent);
+         } else {
+            ent->stale = true;
+         }
+      }
+
+      /* replace a free slot, or else the least recently used one */
+      if (ent->path == NULL) {
+         if (victim == NULL || victim->path != NULL) {
+            victim = ent;
+         }
+      } else if (ent->refs == 0 && (victim == NULL ||
+                                    (victim->path != NULL && ent->used < victim->used))) {
+         victim = ent;
+      }
+   }
+
+   /* miss */
+   char path[PATH_MAX];
+   int fd;
+
+   if (len >= sizeof(path)) {
+      return -ENAMETOOLONG;
+   }
+   memcpy(path, rel, len);
+   path[len] = '\0';
+   if ((fd = home_openat(home.rootfd, path, HOME_DIR_FLAGS, 0)) < 0) {
+      return -errno;
+   }
+
+   dir->fd = fd;
+   dir->slot = -1;
+   if (victim != NULL) {
+      char *copy;
+      if ((copy = strdup(path)) != NULL) {
+         if (victim->path != NULL) {
+            home_ent_drop(victim);
+         }
+         *victim = (struct home_ent) {.path = copy, .len = len, .fd = fd, .refs = 1,
+                                      .opened = now, .used = now};
+         dir->slot = victim - home.ents;
+      }
+   }
+
+   return 0;
+}
+
+/* home_lookup() -- find directory containing a file
+ * ARGS:
+ *  - path: path of file relative to owner, as in a resource
+ *  - dir: directory to fill in; release with home_release()
+ * RETV: 0 on success; -errno on error (-EACCES if _path_ contains ``..'').
+ */
+int home_lookup(const char *path, struct home_dir *dir) {
+   const char *rel;
+   const char *slash;
+   int retv = 0;
+
+   if ((rel = home_relpath(path)) == NULL) {
+      return -EACCES;
+   }
+   slash = strrchr(rel, '/');
+
+   pthread_mutex_lock(&home.lock);
+
+   dir->slot = -1;
+   if ((dir->fd = home_rootfd()) < 0) {
+      retv = -errno;
+   } else if (*rel == '\0') {
+      dir->base = "."; /* home directory itself */
+   } else if (slash == NULL) {
+      dir->base = rel; /* in home directory */
+   } else {
+      dir->base = slash + 1;
+      retv = home_cache_get(rel, slash - rel, dir);
+   }
+
+   pthread_mutex_unlock(&home.lock);
+
+   return retv;
+}
+
+/* home_release() -- release directory found by home_lookup() */
+void home_release(struct home_dir *dir) {
+   if (dir->slot >= 0) {
+      pthread_mutex_lock(&home.lock);
+      struct home_ent *ent = &home.ents[dir->slot];
+      if (--ent->refs == 0 && ent->stale) {
+         home_ent_drop(ent);
+      }
+      pthread_mutex_unlock(&home.lock);
+   } else if (dir->fd != home.rootfd) {
+      close(dir->fd); /* couldn't be cached */
+   }
+   dir->fd = -1;
+}
+
+/* home_open() -- open file in home directory
+ * ARGS:
+ *  - path: path of file relative to owner, as in a resource
+ *  - flags, mode: as for open(2)
+ * RETV: file descriptor on success; -errno on error.
+ */
+int home_open(const char *path, int flags, mode_t mode) {
+   struct home_dir dir;
+   int fd;
+
+   if ((fd = home_lookup(path, &dir)) < 0) {
+      return fd;
+   }
+   if ((fd = home_openat(dir.fd, dir.base, flags, mode)) < 0) {
+      fd = -errno;
+   }
+   home_release(&dir);
+
+   return fd;
+}
+
+/* home_invalidate() -- drop cached directories at or below _path_, e.g.
+ *                      after it was renamed or removed
+ * ARGS:
+ *  - path: path relative to owner, as in a resource
+ */
+void home_invalidate(const char *path) {
+   const char *rel;
+   size_t len;
+
+   if ((rel = home_relpath(path)) == NULL) {
+      return;
+   }
+   len = strlen(rel);
+
+   pthread_mutex_lock(&home.lock);
+   for (int i = 0; i < HOME_CACHE_LEN; ++i) {
+      struct home_ent *ent = &home.ents[i];
+      if (ent->path != NULL && ent->len >= len && memcmp(ent->path, rel, len) == 0 &&
+          (len == 0 || ent->len == len || ent->path[len] == '/')) {
+         if (ent->refs == 0) {
+            home_ent_drop(ent);
+         } else {
+            ent->stale = true;
+         }
+      }
+   }
+   pthread_mutex_unlock(&home.lock);
+}
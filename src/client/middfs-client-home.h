@@ -0,0 +1,27 @@
+/* middfs-client-home.h -- access to files in the client's home directory
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_HOME_H
+#define __MIDDFS_CLIENT_HOME_H
+
+#include <sys/types.h>
+
+/* Files owned by this client live in <homepath>/<username>. Paths are
+ * resolved relative to a descriptor of that directory (and to cached
+ * descriptors of its subdirectories), never as absolute paths, and can't
+ * escape it through ``..'' or symbolic links (see middfs-client-home.c). */
+
+/* struct home_dir -- directory containing a file, as found by home_lookup() */
+struct home_dir {
+   int fd;           /* directory; pass to *at() functions with _base_ */
+   const char *base; /* last component of path ("." for the home directory) */
+   int slot;         /* cache slot holding _fd_; -1 if not cached */
+};
+
+int home_lookup(const char *path, struct home_dir *dir);
+void home_release(struct home_dir *dir);
+int home_open(const char *path, int flags, mode_t mode);
+void home_invalidate(const char *path);
+
+#endif
@@ -0,0 +1,372 @@
+/* middfs-client-inode.c -- table of the inodes the kernel knows of
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * A node's ID is its address (except the root's, which FUSE fixes at 1), so
+ * operations find their node without a lookup. Nodes are also hashed by
+ * parent & name so that repeated lookups of an entry return the same node.
+ * An unlinked node is taken out of the hash, but stays in the tree (and
+ * keeps its parent alive) until the kernel forgets it.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "lib/middfs-intern.h"
+
+#include "client/middfs-client-inode.h"
+#include "client/middfs-client-rsrc.h"
+
+#define INODE_BUCKETS_MIN 1024 /* initial size of hash table (power of two) */
+
+struct inode {
+   struct inode *parent; /* NULL for the root */
+   char *name;           /* entry in _parent_ */
+   size_t namelen;
+   const char *owner;    /* interned _name_ of nodes in the root; else NULL */
+   uint64_t nlookup;     /* lookups the kernel hasn't forgotten */
+   uint64_t nchildren;   /* nodes in this one (which need its path) */
+   uint64_t generation;
+   bool linked;          /* false once unlinked or renamed over */
+   struct inode *next;   /* next in hash chain */
+};
+
+static struct inode inode_root = {.name = "", .owner = "", .linked = true};
+
+static struct {
+   pthread_mutex_t lock;
+   struct inode **buckets;
+   size_t nbuckets;     /* power of two; 0 until the first node is added */
+   size_t count;        /* nodes hashed */
+   uint64_t generation; /* of last node added */
+} inode_table = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static struct inode *inode_get(uint64_t ino) {
+   return (ino == INODE_ROOT) ? &inode_root : (struct inode *) (uintptr_t) ino;
+}
+
+static uint64_t inode_id(const struct inode *node) {
+   return (node == &inode_root) ? INODE_ROOT : (uint64_t) (uintptr_t) node;
+}
+
+static size_t inode_hash(const struct inode *parent, const char *name, size_t len) {
+   uint64_t hash = 14695981039346656037ULL ^ (uintptr_t) parent; /* FNV-1a */
+
+   for (size_t i = 0; i < len; ++i) {
+      hash = (hash ^ (unsigned char) name[i]) * 1099511628211ULL;
+   }
+   return hash ^ (hash >> 32);
+}
+
+/* inode_find() -- find linked node of entry _name_ in _parent_
+ * NOTE: Call with _inode_table.lock_ held.
+ */
+static struct inode *inode_find(const struct inode *parent, const char *name) {
+   size_t len = strlen(name);
+   struct inode *node;
+
+   if (inode_table.nbuckets == 0) {
+      return NULL;
+   }
+   node = inode_table.buckets[inode_hash(parent, name, len) & (inode_table.nbuckets - 1)];
+   for (; node != NULL; node = node->next) {
+      if (node->parent == parent && node->namelen == len && memcmp(node->name, name, len) == 0) {
+         return node;
+      }
+   }
+   return NULL;
+}
+
+/* inode_link() -- hash node by its parent & name, growing the table if it is
+ *                 getting full
+ * RETV: 0 on success; -ENOMEM if the table couldn't be created.
+ * NOTE: Call with _inode_table.lock_ held.
+ */
+static int inode_link(struct inode *node) {
+   size_t nbuckets = inode_table.nbuckets;
+
+   if (inode_table.count >= nbuckets) {
+      size_t newsize = (nbuckets == 0) ? INODE_BUCKETS_MIN : 2 * nbuckets;
+      struct inode **buckets = calloc(newsize, sizeof(*buckets));
+      if (buckets != NULL) {
+         for (size_t i = 0; i < nbuckets; ++i) {
+            struct inode *it, *next;
+            for (it = inode_table.buckets[i]; it != NULL; it = next) {
+               size_t bucket = inode_hash(it->parent, it->name, it->namelen) & (newsize - 1);
+               next = it->next;
+               it->next = buckets[bucket];
+               buckets[bucket] = it;
+            }
+         }
+         free(inode_table.buckets);
+         inode_table.buckets = buckets;
+         inode_table.nbuckets = nbuckets = newsize;
+      } else if (nbuckets == 0) {
+         return -ENOMEM;
+      } /* else chains just get longer */
+   }
+
+   size_t bucket = inode_hash(node->parent, node->name, node->namelen) & (nbuckets - 1);
+   node->next = inode_table.buckets[bucket];
+   inode_table.buckets[bucket] = node;
+   node->linked = true;
+   ++inode_table.count;
+   return 0;
+}
+
+/* inode_unhash() -- take node out of the hash, e.g. once it's unlinked
+ * NOTE: Call with _inode_table.lock_ held.
+ */
+static void inode_unhash(struct inode *node) {
+   size_t bucket = inode_hash(node->parent, node->name, node->namelen) &
+      (inode_table.nbuckets - 1);
+   struct inode **it;
+
+   for (it = &inode_table.buckets[bucket]; *it != NULL; it = &(*it)->next) {
+      if (*it == node) {
+         *it = node->next;
+         --inode_table.count;
+         break;
+      }
+   }
+   node->linked = false;
+}
+
+/* inode_unref() -- free node if it is no longer needed, along with any of
+ *                  its ancestors that were only kept for its sake
+ * NOTE: Call with _inode_table.lock_ held.
+ */
+static void inode_unref(struct inode *node) {
+   while (node != &inode_root && node->nlookup == 0 && node->nchildren == 0) {
+      struct inode *parent = node->parent;
+      if (node->linked) {
+         inode_unhash(node);
+      }
+      --parent->nchildren;
+      free(node->name);
+      free(node);
+      node = parent;
+   }
+}
+
+/* inode_path() -- get owner of node and its path on the owner's host
+ * ARGS:
+ *  - ino: node ID
+ *  - owner: where to put the owner (interned; "" for the root)
+ *  - path: buffer for the path ("/" for an owner's home; "" for the root)
+ *  - size: size of _path_
+ * RETV: 0 on success; -ENOENT if the node (or a directory above it) has
+ *       been unlinked; -ENAMETOOLONG if the path doesn't fit in _path_.
+ */
+int inode_path(uint64_t ino, const char **owner, char *path, size_t size) {
+   struct inode *node = inode_get(ino);
+   struct inode *it;
+   size_t len = 0;
+   int retv = 0;
+
+   pthread_mutex_lock(&inode_table.lock);
+
+   /* find length of path & owner */
+   for (it = node; it != &inode_root && it->parent != &inode_root; it = it->parent) {
+      if (!it->linked) {
+         retv = -ENOENT;
+         goto done;
+      }
+      len += 1 + it->namelen;
+   }
+   if (!it->linked) {
+      retv = -ENOENT;
+      goto done;
+   }
+   *owner = it->owner;
+
+   if (it != &inode_root && len == 0) {
+      len = 1; /* owner's home */
+   }
+   if (len + 1 > size) {
+      retv = -ENAMETOOLONG;
+      goto done;
+   }
+
+   /* fill in path from the end */
+   path[len] = '\0';
+   if (node != &inode_root && node->parent == &inode_root) {
+      path[0] = '/';
+   }
+   for (it = node; it != &inode_root && it->parent != &inode_root; it = it->parent) {
+      len -= it->namelen;
+      memcpy(&path[len], it->name, it->namelen);
+      path[--len] = '/';
+   }
+
+ done:
+   pthread_mutex_unlock(&inode_table.lock);
+   return retv;
+}
+
+/* inode_child_path() -- like inode_path(), for entry _name_ of node _parent_,
+ *                       which needn't have been looked up
+ */
+int inode_child_path(uint64_t parent, const char *name, const char **owner,
+                     char *path, size_t size) {
+   size_t namelen = strlen(name);
+   size_t len;
+   int retv;
+
+   if (parent == INODE_ROOT) {
+      /* entries in the root are owners' homes */
+      if (size < 2) {
+         return -ENAMETOOLONG;
+      }
+      if ((*owner = client_rsrc_owner(name, namelen)) == NULL) {
+         return -errno;
+      }
+      strcpy(path, "/");
+      return 0;
+   }
+
+   if ((retv = inode_path(parent, owner, path, size)) < 0) {
+      return retv;
+   }
+   len = strlen(path);
+   if (len == 1) {
+      len = 0; /* don't double the '/' of the owner's home */
+   }
+   if (len + 1 + namelen + 1 > size) {
+      return -ENAMETOOLONG;
+   }
+   path[len] = '/';
+   memcpy(&path[len + 1], name, namelen + 1);
+   return 0;
+}
+
+/* inode_lookup() -- count lookup of entry _name_ of node _parent_ by the
+ *                   kernel, adding a node for it if it hasn't one
+ * ARGS:
+ *  - parent: node ID of directory
+ *  - name: name of entry, which must exist
+ *  - entry: where to put the node ID & generation of the entry
+ * RETV: 0 on success; -errno on error.
+ * NOTE: Each successful call must be matched by an inode_forget() of the
+ *       entry, which the kernel sends once it drops the entry.
+ */
+int inode_lookup(uint64_t parent, const char *name, struct inode_entry *entry) {
+   struct inode *dir = inode_get(parent);
+   struct inode *node;
+   const char *owner = NULL;
+   int retv = 0;
+
+   /* the entry exists, so its owner's name was interned when it was
+    * looked up */
+   if (dir == &inode_root && (owner = intern_find(name, strlen(name))) == NULL) {
+      return -ENOENT;
+   }
+
+   pthread_mutex_lock(&inode_table.lock);
+
+   if ((node = inode_find(dir, name)) == NULL) {
+      if ((node = calloc(1, sizeof(*node))) == NULL ||
+          (node->name = strdup(name)) == NULL) {
+         retv = -errno;
+         free(node);
+         goto done;
+      }
+      node->parent = dir;
+      node->namelen = strlen(name);
+      node->owner = owner;
+      node->generation = ++inode_table.generation;
+      if ((retv = inode_link(node)) < 0) {
+         free(node->name);
+         free(node);
+         goto done;
+      }
+      ++dir->nchildren;
+   }
+
+   ++node->nlookup;
+   entry->ino = inode_id(node);
+   entry->generation = node->generation;
+
+ done:
+   pthread_mutex_unlock(&inode_table.lock);
+   return retv;
+}
+
+/* inode_forget() -- drop _nlookup_ lookups of node _ino_ by the kernel */
+void inode_forget(uint64_t ino, uint64_t nlookup) {
+   struct inode *node = inode_get(ino);
+
+   if (node == &inode_root) {
+      return;
+   }
+
+   pthread_mutex_lock(&inode_table.lock);
+   node->nlookup -= (nlookup < node->nlookup) ? nlookup : node->nlookup;
+   inode_unref(node);
+   pthread_mutex_unlock(&inode_table.lock);
+}
+
+/* inode_unlink() -- note that entry _name_ of node _parent_ was removed, so
+ *                   that its node no longer refers to the name */
+void inode_unlink(uint64_t parent, const char *name) {
+   struct inode *node;
+
+   pthread_mutex_lock(&inode_table.lock);
+   if ((node = inode_find(inode_get(parent), name)) != NULL) {
+      inode_unhash(node);
+   }
+   pthread_mutex_unlock(&inode_table.lock);
+}
+
+/* inode_rename() -- note that entry _name_ of node _parent_ was renamed to
+ *                   _newname_ in node _newparent_, replacing any entry there
+ * NOTE: If the node can't be moved (out of memory), it's unlinked instead,
+ *       so that the kernel looks it up again under its new name.
+ */
+void inode_rename(uint64_t parent, const char *name, uint64_t newparent, const char *newname) {
+   struct inode *dir = inode_get(newparent);
+   struct inode *node, *replaced;
+   const char *owner = NULL;
+   char *namebuf;
+
+   if (parent == newparent && strcmp(name, newname) == 0) {
+      return;
+   }
+   if ((namebuf = strdup(newname)) != NULL && dir == &inode_root &&
+       (owner = intern_find(newname, strlen(newname))) == NULL) {
+      free(namebuf);
+      namebuf = NULL;
+   }
+
+   pthread_mutex_lock(&inode_table.lock);
+
+   if ((replaced = inode_find(dir, newname)) != NULL) {
+      inode_unhash(replaced);
+   }
+   if ((node = inode_find(inode_get(parent), name)) == NULL) {
+      free(namebuf);
+      goto done; /* kernel hasn't looked it up */
+   }
+
+   inode_unhash(node);
+   if (namebuf == NULL) {
+      goto done;
+   }
+
+   /* move node */
+   struct inode *olddir = node->parent;
+   free(node->name);
+   node->name = namebuf;
+   node->namelen = strlen(namebuf);
+   node->owner = owner;
+   node->parent = dir;
+   ++dir->nchildren;
+   inode_link(node); /* can't fail: table exists */
+   --olddir->nchildren;
+   inode_unref(olddir);
+
+ done:
+   pthread_mutex_unlock(&inode_table.lock);
+}
@@ -0,0 +1,32 @@
+/* middfs-client-inode.h -- table of the inodes the kernel knows of
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_INODE_H
+#define __MIDDFS_CLIENT_INODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define INODE_ROOT 1 /* node ID of the middfs root (FUSE_ROOT_ID) */
+
+/* The low-level FUSE interface names files by node ID rather than by path.
+ * Each node is an entry (name) in its parent's node, from which its owner
+ * and its path on the owner's host are rebuilt when an operation needs
+ * them; a rename just moves the one node. Nodes live until the kernel has
+ * forgotten every lookup of them and of the nodes below them. */
+
+struct inode_entry {
+   uint64_t ino;        /* node ID */
+   uint64_t generation; /* distinguishes nodes that reuse a node ID */
+};
+
+int inode_path(uint64_t ino, const char **owner, char *path, size_t size);
+int inode_child_path(uint64_t parent, const char *name, const char **owner,
+                     char *path, size_t size);
+int inode_lookup(uint64_t parent, const char *name, struct inode_entry *entry);
+void inode_forget(uint64_t ino, uint64_t nlookup);
+void inode_unlink(uint64_t parent, const char *name);
+void inode_rename(uint64_t parent, const char *name, uint64_t newparent, const char *newname);
+
+#endif
@@ -0,0 +1,178 @@
+/* middfs-client-lease.c -- files kept open for other clients
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Leases live in a fixed table. A handle is the lease's slot plus a sequence
+ * number, so a handle whose lease has ended never refers to a later lease in
+ * the same slot. Ended leases whose descriptors are still in use by a request
+ * are closed when the last such request is done with them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "client/middfs-client-lease.h"
+#include "client/middfs-client-conf.h"
+
+#define LEASE_MAX 256 /* most files kept open at once */
+
+struct lease {
+   bool active;           /* false if lease has ended (slot is free once
+                           * _refs_ is 0, too) */
+   int fd;                /* open file */
+   uint32_t seq;          /* sequence number of lease in this slot */
+   char *requester;       /* owned; freed when the slot is reused */
+   uint64_t expires;      /* when lease ends unless used again */
+   int refs;              /* requests using _fd_ */
+};
+
+static struct {
+   pthread_mutex_t lock;
+   uint32_t seq;          /* sequence number of last lease */
+   struct lease leases[LEASE_MAX];
+} lease_table = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t lease_clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t lease_timeout_ns(void) {
+   return (uint64_t) (client_conf()->lease_timeout * 1e9);
+}
+
+/* lease_find() -- find active lease with handle _handle_
+ * RETV: the lease; NULL if it has ended.
+ * NOTE: Call with _lease_table.lock_ held.
+ */
+static struct lease *lease_find(uint64_t handle) {
+   uint32_t slot = handle & 0xffffffff;
+   struct lease *lease;
+
+   if (slot >= LEASE_MAX) {
+      return NULL;
+   }
+   lease = &lease_table.leases[slot];
+   if (!lease->active || lease->seq != (uint32_t) (handle >> 32)) {
+      return NULL;
+   }
+   return lease;
+}
+
+/* lease_end() -- end lease, closing its file unless it is in use
+ * NOTE: Call with _lease_table.lock_ held.
+ */
+static void lease_end(struct lease *lease) {
+   lease->active = false;
+   if (lease->refs == 0 && close(lease->fd) < 0) {
+      perror("close");
+   }
+}
+
+/* lease_new() -- keep file open for requester
+ * ARGS:
+ *  - fd: open file, which the lease takes over
+ *  - requester: client that opened it
+ * RETV: handle of the lease; 0 if leases are disabled or too many are
+ *       active, in which case _fd_ is left to the caller.
+ */
+uint64_t lease_new(int fd, const char *requester) {
+   uint64_t now = lease_clock_ns();
+   uint64_t timeout = lease_timeout_ns();
+   uint64_t handle = 0;
+   struct lease *slot = NULL;
+   char *copy;
+
+   /* requesters' names come from peers, so they aren't interned */
+   if (timeout == 0 || (copy = strdup(requester)) == NULL) {
+      return 0;
+   }
+
+   pthread_mutex_lock(&lease_table.lock);
+
+   /* end expired leases, looking for a free slot along the way */
+   for (int i = 0; i < LEASE_MAX; ++i) {
+      struct lease *lease = &lease_table.leases[i];
+      if (lease->active && now >= lease->expires) {
+         lease_end(lease);
+      }
+      if (slot == NULL && !lease->active && lease->refs == 0) {
+         slot = lease;
+      }
+   }
+
+   if (slot != NULL) {
+      if (++lease_table.seq == 0) {
+         ++lease_table.seq; /* handle 0 means ``none'' */
+      }
+      free(slot->requester);
+      *slot = (struct lease) {.active = true, .fd = fd, .seq = lease_table.seq,
+                              .requester = copy, .expires = now + timeout};
+      handle = ((uint64_t) slot->seq << 32) | (uint64_t) (slot - lease_table.leases);
+   } else {
+      free(copy);
+   }
+
+   pthread_mutex_unlock(&lease_table.lock);
+
+   return handle;
+}
+
+/* lease_get() -- get file of lease for use by a request, renewing the lease
+ * ARGS:
+ *  - handle: handle of lease
+ *  - requester: client that sent the request
+ * RETV: the file descriptor; -ESTALE if the lease has ended (or belongs to
+ *       another client).
+ * NOTE: Call lease_put() when done with the descriptor.
+ */
+int lease_get(uint64_t handle, const char *requester) {
+   uint64_t now = lease_clock_ns();
+   struct lease *lease;
+   int fd = -ESTALE;
+
+   pthread_mutex_lock(&lease_table.lock);
+   if ((lease = lease_find(handle)) != NULL && now < lease->expires &&
+       strcmp(lease->requester, requester) == 0) {
+      lease->expires = now + lease_timeout_ns();
+      ++lease->refs;
+      fd = lease->fd;
+   }
+   pthread_mutex_unlock(&lease_table.lock);
+
+   return fd;
+}
+
+/* lease_put() -- done with file descriptor from lease_get() */
+void lease_put(uint64_t handle) {
+   struct lease *lease = &lease_table.leases[handle & 0xffffffff];
+
+   pthread_mutex_lock(&lease_table.lock);
+   if (--lease->refs == 0 && !lease->active && close(lease->fd) < 0) {
+      perror("close"); /* lease ended while in use */
+   }
+   pthread_mutex_unlock(&lease_table.lock);
+}
+
+/* lease_release() -- end lease at its requester's request
+ * RETV: 0 on success; -ESTALE if it had already ended.
+ */
+int lease_release(uint64_t handle, const char *requester) {
+   struct lease *lease;
+   int retv = -ESTALE;
+
+   pthread_mutex_lock(&lease_table.lock);
+   if ((lease = lease_find(handle)) != NULL && strcmp(lease->requester, requester) == 0) {
+      lease_end(lease);
+      retv = 0;
+   }
+   pthread_mutex_unlock(&lease_table.lock);
+
+   return retv;
+}
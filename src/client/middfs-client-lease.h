@@ -0,0 +1,22 @@
+/* middfs-client-lease.h -- files kept open for other clients
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_LEASE_H
+#define __MIDDFS_CLIENT_LEASE_H
+
+#include <stdint.h>
+
+/* When another client opens one of this client's files, the file stays open
+ * here as a ``lease'' identified by a handle, which that client sends with
+ * each read, write and fsync so that they needn't look up and open the path
+ * again. A lease ends when the client releases it (MREQ_RELEASE) or hasn't
+ * used it for lease_timeout seconds; requests with a handle that has ended
+ * fall back to opening the path. */
+
+uint64_t lease_new(int fd, const char *requester);
+int lease_get(uint64_t handle, const char *requester);
+void lease_put(uint64_t handle);
+int lease_release(uint64_t handle, const char *requester);
+
+#endif
@@ -0,0 +1,767 @@
+/* middfs-client-llops.c -- implementation of middfs-client file
+ * operations on FUSE's low-level interface
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Operations name files by node ID, so they get a file's owner & path from
+ * the inode table (middfs-client-inode.c) instead of parsing a full path,
+ * and the kernel's lookups are counted there rather than in libfuse's own
+ * table of paths. Open files keep their resources in _fi->fh_, just as in
+ * middfs-client-ops.c.
+ */
+
+#if FUSE == 3 && FUSE_MINOR >= 12
+#define FUSE_USE_VERSION 312 /* loop config is built with fuse_loop_cfg_*() */
+#elif FUSE == 3
+#define FUSE_USE_VERSION 32 /* fuse_session_loop_mt() takes a loop config */
+#endif
+
+#include "client/middfs-client-fuse.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "lib/middfs-bufpool.h"
+#include "lib/middfs-util.h"
+
+#include "client/middfs-client-ops.h"
+#include "client/middfs-client-rsrc.h"
+#include "client/middfs-client-inode.h"
+#include "client/middfs-client-conf.h"
+
+#if FUSE == 3
+
+/* middfs_ll_attr_timeout(), middfs_ll_entry_timeout() -- timeouts of the
+ * attributes & entries given to the kernel, so that it caches them (and
+ * missing names) as long as we do; taken from the current configuration
+ * for each reply, so that a reload applies to the next one */
+static double middfs_ll_attr_timeout(void) {
+  return middfs_attr_timeout();
+}
+
+static double middfs_ll_entry_timeout(void) {
+  return client_conf()->entry_timeout;
+}
+
+/* middfs_ll_rsrc() -- construct resource of node
+ * ARGS:
+ *  - ino: node ID
+ *  - path: buffer of PATH_MAX bytes for its path, which _rsrc_ points into
+ *  - rsrc: resource to initialize
+ * RETV: 0 on success; -errno on error.
+ * NOTE: Like client_rsrc_init(), doesn't allocate; the resource only needs
+ *       deleting once it is opened or owned.
+ */
+static int middfs_ll_rsrc(fuse_ino_t ino, char *path, struct client_rsrc *rsrc) {
+  const char *owner;
+  int retv;
+
+  if ((retv = inode_path(ino, &owner, path, PATH_MAX)) < 0) {
+    return retv;
+  }
+  client_rsrc_init_at(owner, path, rsrc);
+  return 0;
+}
+
+/* middfs_ll_child_rsrc() -- like middfs_ll_rsrc(), for entry _name_ of
+ * node _parent_ */
+static int middfs_ll_child_rsrc(fuse_ino_t parent, const char *name, char *path,
+                                struct client_rsrc *rsrc) {
+  const char *owner;
+  int retv;
+
+  if ((retv = inode_child_path(parent, name, &owner, path, PATH_MAX)) < 0) {
+    return retv;
+  }
+  client_rsrc_init_at(owner, path, rsrc);
+  return 0;
+}
+
+/* middfs_ll_entry() -- get entry of existing file for the kernel
+ * ARGS:
+ *  - parent, name: the entry
+ *  - rsrc: its resource
+ *  - e: entry to fill in
+ * RETV: 0 on success; -errno on error.
+ * NOTE: Counts a lookup of the entry (see inode_lookup()) on success.
+ */
+static int middfs_ll_entry(fuse_ino_t parent, const char *name, const struct client_rsrc *rsrc,
+                           struct fuse_entry_param *e) {
+  struct inode_entry entry;
+  int retv;
+
+  memset(e, 0, sizeof(*e));
+  if ((retv = client_rsrc_lstat(rsrc, &e->attr)) < 0) {
+    return retv;
+  }
+  if ((retv = inode_lookup(parent, name, &entry)) < 0) {
+    return retv;
+  }
+  e->ino = entry.ino;
+  e->generation = entry.generation;
+  e->attr_timeout = middfs_ll_attr_timeout();
+  e->entry_timeout = middfs_ll_entry_timeout();
+  return 0;
+}
+
+/* middfs_ll_reply_entry() -- reply to request that made entry _name_ of
+ * node _parent_ with the entry, or with the error _retv_ */
+static void middfs_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                                  const struct client_rsrc *rsrc, int retv) {
+  struct fuse_entry_param e;
+
+  if (retv < 0 || (retv = middfs_ll_entry(parent, name, rsrc, &e)) < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_entry(req, &e);
+  }
+}
+
+static void middfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  middfs_init_conn(conn);
+
+  /* let libfuse splice pages of local files into replies (see
+   * middfs_ll_read()) */
+  if ((conn->capable & FUSE_CAP_SPLICE_WRITE)) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+  if ((conn->capable & FUSE_CAP_SPLICE_MOVE)) {
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+  }
+}
+
+static void middfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+  struct client_rsrc rsrc;
+  struct fuse_entry_param e;
+  int retv;
+
+  if ((retv = middfs_ll_child_rsrc(parent, name, path, &rsrc)) == 0) {
+    retv = middfs_ll_entry(parent, name, &rsrc, &e);
+  }
+
+  if (retv == -ENOENT) {
+    /* node ID 0 tells the kernel to remember that it's missing */
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = middfs_ll_entry_timeout();
+    fuse_reply_entry(req, &e);
+  } else if (retv < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_entry(req, &e);
+  }
+}
+
+static void middfs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  inode_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void middfs_ll_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; ++i) {
+    inode_forget(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void middfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  int retv = 0;
+  int64_t allocs = client_allocs();
+  const struct client_rsrc *client_rsrc;
+  struct client_rsrc client_rsrc_tmp;
+  char path[PATH_MAX];
+  struct stat sb;
+
+  if (fi != NULL) {
+    client_rsrc = (struct client_rsrc *) fi->fh;
+  } else if ((retv = middfs_ll_rsrc(ino, path, &client_rsrc_tmp)) < 0) {
+    goto done;
+  } else {
+    client_rsrc = &client_rsrc_tmp;
+  }
+
+  retv = client_rsrc_lstat(client_rsrc, &sb);
+
+ done:
+  if (middfs_op_done(MOP_GETATTR, allocs, retv) < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_attr(req, &sb, middfs_ll_attr_timeout());
+  }
+}
+
+static void middfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                              struct fuse_file_info *fi) {
+  int retv = 0;
+  const struct client_rsrc *client_rsrc;
+  struct client_rsrc client_rsrc_tmp;
+  char path[PATH_MAX];
+  struct stat sb;
+
+  if ((to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+    retv = -ENOSYS; /* not supported */
+    goto done;
+  }
+
+  if (fi != NULL) {
+    client_rsrc = (struct client_rsrc *) fi->fh;
+  } else if ((retv = middfs_ll_rsrc(ino, path, &client_rsrc_tmp)) < 0) {
+    goto done;
+  } else {
+    client_rsrc = &client_rsrc_tmp;
+  }
+
+  if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    /* forwarded to the owner; UTIME_NOW takes the owner's clock */
+    struct timespec times[2] =
+      {{.tv_nsec = UTIME_OMIT}, {.tv_nsec = UTIME_OMIT}};
+    if ((to_set & FUSE_SET_ATTR_ATIME_NOW)) {
+      times[0].tv_nsec = UTIME_NOW;
+    } else if ((to_set & FUSE_SET_ATTR_ATIME)) {
+      times[0] = attr->st_atim;
+    }
+    if ((to_set & FUSE_SET_ATTR_MTIME_NOW)) {
+      times[1].tv_nsec = UTIME_NOW;
+    } else if ((to_set & FUSE_SET_ATTR_MTIME)) {
+      times[1] = attr->st_mtim;
+    }
+    if ((retv = client_rsrc_utimens(client_rsrc, times)) < 0) {
+      goto done;
+    }
+  }
+  if ((to_set & FUSE_SET_ATTR_MODE) && (retv = client_rsrc_chmod(client_rsrc, attr->st_mode)) < 0) {
+    goto done;
+  }
+  if ((to_set & FUSE_SET_ATTR_SIZE) &&
+      (retv = client_rsrc_truncate(client_rsrc, attr->st_size)) < 0) {
+    goto done;
+  }
+
+  retv = client_rsrc_lstat(client_rsrc, &sb);
+
+ done:
+  if (retv < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_attr(req, &sb, middfs_ll_attr_timeout());
+  }
+}
+
+static void middfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_rsrc(ino, path, &client_rsrc)) == 0) {
+    retv = client_rsrc_access(&client_rsrc, mask);
+  }
+  fuse_reply_err(req, -retv);
+}
+
+static void middfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char path[PATH_MAX];
+  char buf[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_rsrc(ino, path, &client_rsrc)) < 0 ||
+      (retv = client_rsrc_readlink(&client_rsrc, buf, sizeof(buf) - 1)) < 0) { /* room for '\0' */
+    fuse_reply_err(req, -retv);
+    return;
+  }
+
+  buf[retv] = '\0';
+  fuse_reply_readlink(req, buf);
+}
+
+static void middfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_child_rsrc(parent, name, path, &client_rsrc)) == 0) {
+    retv = client_rsrc_mkdir(&client_rsrc, mode);
+  }
+  middfs_ll_reply_entry(req, parent, name, &client_rsrc, retv);
+}
+
+static void middfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                              const char *name) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_child_rsrc(parent, name, path, &client_rsrc)) == 0) {
+    retv = client_rsrc_symlink(&client_rsrc, link);
+  }
+  middfs_ll_reply_entry(req, parent, name, &client_rsrc, retv);
+}
+
+static void middfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_child_rsrc(parent, name, path, &client_rsrc)) == 0 &&
+      (retv = client_rsrc_unlink(&client_rsrc)) == 0) {
+    inode_unlink(parent, name);
+  }
+  fuse_reply_err(req, -retv);
+}
+
+static void middfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_child_rsrc(parent, name, path, &client_rsrc)) == 0 &&
+      (retv = client_rsrc_rmdir(&client_rsrc)) == 0) {
+    inode_unlink(parent, name);
+  }
+  fuse_reply_err(req, -retv);
+}
+
+static void middfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname, unsigned int flags) {
+  char path_from[PATH_MAX], path_to[PATH_MAX];
+  struct client_rsrc client_rsrc_from, client_rsrc_to;
+  int retv;
+
+  if (flags != 0) {
+    retv = -EINVAL; /* RENAME_EXCHANGE & RENAME_NOREPLACE not supported */
+  } else if ((retv = middfs_ll_child_rsrc(parent, name, path_from, &client_rsrc_from)) == 0 &&
+             (retv = middfs_ll_child_rsrc(newparent, newname, path_to, &client_rsrc_to)) == 0 &&
+             (retv = client_rsrc_rename(&client_rsrc_from, &client_rsrc_to)) == 0) {
+    inode_rename(parent, name, newparent, newname);
+  }
+  fuse_reply_err(req, -retv);
+}
+
+/* middfs_ll_open_rsrc() -- open resource for an open file, keeping it in
+ * _fi->fh_
+ * ARGS:
+ *  - rsrc: resource of the file, which is copied
+ *  - fi: the open file
+ *  - mode: mode of the file, if it is created
+ * RETV: 0 on success; -errno on error.
+ */
+static int middfs_ll_open_rsrc(const struct client_rsrc *rsrc, struct fuse_file_info *fi,
+                               mode_t mode) {
+  struct client_rsrc *client_rsrc;
+  int retv;
+
+  if ((client_rsrc = malloc(sizeof(*client_rsrc))) == NULL) {
+    return -errno;
+  }
+  *client_rsrc = *rsrc;
+  if ((retv = client_rsrc_own(client_rsrc)) < 0 || /* outlives path buffer */
+      (retv = client_rsrc_open(client_rsrc, middfs_open_flags(fi->flags), mode)) < 0) {
+    client_rsrc_delete(client_rsrc);
+    free(client_rsrc);
+    return retv;
+  }
+
+  fi->fh = (uint64_t) client_rsrc;
+  fi->keep_cache = client_rsrc->mr_unchanged;
+  return 0;
+}
+
+static void middfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc;
+  int retv;
+
+  if ((retv = middfs_ll_rsrc(ino, path, &client_rsrc)) < 0 ||
+      (retv = middfs_ll_open_rsrc(&client_rsrc, fi, 0)) < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_open(req, fi);
+  }
+}
+
+static void middfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+                             struct fuse_file_info *fi) {
+  char path[PATH_MAX];
+  struct client_rsrc client_rsrc_tmp;
+  struct client_rsrc *client_rsrc;
+  struct fuse_entry_param e;
+  int retv;
+
+  if ((retv = middfs_ll_child_rsrc(parent, name, path, &client_rsrc_tmp)) < 0 ||
+      (retv = middfs_ll_open_rsrc(&client_rsrc_tmp, fi, mode)) < 0) {
+    fuse_reply_err(req, -retv);
+    return;
+  }
+
+  client_rsrc = (struct client_rsrc *) fi->fh;
+  if ((retv = middfs_ll_entry(parent, name, client_rsrc, &e)) < 0) {
+    client_rsrc_delete(client_rsrc);
+    free(client_rsrc);
+    fuse_reply_err(req, -retv);
+    return;
+  }
+
+  fuse_reply_create(req, &e, fi);
+}
+
+static void middfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+  int retv = 0;
+  int64_t allocs = client_allocs();
+  struct client_rsrc *client_rsrc = (struct client_rsrc *) fi->fh;
+  char *buf;
+
+  if (client_rsrc->mr_type == MR_LOCAL) {
+    /* let libfuse move the file's pages into the reply with splice(2),
+     * rather than copying them through a buffer */
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv.buf[0].fd = client_rsrc->mr_fd;
+    bufv.buf[0].pos = offset;
+    middfs_op_done(MOP_READ, allocs, 0);
+    fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+    return;
+  }
+
+  if ((buf = bufpool_get(size)) == NULL) {
+    retv = -ENOMEM;
+  } else if ((retv = client_rsrc_read(client_rsrc, buf, size, offset)) < 0) {
+    errno = -retv;
+    perror("client_rsrc_read");
+  }
+
+  if (middfs_op_done(MOP_READ, allocs, retv) < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_buf(req, buf, retv);
+  }
+  if (buf != NULL) {
+    bufpool_put(buf, size);
+  }
+}
+
+static void middfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+  int retv = 0;
+  int64_t allocs = client_allocs();
+  const struct client_rsrc *client_rsrc = (struct client_rsrc *) fi->fh;
+
+  if ((retv = client_rsrc_write(client_rsrc, buf, size, offset)) < 0) {
+    errno = -retv;
+    perror("client_rsrc_write");
+  }
+
+  if (middfs_op_done(MOP_WRITE, allocs, retv) < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_write(req, retv);
+  }
+}
+
+/* middfs_ll_flush() -- see middfs_flush() */
+static void middfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  fuse_reply_err(req, 0);
+}
+
+static void middfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi) {
+  const struct client_rsrc *client_rsrc = (struct client_rsrc *) fi->fh;
+  fuse_reply_err(req, -client_rsrc_fsync(client_rsrc, datasync));
+}
+
+static void middfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct client_rsrc *client_rsrc = (struct client_rsrc *) fi->fh;
+
+  client_rsrc_delete(client_rsrc);
+  free(client_rsrc);
+  fuse_reply_err(req, 0);
+}
+
+/* struct middfs_ll_dir -- open directory. Its entries are listed when the
+ * kernel starts reading it (at offset 0) and handed out over however many
+ * readdirs it takes; the offset of an entry is its index + 1. */
+struct middfs_ll_dir {
+  struct client_rsrc rsrc;
+  struct middfs_ll_dirent {
+    struct stat st;
+    bool plus;   /* whether _st_ holds all of the entry's attributes */
+    size_t name; /* offset of name in _names_ */
+  } *ents;
+  size_t nents, maxents;
+  char *names;
+  size_t nameslen, maxnames;
+  int error;     /* -errno if listing ran out of memory */
+};
+
+/* middfs_ll_fill() -- add entry to listing of open directory _buf_ (a
+ * fuse_fill_dir_t for client_rsrc_readdir()) */
+static int middfs_ll_fill(void *buf, const char *name, const struct stat *st, off_t off,
+                          enum fuse_fill_dir_flags flags) {
+  struct middfs_ll_dir *dir = buf;
+  size_t len = strlen(name) + 1;
+
+  if (dir->nents == dir->maxents) {
+    size_t maxents = (dir->maxents == 0) ? 64 : 2 * dir->maxents;
+    struct middfs_ll_dirent *ents = realloc(dir->ents, maxents * sizeof(*ents));
+    if (ents == NULL) {
+      dir->error = -errno;
+      return 1;
+    }
+    dir->ents = ents;
+    dir->maxents = maxents;
+  }
+  if (dir->nameslen + len > dir->maxnames) {
+    size_t maxnames = MAX(2 * dir->maxnames, dir->nameslen + len);
+    char *names = realloc(dir->names, maxnames);
+    if (names == NULL) {
+      dir->error = -errno;
+      return 1;
+    }
+    dir->names = names;
+    dir->maxnames = maxnames;
+  }
+
+  struct middfs_ll_dirent *ent = &dir->ents[dir->nents++];
+  ent->st = *st;
+  ent->plus = (flags & FUSE_FILL_DIR_PLUS);
+  ent->name = dir->nameslen;
+  memcpy(&dir->names[dir->nameslen], name, len);
+  dir->nameslen += len;
+  return 0;
+}
+
+/* middfs_ll_list() -- (re)list entries of open directory
+ * RETV: 0 on success; -errno on error.
+ */
+static int middfs_ll_list(struct middfs_ll_dir *dir) {
+  int retv;
+
+  dir->nents = dir->nameslen = 0;
+  dir->error = 0;
+
+  /* only local directories need opening; network ones are read in a single
+   * readdirplus round trip */
+  if (dir->rsrc.mr_type == MR_LOCAL && (retv = client_rsrc_open(&dir->rsrc, O_RDONLY)) < 0) {
+    return retv;
+  }
+  if ((retv = client_rsrc_readdir(&dir->rsrc, dir, middfs_ll_fill, 0)) < 0) {
+    return retv;
+  }
+  return dir->error;
+}
+
+static void middfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  char path[PATH_MAX];
+  struct middfs_ll_dir *dir;
+  int retv;
+
+  if ((dir = calloc(1, sizeof(*dir))) == NULL) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  if ((retv = middfs_ll_rsrc(ino, path, &dir->rsrc)) < 0 ||
+      (retv = client_rsrc_own(&dir->rsrc)) < 0) {
+    free(dir);
+    fuse_reply_err(req, -retv);
+    return;
+  }
+
+  fi->fh = (uint64_t) dir;
+  fuse_reply_open(req, fi);
+}
+
+/* middfs_ll_readdir_any() -- reply to readdir or, if _plus_, readdirplus
+ * NOTE: For readdirplus, entries with all their attributes are looked up, so
+ *       that the kernel needn't; the rest (e.g. those of local directories)
+ *       go without, and are looked up by the kernel as usual.
+ */
+static void middfs_ll_readdir_any(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                  struct fuse_file_info *fi, bool plus) {
+  int retv = 0;
+  int64_t allocs = client_allocs();
+  struct middfs_ll_dir *dir = (struct middfs_ll_dir *) fi->fh;
+  char *buf = NULL;
+  size_t len = 0;
+
+  if (offset == 0 && (retv = middfs_ll_list(dir)) < 0) {
+    goto done;
+  }
+  if ((buf = bufpool_get(size)) == NULL) {
+    retv = -ENOMEM;
+    goto done;
+  }
+
+  for (size_t i = offset; i < dir->nents; ++i) {
+    const struct middfs_ll_dirent *ent = &dir->ents[i];
+    const char *name = &dir->names[ent->name];
+    size_t entlen;
+
+    if (plus) {
+      struct fuse_entry_param e = {.attr = ent->st};
+      struct inode_entry entry;
+
+      /* only count a lookup once the entry is sure to fit */
+      if ((entlen = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0)) > size - len) {
+        break;
+      }
+      if (ent->plus && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 &&
+          inode_lookup(ino, name, &entry) == 0) {
+        e.ino = entry.ino;
+        e.generation = entry.generation;
+        e.attr_timeout = middfs_ll_attr_timeout();
+        e.entry_timeout = middfs_ll_entry_timeout();
+      }
+      fuse_add_direntry_plus(req, buf + len, size - len, name, &e, i + 1);
+    } else if ((entlen = fuse_add_direntry(req, buf + len, size - len, name, &ent->st,
+                                           i + 1)) > size - len) {
+      break;
+    }
+
+    len += entlen;
+  }
+
+ done:
+  if (middfs_op_done(MOP_READDIR, allocs, retv) < 0) {
+    fuse_reply_err(req, -retv);
+  } else {
+    fuse_reply_buf(req, buf, len);
+  }
+  if (buf != NULL) {
+    bufpool_put(buf, size);
+  }
+}
+
+static void middfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                              struct fuse_file_info *fi) {
+  middfs_ll_readdir_any(req, ino, size, offset, fi, false);
+}
+
+static void middfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                                  struct fuse_file_info *fi) {
+  middfs_ll_readdir_any(req, ino, size, offset, fi, true);
+}
+
+static void middfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct middfs_ll_dir *dir = (struct middfs_ll_dir *) fi->fh;
+
+  client_rsrc_delete(&dir->rsrc);
+  free(dir->ents);
+  free(dir->names);
+  free(dir);
+  fuse_reply_err(req, 0);
+}
+
+static void middfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct statvfs stbuf;
+
+  if (statvfs(client_conf()->homepath, &stbuf) < 0) {
+    fuse_reply_err(req, errno);
+  } else {
+    fuse_reply_statfs(req, &stbuf);
+  }
+}
+
+struct fuse_lowlevel_ops middfs_ll_oper =
+  {.init = middfs_ll_init,
+   .lookup = middfs_ll_lookup,
+   .forget = middfs_ll_forget,
+   .forget_multi = middfs_ll_forget_multi,
+   .getattr = middfs_ll_getattr,
+   .setattr = middfs_ll_setattr,
+   .access = middfs_ll_access,
+   .readlink = middfs_ll_readlink,
+   .mkdir = middfs_ll_mkdir,
+   .symlink = middfs_ll_symlink,
+   .unlink = middfs_ll_unlink,
+   .rmdir = middfs_ll_rmdir,
+   .rename = middfs_ll_rename,
+   /* link & mknod not supported */
+   .open = middfs_ll_open,
+   .create = middfs_ll_create,
+   .read = middfs_ll_read,
+   .write = middfs_ll_write,
+   .flush = middfs_ll_flush,
+   .fsync = middfs_ll_fsync,
+   .release = middfs_ll_release,
+   .opendir = middfs_ll_opendir,
+   .readdir = middfs_ll_readdir,
+   .readdirplus = middfs_ll_readdirplus,
+   .releasedir = middfs_ll_releasedir,
+   .statfs = middfs_ll_statfs,
+  };
+
+/* middfs_ll_main() -- mount middfs & serve the kernel's requests until it is
+ * unmounted, like fuse_main() but on the low-level interface
+ * ARGS:
+ *  - args: FUSE arguments (see middfs_mount_args())
+ * RETV: 0 on success; 1 on error.
+ */
+int middfs_ll_main(struct fuse_args *args) {
+  struct fuse_cmdline_opts opts;
+  struct fuse_session *se;
+  int retv = 1;
+
+  if (fuse_parse_cmdline(args, &opts) != 0) {
+    return 1;
+  }
+  if (opts.show_version) {
+    fuse_lowlevel_version();
+    retv = 0;
+    goto done;
+  }
+  if (opts.mountpoint == NULL) {
+    fprintf(stderr, "middfs-client: no mountpoint given\n");
+    goto done;
+  }
+
+  if ((se = fuse_session_new(args, &middfs_ll_oper, sizeof(middfs_ll_oper), NULL)) == NULL) {
+    goto done;
+  }
+  if (fuse_set_signal_handlers(se) != 0) {
+    goto destroy;
+  }
+  if (fuse_session_mount(se, opts.mountpoint) != 0) {
+    goto remove_handlers;
+  }
+
+  fuse_daemonize(opts.foreground);
+
+  if (opts.singlethread) {
+    retv = fuse_session_loop(se);
+  } else {
+#if FUSE_USE_VERSION >= 312
+    /* libfuse parsed ``-omax_threads'' (see middfs_mount_args()) */
+    struct fuse_loop_config *config = fuse_loop_cfg_create();
+    if (config != NULL) {
+      fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+      fuse_loop_cfg_set_idle_threads(config, opts.max_idle_threads);
+      fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+      retv = fuse_session_loop_mt(se, config);
+      fuse_loop_cfg_destroy(config);
+    }
+#else
+    struct fuse_loop_config config = {.clone_fd = opts.clone_fd,
+                                      .max_idle_threads = opts.max_idle_threads};
+    retv = fuse_session_loop_mt(se, &config);
+#endif
+  }
+  retv = (retv != 0);
+
+  fuse_session_unmount(se);
+ remove_handlers:
+  fuse_remove_signal_handlers(se);
+ destroy:
+  fuse_session_destroy(se);
+ done:
+  free(opts.mountpoint);
+  return retv;
+}
+
+#endif
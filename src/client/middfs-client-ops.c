@@ -17,6 +17,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include "lib/middfs-serial.h"
 #include "lib/middfs-conn.h"
@@ -29,19 +30,148 @@
 #include "client/middfs-client-handler.h"
 #include "client/middfs-client-conf.h"
 
+static const char *middfs_op_strs[MOP_NTYPES] =
+  {[MOP_GETATTR] = "getattr", [MOP_READ] = "read", [MOP_WRITE] = "write",
+   [MOP_READDIR] = "readdir"};
+
+static struct {
+  atomic_ullong calls;
+  atomic_ullong allocs;
+} middfs_op_stats[MOP_NTYPES];
+
+/* middfs_op_done() -- record call of operation
+ * ARGS:
+ *  - op: operation
+ *  - allocs: client_allocs() when the operation started
+ *  - retv: return value of the operation
+ * RETV: _retv_
+ */
+int middfs_op_done(enum middfs_op op, int64_t allocs, int retv) {
+  atomic_fetch_add_explicit(&middfs_op_stats[op].calls, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&middfs_op_stats[op].allocs, client_allocs() - allocs,
+                            memory_order_relaxed);
+  return retv;
+}
+
+/* print_op_stats() -- print number of calls of, and heap allocations per call
+ * made by, the operations on the hot path */
+void print_op_stats(void) {
+  fprintf(stderr, "ops:");
+  for (int op = 0; op < MOP_NTYPES; ++op) {
+    unsigned long long calls = atomic_load(&middfs_op_stats[op].calls);
+    unsigned long long allocs = atomic_load(&middfs_op_stats[op].allocs);
+    if (client_allocs() < 0) {
+      fprintf(stderr, " %s=%llu", middfs_op_strs[op], calls);
+    } else {
+      fprintf(stderr, " %s=%llu (%.2f allocs/op)", middfs_op_strs[op], calls,
+              calls ? (double) allocs / calls : 0.0);
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+#if FUSE == 3
+
+/* Whether the kernel caches writes, and the largest request it sends if so;
+ * fixed at mount time (see middfs_mount_args()). */
+static bool middfs_writeback;
+static size_t middfs_max_io;
+
+/* middfs_mount_args() -- add the mount options that the configuration calls
+ * for to _args_
+ * RETV: 0 on success; -1 on error.
+ * NOTE: The kernel only accepts a larger max_read as a mount option, which
+ *       middfs_init() must then request again.
+ */
+int middfs_mount_args(struct fuse_args *args) {
+  const struct client_conf *conf = client_conf();
+  char opt[sizeof("-omax_idle_threads=") + 20];
+
+  /* size of FUSE's pool of worker threads */
+  if (conf->max_idle_threads > 0) {
+    snprintf(opt, sizeof(opt), "-omax_idle_threads=%u", conf->max_idle_threads);
+    if (fuse_opt_add_arg(args, opt) < 0) {
+      return -1;
+    }
+  }
+  if (conf->max_threads > 0) {
+#if FUSE_MAJOR_VERSION > 3 || FUSE_MINOR_VERSION >= 12
+    snprintf(opt, sizeof(opt), "-omax_threads=%u", conf->max_threads);
+    if (fuse_opt_add_arg(args, opt) < 0) {
+      return -1;
+    }
+#else
+    fprintf(stderr, "middfs-client: ``max_threads'' needs libfuse 3.12; ignored\n");
+#endif
+  }
+
+  middfs_writeback = conf->writeback;
+  middfs_max_io = conf->max_io;
+  if (!middfs_writeback) {
+    return 0;
+  }
+  snprintf(opt, sizeof(opt), "-omax_read=%zu", middfs_max_io);
+  return fuse_opt_add_arg(args, opt);
+}
+
+/* middfs_open_flags() -- adjust flags of file being opened for the kernel's
+ * writeback cache, which may read the pages of write-only files and
+ * positions appends itself */
+int middfs_open_flags(int flags) {
+  if (middfs_writeback) {
+    if ((flags & O_ACCMODE) == O_WRONLY) {
+      flags = (flags & ~O_ACCMODE) | O_RDWR;
+    }
+    flags &= ~O_APPEND;
+  }
+  return flags;
+}
+
+/* middfs_init_conn() -- let the kernel gather small writes into large ones
+ * in its page cache; it writes them back before flush & fsync (see
+ * middfs_fsync()) */
+void middfs_init_conn(struct fuse_conn_info *conn) {
+  if (middfs_writeback) {
+    conn->max_read = middfs_max_io; /* must match the mount option */
+    conn->max_write = middfs_max_io;
+    conn->max_readahead = middfs_max_io;
+    if ((conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+      conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+  }
+}
+
+/* middfs_attr_timeout() -- get timeout of attributes given to the kernel
+ * NOTE: The kernel should cache attributes as long as we do (see
+ *       middfs-client-attr.c), so use the shortest configured. Through the
+ *       high-level interface, it only takes one attribute timeout for the
+ *       whole mount, which is fixed until remounting; the low-level one
+ *       (middfs-client-llops.c) sends the current timeout with each reply.
+ */
+double middfs_attr_timeout(void) {
+  const struct client_conf *conf = client_conf();
+  double timeout = conf->attr_timeout;
+
+  for (int i = 0; i < conf->nattr_dirs; ++i) {
+    timeout = MIN(timeout, conf->attr_dirs[i].timeout);
+  }
+  return timeout;
+}
+
 /* NOTE: return value is for private context and is passed
  * to all other middfs functions. Don't need to use for now,
  * though. */
-#if FUSE == 3
-
 static void *middfs_init(struct fuse_conn_info *conn,
 			 struct fuse_config *cfg) {
   cfg->use_ino = 1; /* use inodes */
+
+  middfs_init_conn(conn);
   
-  /* disable caching */
-  cfg->entry_timeout = 0.0;
-  cfg->attr_timeout = 0.0;
-  cfg->negative_timeout = 0.0;
+  /* let the kernel cache names as long as we do, too (see
+   * middfs-client-dentry.c) */
+  cfg->attr_timeout = middfs_attr_timeout();
+  cfg->entry_timeout = client_conf()->entry_timeout;
+  cfg->negative_timeout = client_conf()->entry_timeout;
   
   return NULL;  
 }
@@ -51,6 +181,14 @@ static void *middfs_init(struct fuse_conn_info *conn) {
   return NULL;
 }
 
+int middfs_mount_args(struct fuse_args *args) {
+  return 0; /* no writeback cache, and FUSE 2 sizes its thread pool itself */
+}
+
+int middfs_open_flags(int flags) {
+  return flags;
+}
+
 #endif
 
 
@@ -65,6 +203,7 @@ static int middfs_getattr
 )
 {
   int retv = 0;
+  int64_t allocs = client_allocs();
   struct client_rsrc *client_rsrc = NULL;
   struct client_rsrc client_rsrc_tmp;
 
@@ -75,7 +214,7 @@ static int middfs_getattr
   if (fi == NULL) {
     /* create & open temporary resource */
     if ((retv = client_rsrc_init(path, &client_rsrc_tmp)) < 0) {
-      return retv;
+      return middfs_op_done(MOP_GETATTR, allocs, retv);
     }
     client_rsrc = &client_rsrc_tmp;
   }
@@ -97,7 +236,7 @@ static int middfs_getattr
     retv = (retv < 0) ? retv : res; /* correctly set return val */
   }
   
-  return retv;
+  return middfs_op_done(MOP_GETATTR, allocs, retv);
 }
 
 static int middfs_access(const char *path, int mode) {
@@ -131,7 +270,7 @@ static int middfs_readlink(const char *path, char *buf,
   if ((retv = client_rsrc_init(path, &client_rsrc_tmp)) < 0) {
     return retv;
   }
-  if ((retv = client_rsrc_readlink(&client_rsrc_tmp, buf, size)) < 0) {
+  if ((retv = client_rsrc_readlink(&client_rsrc_tmp, buf, size - 1)) < 0) { /* room for '\0' */
     goto cleanup;
   }
 
@@ -159,16 +298,19 @@ static int middfs_readdir
 {
   int retv = 0;
   int res;
+  int64_t allocs = client_allocs();
   struct client_rsrc rsrc;
 
   /* DEBUGGING */
-  fprintf(stderr, "``%s''", conf_get(MIDDFS_CONF_HOMEPATH));
+  fprintf(stderr, "``%s''", client_conf()->homepath);
   
   /* get resource handle */
   if ((retv = client_rsrc_init(path, &rsrc)) < 0) {
-    return retv;
+    return middfs_op_done(MOP_READDIR, allocs, retv);
   }
-  if ((retv = client_rsrc_open(&rsrc, O_RDONLY)) < 0) {
+  /* only local directories need opening; network ones are read in a single
+   * readdirplus round trip */
+  if (rsrc.mr_type == MR_LOCAL && (retv = client_rsrc_open(&rsrc, O_RDONLY)) < 0) {
     goto cleanup;
   }
 
@@ -216,8 +358,7 @@ static int middfs_readdir
     }
   }
 
-  
-  return retv;
+  return middfs_op_done(MOP_READDIR, allocs, retv);
 }
 
 
@@ -368,6 +509,45 @@ static int middfs_chmod
   return retv;
 }
 
+static int middfs_utimens
+(
+#if FUSE == 3
+ const char *path, const struct timespec tv[2], struct fuse_file_info *fi
+#else
+ const char *path, const struct timespec tv[2]
+#endif
+ )
+{
+  int retv = 0;
+  struct client_rsrc *client_rsrc = NULL;
+  struct client_rsrc client_rsrc_tmp;
+
+#if FUSE == 2
+  void *fi = NULL; /* fi parameter missing in FUSE 2 API */
+#endif
+
+  if (fi == NULL) {
+    if ((retv = client_rsrc_init(path, &client_rsrc_tmp)) < 0) {
+      return retv;
+    }
+    client_rsrc = &client_rsrc_tmp;
+  }
+#if FUSE == 3
+  else {
+    client_rsrc = (struct client_rsrc *) fi->fh;
+  }
+#endif
+
+  retv = client_rsrc_utimens(client_rsrc, tv);
+
+  /* cleanup */
+  if (fi == NULL) {
+    client_rsrc_delete(&client_rsrc_tmp);
+  }
+  
+  return retv;
+}
+
 static int middfs_truncate
 (
 #if FUSE == 3
@@ -421,9 +601,14 @@ static int middfs_create(const char *path, mode_t mode, struct fuse_file_info *f
     free(client_rsrc);
     return retv;
   }
+  if ((retv = client_rsrc_own(client_rsrc)) < 0) { /* outlives _path_ */
+    client_rsrc_delete(client_rsrc);
+    free(client_rsrc);
+    return retv;
+  }
 
   /* open resource */
-  if ((retv = client_rsrc_open(client_rsrc, fi->flags, mode)) < 0) {
+  if ((retv = client_rsrc_open(client_rsrc, middfs_open_flags(fi->flags), mode)) < 0) {
     client_rsrc_delete(client_rsrc);
     free(client_rsrc);
     return retv;
@@ -431,6 +616,7 @@ static int middfs_create(const char *path, mode_t mode, struct fuse_file_info *f
 
   /* update file handle with resource */
   fi->fh = (uint64_t) client_rsrc;
+  fi->keep_cache = client_rsrc->mr_unchanged;
   return retv;
 }
 
@@ -446,9 +632,14 @@ static int middfs_open(const char *path, struct fuse_file_info *fi) {
     free(client_rsrc);
     return retv;
   }
+  if ((retv = client_rsrc_own(client_rsrc)) < 0) { /* outlives _path_ */
+    client_rsrc_delete(client_rsrc);
+    free(client_rsrc);
+    return retv;
+  }
   
   /* open resource */
-  if ((retv = client_rsrc_open(client_rsrc, fi->flags)) < 0) {
+  if ((retv = client_rsrc_open(client_rsrc, middfs_open_flags(fi->flags))) < 0) {
     client_rsrc_delete(client_rsrc);
     free(client_rsrc);
     return retv;
@@ -456,6 +647,7 @@ static int middfs_open(const char *path, struct fuse_file_info *fi) {
   
   /* update file handle with resource */
   fi->fh = (uint64_t) client_rsrc;
+  fi->keep_cache = client_rsrc->mr_unchanged;
   return 0;
 }
 
@@ -464,13 +656,14 @@ static int middfs_open(const char *path, struct fuse_file_info *fi) {
 static int middfs_read(const char *path, char *buf, size_t size,
 		       off_t offset, struct fuse_file_info *fi) {
   int retv = 0;
+  int64_t allocs = client_allocs();
   struct client_rsrc *client_rsrc = NULL;
   struct client_rsrc client_rsrc_tmp;
 
   if (fi == NULL) {
     /* create & open temporary resource */
     if ((retv = client_rsrc_init(path, &client_rsrc_tmp)) < 0) {
-      return retv;
+      return middfs_op_done(MOP_READ, allocs, retv);
     }
     if ((retv = client_rsrc_open(&client_rsrc_tmp, O_RDONLY)) < 0) {
       goto cleanup;
@@ -489,28 +682,30 @@ static int middfs_read(const char *path, char *buf, size_t size,
  cleanup:
   /* delete temporary resource if needed */
   if (fi == NULL) {
-    int res = client_rsrc_delete(client_rsrc);
+    int res = client_rsrc_delete(&client_rsrc_tmp);
     retv = (retv < 0) ? retv : res;
   }
 
-  return retv;
+  return middfs_op_done(MOP_READ, allocs, retv);
 }
 
 static int middfs_write(const char *path, const char *buf,
 			size_t size, off_t offset,
 			struct fuse_file_info *fi) {
   int retv = 0;
+  int64_t allocs = client_allocs();
   struct client_rsrc *client_rsrc = NULL;
   struct client_rsrc client_rsrc_tmp;
   
   /* obtain resource */
   if (fi == NULL) {
     if ((retv = client_rsrc_init(path, &client_rsrc_tmp)) < 0) {
-      return retv;
+      return middfs_op_done(MOP_WRITE, allocs, retv);
     }
     if ((retv = client_rsrc_open(&client_rsrc_tmp, O_WRONLY)) < 0) {
       goto cleanup;
     }
+    client_rsrc = &client_rsrc_tmp;
   } else {
     client_rsrc = (struct client_rsrc *) fi->fh;
   }
@@ -529,10 +724,10 @@ static int middfs_write(const char *path, const char *buf,
 
  cleanup:
   if (fi == NULL) {
-    client_rsrc_delete(client_rsrc);
+    client_rsrc_delete(&client_rsrc_tmp);
   }
 
-  return retv;
+  return middfs_op_done(MOP_WRITE, allocs, retv);
 }
 
 static int middfs_statfs(const char *path, struct statvfs *stbuf) {
@@ -545,6 +740,18 @@ static int middfs_statfs(const char *path, struct statvfs *stbuf) {
   return retv;
 }
 
+/* middfs_flush() -- called on each close(2) of an open file, after the
+ * kernel has written back the pages the file dirtied. Writes are passed on
+ * as they come, so nothing is left to flush. */
+static int middfs_flush(const char *path, struct fuse_file_info *fi) {
+  return 0;
+}
+
+static int middfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  struct client_rsrc *client_rsrc = (struct client_rsrc *) fi->fh;
+  return client_rsrc_fsync(client_rsrc, datasync);
+}
+
 static int middfs_release(const char *path,
 			  struct fuse_file_info *fi) {
 
@@ -575,11 +782,14 @@ struct fuse_operations middfs_oper =
    .chmod = middfs_chmod,
    // .chown = middfs_chown, /* not supported */
    .truncate = middfs_truncate,
+   .utimens = middfs_utimens,
    .open = middfs_open,
    .create = middfs_create,
    .read = middfs_read,
    .write = middfs_write,
    .statfs = middfs_statfs,
+   .flush = middfs_flush,
+   .fsync = middfs_fsync,
    .release = middfs_release,
    .readdir = middfs_readdir,
   };
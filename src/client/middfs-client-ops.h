@@ -6,8 +6,31 @@
 #ifndef __MIDDFS_CLIENT_OPS_H
 #define __MIDDFS_CLIENT_OPS_H
 
-#include <fuse.h>
+#include <stdint.h>
+
+#include "client/middfs-client-fuse.h"
+
+/* Operations on the hot path, which shouldn't allocate. The allocations
+ * made by each are counted to make sure they don't. */
+enum middfs_op {MOP_GETATTR, MOP_READ, MOP_WRITE, MOP_READDIR, MOP_NTYPES};
 
 extern struct fuse_operations middfs_oper;
 
+int middfs_mount_args(struct fuse_args *args);
+int middfs_op_done(enum middfs_op op, int64_t allocs, int retv);
+int middfs_open_flags(int flags);
+void print_op_stats(void);
+
+#if FUSE == 3
+void middfs_init_conn(struct fuse_conn_info *conn);
+double middfs_attr_timeout(void);
+
+/* low-level interface (middfs-client-llops.c) */
+extern struct fuse_lowlevel_ops middfs_ll_oper;
+int middfs_ll_main(struct fuse_args *args);
+#endif
+
+/* allocation counting (middfs-client-alloc.c) */
+int64_t client_allocs(void);
+
 #endif
@@ -7,11 +7,16 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <assert.h>
+#include <poll.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "lib/middfs-conf.h"
 #include "lib/middfs-serial.h"
 #include "lib/middfs-buf.h"
 #include "lib/middfs-pkt.h"
+#include "lib/middfs-dict.h"
+#include "lib/middfs-arena.h"
 
 #include "client/middfs-client-conf.h"
 #include "client/middfs-client-pkt.h"
@@ -19,30 +24,31 @@
 /* packet_send() -- send a packet over the given socket fd 
  * ARGS:
  *  - fd: socket file descriptor to write packet over 
- *  - pkt: packet to send 
+ *  - buf: buffer to serialize packet into; reused across calls, so that
+ *    sending doesn't allocate. It is empty when this returns.
+ *  - pkt: packet to send; its data is serialized straight from the
+ *    caller's buffer
  * RETV: 0 on success; negated error code on error.
  */
-int packet_send(int fd, const struct middfs_packet *pkt) {
+int packet_send(int fd, struct buffer *buf, const struct middfs_packet *pkt) {
    int retv = 0;
-   struct buffer buf;
-   buffer_init(&buf);
 
    fprintf(stderr, "FUSE: ");
    print_packet(pkt);
    
-   if (buffer_serialize(pkt, (serialize_f) serialize_pkt, &buf) < 0) {
-      return -errno;
+   if (buffer_serialize(pkt, (serialize_f) serialize_pkt, buf) < 0) {
+      retv = -errno;
    }
-   while (!buffer_isempty(&buf)) {
+   while (retv == 0 && !buffer_isempty(buf)) {
       int write_retv;
-      if ((write_retv = buffer_write(fd, &buf)) < 0 && errno != EINTR) {
+      if ((write_retv = buffer_write(fd, buf)) < 0 && errno != EINTR) {
          retv = -errno;
-         break;
       }
    }
 
    /* cleanup */
-   buffer_delete(&buf);
+   buffer_empty(buf);
+   buffer_trim(buf);
 
    return retv;
 }
@@ -50,59 +56,200 @@ int packet_send(int fd, const struct middfs_packet *pkt) {
 /* packet_recv() -- receive a packet over the given socket fd
  * ARGS:
  *  - fd: socket file descriptor to receive packet over
- *  - pkt: pointer to packet to deserialize into 
+ *  - buf: bytes received over _fd_ but not yet deserialized; may hold the
+ *    beginning of the next packet when this returns
+ *  - pkt: pointer to packet to deserialize into; only _pkt->mpkt_dict_ and
+ *    _pkt->mpkt_arena_ need to be set. On success, free it with packet_free().
  * RETV: 0 on success; negated error code on error.
  */
-int packet_recv(int fd, struct middfs_packet *pkt) {
+int packet_recv(int fd, struct buffer *buf, struct middfs_packet *pkt) {
    int retv = 0;
-   struct buffer buf;
-   buffer_init(&buf);
+   struct middfs_dict *dict = pkt->mpkt_dict;
+   struct arena *arena = pkt->mpkt_arena;
    
    /* deserialize & read into buffer */
-   while ((retv = buffer_deserialize(pkt, (deserialize_f) deserialize_pkt, &buf)) > 0) {
+   for (;;) {
+      memset(pkt, 0, sizeof(*pkt));
+      pkt->mpkt_dict = dict;
+      pkt->mpkt_arena = arena;
+      if ((retv = buffer_deserialize(pkt, (deserialize_f) deserialize_pkt, buf)) <= 0) {
+         break;
+      }
+      packet_free(pkt); /* free members deserialized so far */
+
       int read_retv;
       /* NOTE: Be careful to not treat interrupt as error. */
-      if ((read_retv = buffer_read(fd, &buf)) <= 0) {
+      if ((read_retv = buffer_read(fd, buf)) <= 0) {
+         if (read_retv == 0) {
+            errno = ECONNRESET; /* connection closed mid-packet */
+         }
+         retv = -1;
          break;
       }
    }
    if (retv < 0) {
       retv = -errno;
+      packet_free(pkt);
    } else {
       fprintf(stderr,"RESP: ");
       print_packet(pkt);
    }
    
-   /* cleanup */
-   buffer_delete(&buf);
-   
    return retv;
 }
             
+/* Connection to the server, kept open across requests so that the
+ * dictionary used to encode requests stays valid. Each thread has its own,
+ * so that FUSE's worker threads and read-ahead don't wait for one another's
+ * requests; it is closed when the thread exits. */
+static _Thread_local struct {
+   bool registered;     /* whether the thread-exit destructor is registered */
+   int fd;
+   struct middfs_dict dict;
+   struct arena arena;  /* members of the last response */
+   struct buffer buf;   /* bytes received but not yet deserialized */
+   struct buffer sendbuf; /* requests being sent */
+   uint32_t peer_flags; /* flags of the last packet received from the server */
+   bool streaming;      /* more packets of the last response follow */
+} server_conn = {.fd = -1};
+
+/* server_conn_close() -- drop the connection to the server */
+static void server_conn_close(void) {
+   if (server_conn.fd >= 0) {
+      close(server_conn.fd);
+      server_conn.fd = -1;
+   }
+   dict_reset(&server_conn.dict);
+   buffer_empty(&server_conn.buf);
+   buffer_trim(&server_conn.buf);
+   server_conn.peer_flags = 0;
+   server_conn.streaming = false;
+}
+
+static pthread_key_t server_conn_key;
+static pthread_once_t server_conn_key_once = PTHREAD_ONCE_INIT;
+
+/* server_conn_exit() -- close thread's connection & free its buffers
+ * (called on thread exit, e.g. when FUSE retires an idle worker) */
+static void server_conn_exit(void *arg) {
+   server_conn_close();
+   arena_delete(&server_conn.arena);
+   buffer_delete(&server_conn.buf);
+   buffer_init(&server_conn.buf);
+   buffer_delete(&server_conn.sendbuf);
+   buffer_init(&server_conn.sendbuf);
+}
+
+static void server_conn_key_init(void) {
+   pthread_key_create(&server_conn_key, server_conn_exit);
+}
+
+/* server_conn_get() -- get connection to the server, (re)connecting if necessary
+ * RETV: socket fd on success; -1 on error.
+ */
+static int server_conn_get(void) {
+   /* an idle connection should never be readable; if it is, the server hung up.
+    * Likewise, the rest of an unfinished streamed response can't be skipped. */
+   if (server_conn.fd >= 0 && server_conn.streaming) {
+      server_conn_close();
+   }
+   if (server_conn.fd >= 0) {
+      struct pollfd pfd = {.fd = server_conn.fd, .events = POLLIN};
+      if (poll(&pfd, 1, 0) != 0) {
+         server_conn_close();
+      }
+   }
+
+   if (server_conn.fd < 0) {
+      const struct client_conf *conf = client_conf();
+      if (!server_conn.registered) {
+         pthread_once(&server_conn_key_once, server_conn_key_init);
+         pthread_setspecific(server_conn_key, &server_conn);
+         server_conn.registered = true;
+      }
+      server_conn.fd = inet_connect(conf->serverip, conf->serverport);
+   }
+
+   return server_conn.fd;
+}
+            
 /* packet_xchg() -- exchange packets with server 
- * ARGS: */
+ * ARGS:
+ *  - out_pkt: request to send
+ *  - in_pkt: response received
+ * RETV: 0 on success; negated error code on error.
+ * NOTE: The members of _in_pkt_ are only valid until the next call (or
+ *       packet_free(_in_pkt_)), except for the payload, which the caller
+ *       may payload_ref().
+ *       If _in_pkt_ has MPKT_F_MORE set, the rest of the response should be
+ *       received with packet_xchg_next(); otherwise, the connection is reset
+ *       on the next exchange.
+ */
 int packet_xchg(const struct middfs_packet *out_pkt, struct middfs_packet *in_pkt) {
    int retv = 0;
-   const char *serverip = conf_get(MIDDFS_CONF_SERVERIP);
-   int err = 0;
-   uint32_t serverport = conf_get_uint32(MIDDFS_CONF_SERVERPORT, &err);
-
-   /* validate params */
-   assert(serverip != NULL && err == 0);
+   struct middfs_packet pkt = *out_pkt;
 
    /* connect to server */
    int fd;
-   if ((fd = inet_connect(serverip, serverport)) < 0) {
+   if ((fd = server_conn_get()) < 0) {
       return -errno;
    }
 
    /* send packet and receive response */
-   if (packet_send(fd, out_pkt) < 0 || packet_recv(fd, in_pkt) < 0) {
+   pkt.mpkt_dict = &server_conn.dict;
+   packet_set_lz(&pkt, compression_enabled(), server_conn.peer_flags);
+   packet_set_crc(&pkt, checksums_enabled());
+   if (packet_send(fd, &server_conn.sendbuf, &pkt) < 0) {
       retv = -errno;
+      server_conn_close(); /* connection is in an unknown state */
+      return retv;
    }
 
-   close(fd);
-   return retv;
+   return packet_xchg_next(in_pkt);
+}
+
+/* packet_xchg_next() -- receive the next packet of a streamed response, i.e.
+ * after packet_xchg() or packet_xchg_next() received a packet with
+ * MPKT_F_MORE set. Also used by packet_xchg() to receive the first packet.
+ * ARGS:
+ *  - in_pkt: response packet received
+ * RETV: 0 on success; negated error code on error.
+ * NOTE: Invalidates the members of the packet received previously, as
+ *       described for packet_xchg().
+ */
+int packet_xchg_next(struct middfs_packet *in_pkt) {
+   int retv;
+
+   in_pkt->mpkt_dict = NULL;
+   in_pkt->mpkt_arena = &server_conn.arena;
+   arena_reset(&server_conn.arena); /* previous response is no longer in use */
+   if ((retv = packet_recv(server_conn.fd, &server_conn.buf, in_pkt)) < 0) {
+      server_conn_close(); /* connection is in an unknown state */
+      return retv;
+   }
+
+   server_conn.peer_flags = in_pkt->mpkt_flags;
+   server_conn.streaming = in_pkt->mpkt_flags & MPKT_F_MORE;
+   if (!server_conn.streaming) {
+      buffer_trim(&server_conn.buf);
+   }
+
+   return 0;
+}
+
+
+/* compression_enabled() -- whether payload compression is enabled
+ * (``compression'' configuration variable; defaults to on).
+ */
+bool compression_enabled(void) {
+   return client_conf()->compression;
+}
+
+/* checksums_enabled() -- whether outgoing packets are checksummed
+ * (``checksums'' configuration variable; defaults to on).
+ */
+bool checksums_enabled(void) {
+   return client_conf()->checksums;
 }
 
 
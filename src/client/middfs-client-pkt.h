@@ -3,11 +3,17 @@
 #ifndef __MIDDFS_CLIENT_PKT_H
 #define __MIDDFS_CLIENT_PKT_H
 
+#include <stdbool.h>
+
 #include "lib/middfs-pkt.h"
+#include "lib/middfs-buf.h"
 
-int packet_send(int fd, const struct middfs_packet *pkt);
-int packet_recv(int fd, struct middfs_packet *pkt);
+int packet_send(int fd, struct buffer *buf, const struct middfs_packet *pkt);
+int packet_recv(int fd, struct buffer *buf, struct middfs_packet *pkt);
 int packet_xchg(const struct middfs_packet *out_pkt, struct middfs_packet *in_pkt);
+int packet_xchg_next(struct middfs_packet *in_pkt);
+bool compression_enabled(void);
+bool checksums_enabled(void);
 int response_validate(const struct middfs_packet *pkt, enum middfs_response_type type);
 
 #endif
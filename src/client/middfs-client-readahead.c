@@ -0,0 +1,166 @@
+/* middfs-client-readahead.c -- read-ahead of network files
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Windows are prefetched by READAHEAD_THREADS background threads, each
+ * with its own connection to the server, from a small queue of pending
+ * windows; if the queue is full, the window is dropped and read on demand
+ * instead. Each window is a single streamed READ (see
+ * block_cache_prefetch()), and with more than one thread the next window is
+ * requested while the last one is still arriving, so a sequential reader
+ * isn't held to a window per round trip. The queue's lock also guards the
+ * access patterns of open files, which FUSE may read from several threads
+ * at once.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lib/middfs-util.h"
+
+#include "client/middfs-client-readahead.h"
+#include "client/middfs-client-conf.h"
+
+#define READAHEAD_QUEUE 16  /* most windows pending */
+#define READAHEAD_THREADS 2 /* most windows being prefetched at once */
+
+struct readahead_req {
+   const char *owner; /* interned */
+   char path[BLOCK_PATH_MAX];
+   uint64_t handle;         /* may be released by the time it's used */
+   struct stat sb;
+   size_t size;
+   off_t offset;
+   block_fetch_f fetch;
+};
+
+static struct {
+   pthread_mutex_t lock;
+   pthread_cond_t pending;  /* signalled when a window is queued */
+   pthread_once_t once;     /* starts the threads */
+   struct readahead_req queue[READAHEAD_QUEUE];
+   size_t head;             /* index of next window to prefetch */
+   size_t len;              /* number of windows queued */
+} readahead_queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .pending = PTHREAD_COND_INITIALIZER,
+                     .once = PTHREAD_ONCE_INIT};
+
+/* readahead_thread() -- prefetch queued windows forever */
+static void *readahead_thread(void *arg) {
+   struct readahead_req req;
+
+   for (;;) {
+      pthread_mutex_lock(&readahead_queue.lock);
+      while (readahead_queue.len == 0) {
+         pthread_cond_wait(&readahead_queue.pending, &readahead_queue.lock);
+      }
+      req = readahead_queue.queue[readahead_queue.head];
+      readahead_queue.head = (readahead_queue.head + 1) % READAHEAD_QUEUE;
+      --readahead_queue.len;
+      pthread_mutex_unlock(&readahead_queue.lock);
+
+      struct rsrc rsrc = {.mr_owner = (char *) req.owner, .mr_path = req.path};
+      block_cache_prefetch(&rsrc, req.handle, &req.sb, req.size, req.offset, req.fetch);
+   }
+
+   return NULL;
+}
+
+static void readahead_start(void) {
+   pthread_t thread;
+   int err;
+
+   for (int i = 0; i < READAHEAD_THREADS; ++i) {
+      if ((err = pthread_create(&thread, NULL, readahead_thread, NULL)) != 0) {
+         fprintf(stderr, "middfs-client: read-ahead %s: %s\n", i ? "limited" : "disabled",
+                 strerror(err));
+         return;
+      }
+      pthread_detach(thread);
+   }
+}
+
+/* readahead_submit() -- queue window for prefetching
+ * RETV: true if it was queued; false if the queue is full.
+ * NOTE: Call with _readahead_queue.lock_ held.
+ */
+static bool readahead_submit(const struct rsrc *rsrc, uint64_t handle, const struct stat *sb,
+                             size_t size, off_t offset, block_fetch_f fetch) {
+   size_t len = strlen(rsrc->mr_path);
+   bool queued = false;
+
+   if (len >= BLOCK_PATH_MAX) {
+      return false; /* wouldn't be cached anyway */
+   }
+
+   pthread_once(&readahead_queue.once, readahead_start);
+
+   if (readahead_queue.len < READAHEAD_QUEUE) {
+      struct readahead_req *req =
+         &readahead_queue.queue[(readahead_queue.head + readahead_queue.len) % READAHEAD_QUEUE];
+      req->owner = rsrc->mr_owner;
+      memcpy(req->path, rsrc->mr_path, len + 1);
+      req->handle = handle;
+      req->sb = *sb;
+      req->size = size;
+      req->offset = offset;
+      req->fetch = fetch;
+      ++readahead_queue.len;
+      pthread_cond_signal(&readahead_queue.pending);
+      queued = true;
+   }
+
+   return queued;
+}
+
+/* readahead_init() -- initialize access pattern of newly opened file */
+void readahead_init(struct readahead *ra) {
+   *ra = (struct readahead) {0};
+}
+
+/* readahead_read() -- note read of network file, prefetching what follows
+ *                     it if reads have been sequential
+ * ARGS:
+ *  - ra: access pattern of the open file
+ *  - rsrc: network resource
+ *  - handle: owner's handle of the open file; 0 if none
+ *  - sb: its current attributes
+ *  - size, offset: range being read
+ *  - fetch: function that reads blocks from the owner
+ * NOTE: Call before reading the range itself, so that prefetching overlaps
+ *       with the read.
+ */
+void readahead_read(struct readahead *ra, const struct rsrc *rsrc, uint64_t handle,
+                    const struct stat *sb, size_t size, off_t offset, block_fetch_f fetch) {
+   const struct client_conf *conf = client_conf();
+   size_t max = MIN(conf->readahead, conf->cache_size / 8); /* leave room for the rest */
+   off_t end = offset + size;
+
+   pthread_mutex_lock(&readahead_queue.lock);
+
+   bool sequential = (offset == ra->next);
+   ra->next = end;
+   if (!sequential || max < BLOCK_SIZE) {
+      ra->window = 0; /* random access */
+      goto done;
+   }
+
+   if (ra->window == 0) {
+      /* start of a sequential run */
+      ra->window = MIN(2 * size, max);
+      ra->start = ra->end = end;
+   } else if (end <= ra->start) {
+      goto done; /* reader hasn't reached the last window yet */
+   } else {
+      ra->window = MIN(2 * ra->window, max);
+   }
+
+   ra->end = MAX(ra->end, end); /* in case the reader caught up */
+   if (ra->end < sb->st_size && readahead_submit(rsrc, handle, sb, ra->window, ra->end, fetch)) {
+      ra->start = ra->end;
+      ra->end += ra->window;
+   }
+
+ done:
+   pthread_mutex_unlock(&readahead_queue.lock);
+}
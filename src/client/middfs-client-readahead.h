@@ -0,0 +1,33 @@
+/* middfs-client-readahead.h -- read-ahead of network files
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CLIENT_READAHEAD_H
+#define __MIDDFS_CLIENT_READAHEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "lib/middfs-rsrc.h"
+
+#include "client/middfs-client-block.h"
+
+/* struct readahead -- access pattern of an open network file. Once reads are
+ * sequential, the blocks following them are prefetched into the block cache
+ * in the background, one window ahead of the reader; the window doubles
+ * each time the reader enters the last one prefetched, up to the configured
+ * readahead size, and starts over after a read elsewhere in the file. */
+struct readahead {
+   off_t next;    /* offset following the last read */
+   off_t start;   /* start of the last window prefetched */
+   off_t end;     /* end of the last window prefetched */
+   size_t window; /* size of the last window; 0 if reads aren't sequential */
+};
+
+void readahead_init(struct readahead *ra);
+void readahead_read(struct readahead *ra, const struct rsrc *rsrc, uint64_t handle,
+                    const struct stat *sb, size_t size, off_t offset, block_fetch_f fetch);
+
+#endif
@@ -12,16 +12,24 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <dirent.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #include "lib/middfs-conf.h"
 #include "lib/middfs-pkt.h"
 #include "lib/middfs-util.h"
+#include "lib/middfs-intern.h"
 
 #include "client/middfs-client-rsrc.h"
+#include "client/middfs-client-home.h"
+#include "client/middfs-client-attr.h"
+#include "client/middfs-client-block.h"
+#include "client/middfs-client-dentry.h"
 #include "client/middfs-client.h"
 #include "client/middfs-client-conf.h"
 #include "client/middfs-client-pkt.h"
@@ -31,14 +39,9 @@
 #define STAT_EXAMPLE_REG "/write"
 #define STAT_EXAMPLE_DIR "/dir"
 
-/* utility function definitions */
+static pthread_mutex_t client_rsrc_stat_lock = PTHREAD_MUTEX_INITIALIZER; /* see mr_stat */
 
-char *middfs_localpath_tmp(const char *middfs_path) {
-  char *localpath;
-  asprintf(&localpath, "%s/%s%s", conf_get(MIDDFS_CONF_HOMEPATH),
-           conf_get(MIDDFS_CONF_USERNAME), middfs_path);
-  return localpath;
-}
+/* utility function definitions */
 
 /* middfs_abspath() -- convert a relative path into an absolute path
  * ARGS:
@@ -69,14 +72,129 @@ int middfs_abspath(char **path) {
 }
 
 
+/* client_rsrc_ino() -- map inode number of file on its owner's host to one
+ *                      that is unique across owners
+ * ARGS:
+ *  - owner: owner of file
+ *  - mstat: attributes of file
+ * NOTE: Inode numbers are XORed with a hash of the owner & device, so files
+ *       on the same device never collide and the mapping is stable across
+ *       mounts.
+ */
+static ino_t client_rsrc_ino(const char *owner, const struct middfs_stat *mstat) {
+  uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+
+  for (const char *it = owner; it != NULL && *it != '\0'; ++it) {
+    hash = (hash ^ (unsigned char) *it) * 1099511628211ULL;
+  }
+  hash = (hash ^ mstat->mstat_dev) * 1099511628211ULL;
+  return (ino_t) (mstat->mstat_ino ^ hash);
+}
+
+/* client_rsrc_stat() -- convert attributes of network file to stat buf
+ * ARGS:
+ *  - owner: owner of file
+ *  - mstat: its attributes, as sent by the owner
+ *  - sb: stat buf to fill in
+ */
+static void client_rsrc_stat(const char *owner, const struct middfs_stat *mstat,
+                             struct stat *sb) {
+  memset(sb, 0, sizeof(*sb));
+  sb->st_mode = mstat->mstat_mode;
+  sb->st_size = mstat->mstat_size;
+  sb->st_blocks = mstat->mstat_blocks;
+  sb->st_blksize = mstat->mstat_blksize;
+  sb->st_mtim.tv_sec = mstat->mstat_mtime;
+  sb->st_mtim.tv_nsec = mstat->mstat_mtime_nsec;
+  sb->st_atim.tv_sec = mstat->mstat_atime;
+  sb->st_atim.tv_nsec = mstat->mstat_atime_nsec;
+  sb->st_ctim.tv_sec = mstat->mstat_ctime;
+  sb->st_ctim.tv_nsec = mstat->mstat_ctime_nsec;
+  sb->st_ino = client_rsrc_ino(owner, mstat);
+  sb->st_nlink = mstat->mstat_nlink;
+  sb->st_uid = mstat->mstat_uid;
+  sb->st_gid = mstat->mstat_gid;
+}
+
+/* client_rsrc_cache_child() -- cache attributes of entry of network
+ *                              directory, as returned by readdirplus
+ * ARGS:
+ *  - dir: network directory
+ *  - name: name of entry
+ *  - sb: its attributes
+ *  - gen: attr_cache_gen() from before the directory was read
+ */
+static void client_rsrc_cache_child(const struct rsrc *dir, const char *name,
+                                    const struct stat *sb, uint64_t gen) {
+  char path[PATH_MAX];
+  struct rsrc child = {.mr_owner = dir->mr_owner, .mr_path = path};
+
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return;
+  }
+  if (snprintf(path, sizeof(path), "%s/%s", strcmp(dir->mr_path, "/") ? dir->mr_path : "",
+               name) >= (int) sizeof(path)) {
+    return;
+  }
+  attr_cache_put(&child, sb, gen);
+}
+
 /* client_rsrc_* FUNCTIONS
  * NOTE: All client_rsrc_* functions return negated error codes directly
  * (e.g. return -errno).
  */
 
+/* client_rsrc_owner() -- get interned name of owner _name_
+ * ARGS:
+ *  - name: owner's name (needn't be null-terminated)
+ *  - len: length of _name_
+ * RETV: interned name; NULL on error (errno set, e.g. to ENOENT if the
+ *       server knows no such client).
+ * NOTE: Names that come from paths are interned only once the server has
+ *       answered for the owner's home, so that looking up made-up names
+ *       doesn't grow the table of interned strings.
+ */
+const char *client_rsrc_owner(const char *name, size_t len) {
+   const char *owner;
+   struct middfs_packet out = {0};
+   struct middfs_packet in = {0};
+   struct rsrc home = {.mr_path = "/"};
+   int retv;
+
+   if ((owner = intern_find(name, len)) != NULL) {
+      return owner;
+   }
+   if (len == 0 || memchr(name, '\0', len) != NULL) {
+      errno = ENOENT;
+      return NULL;
+   }
+   if ((home.mr_owner = strndup(name, len)) == NULL) {
+      return NULL;
+   }
+
+   packet_init(&out, MPKT_REQUEST);
+   request_init(&out.mpkt_un.mpkt_request, MREQ_GETATTR, client_conf()->username, &home);
+   if ((retv = packet_xchg(&out, &in)) < 0 ||
+       (retv = response_validate(&in, MRSP_STAT)) < 0) {
+      owner = NULL;
+      errno = -retv;
+   } else {
+      owner = intern(name, len);
+   }
+
+   free(home.mr_owner);
+   return owner;
+}
+
 /* client_rsrc_init() -- construct resource from path
  * ARGS:
+ *  - path: middfs path of resource
+ *  - client_rsrc: resource to initialize
  * RETV: returns 0 on success; -errno on error.
+ * NOTE: Doesn't allocate: the resource's path points into _path_, so it is
+ *       only valid as long as _path_ is (see client_rsrc_own()), and the
+ *       owner is interned. The first time an owner is named, this asks the
+ *       server about it (see client_rsrc_owner()).
  */
 int client_rsrc_init(const char *path, struct client_rsrc *client_rsrc) {
   /* find owner string in _path_ */
@@ -88,51 +206,105 @@ int client_rsrc_init(const char *path, struct client_rsrc *client_rsrc) {
 
   if (*owner_begin == '\0') {
     /* requesting middfs root -- special type of request */
-     client_rsrc->mr_rsrc.mr_owner = strdup("\0");
-     client_rsrc->mr_rsrc.mr_path = strdup("\0");
-     client_rsrc->mr_type = MR_ROOT;
+    client_rsrc_init_at("", "", client_rsrc);
   } else {
     /* requesting something in a user directory */
     
     const char *owner_end = owner_begin + strcspn(owner_begin, "/");
   
-    /* dup and save owner string */
-    client_rsrc->mr_rsrc.mr_owner = strndup(owner_begin, owner_end - owner_begin);
+    /* intern owner string */
+    const char *owner = client_rsrc_owner(owner_begin, owner_end - owner_begin);
+    if (owner == NULL) {
+      return -errno;
+    }
   
     /* find owner path string */
-    if (*owner_end == '\0') {
-      client_rsrc->mr_rsrc.mr_path = strdup("/");
-    } else {
-      client_rsrc->mr_rsrc.mr_path = strdup(owner_end);
-    }
+    client_rsrc_init_at(owner, (*owner_end == '\0') ? "/" : owner_end, client_rsrc);
+  }
+  
+  return 0; /* success */
+}
+
+/* client_rsrc_init_at() -- construct resource from its owner and its path
+ *                          on the owner's host, e.g. as kept by the inode
+ *                          table
+ * ARGS:
+ *  - owner: interned owner; "" for the middfs root
+ *  - path: path relative to owner's home ("/" for the home itself)
+ *  - client_rsrc: resource to initialize
+ * NOTE: Like client_rsrc_init(), the resource's path points into _path_.
+ */
+void client_rsrc_init_at(const char *owner, const char *path, struct client_rsrc *client_rsrc) {
+  client_rsrc->mr_rsrc.mr_owner = (char *) owner;
+  client_rsrc->mr_pathbuf = NULL;
+
+  if (*owner == '\0') {
+    client_rsrc->mr_rsrc.mr_path = "";
+    client_rsrc->mr_type = MR_ROOT;
+  } else {
+    client_rsrc->mr_rsrc.mr_path = (char *) path;
 
-    /* find resource type */
-    if (strcmp(client_rsrc->mr_rsrc.mr_owner, conf_get(MIDDFS_CONF_USERNAME)) != 0) {
+    /* find resource type (both strings are interned) */
+    if (owner != client_conf()->username) {
       client_rsrc->mr_type = MR_NETWORK; /* resource not owned by client */
     } else {
       client_rsrc->mr_type = MR_LOCAL; /* resource owned by client */
     }
-
   }
   
   /* initialize other fields */
   client_rsrc->mr_fd = -1;
-  
-  return 0; /* success */
+  client_rsrc->mr_handle = 0;
+  readahead_init(&client_rsrc->mr_ra);
+  client_rsrc->mr_unchanged = false;
+  client_rsrc->mr_stat_gen = UINT64_MAX; /* not current until opened */
+}
+
+/* client_rsrc_own() -- make resource independent of the path it was
+ *                      constructed from, e.g. to keep it in an open file
+ * RETV: returns 0 on success; -errno on error.
+ */
+int client_rsrc_own(struct client_rsrc *client_rsrc) {
+  if (client_rsrc->mr_pathbuf == NULL) {
+    if ((client_rsrc->mr_pathbuf = strdup(client_rsrc->mr_rsrc.mr_path)) == NULL) {
+      return -errno;
+    }
+    client_rsrc->mr_rsrc.mr_path = client_rsrc->mr_pathbuf;
+  }
+  return 0;
+}
+
+/* client_rsrc_release() -- end owner's lease on open network file */
+static void client_rsrc_release(struct client_rsrc *client_rsrc) {
+  struct middfs_packet out = {0};
+  struct middfs_packet in = {0};
+
+  packet_init(&out, MPKT_REQUEST);
+  request_init(&out.mpkt_un.mpkt_request, MREQ_RELEASE, client_conf()->username,
+               &client_rsrc->mr_rsrc);
+  out.mpkt_un.mpkt_request.mreq_handle = client_rsrc->mr_handle;
+  client_rsrc->mr_handle = 0;
+
+  /* if this fails, the lease will run out on its own */
+  if (packet_xchg(&out, &in) >= 0) {
+    packet_free(&in);
+  }
 }
 
 int client_rsrc_delete(struct client_rsrc *client_rsrc) {
   int retv = 0;
 
   if (client_rsrc != NULL) {
+    if (client_rsrc->mr_handle != 0) {
+      client_rsrc_release(client_rsrc);
+    }
     if (client_rsrc->mr_fd >= 0) {
       if (close(client_rsrc->mr_fd) < 0) {
 	retv = -errno;
       }
     }
     
-    free(client_rsrc->mr_rsrc.mr_owner);
-    free(client_rsrc->mr_rsrc.mr_path);
+    free(client_rsrc->mr_pathbuf);
   }
   
   return retv;
@@ -146,7 +318,6 @@ int client_rsrc_open(struct client_rsrc *client_rsrc, int flags, ...) {
   int retv = 0;
   int fd = -1;
   int mode = 0; /* NOTE: This might need to be init'ed to umask(2)? */
-  char *localpath = NULL;
 
   /* check for file create flag; obtain mode param if present */
   if ((flags & O_CREAT)) {
@@ -160,17 +331,46 @@ int client_rsrc_open(struct client_rsrc *client_rsrc, int flags, ...) {
      {
         struct middfs_packet out = {0};
         struct middfs_packet in  = {0};
+        struct stat sb;
+        uint64_t gen = attr_cache_gen();
+        uint64_t block_gen = block_cache_gen(&client_rsrc->mr_rsrc);
+        if (!(flags & O_CREAT) && dentry_missing(&client_rsrc->mr_rsrc)) {
+           return -ENOENT;
+        }
         packet_init(&out, MPKT_REQUEST);
-        request_init(&out.mpkt_un.mpkt_request, MREQ_OPEN, &client_rsrc->mr_rsrc);
+        request_init(&out.mpkt_un.mpkt_request, MREQ_OPEN, client_conf()->username,
+                     &client_rsrc->mr_rsrc);
         out.mpkt_un.mpkt_request.mreq_mode = flags;
-        if (packet_xchg(&out, &in) < 0) {
+        retv = packet_xchg(&out, &in);
+        if ((flags & (O_CREAT | O_TRUNC))) {
+           attr_cache_invalidate(&client_rsrc->mr_rsrc, false);
+           block_cache_invalidate(&client_rsrc->mr_rsrc, false);
+        }
+        if ((flags & O_CREAT)) {
+           dentry_invalidate(&client_rsrc->mr_rsrc);
+        }
+        if (retv < 0) {
            perror("packet_xchg");
            return -EIO;
         }
-        if ((retv = response_validate(&in, MRSP_OK)) < 0) {
+        if ((retv = response_validate(&in, MRSP_HANDLE)) < 0) {
            return retv;
         }
 
+        /* the owner replies with a handle & the file's attributes as of the open */
+        const struct middfs_handle *handle = &in.mpkt_un.mpkt_response.mrsp_un.mrsp_handle;
+        if (client_rsrc->mr_handle != 0) {
+           client_rsrc_release(client_rsrc); /* reopened */
+        }
+        client_rsrc->mr_handle = handle->mh_id;
+        client_rsrc_stat(client_rsrc->mr_rsrc.mr_owner, &handle->mh_stat, &sb);
+        attr_cache_put(&client_rsrc->mr_rsrc, &sb, gen);
+        client_rsrc->mr_unchanged = attr_cache_reopen(&client_rsrc->mr_rsrc, &sb);
+        pthread_mutex_lock(&client_rsrc_stat_lock);
+        client_rsrc->mr_stat = sb;
+        client_rsrc->mr_stat_gen = block_gen;
+        pthread_mutex_unlock(&client_rsrc_stat_lock);
+
         return 0;
      }
      
@@ -179,13 +379,15 @@ int client_rsrc_open(struct client_rsrc *client_rsrc, int flags, ...) {
     
   case MR_LOCAL:
     /* open local file */
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if ((fd = open(localpath, flags, mode)) < 0) {
-      retv = -errno;
+    if ((fd = home_open(client_rsrc->mr_rsrc.mr_path, flags, mode)) < 0) {
+      retv = fd;
     } else {
+      struct stat sb;
       client_rsrc->mr_fd = fd;
+      if (fstat(fd, &sb) == 0) {
+        client_rsrc->mr_unchanged = attr_cache_reopen(&client_rsrc->mr_rsrc, &sb);
+      }
     }
-    free(localpath);
     return retv;
     
   default:
@@ -196,7 +398,7 @@ int client_rsrc_open(struct client_rsrc *client_rsrc, int flags, ...) {
 int client_rsrc_lstat(const struct client_rsrc *client_rsrc,
 		      struct stat *sb) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   memset(sb, 0, sizeof(*sb)); /* initialize buffer */
 
@@ -208,11 +410,20 @@ int client_rsrc_lstat(const struct client_rsrc *client_rsrc,
            {.mpkt_magic = MPKT_MAGIC,
             .mpkt_type = MPKT_REQUEST};
         struct middfs_packet in_pkt;
+        uint64_t gen = attr_cache_gen();
+        uint64_t dgen = dentry_gen();
+
+        if (attr_cache_get(&client_rsrc->mr_rsrc, sb)) {
+           return 0;
+        }
+        if (dentry_missing(&client_rsrc->mr_rsrc)) {
+           return -ENOENT;
+        }
 
         /* init request */
         struct middfs_request *req = &out_pkt.mpkt_un.mpkt_request;
         req->mreq_type = MREQ_GETATTR;
-        req->mreq_requester = conf_get(MIDDFS_CONF_USERNAME);
+        req->mreq_requester = (char *) client_conf()->username;
         req->mreq_rsrc = client_rsrc->mr_rsrc;
 
         /* exchange packets & validate response */
@@ -220,20 +431,16 @@ int client_rsrc_lstat(const struct client_rsrc *client_rsrc,
            return retv;
         }
         if ((retv = response_validate(&in_pkt, MRSP_STAT)) < 0) {
+           if (retv == -ENOENT) {
+              dentry_put_missing(&client_rsrc->mr_rsrc, dgen);
+           }
            return retv;
         }
      
         /* set stat buf */
-        const struct middfs_stat *mstat = &in_pkt.mpkt_un.mpkt_response.mrsp_un.mrsp_stat;
-        sb->st_mode = mstat->mstat_mode;
-        sb->st_size = mstat->mstat_size;
-        sb->st_blocks = mstat->mstat_blocks;
-        sb->st_blksize = mstat->mstat_blksize;
-
-        /* populate other fields */
-        sb->st_uid = getuid();
-        sb->st_gid = getgid();
-        sb->st_nlink = 1;
+        client_rsrc_stat(client_rsrc->mr_rsrc.mr_owner,
+                         &in_pkt.mpkt_un.mpkt_response.mrsp_un.mrsp_stat, sb);
+        attr_cache_put(&client_rsrc->mr_rsrc, sb, gen);
      }
 
      return 0;
@@ -246,11 +453,13 @@ int client_rsrc_lstat(const struct client_rsrc *client_rsrc,
      return 0;
      
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if (lstat(localpath, sb) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if (fstatat(dir.fd, dir.base, sb, AT_SYMLINK_NOFOLLOW) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
     return retv;
 
   default:
@@ -261,19 +470,51 @@ int client_rsrc_lstat(const struct client_rsrc *client_rsrc,
 int client_rsrc_readlink(const struct client_rsrc *client_rsrc,
                          char *buf, size_t bufsize) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
+     {
+        struct middfs_packet out = {0};
+        struct middfs_packet in = {0};
+        uint64_t gen = dentry_gen();
+
+        if ((retv = dentry_get_link(&client_rsrc->mr_rsrc, buf, bufsize)) >= 0) {
+           return retv;
+        }
+        
+        packet_init(&out, MPKT_REQUEST);
+        request_init(&out.mpkt_un.mpkt_request, MREQ_READLINK, client_conf()->username,
+                     &client_rsrc->mr_rsrc);
+        out.mpkt_un.mpkt_request.mreq_size = bufsize;
+        if ((retv = packet_xchg(&out, &in)) < 0) {
+           return retv;
+        }
+        if ((retv = response_validate(&in, MRSP_DATA)) < 0) {
+           return retv;
+        }
+
+        const struct middfs_data *data = &in.mpkt_un.mpkt_response.mrsp_un.mrsp_data;
+        retv = MIN(bufsize, data->mdata_nbytes);
+        memcpy(buf, data->mdata_buf, retv);
+        if (data->mdata_nbytes < bufsize) { /* else it may have been truncated */
+           dentry_put_link(&client_rsrc->mr_rsrc, data->mdata_buf, data->mdata_nbytes, gen);
+        }
+        packet_free(&in);
+        return retv;
+     }
+
   case MR_ROOT:
     return -EOPNOTSUPP;
     
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if ((retv = readlink(localpath, buf, bufsize)) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if ((retv = readlinkat(dir.fd, dir.base, buf, bufsize)) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
     return retv;
 
   default:
@@ -283,7 +524,7 @@ int client_rsrc_readlink(const struct client_rsrc *client_rsrc,
 
 int client_rsrc_access(const struct client_rsrc *client_rsrc, int mode) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -291,8 +532,12 @@ int client_rsrc_access(const struct client_rsrc *client_rsrc, int mode) {
      {
         struct middfs_packet out = {0};
         struct middfs_packet in = {0};
+        if (client_rsrc->mr_type == MR_NETWORK && dentry_missing(&client_rsrc->mr_rsrc)) {
+           return -ENOENT;
+        }
         packet_init(&out, MPKT_REQUEST);
-        request_init(&out.mpkt_un.mpkt_request, MREQ_ACCESS, &client_rsrc->mr_rsrc);
+        request_init(&out.mpkt_un.mpkt_request, MREQ_ACCESS, client_conf()->username,
+                     &client_rsrc->mr_rsrc);
         out.mpkt_un.mpkt_request.mreq_mode = mode;
         if (packet_xchg(&out, &in) < 0) {
            perror("packet_xchg");
@@ -306,11 +551,13 @@ int client_rsrc_access(const struct client_rsrc *client_rsrc, int mode) {
      }
      
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if (access(localpath, mode) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if (faccessat(dir.fd, dir.base, mode, AT_SYMLINK_NOFOLLOW) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
     return retv;
 
   default:
@@ -320,7 +567,7 @@ int client_rsrc_access(const struct client_rsrc *client_rsrc, int mode) {
 
 int client_rsrc_mkdir(const struct client_rsrc *client_rsrc, mode_t mode) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -328,11 +575,13 @@ int client_rsrc_mkdir(const struct client_rsrc *client_rsrc, mode_t mode) {
     return -EOPNOTSUPP;
 
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if (mkdir(localpath, mode) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if (mkdirat(dir.fd, dir.base, mode) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
     return retv;
 
   default:
@@ -342,7 +591,7 @@ int client_rsrc_mkdir(const struct client_rsrc *client_rsrc, mode_t mode) {
 
 int client_rsrc_unlink(const struct client_rsrc *client_rsrc) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -350,11 +599,13 @@ int client_rsrc_unlink(const struct client_rsrc *client_rsrc) {
     return -EOPNOTSUPP;
     
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if (unlink(localpath) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if (unlinkat(dir.fd, dir.base, 0) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
     break;
     
   default:
@@ -366,7 +617,7 @@ int client_rsrc_unlink(const struct client_rsrc *client_rsrc) {
 
 int client_rsrc_rmdir(const struct client_rsrc *client_rsrc) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -374,11 +625,14 @@ int client_rsrc_rmdir(const struct client_rsrc *client_rsrc) {
     return -EOPNOTSUPP;
     
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if (rmdir(localpath) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if (unlinkat(dir.fd, dir.base, AT_REMOVEDIR) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
+    home_invalidate(client_rsrc->mr_rsrc.mr_path);
     return retv;
     
   default:
@@ -389,7 +643,6 @@ int client_rsrc_rmdir(const struct client_rsrc *client_rsrc) {
 
 int client_rsrc_truncate(const struct client_rsrc *client_rsrc, off_t size) {
   int retv = 0;
-  char *localpath = NULL;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -399,9 +652,12 @@ int client_rsrc_truncate(const struct client_rsrc *client_rsrc, off_t size) {
         struct middfs_packet in = {0};
         packet_init(&out, MPKT_REQUEST);
         struct middfs_request *req = &out.mpkt_un.mpkt_request;
-        request_init(req, MREQ_TRUNCATE, &client_rsrc->mr_rsrc);
+        request_init(req, MREQ_TRUNCATE, client_conf()->username, &client_rsrc->mr_rsrc);
         req->mreq_size = size;
-        if (packet_xchg(&out, &in) < 0) {
+        retv = packet_xchg(&out, &in);
+        attr_cache_invalidate(&client_rsrc->mr_rsrc, false);
+        block_cache_invalidate(&client_rsrc->mr_rsrc, false);
+        if (retv < 0) {
            perror("packet_xchg");
            return -EIO;
         }
@@ -417,11 +673,14 @@ int client_rsrc_truncate(const struct client_rsrc *client_rsrc, off_t size) {
 	retv = -errno;
       }
     } else {
-      localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-      if (truncate(localpath, size) < 0) {
+      int fd;
+      if ((fd = home_open(client_rsrc->mr_rsrc.mr_path, O_WRONLY, 0)) < 0) {
+        return fd;
+      }
+      if (ftruncate(fd, size) < 0) {
 	retv = -errno;
       }
-      free(localpath);
+      close(fd);
     }
     return retv;
 
@@ -433,7 +692,7 @@ int client_rsrc_truncate(const struct client_rsrc *client_rsrc, off_t size) {
 int client_rsrc_symlink(const struct client_rsrc *client_rsrc,
 			const char *to) {
   int retv = 0;
-  char *localpath = NULL;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -441,11 +700,13 @@ int client_rsrc_symlink(const struct client_rsrc *client_rsrc,
     return -EOPNOTSUPP;
 
   case MR_LOCAL:
-    localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-    if (symlink(to, localpath) < 0) {
+    if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+      return retv;
+    }
+    if (symlinkat(to, dir.fd, dir.base) < 0) {
       retv = -errno;
     }
-    free(localpath);
+    home_release(&dir);
     return retv;
 
   default:
@@ -470,9 +731,16 @@ int client_rsrc_rename(const struct client_rsrc *from,
         struct middfs_packet in_pkt = {0};
         packet_init(&out_pkt, MPKT_REQUEST);
         struct middfs_request *req = &out_pkt.mpkt_un.mpkt_request;
-        request_init(req, MREQ_RENAME, &from->mr_rsrc);
+        request_init(req, MREQ_RENAME, client_conf()->username, &from->mr_rsrc);
         req->mreq_to = to->mr_rsrc;
-        if (packet_xchg(&out_pkt, &in_pkt) < 0) {
+        retv = packet_xchg(&out_pkt, &in_pkt);
+        attr_cache_invalidate(&from->mr_rsrc, true); /* in case it's a directory */
+        attr_cache_invalidate(&to->mr_rsrc, true);   /* ... that replaced one */
+        block_cache_invalidate(&from->mr_rsrc, true);
+        block_cache_invalidate(&to->mr_rsrc, true);
+        dentry_invalidate(&from->mr_rsrc);
+        dentry_invalidate(&to->mr_rsrc);
+        if (retv < 0) {
            perror("packet_xchg");
            return -EIO;
         }
@@ -484,16 +752,23 @@ int client_rsrc_rename(const struct client_rsrc *from,
      
   case MR_LOCAL:
      {
-        char *local_to, *local_from;
-        local_from = middfs_localpath_tmp(from->mr_rsrc.mr_path);
-        local_to = middfs_localpath_tmp(to->mr_rsrc.mr_path);
+        struct home_dir dir_from, dir_to;
+        if ((retv = home_lookup(from->mr_rsrc.mr_path, &dir_from)) < 0) {
+           return retv;
+        }
+        if ((retv = home_lookup(to->mr_rsrc.mr_path, &dir_to)) < 0) {
+           home_release(&dir_from);
+           return retv;
+        }
         
-        if (rename(local_from, local_to) < 0) {
+        if (renameat(dir_from.fd, dir_from.base, dir_to.fd, dir_to.base) < 0) {
            retv = -errno;
         }
         
-        free(local_to);
-        free(local_from);
+        home_release(&dir_to);
+        home_release(&dir_from);
+        home_invalidate(from->mr_rsrc.mr_path); /* in case it's a directory */
+        home_invalidate(to->mr_rsrc.mr_path);   /* ... that replaced one */
         return retv;
      }
   default:
@@ -503,7 +778,7 @@ int client_rsrc_rename(const struct client_rsrc *from,
 
 int client_rsrc_chmod(const struct client_rsrc *client_rsrc, mode_t mode) {
   int retv = 0;
-  char *localpath;
+  struct home_dir dir;
 
   switch (client_rsrc->mr_type) {
   case MR_NETWORK:
@@ -516,11 +791,13 @@ int client_rsrc_chmod(const struct client_rsrc *client_rsrc, mode_t mode) {
 	retv = -errno;
       }
     } else {
-      localpath = middfs_localpath_tmp(client_rsrc->mr_rsrc.mr_path);
-      if (lchmod(localpath, mode) < 0) {
+      if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+        return retv;
+      }
+      if (fchmodat(dir.fd, dir.base, mode, AT_SYMLINK_NOFOLLOW) < 0) {
          retv = -errno;
       }
-      free(localpath);
+      home_release(&dir);
     }
     return retv;
     
@@ -530,54 +807,186 @@ int client_rsrc_chmod(const struct client_rsrc *client_rsrc, mode_t mode) {
   
 }
 
-int client_rsrc_read(const struct client_rsrc *client_rsrc, char *buf, size_t size, off_t offset) {
+/* client_rsrc_utimens() -- set access & modification times
+ * ARGS:
+ *  - times: as for utimensat(2); UTIME_NOW and UTIME_OMIT are honored, and
+ *           UTIME_NOW uses the owner's clock
+ * RETV: 0 on success; -errno on error.
+ */
+int client_rsrc_utimens(const struct client_rsrc *client_rsrc, const struct timespec times[2]) {
+  int retv = 0;
+  struct home_dir dir;
+
+  switch (client_rsrc->mr_type) {
+  case MR_NETWORK:
+  case MR_ROOT:
+     {
+        struct middfs_packet out = {0};
+        struct middfs_packet in = {0};
+        packet_init(&out, MPKT_REQUEST);
+        struct middfs_request *req = &out.mpkt_un.mpkt_request;
+        request_init(req, MREQ_UTIMENS, client_conf()->username, &client_rsrc->mr_rsrc);
+        req->mreq_times[0] = times[0];
+        req->mreq_times[1] = times[1];
+        retv = packet_xchg(&out, &in);
+        attr_cache_invalidate(&client_rsrc->mr_rsrc, false);
+        if (retv < 0) {
+           perror("packet_xchg");
+           return -EIO;
+        }
+        return response_validate(&in, MRSP_OK);
+     }
+
+  case MR_LOCAL:
+    if (client_rsrc->mr_fd >= 0) {
+      if (futimens(client_rsrc->mr_fd, times) < 0) {
+        retv = -errno;
+      }
+    } else {
+      if ((retv = home_lookup(client_rsrc->mr_rsrc.mr_path, &dir)) < 0) {
+        return retv;
+      }
+      if (utimensat(dir.fd, dir.base, times, AT_SYMLINK_NOFOLLOW) < 0) {
+        retv = -errno;
+      }
+      home_release(&dir);
+    }
+    return retv;
+
+  default:
+    abort();
+  }
+}
+
+/* client_rsrc_fetch() -- read from network file, bypassing the cache
+ * ARGS:
+ *  - rsrc: network resource
+ *  - handle: owner's handle of the open file; 0 if none
+ *  - iov, iovcnt: buffers to fill, in order
+ *  - offset: offset in file to read from
+ *  - filled, arg: if _filled_ isn't NULL, it is called with _arg_ after each
+ *                 chunk of the response is copied into _iov_
+ * RETV: number of bytes read; -errno on error.
+ */
+static ssize_t client_rsrc_fetch(const struct rsrc *rsrc, uint64_t handle,
+                                 const struct iovec *iov, int iovcnt, off_t offset,
+                                 block_filled_f filled, void *arg) {
+   size_t size = 0;
+   int retv;
+
+   for (int i = 0; i < iovcnt; ++i) {
+      size += iov[i].iov_len;
+   }
+
+   /* construct packet */
+   struct middfs_packet out_pkt =
+      {.mpkt_magic = MPKT_MAGIC,
+       .mpkt_type = MPKT_REQUEST,
+       .mpkt_flags = MPKT_F_ACCEPT_STREAM,
+       .mpkt_un = {.mpkt_request = {.mreq_type = MREQ_READ,
+                                    .mreq_requester = (char *) client_conf()->username,
+                                    .mreq_rsrc = *rsrc,
+                                    .mreq_handle = handle,
+                                    .mreq_size = size,
+                                    .mreq_off = offset
+                                    }
+                   }
+      };
+   struct middfs_packet in_pkt = {0};
+   size_t nbytes = 0;
+   size_t iov_off = 0; /* bytes of _iov[0]_ filled */
+
+   /* receive the response chunk by chunk, scattering each one into _iov_ */
+   for (retv = packet_xchg(&out_pkt, &in_pkt); retv >= 0;
+        retv = packet_xchg_next(&in_pkt)) {
+      bool more = in_pkt.mpkt_flags & MPKT_F_MORE;
+
+      /* validate response */
+      if ((retv = response_validate(&in_pkt, MRSP_DATA)) < 0) {
+         packet_free(&in_pkt);
+         break;
+      }
+
+      /* copy data from response */
+      const struct middfs_data *data = &in_pkt.mpkt_un.mpkt_response.mrsp_un.mrsp_data;
+      const char *src = data->mdata_buf;
+      size_t rem = MIN(size - nbytes, data->mdata_nbytes);
+      nbytes += rem;
+      while (rem > 0) {
+         size_t chunk = MIN(rem, iov->iov_len - iov_off);
+         memcpy((char *) iov->iov_base + iov_off, src, chunk);
+         src += chunk;
+         rem -= chunk;
+         if ((iov_off += chunk) == iov->iov_len) {
+            ++iov;
+            iov_off = 0;
+         }
+      }
+      packet_free(&in_pkt);
+
+      if (filled != NULL) {
+         filled(arg, nbytes);
+      }
+      if (!more) {
+         return nbytes;
+      }
+   }
+
+   return retv;
+}
+
+/* client_rsrc_open_stat() -- get attributes of open network file
+ * ARGS:
+ *  - client_rsrc: open network resource
+ *  - sb: where to store its attributes
+ *  - end: end of the range about to be read
+ * RETV: 0 on success; -errno on error.
+ * NOTE: The attributes are those the owner sent when the file was opened,
+ *       so changes other clients make to it are seen once it is reopened.
+ *       They are only fetched again after this client changes the file, or
+ *       when a read reaches past its end, so that a file growing under a
+ *       reader (e.g. tail -f) is seen to within the attribute timeout.
+ */
+static int client_rsrc_open_stat(struct client_rsrc *client_rsrc, struct stat *sb, off_t end) {
+   uint64_t gen = block_cache_gen(&client_rsrc->mr_rsrc);
+   bool current;
+   int retv;
+
+   pthread_mutex_lock(&client_rsrc_stat_lock);
+   if ((current = (client_rsrc->mr_stat_gen == gen))) {
+      *sb = client_rsrc->mr_stat;
+   }
+   pthread_mutex_unlock(&client_rsrc_stat_lock);
+   if (current && end <= sb->st_size) {
+      return 0;
+   }
+
+   if ((retv = client_rsrc_lstat(client_rsrc, sb)) < 0) {
+      return retv;
+   }
+   pthread_mutex_lock(&client_rsrc_stat_lock);
+   client_rsrc->mr_stat = *sb;
+   client_rsrc->mr_stat_gen = gen;
+   pthread_mutex_unlock(&client_rsrc_stat_lock);
+   return 0;
+}
+
+int client_rsrc_read(struct client_rsrc *client_rsrc, char *buf, size_t size, off_t offset) {
    int retv = 0;
 
    switch (client_rsrc->mr_type) {
    case MR_NETWORK:
       {
-         /* construct packet */
-         struct middfs_packet out_pkt =
-            {.mpkt_magic = MPKT_MAGIC,
-             .mpkt_type = MPKT_REQUEST,
-             .mpkt_un = {.mpkt_request = {.mreq_type = MREQ_READ,
-                                          .mreq_requester = strdup(conf_get(MIDDFS_CONF_USERNAME)),
-                                          .mreq_rsrc = client_rsrc->mr_rsrc,
-                                          .mreq_size = size,
-                                          .mreq_off = offset
-                                          }
-                         }
-            };
-         struct middfs_packet in_pkt = {0};
-
-         if ((retv = packet_xchg(&out_pkt, &in_pkt)) < 0) {
+         /* validate cached blocks against the file's attributes as of the
+          * open, which only go stale if this client changed it since */
+         struct stat sb;
+         if ((retv = client_rsrc_open_stat(client_rsrc, &sb, offset + size)) < 0) {
             return retv;
          }
-
-         /* validate response */
-         if (in_pkt.mpkt_magic != MPKT_MAGIC || in_pkt.mpkt_type != MPKT_RESPONSE) {
-            return -EIO;
-         }
-         
-         const struct middfs_response *rsp = &in_pkt.mpkt_un.mpkt_response;
-         switch (rsp->mrsp_type) {
-         case MRSP_DATA:
-            {
-               /* copy data from response */
-               const struct middfs_data *data = &in_pkt.mpkt_un.mpkt_response.mrsp_un.mrsp_data;
-               size_t nbytes = MIN(size, data->mdata_nbytes);
-               memcpy(buf, data->mdata_buf, nbytes);
-               retv = nbytes;
-               return retv;
-            }
-            
-         case MRSP_ERROR:
-            /* return specific error */
-            return -rsp->mrsp_un.mrsp_error;
-            
-         default:
-            return -EIO; /* packet corrupted */
-         }
+         readahead_read(&client_rsrc->mr_ra, &client_rsrc->mr_rsrc, client_rsrc->mr_handle,
+                        &sb, size, offset, client_rsrc_fetch);
+         return block_cache_read(&client_rsrc->mr_rsrc, client_rsrc->mr_handle, &sb, buf, size,
+                                 offset, client_rsrc_fetch);
       }
          
    case MR_ROOT:
@@ -601,45 +1010,35 @@ int client_rsrc_write(const struct client_rsrc *client_rsrc, const void *buf,
    switch (client_rsrc->mr_type) {
    case MR_NETWORK:
       {
-         /* construct packet */
-         char *username = conf_get(MIDDFS_CONF_USERNAME);
-         char *username_dup;
-         void *buf_dup;
-         
-         assert(username && *username);
-         username_dup = strdup(username);
-         buf_dup = memdup(buf, size);
-
-         if (buf_dup == NULL || username_dup == NULL) {
-            free(buf_dup);
-            free(username_dup);
-            return -errno;
-         }
-         
+         /* construct packet (borrows _buf_ until sent) */
          struct middfs_packet out_pkt =
             {.mpkt_magic = MPKT_MAGIC,
              .mpkt_type = MPKT_REQUEST,
              .mpkt_un = {.mpkt_request = {.mreq_type = MREQ_WRITE,
-                                          .mreq_requester = username_dup,
+                                          .mreq_requester = (char *) client_conf()->username,
                                           .mreq_rsrc = client_rsrc->mr_rsrc,
+                                          .mreq_handle = client_rsrc->mr_handle,
                                           .mreq_size = size,
                                           .mreq_off = offset,
-                                          .mreq_data = buf_dup
+                                          .mreq_data = (void *) buf
                                           }
                          }
             };
          struct middfs_packet in_pkt;
 
-         if (packet_xchg(&out_pkt, &in_pkt) < 0) {
-            return -1;
+         retv = packet_xchg(&out_pkt, &in_pkt);
+         attr_cache_invalidate(&client_rsrc->mr_rsrc, false); /* even if it failed midway */
+         block_cache_invalidate(&client_rsrc->mr_rsrc, false);
+         if (retv < 0) {
+            return retv;
          }
 
-         /* validate response */
-         assert(in_pkt.mpkt_magic == MPKT_MAGIC);
-         assert(in_pkt.mpkt_type == MPKT_RESPONSE);
-         assert(in_pkt.mpkt_un.mpkt_response.mrsp_type == MRSP_OK);
+         /* validate response (e.g. EAGAIN if the server is short of memory) */
+         if ((retv = response_validate(&in_pkt, MRSP_OK)) < 0) {
+            return retv;
+         }
          
-         return (retv < 0) ? retv : size;
+         return size;
       }
       
    case MR_ROOT:
@@ -656,6 +1055,48 @@ int client_rsrc_write(const struct client_rsrc *client_rsrc, const void *buf,
    }
 }
 
+/* client_rsrc_fsync() -- make the data written to an open file durable
+ * ARGS:
+ *  - client_rsrc: open resource
+ *  - datasync: whether only the data (and not all metadata) needs syncing
+ * RETV: 0 on success; -errno on error.
+ * NOTE: Writes to network files reach the owner before client_rsrc_write()
+ *       returns, so there is nothing to send but the request to sync them.
+ */
+int client_rsrc_fsync(const struct client_rsrc *client_rsrc, int datasync) {
+   int retv = 0;
+
+   switch (client_rsrc->mr_type) {
+   case MR_NETWORK:
+      {
+         struct middfs_packet out = {0};
+         struct middfs_packet in = {0};
+         packet_init(&out, MPKT_REQUEST);
+         request_init(&out.mpkt_un.mpkt_request, MREQ_FSYNC, client_conf()->username,
+                      &client_rsrc->mr_rsrc);
+         out.mpkt_un.mpkt_request.mreq_mode = datasync;
+         out.mpkt_un.mpkt_request.mreq_handle = client_rsrc->mr_handle;
+         if ((retv = packet_xchg(&out, &in)) < 0) {
+            perror("packet_xchg");
+            return -EIO;
+         }
+         return response_validate(&in, MRSP_OK);
+      }
+
+   case MR_ROOT:
+      return 0;
+
+   case MR_LOCAL:
+      if ((datasync ? fdatasync(client_rsrc->mr_fd) : fsync(client_rsrc->mr_fd)) < 0) {
+         retv = -errno;
+      }
+      return retv;
+
+   default:
+      abort();
+   }
+}
+
 
 int client_rsrc_readdir(struct client_rsrc *rsrc, void *buf, fuse_fill_dir_t filler,
                         off_t offset) {
@@ -668,8 +1109,11 @@ int client_rsrc_readdir(struct client_rsrc *rsrc, void *buf, fuse_fill_dir_t fil
          /* construct a readdir request */
          struct middfs_packet in_pkt = {0};
          struct middfs_packet out_pkt = {0};
+         uint64_t gen = dentry_gen();
+         uint64_t agen = attr_cache_gen();
          packet_init(&out_pkt, MPKT_REQUEST);
-         request_init(&out_pkt.mpkt_un.mpkt_request, MREQ_READDIR, &rsrc->mr_rsrc);
+         request_init(&out_pkt.mpkt_un.mpkt_request, MREQ_READDIRPLUS, client_conf()->username,
+                      &rsrc->mr_rsrc);
 
          if ((retv = packet_xchg(&out_pkt, &in_pkt)) < 0) {
             return retv;
@@ -681,16 +1125,36 @@ int client_rsrc_readdir(struct client_rsrc *rsrc, void *buf, fuse_fill_dir_t fil
          }
 
          const struct middfs_dir *dir = &in_pkt.mpkt_un.mpkt_response.mrsp_un.mrsp_dir;
+         if (rsrc->mr_type == MR_NETWORK) {
+            dentry_put_dir(&rsrc->mr_rsrc, dir, gen);
+         } else {
+            /* the root lists the clients the server knows, so their names
+             * can be interned without asking about each one */
+            for (uint64_t i = 0; i < dir->mdir_count; ++i) {
+               intern(dir->mdir_ents[i].mde_name, strlen(dir->mdir_ents[i].mde_name));
+            }
+         }
 
-         /* decode and fill buffer with dirents */
+         /* decode and fill buffer with dirents, passing on their attributes
+          * (if any) so that the kernel needn't look each one up */
          for (uint64_t i = 0; i < dir->mdir_count; ++i) {
             const struct middfs_dirent *dirent = &dir->mdir_ents[i];
             struct stat st;
+            int fill_flags = 0;
             memset(&st, 0, sizeof(st));
             st.st_mode = dirent->mde_mode;
+            if (dir->mdir_plus && dirent->mde_stat.mstat_mode != 0) {
+               client_rsrc_stat(rsrc->mr_rsrc.mr_owner, &dirent->mde_stat, &st);
+#if FUSE == 3
+               fill_flags = FUSE_FILL_DIR_PLUS;
+#endif
+               if (rsrc->mr_type == MR_NETWORK) {
+                  client_rsrc_cache_child(&rsrc->mr_rsrc, dirent->mde_name, &st, agen);
+               }
+            }
             if (filler(
 #if FUSE == 3	       
-                       buf, dirent->mde_name, &st, 0, 0
+                       buf, dirent->mde_name, &st, 0, fill_flags
 #else
                        buf, dirent->mde_name, &st, 0
 #endif
@@ -698,6 +1162,8 @@ int client_rsrc_readdir(struct client_rsrc *rsrc, void *buf, fuse_fill_dir_t fil
                break; /* buffer full */
             }
          }
+
+         packet_free(&in_pkt);
          break;
       }
 
@@ -7,11 +7,14 @@
 #ifndef __MIDDFS_CLIENT_UTIL_H
 #define __MIDDFS_CLIENT_UTIL_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <sys/stat.h>
 
 #include "lib/middfs-rsrc.h"
 
 #include "client/middfs-client-fuse.h"
+#include "client/middfs-client-readahead.h"
 
 struct client_rsrc {
   /* mr_type: type of resource (local or network)
@@ -28,12 +31,39 @@ struct client_rsrc {
    * to -1.
    */
   int mr_fd;
+
+  /* mr_handle: owner's handle of the open file (MR_NETWORK), sent with reads
+   * & writes so that the owner needn't reopen it; 0 if none. */
+  uint64_t mr_handle;
+
+  /* mr_pathbuf: copy of the path that _mr_rsrc.mr_path_ points to, if
+   * the resource owns it (see client_rsrc_own()); NULL otherwise. */
+  char *mr_pathbuf;
+
+  /* mr_ra: access pattern of reads (MR_NETWORK) */
+  struct readahead mr_ra;
+
+  /* mr_unchanged: whether the file had the same size & mtime when it was
+   * last opened, so that the kernel may keep its cached pages of it (set by
+   * client_rsrc_open()). */
+  bool mr_unchanged;
+
+  /* mr_stat: attributes of the open file (MR_NETWORK), as the owner sent
+   * them with its handle or as refetched after this client changed the
+   * file or read past its end; current as long as block_cache_gen() of the
+   * file is _mr_stat_gen_.
+   * Guarded by a lock in middfs-client-rsrc.c, as FUSE may read an open file
+   * from several threads at once. */
+  struct stat mr_stat;
+  uint64_t mr_stat_gen;
 };
 
-char *middfs_localpath_tmp(const char *middfs_path);
 int middfs_abspath(char **path);
 
+const char *client_rsrc_owner(const char *name, size_t len);
 int client_rsrc_init(const char *path, struct client_rsrc *client_rsrc);
+void client_rsrc_init_at(const char *owner, const char *path, struct client_rsrc *client_rsrc);
+int client_rsrc_own(struct client_rsrc *client_rsrc);
 int client_rsrc_delete(struct client_rsrc *client_rsrc);
 int client_rsrc_open(struct client_rsrc *client_rsrc, int flags, ...);
 int client_rsrc_lstat(const struct client_rsrc *client_rsrc,
@@ -50,10 +80,12 @@ int client_rsrc_symlink(const struct client_rsrc *client_rsrc,
 int client_rsrc_rename(const struct client_rsrc *from,
 		       const struct client_rsrc *to);
 int client_rsrc_chmod(const struct client_rsrc *client_rsrc, mode_t mode);
+int client_rsrc_utimens(const struct client_rsrc *client_rsrc, const struct timespec times[2]);
 
-int client_rsrc_read(const struct client_rsrc *client_rsrc, char *buf, size_t size, off_t offset);
+int client_rsrc_read(struct client_rsrc *client_rsrc, char *buf, size_t size, off_t offset);
 int client_rsrc_write(const struct client_rsrc *client_rsrc, const void *buf,
                       size_t size, off_t offset);
+int client_rsrc_fsync(const struct client_rsrc *client_rsrc, int datasync);
 int client_rsrc_readdir(struct client_rsrc *rsrc, void *buf, fuse_fill_dir_t filler,
                         off_t offset);
 
@@ -29,6 +29,9 @@
 #include "lib/middfs-pkt.h"
 #include "lib/middfs-util.h"
 #include "lib/middfs-conf.h"
+#include "lib/middfs-lz.h"
+#include "lib/middfs-bufpool.h"
+#include "lib/middfs-mem.h"
 
 #include "client/middfs-client.h"
 #include "client/middfs-client-ops.h"
@@ -36,13 +39,14 @@
 #include "client/middfs-client-responder.h"
 #include "client/middfs-client-handler.h"
 #include "client/middfs-client-conf.h"
+#include "client/middfs-client-pkt.h"
 
 #define OPTDEF(t, p) {t, offsetof(struct middfs_opts, p), 1}
 
 #define CLIENT_BACKLOG_DEFAULT 10
 
 static int start_client_responder(const char *port, int backlog, pthread_t *thread);
-static int client_connect(const char *server_IP, int port, char *username);
+static int client_connect(const char *server_IP, int port, const char *username);
 
 /* middfs options 
  * NOTE: Must be global because FUSE API doesn't know about this.
@@ -167,6 +171,17 @@ int main(int argc, char *argv[]) {
      fprintf(stderr, "middfs-client: no configuration file found\n");
   }
 
+  /* parse configuration, and reparse it on SIGHUP (before starting any threads) */
+  if (client_conf_init() < 0) {
+     perror("client_conf_init");
+     goto cleanup;
+  }
+  if (client_conf_watch(confpath) < 0) {
+     perror("client_conf_watch");
+     goto cleanup;
+  }
+  const struct client_conf *conf = client_conf();
+
 #if 0
   /* validate options */
   /* convert to absolute path */
@@ -177,19 +192,16 @@ int main(int argc, char *argv[]) {
 #endif
 
   /* connect to server */
-  if (client_connect(SERVER_IP, LISTEN_PORT_DEFAULT, conf_get(MIDDFS_CONF_USERNAME)) < 0) {
+  if (client_connect(conf->serverip, conf->serverport, conf->username) < 0) {
      perror("client_connect");
      goto cleanup;
   }
 
   /* start client responder */
   pthread_t client_responder_thread;
-  char *client_responder_port;
+  char client_responder_port[sizeof("65535")];
 
-  if ((client_responder_port = conf_get(MIDDFS_CONF_LOCALPORT)) == NULL) {
-     perror("conf_get");
-     goto cleanup;
-  }
+  snprintf(client_responder_port, sizeof(client_responder_port), "%u", conf->localport);
   
   if (start_client_responder(client_responder_port, CLIENT_BACKLOG_DEFAULT,
                              &client_responder_thread) < 0) {
@@ -199,8 +211,25 @@ int main(int argc, char *argv[]) {
   
   umask(S_IRGRP|S_IROTH|S_IWGRP|S_IWOTH);
 
+  if (middfs_mount_args(&args) < 0) {
+    goto cleanup;
+  }
+
   /* set up client listener */
+#if FUSE == 3
+  if (conf->lowlevel) {
+    retv = middfs_ll_main(&args);
+  } else {
+    retv = fuse_main(args.argc, args.argv, &middfs_oper, NULL);
+  }
+#else
   retv = fuse_main(args.argc, args.argv, &middfs_oper, NULL);
+#endif
+
+  print_lz_stats();
+  print_bufpool_stats();
+  print_mem_stats();
+  print_op_stats();
 
  cleanup:
   fuse_opt_free_args(&args);
@@ -237,7 +266,7 @@ static int start_client_responder(const char *port, int backlog, pthread_t *thre
 /* client_connect() -- send MPKT_CONNECT packet to server.
  * RETV: -1 on error; 0 on success.
  */
-static int client_connect(const char *server_IP, int port, char *username) {
+static int client_connect(const char *server_IP, int port, const char *username) {
    int retv = -1;
    
    /* obtain socket for communication with server */
@@ -253,14 +282,11 @@ static int client_connect(const char *server_IP, int port, char *username) {
        .mpkt_type = MPKT_CONNECT
       };
    struct middfs_connect *conn = &conn_pkt.mpkt_un.mpkt_connect;
-   conn->name = username;
+   conn->name = (char *) username;
+   packet_set_lz(&conn_pkt, compression_enabled(), 0);
+   packet_set_crc(&conn_pkt, checksums_enabled());
 
-   int err = 0;
-   conn->port = conf_get_uint32(MIDDFS_CONF_LOCALPORT, &err);
-   if (err) {
-      fprintf(stderr, "client_connect: invalid local port value ``%s''\n", MIDDFS_CONF_LOCALPORT);
-      goto cleanup;
-   }
+   conn->port = client_conf()->localport;
    
    struct buffer buf_out;
    buffer_init(&buf_out);
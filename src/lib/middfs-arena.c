@@ -0,0 +1,113 @@
+/* middfs-arena.c -- arena allocator for deserialized packets
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "middfs-arena.h"
+#include "middfs-bufpool.h"
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+#define ARENA_MAX_CHUNK (64 * 1024) /* chunks grow by doubling up to this size */
+
+struct arena_chunk {
+   struct arena_chunk *next;
+   size_t size; /* size of chunk, including this header */
+   _Alignas(max_align_t) uint8_t data[];
+};
+
+void arena_init(struct arena *arena) {
+   arena->chunks = NULL;
+   arena->ptr = arena->end = NULL;
+}
+
+/* arena_free_chunks() -- return chunks to the buffer pool */
+static void arena_free_chunks(struct arena_chunk *chunk) {
+   while (chunk != NULL) {
+      struct arena_chunk *next = chunk->next;
+      bufpool_put(chunk, chunk->size);
+      chunk = next;
+   }
+}
+
+void arena_delete(struct arena *arena) {
+   arena_free_chunks(arena->chunks);
+   arena_init(arena);
+}
+
+/* arena_reset() -- free all allocations at once
+ * NOTE: The newest chunk is kept unless it's larger than chunks normally
+ *       grow, e.g. after an unusually large packet.
+ */
+void arena_reset(struct arena *arena) {
+   struct arena_chunk *keep = arena->chunks;
+
+   if (keep == NULL) {
+      return;
+   }
+
+   arena_free_chunks(keep->next);
+   keep->next = NULL;
+   
+   if (keep->size > ARENA_MAX_CHUNK) {
+      arena_delete(arena);
+   } else {
+      arena->ptr = keep->data;
+      arena->end = (uint8_t *) keep + keep->size;
+   }
+}
+
+/* arena_alloc() -- allocate memory from arena
+ * RETV: pointer to _size_ bytes, aligned for any type; NULL on error.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+   void *ptr;
+
+   if (size > SIZE_MAX / 2) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+   if (size == 0) {
+      size = ARENA_ALIGN; /* return a unique pointer */
+   }
+
+   if ((size_t) (arena->end - arena->ptr) < size) {
+      /* allocate new chunk, twice as large as the last one */
+      struct arena_chunk *chunk;
+      size_t last = arena->chunks ? arena->chunks->size : BUFPOOL_MINSIZE / 2;
+      size_t chunk_size = last < ARENA_MAX_CHUNK ? last * 2 : last;
+
+      if (chunk_size < sizeof(*chunk) + size) {
+         chunk_size = sizeof(*chunk) + size;
+      }
+      chunk_size = bufpool_roundup(chunk_size);
+      
+      if ((chunk = bufpool_get(chunk_size)) == NULL) {
+         return NULL;
+      }
+      chunk->size = chunk_size;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+      arena->ptr = chunk->data;
+      arena->end = (uint8_t *) chunk + chunk_size;
+   }
+
+   ptr = arena->ptr;
+   arena->ptr += size;
+   return ptr;
+}
+
+/* arena_strndup() -- copy _len_ bytes of _str_ into arena as a string */
+char *arena_strndup(struct arena *arena, const char *str, size_t len) {
+   char *copy;
+
+   if ((copy = arena_alloc(arena, len + 1)) != NULL) {
+      memcpy(copy, str, len);
+      copy[len] = '\0';
+   }
+   return copy;
+}
@@ -0,0 +1,30 @@
+/* middfs-arena.h -- arena allocator for deserialized packets
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_ARENA_H
+#define __MIDDFS_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct arena_chunk;
+
+/* Arena of memory that is released all at once.
+ * Allocations are carved out of chunks taken from the buffer pool;
+ * arena_reset() frees everything allocated so far and keeps one chunk for
+ * reuse, so an arena that is reset after each packet allocates nothing in
+ * the steady state. */
+struct arena {
+   struct arena_chunk *chunks; /* chunks, newest first */
+   uint8_t *ptr;               /* next free byte in newest chunk */
+   uint8_t *end;               /* end of newest chunk */
+};
+
+void arena_init(struct arena *arena);
+void arena_delete(struct arena *arena);
+void arena_reset(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+
+#endif
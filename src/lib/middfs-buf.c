@@ -13,9 +13,11 @@
 #include "middfs-util.h"
 #include "middfs-serial.h"
 #include "middfs-buf.h"
+#include "middfs-bufpool.h"
+#include "middfs-mem.h"
 
 size_t buffer_size(const struct buffer *buf) {
-  return (uint8_t *) buf->end - (uint8_t *) buf->begin;
+  return (uint8_t *) buf->end - (uint8_t *) buf->base;
 }
 
 size_t buffer_used(const struct buffer *buf) {
@@ -26,17 +28,58 @@ size_t buffer_rem(const struct buffer *buf) {
   return (uint8_t *) buf->end - (uint8_t *) buf->ptr;
 }
 
-int buffer_resize(struct buffer *buf, size_t newsize) {
+/* buffer_consumed() -- space before the data that has already been consumed */
+static size_t buffer_consumed(const struct buffer *buf) {
+  return (uint8_t *) buf->begin - (uint8_t *) buf->base;
+}
+
+/* buffer_compact() -- move data to the beginning of the buffer */
+static void buffer_compact(struct buffer *buf) {
   size_t used = buffer_used(buf);
+
+  if (buf->begin != buf->base) {
+    memmove(buf->base, buf->begin, used);
+    buf->begin = buf->base;
+    buf->ptr = (uint8_t *) buf->base + used;
+  }
+}
+
+/* buffer_resize() -- resize buffer, compacting it
+ * ARGS:
+ *  - buf: buffer to resize
+ *  - newsize: new minimum size; data past this is discarded
+ * RETV: 0 on success; negated error code on error.
+ * NOTE: Sizes up to BUFPOOL_MAXSIZE are rounded up to the next size class
+ *       and taken from the buffer pool.
+ */
+int buffer_resize(struct buffer *buf, size_t newsize) {
+  size_t size = buffer_size(buf);
+  size_t used = smin(buffer_used(buf), newsize);
   uint8_t *newptr;
+
+  newsize = bufpool_roundup(newsize);
   
-  if ((newptr = realloc(buf->begin, newsize)) == NULL) {
-    /* realloc error */
-    return -errno;
+  if (newsize > BUFPOOL_MAXSIZE && size > BUFPOOL_MAXSIZE) {
+    /* too large to pool; let realloc(3) avoid the copy if it can */
+    buffer_compact(buf);
+    if ((newptr = realloc(buf->base, newsize)) == NULL) {
+      return -errno;
+    }
+  } else {
+    if ((newptr = bufpool_get(newsize)) == NULL) {
+      return -errno;
+    }
+    if (used > 0) {
+      memcpy(newptr, buf->begin, used);
+    }
+    bufpool_put(buf->base, size);
   }
 
-  buf->begin = newptr;
-  buf->ptr = newptr + smin(used, newsize);
+  mem_charge(newsize);
+  mem_uncharge(size);
+
+  buf->base = buf->begin = newptr;
+  buf->ptr = newptr + used;
   buf->end = newptr + newsize;
 
   return 0;
@@ -44,27 +87,22 @@ int buffer_resize(struct buffer *buf, size_t newsize) {
 
 /* buffer_empty() -- empty buffer */
 void buffer_empty(struct buffer *buf) {
-  buf->ptr = buf->begin;
+  buf->begin = buf->ptr = buf->base;
 }
 
-/* buffer_shift() -- shift contents of buffer towards beginning
+/* buffer_shift() -- consume bytes from the beginning of the buffer
  * ARGS:
  *  - buf: buffer to operate on
- *  - shift: number of bytes to shift by */
+ *  - shift: number of bytes to consume 
+ * NOTE: This doesn't move any data; see struct buffer. */
 void buffer_shift(struct buffer *buf, size_t shift) {
   size_t used = buffer_used(buf);
 
   if (shift >= used) {
     /* all data will be shifted out */
     buffer_empty(buf);
-    return;
   } else {
-    void *src = (uint8_t *) buf->begin + shift;
-    size_t newused = used - shift; /* used bytes after shift */
-    
-    memmove(buf->begin, src, newused);
-    
-    buf->ptr = (uint8_t *) buf->begin + newused;
+    buf->begin = (uint8_t *) buf->begin + shift;
   }
 }
 
@@ -72,24 +110,62 @@ void buffer_init(struct buffer *buf) {
   memset(buf, 0, sizeof(*buf));
 }
 
+/* buffer_reserve() -- make sure there are at least _nbytes_ bytes of free
+ *                     space at the end of the buffer
+ * RETV: 0 on success; negated error code on error.
+ */
+int buffer_reserve(struct buffer *buf, size_t nbytes) {
+  size_t rem = buffer_rem(buf);
+  size_t used = buffer_used(buf);
+  size_t consumed = buffer_consumed(buf);
+
+  if (rem >= nbytes) {
+    return 0;
+  }
+
+  /* reclaim consumed space if that's cheap and makes enough room */
+  if (consumed >= used && consumed + rem >= nbytes) {
+    buffer_compact(buf);
+    return 0;
+  }
+
+  return buffer_resize(buf, used + nbytes);
+}
+
 /* buffer_increase() -- make sure there is free space in the buffer 
  *                    so data can be added */
 int buffer_increase(struct buffer *buf) {
-  size_t rem = buffer_rem(buf);
+  size_t size = buffer_size(buf);
 
-  if (rem == 0) {
-    size_t size = buffer_size(buf);
-    size_t newsize = smax(1, size * 2);
-    
-    return buffer_resize(buf, newsize);
-    
-  } else {
+  if (buffer_rem(buf) > 0) {
     return 0;
   }
+
+  /* reclaim consumed space if there's at least as much of it as data */
+  if (buffer_consumed(buf) >= buffer_used(buf)) {
+    buffer_compact(buf);
+    if (buffer_rem(buf) > 0) {
+      return 0;
+    }
+  }
+
+  return buffer_resize(buf, smax(1, size * 2));
 }
 
 void buffer_delete(struct buffer *buf) {
-  free(buf->begin);
+  mem_uncharge(buffer_size(buf));
+  bufpool_put(buf->base, buffer_size(buf));
+}
+
+/* buffer_trim() -- return an empty buffer's memory to the buffer pool if it
+ *                  has grown past the initial size, e.g. after a large
+ *                  transfer. The next use starts again at the initial size.
+ */
+void buffer_trim(struct buffer *buf) {
+  if (buffer_isempty(buf) && buffer_size(buf) > BUFPOOL_MINSIZE) {
+    buffer_delete(buf);
+    buffer_init(buf);
+  }
 }
 
 int buffer_isempty(const struct buffer *buf) {
@@ -106,6 +182,41 @@ void buffer_advance(struct buffer *buf, size_t nbytes) {
   buf->ptr = (uint8_t *) buf->ptr + nbytes;
 }
 
+/* buffer_iov_used() -- get data in buffer as an I/O vector for writev(2)
+ * ARGS:
+ *  - buf: buffer
+ *  - iov, iovcnt: I/O vector to fill in and its length
+ * RETV: number of elements of _iov_ filled in (0 if the buffer is empty).
+ * NOTE: Consume the bytes written with buffer_shift().
+ */
+int buffer_iov_used(const struct buffer *buf, struct iovec *iov, int iovcnt) {
+  size_t used = buffer_used(buf);
+
+  if (used == 0 || iovcnt < 1) {
+    return 0;
+  }
+  iov[0].iov_base = buf->begin;
+  iov[0].iov_len = used;
+  return 1;
+}
+
+/* buffer_iov_rem() -- get free space in buffer as an I/O vector for readv(2)
+ * ARGS: see buffer_iov_used().
+ * RETV: number of elements of _iov_ filled in (0 if the buffer is full).
+ * NOTE: Make room with buffer_reserve() first, and commit the bytes read
+ *       with buffer_advance().
+ */
+int buffer_iov_rem(const struct buffer *buf, struct iovec *iov, int iovcnt) {
+  size_t rem = buffer_rem(buf);
+
+  if (rem == 0 || iovcnt < 1) {
+    return 0;
+  }
+  iov[0].iov_base = buf->ptr;
+  iov[0].iov_len = rem;
+  return 1;
+}
+
 /* buffer_read_once() -- read once from fd into buffer,
  *                       as many bytes as possible
  * ARGS:
@@ -114,15 +225,15 @@ void buffer_advance(struct buffer *buf, size_t nbytes) {
  * RETV: see read(2)
  */
 ssize_t buffer_read(int fd, struct buffer *buf) {
+  struct iovec iov[1];
+  ssize_t bytes_read;
+
   /* make sure there is space in the buffer */
   if (buffer_increase(buf) < 0) {
     return -1;
   }
 
-  size_t rem = buffer_rem(buf);
-  ssize_t bytes_read;
-
-  if ((bytes_read = read(fd, buf->ptr, rem)) >= 0) {
+  if ((bytes_read = readv(fd, iov, buffer_iov_rem(buf, iov, 1))) >= 0) {
     /* advance buffer pointer if read was successful */
     buffer_advance(buf, bytes_read);
   }
@@ -138,11 +249,10 @@ ssize_t buffer_read(int fd, struct buffer *buf) {
  * RETV: see write(2)
  */
 ssize_t buffer_write(int fd, struct buffer *buf) {
-  size_t used = buffer_used(buf);
-
+  struct iovec iov[1];
   ssize_t bytes_written;
 
-  if ((bytes_written = write(fd, buf->begin, used)) >= 0) {
+  if ((bytes_written = writev(fd, iov, buffer_iov_used(buf, iov, 1))) >= 0) {
     buffer_shift(buf, bytes_written);
   }
 
@@ -157,12 +267,8 @@ ssize_t buffer_write(int fd, struct buffer *buf) {
  * RETV: -1 on error; 0 on success.
  */
 ssize_t buffer_copy(struct buffer *buf, void *in, size_t nbytes) {
-  size_t rem = buffer_rem(buf);
-
-  if (rem < nbytes) {
-    if (buffer_resize(buf, buffer_size(buf) + nbytes) < 0) {
-      return -1;
-    }
+  if (buffer_reserve(buf, nbytes) < 0) {
+    return -1;
   }
 
   /* copy data & update pointer */
@@ -187,10 +293,10 @@ ssize_t buffer_serialize(const void *in, serialize_f serialf, struct buffer *buf
   /* NOTE: This while-loop is intended to only run ONCE or TWICE.
    */
   while ((used = serialf(in, buf->ptr, rem)) > rem) {
-    if (buffer_resize(buf, buffer_used(buf) + used) < 0) {
-      return -1; /* buffer_resize() error */
+    if (buffer_reserve(buf, used) < 0) {
+      return -1; /* buffer_reserve() error */
     }
-    rem = used;
+    rem = buffer_rem(buf);
   }
 
   /* advance pointer in buffer past written data */
@@ -214,6 +320,7 @@ ssize_t buffer_deserialize(void *out, deserialize_f deserialf, struct buffer *bu
    int err = 0;
    required = deserialf(buf->begin, used, out, &err);
    if (err) {
+      errno = err;
       return -1;
    }
 
@@ -6,15 +6,24 @@
 #define __MIDDFS_BUF_H
 
 #include <stdio.h>
+#include <sys/uio.h>
 
+/* Buffer of bytes between a read and a write cursor.
+ * Data is appended at _ptr_ and consumed from _begin_. Consuming data only
+ * advances _begin_; the space before it is reclaimed lazily, when more room
+ * is needed at the end and there is at least as much consumed space as data
+ * left to move, so each byte is moved at most once per time it's consumed.
+ */
 struct buffer {
-  void *begin;
-  void *ptr;
-  void *end;
+  void *base;  /* start of allocation */
+  void *begin; /* start of data (read cursor) */
+  void *ptr;   /* end of data (write cursor) */
+  void *end;   /* end of allocation */
 };
 
 void buffer_init(struct buffer *buf);
 void buffer_delete(struct buffer *buf);
+void buffer_trim(struct buffer *buf);
 
 size_t buffer_size(const struct buffer *buf);
 size_t buffer_used(const struct buffer *buf);
@@ -23,11 +32,14 @@ int buffer_resize(struct buffer *buf, size_t newsize);
 void buffer_empty(struct buffer *buf);
 void buffer_shift(struct buffer *buf, size_t shift);
 int buffer_increase(struct buffer *buf);
+int buffer_reserve(struct buffer *buf, size_t nbytes);
 int buffer_isempty(const struct buffer *buf);
 void buffer_advance(struct buffer *buf, size_t nbytes);
 ssize_t buffer_read(int fd, struct buffer *buf);
 ssize_t buffer_write(int fd, struct buffer *buf);
 ssize_t buffer_copy(struct buffer *buf, void *in, size_t nbytes);
+int buffer_iov_used(const struct buffer *buf, struct iovec *iov, int iovcnt);
+int buffer_iov_rem(const struct buffer *buf, struct iovec *iov, int iovcnt);
 
 #include "middfs-serial.h"
 
@@ -0,0 +1,224 @@
+/* middfs-bufpool.c -- pool of buffer memory in size classes
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Each thread keeps a small cache of free blocks per size class, backed by
+ * a shared pool. A thread only takes the pool's lock when its own cache is
+ * empty (on get) or full (on put); blocks that don't fit in the pool either
+ * are freed. Both are capped in bytes per class, so that a burst of large
+ * transfers doesn't pin its memory indefinitely.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "middfs-bufpool.h"
+
+#define BUFPOOL_CACHE_BYTES (256 * 1024)      /* per thread, per class */
+#define BUFPOOL_SHARED_BYTES (1024 * 1024)    /* shared, per class */
+
+/* free block; the link is stored in the block itself */
+struct bufpool_block {
+   struct bufpool_block *next;
+};
+
+struct bufpool_list {
+   struct bufpool_block *head;
+   size_t count;
+};
+
+struct bufpool_cache {
+   struct bufpool_list lists[BUFPOOL_NCLASSES];
+   int registered; /* whether the thread-exit destructor is registered */
+};
+
+static _Thread_local struct bufpool_cache bufpool_cache;
+
+static struct {
+   pthread_mutex_t lock;
+   struct bufpool_list lists[BUFPOOL_NCLASSES];
+} bufpool_shared = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_key_t bufpool_key;
+static pthread_once_t bufpool_key_once = PTHREAD_ONCE_INIT;
+
+static atomic_ullong bufpool_hits;
+static atomic_ullong bufpool_misses;
+static atomic_ullong bufpool_frees;
+static atomic_ullong bufpool_idle;
+
+/* bufpool_class() -- size class of a block of _size_ bytes
+ * RETV: class index; -1 if _size_ isn't exactly a class size.
+ */
+static int bufpool_class(size_t size) {
+   for (int class = 0; class < BUFPOOL_NCLASSES; ++class) {
+      if (size == BUFPOOL_MINSIZE << class) {
+         return class;
+      }
+   }
+   return -1;
+}
+
+/* bufpool_cap() -- maximum number of blocks of class _class_ in a list
+ * ARGS:
+ *  - class: size class
+ *  - bytes: byte limit for the list
+ */
+static size_t bufpool_cap(int class, size_t bytes) {
+   size_t cap = bytes / (BUFPOOL_MINSIZE << class);
+   return cap ? cap : 1;
+}
+
+static void *bufpool_pop(struct bufpool_list *list) {
+   struct bufpool_block *block = list->head;
+   if (block != NULL) {
+      list->head = block->next;
+      --list->count;
+   }
+   return block;
+}
+
+static void bufpool_push(struct bufpool_list *list, void *ptr) {
+   struct bufpool_block *block = ptr;
+   block->next = list->head;
+   list->head = block;
+   ++list->count;
+}
+
+/* bufpool_put_shared() -- return block to the shared pool, or free it if
+ *                         the pool is full */
+static void bufpool_put_shared(void *block, int class) {
+   size_t size = BUFPOOL_MINSIZE << class;
+
+   pthread_mutex_lock(&bufpool_shared.lock);
+   if (bufpool_shared.lists[class].count < bufpool_cap(class, BUFPOOL_SHARED_BYTES)) {
+      bufpool_push(&bufpool_shared.lists[class], block);
+      atomic_fetch_add(&bufpool_idle, size);
+      block = NULL;
+   }
+   pthread_mutex_unlock(&bufpool_shared.lock);
+
+   if (block != NULL) {
+      atomic_fetch_add(&bufpool_frees, 1);
+      free(block);
+   }
+}
+
+/* bufpool_cache_flush() -- move thread's cached blocks to the shared pool
+ * (called on thread exit) */
+static void bufpool_cache_flush(void *arg) {
+   struct bufpool_cache *cache = arg;
+
+   cache->registered = 0; /* blocks freed by later destructors flush again */
+   for (int class = 0; class < BUFPOOL_NCLASSES; ++class) {
+      void *block;
+      while ((block = bufpool_pop(&cache->lists[class])) != NULL) {
+         bufpool_put_shared(block, class);
+      }
+   }
+}
+
+static void bufpool_key_init(void) {
+   pthread_key_create(&bufpool_key, bufpool_cache_flush);
+}
+
+/* bufpool_cache_get() -- get calling thread's cache */
+static struct bufpool_cache *bufpool_cache_get(void) {
+   struct bufpool_cache *cache = &bufpool_cache;
+
+   if (!cache->registered) {
+      pthread_once(&bufpool_key_once, bufpool_key_init);
+      pthread_setspecific(bufpool_key, cache);
+      cache->registered = 1;
+   }
+
+   return cache;
+}
+
+/* bufpool_roundup() -- round size up to the block size that bufpool_get()
+ *                      would allocate for it
+ */
+size_t bufpool_roundup(size_t size) {
+   if (size > BUFPOOL_MAXSIZE) {
+      return size;
+   }
+
+   size_t rounded = BUFPOOL_MINSIZE;
+   while (rounded < size) {
+      rounded <<= 1;
+   }
+   return rounded;
+}
+
+/* bufpool_get() -- get a block of memory
+ * ARGS:
+ *  - size: size of block, as returned by bufpool_roundup()
+ * RETV: the block, with BUFPOOL_HEADROOM bytes to spare if _size_ is a class
+ *       size; NULL on error (errno set).
+ */
+void *bufpool_get(size_t size) {
+   int class = bufpool_class(size);
+   void *block = NULL;
+
+   if (class >= 0) {
+      struct bufpool_cache *cache = bufpool_cache_get();
+      
+      if ((block = bufpool_pop(&cache->lists[class])) == NULL) {
+         pthread_mutex_lock(&bufpool_shared.lock);
+         if ((block = bufpool_pop(&bufpool_shared.lists[class])) != NULL) {
+            atomic_fetch_sub(&bufpool_idle, size);
+         }
+         pthread_mutex_unlock(&bufpool_shared.lock);
+      }
+   }
+
+   if (block != NULL) {
+      atomic_fetch_add(&bufpool_hits, 1);
+      return block;
+   }
+
+   atomic_fetch_add(&bufpool_misses, 1);
+   return malloc(class >= 0 ? size + BUFPOOL_HEADROOM : size);
+}
+
+/* bufpool_put() -- return a block of memory to the pool
+ * ARGS:
+ *  - block: block to return (may be NULL)
+ *  - size: size of block; blocks that aren't of a class size are freed
+ */
+void bufpool_put(void *block, size_t size) {
+   int class = bufpool_class(size);
+
+   if (block == NULL) {
+      return;
+   }
+
+   if (class < 0) {
+      atomic_fetch_add(&bufpool_frees, 1);
+      free(block);
+      return;
+   }
+
+   struct bufpool_cache *cache = bufpool_cache_get();
+   if (cache->lists[class].count < bufpool_cap(class, BUFPOOL_CACHE_BYTES)) {
+      bufpool_push(&cache->lists[class], block);
+   } else {
+      bufpool_put_shared(block, class);
+   }
+}
+
+void bufpool_stats_get(struct bufpool_stats *stats) {
+   stats->hits = atomic_load(&bufpool_hits);
+   stats->misses = atomic_load(&bufpool_misses);
+   stats->frees = atomic_load(&bufpool_frees);
+   stats->bytes_idle = atomic_load(&bufpool_idle);
+}
+
+void print_bufpool_stats(void) {
+   struct bufpool_stats st;
+   bufpool_stats_get(&st);
+   fprintf(stderr, "bufpool: %llu hits, %llu misses, %llu frees; %llu bytes idle in shared pool\n",
+           (unsigned long long) st.hits, (unsigned long long) st.misses,
+           (unsigned long long) st.frees, (unsigned long long) st.bytes_idle);
+}
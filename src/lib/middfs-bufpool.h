@@ -0,0 +1,37 @@
+/* middfs-bufpool.h -- pool of buffer memory in size classes
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_BUFPOOL_H
+#define __MIDDFS_BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size classes are powers of two from BUFPOOL_MINSIZE to BUFPOOL_MAXSIZE.
+ * Blocks larger than BUFPOOL_MAXSIZE aren't pooled.
+ * Pooled blocks have BUFPOOL_HEADROOM bytes beyond their class size, so that
+ * a small header plus a power of two of data (e.g. a payload of a 128 KiB
+ * read) fits in the class of the data rather than the next one up. */
+#define BUFPOOL_MINSHIFT 12
+#define BUFPOOL_MAXSHIFT 20
+#define BUFPOOL_MINSIZE  ((size_t) 1 << BUFPOOL_MINSHIFT) /* 4 KiB; initial buffer size */
+#define BUFPOOL_MAXSIZE  ((size_t) 1 << BUFPOOL_MAXSHIFT) /* 1 MiB */
+#define BUFPOOL_NCLASSES (BUFPOOL_MAXSHIFT - BUFPOOL_MINSHIFT + 1)
+#define BUFPOOL_HEADROOM 64
+
+size_t bufpool_roundup(size_t size);
+void *bufpool_get(size_t size);
+void bufpool_put(void *block, size_t size);
+
+struct bufpool_stats {
+   uint64_t hits;       /* blocks taken from the pool */
+   uint64_t misses;     /* blocks allocated with malloc(3) */
+   uint64_t frees;      /* blocks freed because the pool was full or they were too large */
+   uint64_t bytes_idle; /* bytes held by the shared pool */
+};
+
+void bufpool_stats_get(struct bufpool_stats *stats);
+void print_bufpool_stats(void);
+
+#endif
@@ -9,9 +9,16 @@
 #include <string.h>
 #include <search.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "lib/middfs-conf.h"
 
+/* Configuration variables are kept in the environment, which getenv(3) may
+ * not read while putenv(3) changes it, so lookups & (re)loads exclude each
+ * other. The strings that conf_put() puts are never freed, so values stay
+ * valid after the lock is dropped. */
+static pthread_rwlock_t conf_lock = PTHREAD_RWLOCK_INITIALIZER;
+
 #define MIDDFS_ENVVAR_FMT "MIDDFS_%s"
 static char *conf_envvar(const char *name) {
    char *envvar = NULL;
@@ -21,22 +28,29 @@ static char *conf_envvar(const char *name) {
    return envvar;
 }
 
+#define CONF_NAME_MAX 64
+/* conf_get() -- look up configuration variable
+ * NOTE: Doesn't allocate, since it's called for every request. Thread-safe.
+ */
 char *conf_get(const char *name) {
    /* format name of environment variable */
-   char *envvar;
+   char envvar[sizeof("MIDDFS_") + CONF_NAME_MAX];
    char *val;
 
-   if ((envvar = conf_envvar(name)) == NULL) {
+   if (snprintf(envvar, sizeof(envvar), MIDDFS_ENVVAR_FMT, name) >= (int) sizeof(envvar)) {
+      errno = ENAMETOOLONG;
       return NULL;
    }
 
-   if ((val = getenv(envvar)) == NULL) {
+   pthread_rwlock_rdlock(&conf_lock);
+   val = getenv(envvar);
+   pthread_rwlock_unlock(&conf_lock);
+
+   if (val == NULL) {
       errno = EINVAL;
       perror("getenv");
    }
 
-   free(envvar);
-   
    return val;
 }
 
@@ -84,7 +98,10 @@ int conf_put(const char *string) {
 
    fprintf(stderr, "conf_put: ``%s''\n", envstr);
    
-   if (putenv(envstr) < 0) {
+   pthread_rwlock_wrlock(&conf_lock);
+   int retv = putenv(envstr);
+   pthread_rwlock_unlock(&conf_lock);
+   if (retv != 0) {
       free(envstr);
       return -1;
    }
@@ -92,9 +109,24 @@ int conf_put(const char *string) {
    return 0;
 }
 
+/* conf_unset() -- remove configuration variable, e.g. so that its default
+ *                 applies again
+ * RETV: 0 on success (even if it wasn't set); -1 on error.
+ */
 int conf_unset(const char *name) {
-   /* STUB*/
-   abort();
+   char envvar[sizeof("MIDDFS_") + CONF_NAME_MAX];
+   int retv;
+
+   if (snprintf(envvar, sizeof(envvar), MIDDFS_ENVVAR_FMT, name) >= (int) sizeof(envvar)) {
+      errno = ENAMETOOLONG;
+      return -1;
+   }
+
+   pthread_rwlock_wrlock(&conf_lock);
+   retv = unsetenv(envvar);
+   pthread_rwlock_unlock(&conf_lock);
+
+   return retv;
 }
 
 #define CONF_LOAD_MAXLINE 1024
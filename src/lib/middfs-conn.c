@@ -17,11 +17,20 @@
 #include "lib/middfs-rsrc.h"
 #include "lib/middfs-serial.h"
 #include "lib/middfs-handler.h"
+#include "lib/middfs-mem.h"
 
 static enum handler_e handle_pkt_rd(struct middfs_sockinfo *sockinfo,
                                     const struct handler_info *hi);
 static enum handler_e handle_pkt_wr(struct middfs_sockinfo *sockinfo,
                                     const struct handler_info *hi);
+static enum handler_e handle_pkt_relay(struct middfs_sockinfo *sockinfo,
+                                       const struct handler_info *hi);
+static int pkt_admit(const struct middfs_sockinfo *sockinfo, size_t pktlen, uint64_t rawlen);
+static enum handler_e handle_pkt_reject(struct middfs_sockinfo *sockinfo,
+                                        const struct middfs_packet *in_pkt, int err,
+                                        size_t pktlen, ssize_t bytes_read);
+static enum handler_e handle_pkt_discard(struct middfs_sockinfo *sockinfo, ssize_t bytes_read);
+static bool pkt_fwd_ok(const struct middfs_sockinfo *sockinfo, const struct middfs_packet *hdr);
 
 /* server_start() -- start the server on port _port_ 
    with backlog _backlog_.
@@ -77,7 +86,7 @@ int server_start(const char *port, int backlog, struct middfs_socks *socks) {
   /* assume _socks_ is already initialized */
   struct middfs_sockinfo serv_sockinfo;
   middfs_sockinfo_init(MFD_LSTN, servsock_fd, -1, &serv_sockinfo);
-  if (middfs_socks_add(&serv_sockinfo, socks) < 0) {
+  if (middfs_socks_add(&serv_sockinfo, socks, NULL) < 0) {
     error = 1;
     middfs_sockinfo_delete(&serv_sockinfo);
     middfs_socks_delete(socks);
@@ -133,18 +142,21 @@ int server_loop(struct middfs_socks *socks, const struct handler_info *hi) {
     return -1;
   }
 
-  int count = socks->count;
-  for (int index = 0; index < count; ++index) {
+  /* NOTE: Iterating from the end visits each socket once, even though
+   *       removing a socket moves another one into its place; sockets
+   *       added meanwhile are only visited on the next call. */
+  for (int index = socks->count - 1; index >= 0; --index) {
 
+     struct middfs_sockid id = middfs_socks_at(index, socks);
      struct middfs_sockinfo new_sockinfo;
-     enum handler_e status = handle_socket_event(&socks->sockinfos[index], hi, &new_sockinfo);
+     enum handler_e status = handle_socket_event(middfs_socks_get(id, socks), hi, &new_sockinfo);
      
      switch (status) {
      case HS_SUC:
         break;
       
      case HS_NEW: /* Add new socket to list */
-        if (middfs_socks_add(&new_sockinfo, socks) < 0) {
+        if (middfs_socks_add(&new_sockinfo, socks, NULL) < 0) {
            perror("middfs_socks_add");
            if (middfs_sockinfo_delete(&new_sockinfo) < 0) {
               perror("middfs_sockinfo_delete");
@@ -154,7 +166,7 @@ int server_loop(struct middfs_socks *socks, const struct handler_info *hi) {
         break;
       
      case HS_DEL: /* Remove socket */
-        if (middfs_socks_remove(index, socks) < 0) {
+        if (middfs_socks_remove(id, socks) < 0) {
            perror("middfs_socks_remove");
            return -1;
         }
@@ -165,8 +177,6 @@ int server_loop(struct middfs_socks *socks, const struct handler_info *hi) {
         perror("handle_socket_event");
         return -1;
      }
-    
-     // fprintf(stderr, "nopen=%d\n", middfs_socks_pack(socks));
   }
   
   return retv;
@@ -230,8 +240,10 @@ enum handler_e handle_pkt_event(struct middfs_sockinfo *sockinfo, const struct h
   if (revents) {
     switch (sockinfo->state) {
     case MSS_REQRD:
-    case MSS_RSPFWD:
       return handle_pkt_rd(sockinfo, hi);
+
+    case MSS_RSPFWD:
+      return handle_pkt_relay(sockinfo, hi);
       
     case MSS_RSPWR:
     case MSS_REQFWD:
@@ -266,50 +278,109 @@ static enum handler_e handle_pkt_rd(struct middfs_sockinfo *sockinfo,
     perror("buffer_read");
     return HS_DEL; /* delete socket */
   }
-  if (bytes_read == 0) {
-     /* data ended prematurely -- remove socket from list */
-     fprintf(stderr, "warning: data ended prematurely for socket %d\n", fd);
+  if (bytes_read == 0 && buffer_isempty(buf_in)) {
+     /* peer closed connection -- remove socket from list */
      return HS_DEL;
   }
+  if (sockinfo->reject) {
+     return handle_pkt_discard(sockinfo, bytes_read);
+  }
+  /* NOTE: A peer may close the connection right after the last packet of a
+   *       streamed response, so packets already buffered are still handled. */
+
+  /* handle all complete packets received, for as long as the socket keeps
+   * reading in the same state (i.e. while relaying a streamed response) */
+  const enum middfs_sockstate state = sockinfo->state;
+  do {
+    struct middfs_packet in_pkt = {0};
+    in_pkt.mpkt_dict = &in->dict;
+    in_pkt.mpkt_arena = &in->arena;
+    int errp = 0;
+    size_t bytes_ready = buffer_used(buf_in);
+
+    /* relay compressed responses as they are, if the requester accepts them */
+    if (state == MSS_RSPFWD && hi->fwd_fin != NULL) {
+      uint64_t rawlen;
+      size_t pktlen = deserialize_pkt_len(buf_in->begin, bytes_ready, &in_pkt, &rawlen);
+      if (pktlen > 0 && pktlen <= bytes_ready && pkt_fwd_ok(sockinfo, &in_pkt)) {
+        enum handler_e retv = hi->fwd_fin(sockinfo, &in_pkt, buf_in->begin, pktlen);
+        buffer_shift(buf_in, pktlen);
+        buffer_trim(buf_in);
+        if (retv != HS_SUC) {
+          return retv;
+        }
+        continue;
+      }
+    }
 
-  struct middfs_packet in_pkt = {0};
-  int errp = 0;
-  size_t bytes_ready = buffer_used(buf_in);
-  size_t bytes_required = deserialize_pkt(buf_in->begin, bytes_ready, &in_pkt, &errp);
+    /* reject requests that don't fit in the memory budget, going by the
+     * decompressed size of compressed ones; a request is admitted once, as
+     * soon as its length is known, and then received in full */
+    if (state == MSS_REQRD && !sockinfo->admitted) {
+      uint64_t rawlen;
+      size_t pktlen = deserialize_pkt_len(buf_in->begin, bytes_ready, &in_pkt, &rawlen);
+      if (pktlen > 0) {
+        if ((errp = pkt_admit(sockinfo, pktlen, (in_pkt.mpkt_flags & MPKT_F_LZ) ? rawlen : 0))) {
+          return handle_pkt_reject(sockinfo, &in_pkt, errp, pktlen, bytes_read);
+        }
+        sockinfo->admitted = true;
+      }
+    }
+
+    size_t bytes_required = deserialize_pkt(buf_in->begin, bytes_ready, &in_pkt, &errp);
   
-  if (errp) {
-    /* invalid data; close socket */
-    fprintf(stderr, "warning: packet from socket %d contains invalid data\n", fd);
-    return HS_DEL;
-  }
+    if (errp) {
+      /* invalid data; close socket */
+      fprintf(stderr, "warning: packet from socket %d %s\n", fd,
+              (errp == EIO) ? "failed its checksum" : "contains invalid data");
+      packet_free(&in_pkt);
+      return HS_DEL;
+    }
 
-  if (bytes_required > bytes_ready) {
-    return HS_SUC; /* wait on more bytes */
-  }
+    if (bytes_required > bytes_ready) {
+      packet_free(&in_pkt); /* free members deserialized so far */
+      if (bytes_read == 0) {
+         fprintf(stderr, "warning: data ended prematurely for socket %d\n", fd);
+         return HS_DEL;
+      }
 
-  /* incoming packet has been successfully deserialized */
+      return HS_SUC; /* wait on more bytes */
+    }
 
-  /* remove used bytes */
-  buffer_shift(buf_in, bytes_required);
+    /* incoming packet has been successfully deserialized */
+
+    /* remove used bytes */
+    buffer_shift(buf_in, bytes_required);
+    buffer_trim(buf_in);
+    sockinfo->admitted = false;
+
+    /* Call server/client-specific handler function to handle received data and determine
+     * next socket state.
+     * NOTE: _in_pkt_ is freed once the handler returns, so the handler must
+     *       payload_ref() any payload it holds on to. */
+    enum handler_e retv = hi->rd_fin(sockinfo, &in_pkt);
+    packet_free(&in_pkt);
+    if (retv != HS_SUC) {
+      return retv;
+    }
+  } while (sockinfo->state == state && state == MSS_RSPFWD && !buffer_isempty(buf_in) &&
+           middfs_sockinfo_relay_ready(sockinfo));
 
-  /* Call server/client-specific handler function to handle received data and determine
-   * next socket state. */
-  return hi->rd_fin(sockinfo, &in_pkt);
+  return HS_SUC;
 }
 
 
 /* shared aux fn for rspwr and reqfwd */
 static enum handler_e handle_pkt_wr(struct middfs_sockinfo *sockinfo,
                                     const struct handler_info *hi) {
-  int fd = sockinfo->out.fd;
   struct buffer *buf_out = &sockinfo->out.buf;
 
   assert(sockinfo->revents & POLLOUT);
   
-  ssize_t bytes_written = buffer_write(fd, buf_out);
+  ssize_t bytes_written = middfs_sockend_write(&sockinfo->out);
   if (bytes_written < 0) {
     /* error */
-    perror("buffer_write");
+    perror("middfs_sockend_write");
     return HS_DEL;
   }
 
@@ -321,5 +392,129 @@ static enum handler_e handle_pkt_wr(struct middfs_sockinfo *sockinfo,
   /* all of bytes written;
    * Call server/client-specific handler function to determine next state.
    */
+  buffer_trim(buf_out);
+  if (sockinfo->reject) {
+     /* the rejected request may have updated the requester's dictionary */
+     return HS_DEL;
+  }
   return hi->wr_fin(sockinfo);
 }
+
+
+/* handle_pkt_relay() -- relay a streamed response (MSS_RSPFWD)
+ * Packets are read from the source (_in_) and forwarded to the destination
+ * (_out_) at the same time; reading pauses while MIDDFS_RELAY_WINDOW bytes
+ * are queued for the destination (see middfs_sockinfo_pollfds()).
+ * _hi->rd_fin_ is called for each packet; once it leaves MSS_RSPFWD, the
+ * rest of the output is written as usual.
+ */
+static enum handler_e handle_pkt_relay(struct middfs_sockinfo *sockinfo,
+                                       const struct handler_info *hi) {
+  if (sockinfo->revents & POLLOUT) {
+     if (middfs_sockend_write(&sockinfo->out) < 0) {
+        perror("middfs_sockend_write");
+        return HS_DEL;
+     }
+  }
+
+  if (sockinfo->revents & POLLIN) {
+     return handle_pkt_rd(sockinfo, hi);
+  }
+
+  return HS_SUC;
+}
+
+
+/* pkt_fwd_ok() -- check whether a response being relayed may be forwarded to
+ *                 the requester as it is, without deserializing it
+ * ARGS:
+ *  - sockinfo: socket relaying the response
+ *  - hdr: magic, type & flags of the response (see deserialize_pkt_len())
+ * RETV: true if it is compressed & the requester accepts compressed
+ *       responses, and it has a CRC if the requester asked for one.
+ */
+static bool pkt_fwd_ok(const struct middfs_sockinfo *sockinfo, const struct middfs_packet *hdr) {
+  return hdr->mpkt_magic == MPKT_MAGIC && hdr->mpkt_type == MPKT_RESPONSE &&
+    (hdr->mpkt_flags & MPKT_F_LZ) && (sockinfo->peer_flags & MPKT_F_ACCEPT_LZ) &&
+    ((hdr->mpkt_flags & MPKT_F_CRC) || !(sockinfo->peer_flags & MPKT_F_CRC));
+}
+
+/* pkt_admit() -- check whether a packet may be received
+ * ARGS:
+ *  - sockinfo: socket receiving the packet
+ *  - pktlen: length of the packet
+ *  - rawlen: size of its decompressed body (0 if not compressed)
+ * RETV: 0 if so; EFBIG if it exceeds the budget of a connection; EAGAIN if
+ *       it doesn't fit in the global budget right now.
+ * NOTE: Receiving a packet takes about twice its (decompressed) size: once in
+ *       the receive buffer (or the decompression buffer) and once deserialized.
+ *       Both ends' buffers count against the connection's budget.
+ */
+static int pkt_admit(const struct middfs_sockinfo *sockinfo, size_t pktlen, uint64_t rawlen) {
+  const size_t half = SIZE_MAX / 4;
+  size_t cost = (pktlen > half || rawlen > half) ? SIZE_MAX : pktlen + 2 * (rawlen ? rawlen : pktlen);
+  size_t held = buffer_size(&sockinfo->in.buf); /* reused for the packet */
+  size_t more = cost - smin(cost, held);
+
+  if (!mem_admit_conn(held + buffer_size(&sockinfo->out.buf) + sockinfo->out.spliced, more)) {
+     return EFBIG;
+  }
+  if (!mem_admit(more)) {
+     return EAGAIN;
+  }
+  return 0;
+}
+
+/* handle_pkt_reject() -- reject the request being received
+ * ARGS:
+ *  - sockinfo: socket receiving the request
+ *  - in_pkt: request, of which at least the header has been deserialized
+ *  - err: error to respond with
+ *  - pktlen: length of the request
+ *  - bytes_read: bytes read from the socket by the caller
+ */
+static enum handler_e handle_pkt_reject(struct middfs_sockinfo *sockinfo,
+                                        const struct middfs_packet *in_pkt, int err,
+                                        size_t pktlen, ssize_t bytes_read) {
+  fprintf(stderr, "warning: rejecting %zu-byte request from socket %d: %s\n",
+          pktlen, sockinfo->in.fd, strerror(err));
+  mem_count_rejected();
+
+  sockinfo->peer_flags = in_pkt->mpkt_flags;
+  sockinfo->reject = err;
+  sockinfo->discard = pktlen;
+  return handle_pkt_discard(sockinfo, bytes_read);
+}
+
+/* handle_pkt_discard() -- skip the rest of a rejected request, then queue an
+ * error response to it. The connection is closed once the response has been
+ * written (see handle_pkt_wr()).
+ * ARGS:
+ *  - sockinfo: socket whose request was rejected
+ *  - bytes_read: bytes read from the socket by the caller
+ */
+static enum handler_e handle_pkt_discard(struct middfs_sockinfo *sockinfo, ssize_t bytes_read) {
+  struct buffer *buf_in = &sockinfo->in.buf;
+  size_t nbytes = smin(sockinfo->discard, buffer_used(buf_in));
+
+  buffer_shift(buf_in, nbytes);
+  buffer_trim(buf_in);
+  sockinfo->discard -= nbytes;
+  if (sockinfo->discard > 0) {
+     return (bytes_read == 0) ? HS_DEL : HS_SUC;
+  }
+
+  struct middfs_packet out_pkt;
+  packet_error(&out_pkt, sockinfo->reject);
+  packet_set_crc(&out_pkt, sockinfo->peer_flags & MPKT_F_CRC);
+  if (buffer_serialize(&out_pkt, (serialize_f) serialize_pkt, &sockinfo->out.buf) < 0) {
+     perror("buffer_serialize");
+     return HS_DEL;
+  }
+
+  sockinfo->state = MSS_RSPWR;
+  sockinfo->out.fd = sockinfo->in.fd;
+  sockinfo->in.fd = -1;
+
+  return HS_SUC;
+}
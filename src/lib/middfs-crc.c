@@ -0,0 +1,133 @@
+/* middfs-crc.c -- CRC32C (Castagnoli) checksums
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU supports it and a
+ * table-driven slicing-by-8 implementation otherwise.
+ */
+
+#include <string.h>
+
+#include "middfs-crc.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define CRC32C_HAVE_SSE42 1
+# include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 /* reflected Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *buf, size_t len) = crc32c_sw;
+
+/* crc32c_le32() -- load little-endian 32-bit word */
+static uint32_t crc32c_le32(const uint8_t *p) {
+   return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+      (uint32_t) p[3] << 24;
+}
+
+/* crc32c_sw() -- portable slicing-by-8 CRC32C
+ * ARGS:
+ *  - crc: CRC of preceding data (0 initially)
+ *  - buf, len: data to checksum
+ * RETV: the updated CRC.
+ */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+   const uint8_t *p = (const uint8_t *) buf;
+
+   crc = ~crc;
+
+   /* align to 8 bytes */
+   while (len > 0 && ((uintptr_t) p & 7) != 0) {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+      --len;
+   }
+
+   for (; len >= 8; p += 8, len -= 8) {
+      uint32_t lo = crc32c_le32(p) ^ crc;
+      uint32_t hi = crc32c_le32(p + 4);
+      crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+         crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+         crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+         crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+   }
+
+   while (len-- > 0) {
+      crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+   }
+
+   return ~crc;
+}
+
+#if CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+   const uint8_t *p = (const uint8_t *) buf;
+   uint64_t crc64;
+
+   crc = ~crc;
+
+   while (len > 0 && ((uintptr_t) p & 7) != 0) {
+      crc = _mm_crc32_u8(crc, *p++);
+      --len;
+   }
+
+   crc64 = crc;
+   for (; len >= 8; p += 8, len -= 8) {
+      uint64_t word;
+      memcpy(&word, p, sizeof(word));
+      crc64 = _mm_crc32_u64(crc64, word);
+   }
+   crc = (uint32_t) crc64;
+
+   while (len-- > 0) {
+      crc = _mm_crc32_u8(crc, *p++);
+   }
+
+   return ~crc;
+}
+#endif
+
+/* crc32c_init() -- build tables and select implementation at startup */
+__attribute__((constructor))
+static void crc32c_init(void) {
+   for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t c = n;
+      for (int k = 0; k < 8; ++k) {
+         c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+      }
+      crc32c_table[0][n] = c;
+   }
+   for (uint32_t n = 0; n < 256; ++n) {
+      for (int k = 1; k < 8; ++k) {
+         uint32_t prev = crc32c_table[k - 1][n];
+         crc32c_table[k][n] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+      }
+   }
+
+   if (crc32c_hw_available()) {
+#if CRC32C_HAVE_SSE42
+      crc32c_impl = crc32c_hw;
+#endif
+   }
+}
+
+/* crc32c_hw_available() -- whether crc32c() uses the CPU's crc32 instruction */
+bool crc32c_hw_available(void) {
+#if CRC32C_HAVE_SSE42
+   __builtin_cpu_init(); /* may run before libgcc's constructors */
+   return __builtin_cpu_supports("sse4.2");
+#else
+   return false;
+#endif
+}
+
+/* crc32c() -- compute CRC32C
+ * ARGS:
+ *  - crc: CRC of preceding data (0 initially)
+ *  - buf, len: data to checksum
+ * RETV: the updated CRC.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+   return crc32c_impl(crc, buf, len);
+}
@@ -0,0 +1,16 @@
+/* middfs-crc.h -- CRC32C (Castagnoli) checksums
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_CRC_H
+#define __MIDDFS_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+bool crc32c_hw_available(void);
+
+#endif
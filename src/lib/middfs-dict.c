@@ -0,0 +1,107 @@
+/* middfs-dict.c -- per-connection string dictionary
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "middfs-dict.h"
+
+void dict_init(struct middfs_dict *dict) {
+   memset(dict, 0, sizeof(*dict));
+}
+
+void dict_delete(struct middfs_dict *dict) {
+   for (int i = 0; i < MIDDFS_DICT_LEN; ++i) {
+      free(dict->ents[i]);
+   }
+}
+
+/* dict_reset() -- forget all entries, e.g. when the underlying connection
+ * is replaced by a new one. */
+void dict_reset(struct middfs_dict *dict) {
+   dict_delete(dict);
+   dict_init(dict);
+}
+
+/* dict_find() -- look up a committed string
+ * ARGS:
+ *  - dict: dictionary to search
+ *  - str: string to look up (need not be NUL-terminated)
+ *  - len: length of _str_
+ * RETV: the string's ID if found; -1 otherwise.
+ */
+int dict_find(const struct middfs_dict *dict, const char *str, size_t len) {
+   for (int id = 0; id < MIDDFS_DICT_LEN; ++id) {
+      if (dict->ents[id] != NULL && dict->lens[id] == len &&
+          memcmp(dict->ents[id], str, len) == 0) {
+         return id;
+      }
+   }
+   return -1;
+}
+
+/* dict_get() -- get committed string with given ID
+ * RETV: the string if _id_ is valid; NULL otherwise.
+ */
+const char *dict_get(const struct middfs_dict *dict, int id, size_t *lenp) {
+   if (id < 0 || id >= MIDDFS_DICT_LEN || dict->ents[id] == NULL) {
+      return NULL;
+   }
+   *lenp = dict->lens[id];
+   return dict->ents[id];
+}
+
+/* dict_stage() -- stage a string for insertion when the current packet
+ *                 is committed.
+ * NOTE: _str_ is borrowed until dict_commit() or dict_rollback() is called.
+ * NOTE: Duplicates and strings beyond MIDDFS_DICT_PENDING are silently dropped;
+ *       both ends of the connection drop the same ones.
+ */
+void dict_stage(struct middfs_dict *dict, const char *str, size_t len) {
+   if (dict->npending == MIDDFS_DICT_PENDING) {
+      return;
+   }
+   for (int i = 0; i < dict->npending; ++i) {
+      if (dict->pending_lens[i] == len && memcmp(dict->pending[i], str, len) == 0) {
+         return;
+      }
+   }
+   dict->pending[dict->npending] = str;
+   dict->pending_lens[dict->npending] = len;
+   ++dict->npending;
+}
+
+/* dict_rollback() -- discard strings staged by an incomplete packet */
+void dict_rollback(struct middfs_dict *dict) {
+   dict->npending = 0;
+}
+
+/* dict_commit() -- insert staged strings, evicting the oldest entries.
+ * RETV: 0 on success; -1 if a string couldn't be allocated.
+ * NOTE: A string that can't be allocated still consumes its slot, so that
+ *       slot numbering stays in sync with the other end of the connection.
+ */
+int dict_commit(struct middfs_dict *dict) {
+   int retv = 0;
+
+   for (int i = 0; i < dict->npending; ++i) {
+      size_t len = dict->pending_lens[i];
+      char *str;
+
+      if ((str = malloc(len + 1)) != NULL) {
+         memcpy(str, dict->pending[i], len);
+         str[len] = '\0';
+      } else {
+         retv = -1;
+      }
+
+      free(dict->ents[dict->next]);
+      dict->ents[dict->next] = str;
+      dict->lens[dict->next] = len;
+      dict->next = (dict->next + 1) % MIDDFS_DICT_LEN;
+   }
+
+   dict->npending = 0;
+   return retv;
+}
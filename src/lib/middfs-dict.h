@@ -0,0 +1,43 @@
+/* middfs-dict.h -- per-connection string dictionary
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_DICT_H
+#define __MIDDFS_DICT_H
+
+#include <stddef.h>
+
+#define MIDDFS_DICT_LEN     64 /* number of dictionary slots (must fit in a byte) */
+#define MIDDFS_DICT_PENDING  8 /* max number of strings staged by a single packet */
+#define MIDDFS_DICT_MINLEN   3 /* shortest string worth storing in the dictionary */
+
+/* struct middfs_dict -- dictionary of recently sent strings (owners, requesters
+ * and path prefixes) on one direction of a connection.
+ * The sender and the receiver each keep a copy; since both copies see the same
+ * sequence of packets, they stay identical without ever being sent over the wire.
+ * Strings staged while (de)serializing a packet only become visible once the
+ * packet has been fully (de)serialized (see dict_commit()). */
+struct middfs_dict {
+   char *ents[MIDDFS_DICT_LEN];  /* committed strings (owned by dictionary) */
+   size_t lens[MIDDFS_DICT_LEN]; /* lengths of committed strings */
+   int next;                     /* next slot to be replaced (round robin) */
+
+   /* strings staged by the packet currently being (de)serialized;
+    * borrowed from the packet or receive buffer until committed */
+   const char *pending[MIDDFS_DICT_PENDING];
+   size_t pending_lens[MIDDFS_DICT_PENDING];
+   int npending;
+};
+
+void dict_init(struct middfs_dict *dict);
+void dict_delete(struct middfs_dict *dict);
+void dict_reset(struct middfs_dict *dict);
+
+int dict_find(const struct middfs_dict *dict, const char *str, size_t len);
+const char *dict_get(const struct middfs_dict *dict, int id, size_t *lenp);
+
+void dict_stage(struct middfs_dict *dict, const char *str, size_t len);
+void dict_rollback(struct middfs_dict *dict);
+int dict_commit(struct middfs_dict *dict);
+
+#endif
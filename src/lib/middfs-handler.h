@@ -23,14 +23,25 @@ struct handler_info;
 typedef enum handler_e (*handle_pkt_rd_f)(struct middfs_sockinfo *sockinfo,
 					  const struct middfs_packet *in_pkt);
 typedef enum handler_e (*handle_pkt_wr_f)(struct middfs_sockinfo *sockinfo);
+typedef enum handler_e (*handle_pkt_fwd_f)(struct middfs_sockinfo *sockinfo,
+                                           const struct middfs_packet *hdr,
+                                           const void *pkt, size_t pktlen);
 
 /* Handler Info */
 struct handler_info {
   /* These functions are called when a packet has been fully written/received.
    * They shall update the socket state (MSS_*) and internal fds of the socket.
+   * The received packet is freed with packet_free() after rd_fin returns.
    */
   handle_pkt_rd_f rd_fin; /* handle packet that has been fully read/received */
   handle_pkt_wr_f wr_fin; /* handle when a packet has been fully written/sent */
+
+  /* (Optional) called instead of rd_fin for a compressed packet received
+   * while relaying a response (MSS_RSPFWD) to a requester that accepts it as
+   * it is (see pkt_fwd_ok()), so that it needn't be decompressed and
+   * compressed again. _hdr_ holds the packet's magic, type & flags, and
+   * _pkt_ the _pktlen_ bytes of the packet as received. */
+  handle_pkt_fwd_f fwd_fin;
 };
 
 #endif
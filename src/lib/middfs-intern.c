@@ -0,0 +1,123 @@
+/* middfs-intern.c -- table of interned strings
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Open-addressed hash table with linear probing, guarded by a single lock.
+ * It only grows, and only when a string is seen for the first time; callers
+ * bound it by interning only names they have checked (see middfs-intern.h).
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "middfs-intern.h"
+
+#define INTERN_MINLEN 64 /* initial number of slots (power of two) */
+
+static struct {
+   pthread_mutex_t lock;
+   char **slots; /* interned strings; NULL if free */
+   size_t len;   /* number of slots */
+   size_t count; /* number of strings */
+} intern_table = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* intern_hash() -- FNV-1a hash of _len_ bytes of _str_ */
+static uint32_t intern_hash(const char *str, size_t len) {
+   uint32_t hash = 2166136261u;
+
+   for (size_t i = 0; i < len; ++i) {
+      hash = (hash ^ (uint8_t) str[i]) * 16777619u;
+   }
+   return hash;
+}
+
+/* intern_slot() -- find slot holding _str_, or free slot where it belongs */
+static char **intern_slot(char **slots, size_t nslots, const char *str, size_t len) {
+   size_t i = intern_hash(str, len) & (nslots - 1);
+
+   while (slots[i] != NULL &&
+          (strncmp(slots[i], str, len) != 0 || slots[i][len] != '\0')) {
+      i = (i + 1) & (nslots - 1);
+   }
+   return &slots[i];
+}
+
+/* intern_grow() -- double the number of slots
+ * RETV: 0 on success; -1 on error.
+ */
+static int intern_grow(void) {
+   size_t newlen = intern_table.len ? intern_table.len * 2 : INTERN_MINLEN;
+   char **newslots;
+
+   if ((newslots = calloc(newlen, sizeof(*newslots))) == NULL) {
+      return -1;
+   }
+   for (size_t i = 0; i < intern_table.len; ++i) {
+      char *str = intern_table.slots[i];
+      if (str != NULL) {
+         *intern_slot(newslots, newlen, str, strlen(str)) = str;
+      }
+   }
+
+   free(intern_table.slots);
+   intern_table.slots = newslots;
+   intern_table.len = newlen;
+   return 0;
+}
+
+/* intern_find() -- get the interned copy of a string, if it has one
+ * ARGS:
+ *  - str: string (needn't be null-terminated)
+ *  - len: length of _str_
+ * RETV: interned copy of _str_; NULL if it hasn't been interned.
+ * NOTE: Unlike intern(), never adds to the table.
+ */
+const char *intern_find(const char *str, size_t len) {
+   const char *interned = NULL;
+
+   pthread_mutex_lock(&intern_table.lock);
+   if (intern_table.len > 0) {
+      interned = *intern_slot(intern_table.slots, intern_table.len, str, len);
+   }
+   pthread_mutex_unlock(&intern_table.lock);
+
+   return interned;
+}
+
+/* intern() -- get the interned copy of a string
+ * ARGS:
+ *  - str: string (needn't be null-terminated)
+ *  - len: length of _str_
+ * RETV: null-terminated copy of _str_, which is the same for all equal
+ *       strings and stays valid until exit; NULL on error (errno set).
+ */
+const char *intern(const char *str, size_t len) {
+   char **slot = NULL;
+   const char *interned = NULL;
+
+   pthread_mutex_lock(&intern_table.lock);
+
+   /* keep the table at most half full */
+   if (intern_table.len > 0 || intern_grow() == 0) {
+      slot = intern_slot(intern_table.slots, intern_table.len, str, len);
+      if (*slot == NULL && (intern_table.count + 1) * 2 > intern_table.len) {
+         slot = NULL;
+         if (intern_grow() == 0) {
+            slot = intern_slot(intern_table.slots, intern_table.len, str, len);
+         }
+      }
+   }
+
+   if (slot != NULL) {
+      if (*slot == NULL && (*slot = strndup(str, len)) != NULL) {
+         ++intern_table.count;
+      }
+      interned = *slot;
+   }
+
+   pthread_mutex_unlock(&intern_table.lock);
+
+   return interned;
+}
@@ -0,0 +1,21 @@
+/* middfs-intern.h -- table of interned strings
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_INTERN_H
+#define __MIDDFS_INTERN_H
+
+#include <stddef.h>
+
+/* Identity strings (user names) come from a small set but appear in every
+ * request. Interning them means each distinct one is copied once, for the
+ * life of the process, instead of once per request. Interned strings are
+ * never freed and may be compared by pointer, so only strings from a
+ * bounded set may be interned: a name that came from a user or a peer must
+ * be checked (e.g. that the server knows such a client) before it is
+ * interned, and intern_find() tells whether that is needed. */
+
+const char *intern(const char *str, size_t len);
+const char *intern_find(const char *str, size_t len);
+
+#endif
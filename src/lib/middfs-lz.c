@@ -0,0 +1,264 @@
+/* middfs-lz.c -- fast LZ77 codec for packet payloads
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * The compressed format is a sequence of LZ4-style sequences:
+ *   <token> [<literal length>...] <literals> <offset> [<match length>...]
+ * The high nibble of the token is the number of literals and the low nibble
+ * is the match length minus LZ_MINMATCH; a nibble of 15 is followed by
+ * extension bytes that are added to it, ending with the first byte < 255.
+ * The offset is 2 bytes, little-endian. The last sequence consists only of
+ * a token and literals.
+ */
+
+#include <string.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "middfs-lz.h"
+
+#define LZ_MINMATCH 4
+#define LZ_HASH_LOG 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 /* last bytes of input are always literals */
+#define LZ_MFLIMIT 12      /* no match may start within this many bytes of the end */
+
+static uint32_t lz_read32(const uint8_t *p) {
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+   return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* lz_bound() -- worst-case compressed size of _srclen_ bytes */
+size_t lz_bound(size_t srclen) {
+   return srclen + srclen / 255 + 16;
+}
+
+/* lz_put_len() -- write length extension bytes */
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+   while (len >= 255) {
+      *op++ = 255;
+      len -= 255;
+   }
+   *op++ = (uint8_t) len;
+   return op;
+}
+
+/* lz_emit() -- emit a sequence. A _mlen_ of 0 denotes the last sequence.
+ * RETV: new output pointer; NULL if the sequence doesn't fit before _oend_.
+ */
+static uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t litlen,
+                        size_t offset, size_t mlen) {
+   size_t required = 1 + litlen + litlen / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+   if (required > (size_t) (oend - op)) {
+      return NULL;
+   }
+
+   uint8_t *token = op++;
+   *token = (litlen >= 15 ? 15 : litlen) << 4;
+   if (litlen >= 15) {
+      op = lz_put_len(op, litlen - 15);
+   }
+   memcpy(op, lit, litlen);
+   op += litlen;
+
+   if (mlen) {
+      mlen -= LZ_MINMATCH;
+      *op++ = offset & 0xff;
+      *op++ = offset >> 8;
+      *token |= (mlen >= 15 ? 15 : mlen);
+      if (mlen >= 15) {
+         op = lz_put_len(op, mlen - 15);
+      }
+   }
+
+   return op;
+}
+
+/* lz_compress() -- compress buffer
+ * ARGS:
+ *  - src, srclen: data to compress
+ *  - dst, dstcap: output buffer and its capacity
+ * RETV: compressed size; -1 if the output doesn't fit in _dstcap_ bytes.
+ * NOTE: Passing a _dstcap_ smaller than _srclen_ is a cheap way of giving up
+ *       early on data that doesn't compress.
+ */
+ssize_t lz_compress(const void *src, size_t srclen, void *dst, size_t dstcap) {
+   const uint8_t *in = (const uint8_t *) src;
+   const uint8_t *ip = in;
+   const uint8_t *anchor = in;
+   const uint8_t *iend = in + srclen;
+   uint8_t *op = (uint8_t *) dst;
+   const uint8_t *oend = op + dstcap;
+   uint32_t table[1 << LZ_HASH_LOG] = {0};
+
+   if (srclen > LZ_MFLIMIT) {
+      const uint8_t *mflimit = iend - LZ_MFLIMIT;
+      const uint8_t *matchlimit = iend - LZ_LAST_LITERALS;
+
+      while (ip < mflimit) {
+         uint32_t seq = lz_read32(ip);
+         uint32_t h = lz_hash(seq);
+         const uint8_t *ref = in + table[h];
+         table[h] = ip - in;
+
+         if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+            ++ip;
+            continue;
+         }
+
+         /* extend match forwards */
+         const uint8_t *mp = ip + LZ_MINMATCH;
+         const uint8_t *rp = ref + LZ_MINMATCH;
+         while (mp < matchlimit && *mp == *rp) {
+            ++mp;
+            ++rp;
+         }
+
+         if ((op = lz_emit(op, oend, anchor, ip - anchor, ip - ref, mp - ip)) == NULL) {
+            return -1;
+         }
+         ip = anchor = mp;
+      }
+   }
+
+   /* last literals */
+   if ((op = lz_emit(op, oend, anchor, iend - anchor, 0, 0)) == NULL) {
+      return -1;
+   }
+
+   return op - (uint8_t *) dst;
+}
+
+/* lz_get_len() -- read length extension bytes
+ * RETV: 0 on success; -1 if input ended.
+ */
+static int lz_get_len(const uint8_t **ipp, const uint8_t *iend, size_t *lenp) {
+   uint8_t b;
+   do {
+      if (*ipp >= iend) {
+         return -1;
+      }
+      b = *(*ipp)++;
+      *lenp += b;
+   } while (b == 255);
+   return 0;
+}
+
+/* lz_decompress() -- decompress buffer
+ * ARGS:
+ *  - src, srclen: compressed data
+ *  - dst, dstlen: output buffer and the exact expected decompressed size
+ * RETV: _dstlen_ on success; -1 if the input is corrupt.
+ */
+ssize_t lz_decompress(const void *src, size_t srclen, void *dst, size_t dstlen) {
+   const uint8_t *ip = (const uint8_t *) src;
+   const uint8_t *iend = ip + srclen;
+   uint8_t *out = (uint8_t *) dst;
+   uint8_t *op = out;
+   uint8_t *oend = out + dstlen;
+
+   while (ip < iend) {
+      uint8_t token = *ip++;
+      size_t litlen = token >> 4;
+      size_t mlen = token & 15;
+
+      /* literals */
+      if (litlen == 15 && lz_get_len(&ip, iend, &litlen) < 0) {
+         return -1;
+      }
+      if (litlen > (size_t) (iend - ip) || litlen > (size_t) (oend - op)) {
+         return -1;
+      }
+      memcpy(op, ip, litlen);
+      op += litlen;
+      ip += litlen;
+
+      if (ip == iend) {
+         break; /* last sequence */
+      }
+
+      /* match */
+      if (iend - ip < 2) {
+         return -1;
+      }
+      size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (mlen == 15 && lz_get_len(&ip, iend, &mlen) < 0) {
+         return -1;
+      }
+      mlen += LZ_MINMATCH;
+      if (offset == 0 || offset > (size_t) (op - out) || mlen > (size_t) (oend - op)) {
+         return -1;
+      }
+
+      const uint8_t *mp = op - offset;
+      if (offset >= mlen) {
+         memcpy(op, mp, mlen);
+         op += mlen;
+      } else {
+         /* overlapping match (run) */
+         while (mlen-- > 0) {
+            *op++ = *mp++;
+         }
+      }
+   }
+
+   return (op == oend) ? (ssize_t) dstlen : -1;
+}
+
+
+/* STATISTICS */
+
+static struct {
+   atomic_ullong frames_compressed;
+   atomic_ullong frames_skipped;
+   atomic_ullong frames_decompressed;
+   atomic_ullong bytes_raw;
+   atomic_ullong bytes_compressed;
+   atomic_ullong ns_compress;
+   atomic_ullong ns_decompress;
+} lz_stats;
+
+void lz_stats_add(const struct lz_stats *delta) {
+   atomic_fetch_add(&lz_stats.frames_compressed, delta->frames_compressed);
+   atomic_fetch_add(&lz_stats.frames_skipped, delta->frames_skipped);
+   atomic_fetch_add(&lz_stats.frames_decompressed, delta->frames_decompressed);
+   atomic_fetch_add(&lz_stats.bytes_raw, delta->bytes_raw);
+   atomic_fetch_add(&lz_stats.bytes_compressed, delta->bytes_compressed);
+   atomic_fetch_add(&lz_stats.ns_compress, delta->ns_compress);
+   atomic_fetch_add(&lz_stats.ns_decompress, delta->ns_decompress);
+}
+
+void lz_stats_get(struct lz_stats *stats) {
+   stats->frames_compressed = atomic_load(&lz_stats.frames_compressed);
+   stats->frames_skipped = atomic_load(&lz_stats.frames_skipped);
+   stats->frames_decompressed = atomic_load(&lz_stats.frames_decompressed);
+   stats->bytes_raw = atomic_load(&lz_stats.bytes_raw);
+   stats->bytes_compressed = atomic_load(&lz_stats.bytes_compressed);
+   stats->ns_compress = atomic_load(&lz_stats.ns_compress);
+   stats->ns_decompress = atomic_load(&lz_stats.ns_decompress);
+}
+
+void print_lz_stats(void) {
+   struct lz_stats st;
+   lz_stats_get(&st);
+   fprintf(stderr, "lz: compressed %llu frames (%llu -> %llu bytes, ratio %.2f), skipped %llu, "
+           "decompressed %llu; %.3f ms compressing, %.3f ms decompressing\n",
+           (unsigned long long) st.frames_compressed, (unsigned long long) st.bytes_raw,
+           (unsigned long long) st.bytes_compressed,
+           st.bytes_compressed ? (double) st.bytes_raw / st.bytes_compressed : 0.0,
+           (unsigned long long) st.frames_skipped, (unsigned long long) st.frames_decompressed,
+           st.ns_compress / 1e6, st.ns_decompress / 1e6);
+}
+
+/* lz_clock_ns() -- monotonic clock for timing (de)compression */
+uint64_t lz_clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
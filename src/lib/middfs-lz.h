@@ -0,0 +1,37 @@
+/* middfs-lz.h -- fast LZ77 codec for packet payloads
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_LZ_H
+#define __MIDDFS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LZ_MIN_SIZE 512 /* payloads smaller than this aren't worth compressing */
+#define LZ_MAX_SIZE (4 * 1024 * 1024) /* larger ones are sent raw, so that a
+                                       * receiver never decompresses more */
+
+size_t lz_bound(size_t srclen);
+ssize_t lz_compress(const void *src, size_t srclen, void *dst, size_t dstcap);
+ssize_t lz_decompress(const void *src, size_t srclen, void *dst, size_t dstlen);
+
+/* struct lz_stats -- compression counters (process-wide) */
+struct lz_stats {
+   uint64_t frames_compressed;   /* frames sent compressed */
+   uint64_t frames_skipped;      /* eligible frames sent raw because they didn't compress */
+   uint64_t frames_decompressed; /* compressed frames received */
+   uint64_t bytes_raw;           /* uncompressed size of frames sent compressed */
+   uint64_t bytes_compressed;    /* compressed size of frames sent compressed */
+   uint64_t ns_compress;         /* time spent compressing (incl. skipped frames) */
+   uint64_t ns_decompress;       /* time spent decompressing */
+};
+
+void lz_stats_get(struct lz_stats *stats);
+void lz_stats_add(const struct lz_stats *delta);
+void print_lz_stats(void);
+
+uint64_t lz_clock_ns(void);
+
+#endif
@@ -0,0 +1,125 @@
+/* middfs-mem.c -- accounting of buffer & payload memory against a budget
+ * Nicholas Mosier & Tommaso Monaco 2019
+ *
+ * Buffers and payloads charge the memory they hold to a global counter.
+ * Before buffering a packet, a connection checks that it fits both in the
+ * global budget and in the budget of a single connection (see
+ * handle_pkt_rd()), so that a process degrades by rejecting requests
+ * rather than by running out of memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#include "middfs-mem.h"
+
+static struct {
+   atomic_size_t used;
+   atomic_size_t peak;
+   atomic_ullong rejected;
+   size_t limit;      /* 0 if unlimited */
+   size_t conn_limit; /* 0 if unlimited */
+} mem;
+
+void mem_charge(size_t nbytes) {
+   size_t used = atomic_fetch_add_explicit(&mem.used, nbytes, memory_order_relaxed) + nbytes;
+   size_t peak = atomic_load_explicit(&mem.peak, memory_order_relaxed);
+   while (used > peak &&
+          !atomic_compare_exchange_weak_explicit(&mem.peak, &peak, used, memory_order_relaxed,
+                                                 memory_order_relaxed)) {}
+}
+
+void mem_uncharge(size_t nbytes) {
+   atomic_fetch_sub_explicit(&mem.used, nbytes, memory_order_relaxed);
+}
+
+size_t mem_used(void) {
+   return atomic_load_explicit(&mem.used, memory_order_relaxed);
+}
+
+/* mem_set_limits() -- set memory budgets
+ * ARGS:
+ *  - limit: budget of the whole process (0 for unlimited)
+ *  - conn_limit: budget of a single connection (0 for unlimited)
+ */
+void mem_set_limits(size_t limit, size_t conn_limit) {
+   mem.limit = limit;
+   mem.conn_limit = conn_limit;
+}
+
+/* mem_admit() -- whether another _nbytes_ bytes fit in the global budget */
+bool mem_admit(size_t nbytes) {
+   return mem.limit == 0 || (nbytes <= mem.limit && mem_used() <= mem.limit - nbytes);
+}
+
+/* mem_admit_conn() -- whether a connection already holding _held_ bytes
+ * may hold another _nbytes_ bytes */
+bool mem_admit_conn(size_t held, size_t nbytes) {
+   return mem.conn_limit == 0 || (nbytes <= mem.conn_limit && held <= mem.conn_limit - nbytes);
+}
+
+void mem_count_rejected(void) {
+   atomic_fetch_add_explicit(&mem.rejected, 1, memory_order_relaxed);
+}
+
+void mem_stats_get(struct mem_stats *stats) {
+   stats->used = mem_used();
+   stats->peak = atomic_load_explicit(&mem.peak, memory_order_relaxed);
+   stats->limit = mem.limit;
+   stats->conn_limit = mem.conn_limit;
+   stats->rejected = atomic_load_explicit(&mem.rejected, memory_order_relaxed);
+}
+
+void print_mem_stats(void) {
+   struct mem_stats st;
+   mem_stats_get(&st);
+   fprintf(stderr, "mem: %llu bytes in use (peak %llu), limit %llu, per connection %llu; "
+           "%llu packets rejected\n",
+           (unsigned long long) st.used, (unsigned long long) st.peak,
+           (unsigned long long) st.limit, (unsigned long long) st.conn_limit,
+           (unsigned long long) st.rejected);
+}
+
+/* parse_size() -- parse a size with an optional K, M or G suffix
+ * ARGS:
+ *  - str: string to parse, e.g. ``512M''
+ *  - sizep: where to store size in bytes
+ * RETV: 0 on success; -1 on error (errno set).
+ */
+int parse_size(const char *str, size_t *sizep) {
+   char *end;
+   unsigned long long size;
+   int shift = 0;
+
+   errno = 0;
+   size = strtoull(str, &end, 10);
+   if (errno != 0) {
+      return -1;
+   }
+   switch (*end) {
+   case 'G':
+   case 'g':
+      shift += 10;
+      /* fallthrough */
+   case 'M':
+   case 'm':
+      shift += 10;
+      /* fallthrough */
+   case 'K':
+   case 'k':
+      shift += 10;
+      ++end;
+      break;
+   default:
+      break;
+   }
+   if (end == str || *end != '\0' || size > (SIZE_MAX >> shift)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   *sizep = (size_t) size << shift;
+   return 0;
+}
@@ -0,0 +1,34 @@
+/* middfs-mem.h -- accounting of buffer & payload memory against a budget
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_MEM_H
+#define __MIDDFS_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+void mem_charge(size_t nbytes);
+void mem_uncharge(size_t nbytes);
+size_t mem_used(void);
+
+void mem_set_limits(size_t limit, size_t conn_limit);
+bool mem_admit(size_t nbytes);
+bool mem_admit_conn(size_t held, size_t nbytes);
+void mem_count_rejected(void);
+
+struct mem_stats {
+   uint64_t used;       /* bytes held by buffers & payloads */
+   uint64_t peak;       /* highest value of _used_ */
+   uint64_t limit;      /* global budget (0 if unlimited) */
+   uint64_t conn_limit; /* budget per connection (0 if unlimited) */
+   uint64_t rejected;   /* packets rejected for lack of memory */
+};
+
+void mem_stats_get(struct mem_stats *stats);
+void print_mem_stats(void);
+
+int parse_size(const char *str, size_t *sizep);
+
+#endif
@@ -0,0 +1,84 @@
+/* middfs-payload.c -- reference-counted, immutable payload buffers
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "middfs-payload.h"
+#include "middfs-mem.h"
+#include "middfs-bufpool.h"
+
+_Static_assert(sizeof(struct payload) <= BUFPOOL_HEADROOM, "payload header exceeds headroom");
+
+/* payload_size() -- size of the block holding a payload of _len_ bytes
+ * NOTE: The header goes in the headroom of pooled blocks (see
+ *       BUFPOOL_HEADROOM), so that e.g. a 128 KiB payload takes a 128 KiB
+ *       block rather than a 256 KiB one.
+ */
+static size_t payload_size(size_t len) {
+   size_t size = sizeof(struct payload) + len;
+   size_t class = bufpool_roundup(size > BUFPOOL_HEADROOM ? size - BUFPOOL_HEADROOM : 0);
+
+   return class <= BUFPOOL_MAXSIZE ? class : size;
+}
+
+/* payload_new() -- allocate payload with one reference
+ * ARGS:
+ *  - len: length of payload in bytes
+ * RETV: new payload, whose contents the caller must fill in before sharing it;
+ *       NULL on error (errno set).
+ * NOTE: Payloads are taken from the buffer pool, so that relaying or reading
+ *       a file doesn't cost a malloc(3) per packet.
+ */
+struct payload *payload_new(size_t len) {
+   struct payload *pl;
+
+   if (len > SIZE_MAX - sizeof(*pl)) {
+      errno = ENOMEM;
+      return NULL;
+   }
+   if ((pl = bufpool_get(payload_size(len))) == NULL) {
+      return NULL;
+   }
+   atomic_init(&pl->pl_refs, 1);
+   pl->pl_len = len;
+   mem_charge(payload_size(len));
+
+   return pl;
+}
+
+/* payload_dup() -- allocate payload holding a copy of _data_
+ * RETV: see payload_new().
+ */
+struct payload *payload_dup(const void *data, size_t len) {
+   struct payload *pl;
+
+   if ((pl = payload_new(len)) != NULL) {
+      memcpy(pl->pl_data, data, len);
+   }
+   return pl;
+}
+
+/* payload_ref() -- take another reference to _pl_ (may be NULL)
+ * RETV: _pl_
+ */
+struct payload *payload_ref(struct payload *pl) {
+   if (pl != NULL) {
+      atomic_fetch_add_explicit(&pl->pl_refs, 1, memory_order_relaxed);
+   }
+   return pl;
+}
+
+/* payload_unref() -- drop a reference to _pl_ (may be NULL), freeing it
+ *                    if it was the last one
+ */
+void payload_unref(struct payload *pl) {
+   if (pl != NULL &&
+       atomic_fetch_sub_explicit(&pl->pl_refs, 1, memory_order_acq_rel) == 1) {
+      mem_uncharge(payload_size(pl->pl_len));
+      bufpool_put(pl, payload_size(pl->pl_len));
+   }
+}
@@ -0,0 +1,28 @@
+/* middfs-payload.h -- reference-counted, immutable payload buffers
+ * Nicholas Mosier & Tommaso Monaco 2019
+ */
+
+#ifndef __MIDDFS_PAYLOAD_H
+#define __MIDDFS_PAYLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Payload of a read response or write request.
+ * A payload is filled in once, right after payload_new(), and is read-only
+ * from then on, so it can be shared between a received packet, a forwarded
+ * packet and a cache without copying. Each holder owns one reference; the
+ * payload is freed when the last reference is dropped. */
+struct payload {
+   atomic_uint pl_refs; /* number of references */
+   size_t pl_len;       /* length of _pl_data_ */
+   uint8_t pl_data[];   /* payload bytes */
+};
+
+struct payload *payload_new(size_t len);
+struct payload *payload_dup(const void *data, size_t len);
+struct payload *payload_ref(struct payload *pl);
+void payload_unref(struct payload *pl);
+
+#endif
@@ -5,16 +5,19 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "lib/middfs-pkt.h"
 #include "lib/middfs-buf.h"
 #include "lib/middfs-conf.h"
 #include "lib/middfs-rsrc.h"
+#include "lib/middfs-arena.h"
 
 #include "client/middfs-client-conf.h"
 
 bool req_has_mode(enum middfs_request_type type) {
-  return type == MREQ_ACCESS || type == MREQ_CHMOD || type == MREQ_CREATE || type == MREQ_OPEN;
+  return type == MREQ_ACCESS || type == MREQ_CHMOD || type == MREQ_CREATE || type == MREQ_OPEN ||
+     type == MREQ_FSYNC;
 }
 
 bool req_has_size(enum middfs_request_type type) {
@@ -33,14 +36,44 @@ bool req_has_data(enum middfs_request_type type) {
    return type == MREQ_WRITE;
 }
 
+bool req_has_handle(enum middfs_request_type type) {
+   return type == MREQ_READ || type == MREQ_WRITE || type == MREQ_FSYNC || type == MREQ_RELEASE;
+}
+
+bool req_has_times(enum middfs_request_type type) {
+   return type == MREQ_UTIMENS;
+}
+
 void response_error(struct middfs_response *rsp, int error) {
    rsp->mrsp_type = MRSP_ERROR;
    rsp->mrsp_un.mrsp_error = error;
 }
 
+/* stat_init() -- fill in attributes of file from its stat buf */
+void stat_init(struct middfs_stat *mstat, const struct stat *st) {
+   *mstat = (struct middfs_stat) {.mstat_mode = st->st_mode,
+                                  .mstat_size = st->st_size,
+                                  .mstat_blocks = st->st_blocks,
+                                  .mstat_blksize = st->st_blksize,
+                                  .mstat_mtime = st->st_mtim.tv_sec,
+                                  .mstat_mtime_nsec = st->st_mtim.tv_nsec,
+                                  .mstat_atime = st->st_atim.tv_sec,
+                                  .mstat_atime_nsec = st->st_atim.tv_nsec,
+                                  .mstat_ctime = st->st_ctim.tv_sec,
+                                  .mstat_ctime_nsec = st->st_ctim.tv_nsec,
+                                  .mstat_dev = st->st_dev,
+                                  .mstat_ino = st->st_ino,
+                                  .mstat_nlink = st->st_nlink,
+                                  .mstat_uid = st->st_uid,
+                                  .mstat_gid = st->st_gid};
+}
+
 void packet_error(struct middfs_packet *pkt, int error) {
    pkt->mpkt_magic = MPKT_MAGIC;
    pkt->mpkt_type = MPKT_RESPONSE;
+   pkt->mpkt_flags = 0;
+   pkt->mpkt_dict = NULL;
+   pkt->mpkt_arena = NULL;
 
    struct middfs_response *rsp = &pkt->mpkt_un.mpkt_response;
    rsp->mrsp_type = MRSP_ERROR;
@@ -51,14 +84,17 @@ void packet_error(struct middfs_packet *pkt, int error) {
 /* PACKET SUBTYPE INITIALIZATION FUNCTIONS */
 
 void request_init(struct middfs_request *req, enum middfs_request_type type,
-                  const struct rsrc *rsrc) {
+                  const char *requester, const struct rsrc *rsrc) {
    req->mreq_type = type;
-   req->mreq_requester = conf_get(MIDDFS_CONF_USERNAME);
+   req->mreq_requester = (char *) requester;
    req->mreq_rsrc = *rsrc;
+   req->mreq_handle = 0;
+   req->mreq_payload = NULL;
 }
 
 void response_init(struct middfs_response *rsp, enum middfs_response_type type) {
    rsp->mrsp_type = type;
+   memset(&rsp->mrsp_un, 0, sizeof(rsp->mrsp_un));
 }
 
 int connect_init(struct middfs_connect *conn) {
@@ -75,12 +111,178 @@ int connect_init(struct middfs_connect *conn) {
 
 /* TODO: Disconnect. */
 
+/* PACKET FREEING FUNCTIONS
+ * These free the members of a packet that deserialize_pkt() allocated, or of
+ * a response whose data or directory entries the sender allocated itself.
+ * Payloads are unreferenced rather than freed, so anything that needs a
+ * payload after its packet is freed must payload_ref() it first. Strings of
+ * packets built for sending are usually borrowed; don't free those packets
+ * with packet_free().
+ * If the packet was deserialized into an arena (_mpkt_arena_), packet_free()
+ * resets the arena instead, so the arena must only hold that packet.
+ */
+
+/* request_free() -- free members of a deserialized request */
+void request_free(struct middfs_request *req) {
+   free(req->mreq_requester);
+   free(req->mreq_rsrc.mr_owner);
+   free(req->mreq_rsrc.mr_path);
+   if (req_has_to(req->mreq_type)) {
+      free(req->mreq_to.mr_owner);
+      free(req->mreq_to.mr_path);
+   }
+   if (req_has_data(req->mreq_type)) {
+      payload_unref(req->mreq_payload);
+      req->mreq_payload = NULL;
+      req->mreq_data = NULL;
+   }
+   req->mreq_requester = req->mreq_rsrc.mr_owner = req->mreq_rsrc.mr_path = NULL;
+}
+
+/* response_free() -- free data or directory entries of a response */
+void response_free(struct middfs_response *rsp) {
+   switch (rsp->mrsp_type) {
+   case MRSP_DATA:
+      {
+         struct middfs_data *data = &rsp->mrsp_un.mrsp_data;
+         payload_unref(data->mdata_payload);
+         data->mdata_payload = NULL;
+         data->mdata_buf = NULL;
+      }
+      break;
+      
+   case MRSP_DIR:
+      {
+         struct middfs_dir *dir = &rsp->mrsp_un.mrsp_dir;
+         if (dir->mdir_ents != NULL) {
+            for (uint64_t i = 0; i < dir->mdir_count; ++i) {
+               free(dir->mdir_ents[i].mde_name);
+            }
+            free(dir->mdir_ents);
+         }
+         dir->mdir_ents = NULL;
+         dir->mdir_count = 0;
+      }
+      break;
+
+   default:
+      break;
+   }
+}
+
+/* packet_unref_payload() -- drop packet's payload reference, if any */
+static void packet_unref_payload(struct middfs_packet *pkt) {
+   struct middfs_request *req = &pkt->mpkt_un.mpkt_request;
+   struct middfs_response *rsp = &pkt->mpkt_un.mpkt_response;
+   
+   if (pkt->mpkt_type == MPKT_REQUEST && req_has_data(req->mreq_type)) {
+      payload_unref(req->mreq_payload);
+      req->mreq_payload = NULL;
+      req->mreq_data = NULL;
+   } else if (pkt->mpkt_type == MPKT_RESPONSE && rsp->mrsp_type == MRSP_DATA) {
+      payload_unref(rsp->mrsp_un.mrsp_data.mdata_payload);
+      rsp->mrsp_un.mrsp_data.mdata_payload = NULL;
+      rsp->mrsp_un.mrsp_data.mdata_buf = NULL;
+   }
+}
+
+/* packet_free() -- free members of a deserialized packet */
+void packet_free(struct middfs_packet *pkt) {
+   if (pkt->mpkt_arena != NULL) {
+      /* everything but the payload is in the arena */
+      packet_unref_payload(pkt);
+      arena_reset(pkt->mpkt_arena);
+      return;
+   }
+   
+   switch (pkt->mpkt_type) {
+   case MPKT_CONNECT:
+      free(pkt->mpkt_un.mpkt_connect.name);
+      pkt->mpkt_un.mpkt_connect.name = NULL;
+      break;
+
+   case MPKT_REQUEST:
+      request_free(&pkt->mpkt_un.mpkt_request);
+      break;
+
+   case MPKT_RESPONSE:
+      response_free(&pkt->mpkt_un.mpkt_response);
+      break;
+
+   default:
+      break;
+   }
+}
+
 /* PACKET INITIALIZATION FUNCTIONS */
 
 /* packet_init() -- initialize bare packet */
 void packet_init(struct middfs_packet *pkt, enum middfs_packet_type type) {
    pkt->mpkt_magic = MPKT_MAGIC;
    pkt->mpkt_type = type;
+   pkt->mpkt_flags = 0;
+   pkt->mpkt_dict = NULL;
+   pkt->mpkt_arena = NULL;
+}
+
+/* packet_set_lz() -- set compression flags of an outgoing packet
+ * ARGS:
+ *  - pkt: packet to be sent
+ *  - accept: whether this end can receive compressed packets
+ *  - peer_flags: flags of the last packet received from the recipient
+ *    (or sent by it when it connected); 0 if unknown
+ * NOTE: The payload is only compressed if both ends accept compression and
+ *       serialize_pkt() finds it worthwhile.
+ */
+void packet_set_lz(struct middfs_packet *pkt, bool accept, uint32_t peer_flags) {
+   pkt->mpkt_flags &= ~(MPKT_F_ACCEPT_LZ | MPKT_F_LZ);
+   if (accept) {
+      pkt->mpkt_flags |= MPKT_F_ACCEPT_LZ;
+      if (peer_flags & MPKT_F_ACCEPT_LZ) {
+         pkt->mpkt_flags |= MPKT_F_LZ;
+      }
+   }
+}
+
+/* packet_set_crc() -- set whether an outgoing packet is checksummed
+ * NOTE: The recipient verifies the checksum of any packet that has one, so
+ *       this needs no negotiation.
+ */
+void packet_set_crc(struct middfs_packet *pkt, bool crc) {
+   if (crc) {
+      pkt->mpkt_flags |= MPKT_F_CRC;
+   } else {
+      pkt->mpkt_flags &= ~MPKT_F_CRC;
+   }
+}
+
+/* packet_payload() -- get payload that is the data of a packet
+ * RETV: the payload, if the packet's data (a write request's or a read
+ *       response's) is all of one; NULL otherwise.
+ */
+struct payload *packet_payload(const struct middfs_packet *pkt) {
+   const struct middfs_request *req = &pkt->mpkt_un.mpkt_request;
+   const struct middfs_response *rsp = &pkt->mpkt_un.mpkt_response;
+   struct payload *pl;
+   const void *data;
+   size_t len;
+
+   if (pkt->mpkt_type == MPKT_REQUEST && req_has_data(req->mreq_type)) {
+      pl = req->mreq_payload;
+      data = req->mreq_data;
+      len = req->mreq_size;
+   } else if (pkt->mpkt_type == MPKT_RESPONSE && rsp->mrsp_type == MRSP_DATA) {
+      pl = rsp->mrsp_un.mrsp_data.mdata_payload;
+      data = rsp->mrsp_un.mrsp_data.mdata_buf;
+      len = rsp->mrsp_un.mrsp_data.mdata_nbytes;
+   } else {
+      return NULL;
+   }
+
+   if (pl == NULL || len == 0 || data != pl->pl_data || len != pl->pl_len) {
+      return NULL;
+   }
+   return pl;
 }
 
 
@@ -103,6 +305,10 @@ const char *req_type_strs[MREQ_NTYPES] =
     [MREQ_READ] = "MREQ_READ",
     [MREQ_WRITE] = "MREQ_WRITE",
     [MREQ_READDIR] = "MREQ_READDIR",
+    [MREQ_READDIRPLUS] = "MREQ_READDIRPLUS",
+    [MREQ_FSYNC] = "MREQ_FSYNC",
+    [MREQ_RELEASE] = "MREQ_RELEASE",
+    [MREQ_UTIMENS] = "MREQ_UTIMENS",
    };
 
 
@@ -130,9 +336,17 @@ void print_request(const struct middfs_request *req) {
    if (req_has_off(type)) {
       fprintf(stderr, ".mreq_off = %llu, ", (unsigned long long) req->mreq_size);
    }
+   if (req_has_times(type)) {
+      fprintf(stderr, ".mreq_times = {%lld.%09ld, %lld.%09ld}, ",
+              (long long) req->mreq_times[0].tv_sec, req->mreq_times[0].tv_nsec,
+              (long long) req->mreq_times[1].tv_sec, req->mreq_times[1].tv_nsec);
+   }
    if (req_has_data(type)) {
       fprintf(stderr, ".mreq_data = %p, ", (const void *) req->mreq_data);
    }
+   if (req_has_handle(type)) {
+      fprintf(stderr, ".mreq_handle = %llx, ", (unsigned long long) req->mreq_handle);
+   }
 
    fprintf(stderr, "}");
 }
@@ -144,6 +358,7 @@ const char *rsp_type_strs[MRSP_NTYPES] =
     [MRSP_STAT] = "MRSP_STAT",
     [MRSP_DIR] = "MRSP_DIR",
     [MRSP_ERROR] = "MRSP_ERROR",
+    [MRSP_HANDLE] = "MRSP_HANDLE",
    };
 
 void print_response(const struct middfs_response *rsp) {
@@ -163,6 +378,10 @@ void print_response(const struct middfs_response *rsp) {
       fprintf(stderr, ".mrsp_dir = ");
       print_dir(&rsp->mrsp_un.mrsp_dir);
       break;
+   case MRSP_HANDLE:
+      fprintf(stderr, ".mrsp_handle = ");
+      print_handle(&rsp->mrsp_un.mrsp_handle);
+      break;
    case MRSP_ERROR:
       fprintf(stderr, ".mrsp_error = %d", rsp->mrsp_un.mrsp_error);
       break;
@@ -181,16 +400,35 @@ void print_data(const struct middfs_data *data) {
 
 void print_stat(const struct middfs_stat *st) {
    fprintf(stderr, "{.mstat_mode = %o, .mstat_size = %llu, .mstat_blocks = %llu, " \
-           ".mstat_blksize = %llu}", st->mstat_mode, st->mstat_size, st->mstat_blocks,
-           st->mstat_blksize);
+           ".mstat_blksize = %llu, .mstat_mtime = %lld.%09u, .mstat_atime = %lld.%09u, " \
+           ".mstat_ctime = %lld.%09u, .mstat_dev = %llu, .mstat_ino = %llu, " \
+           ".mstat_nlink = %u, .mstat_uid = %u, .mstat_gid = %u}", st->mstat_mode,
+           (unsigned long long) st->mstat_size, (unsigned long long) st->mstat_blocks,
+           (unsigned long long) st->mstat_blksize, (long long) st->mstat_mtime,
+           st->mstat_mtime_nsec, (long long) st->mstat_atime, st->mstat_atime_nsec,
+           (long long) st->mstat_ctime, st->mstat_ctime_nsec,
+           (unsigned long long) st->mstat_dev, (unsigned long long) st->mstat_ino,
+           st->mstat_nlink, st->mstat_uid, st->mstat_gid);
+}
+
+void print_handle(const struct middfs_handle *handle) {
+   fprintf(stderr, "{.mh_id = %llx, .mh_stat = ", (unsigned long long) handle->mh_id);
+   print_stat(&handle->mh_stat);
+   fprintf(stderr, "}");
 }
 
 void print_dirent(const struct middfs_dirent *de) {
-   fprintf(stderr, "{.mde_name = ``%s'', .mde_mode = %o}", de->mde_name, de->mde_mode);
+   fprintf(stderr, "{.mde_name = ``%s'', .mde_mode = %o", de->mde_name, de->mde_mode);
+   if (de->mde_stat.mstat_mode != 0) {
+      fprintf(stderr, ", .mde_stat = ");
+      print_stat(&de->mde_stat);
+   }
+   fprintf(stderr, "}");
 }
 
 void print_dir(const struct middfs_dir *dir) {
-   fprintf(stderr, "{.mdir_count = %llu, .mdir_ents = {", dir->mdir_count);
+   fprintf(stderr, "{.mdir_count = %llu, .mdir_plus = %d, .mdir_ents = {", dir->mdir_count,
+           dir->mdir_plus);
    for (uint64_t i = 0; i < dir->mdir_count; ++i) {
       fprintf(stderr, "[%llu] = ", i);
       print_dirent(dir->mdir_ents + i);
@@ -215,9 +453,9 @@ const char *packet_type_strs[MPKT_NTYPES] =
 
 void print_packet(const struct middfs_packet *pkt) {
    enum middfs_packet_type type = pkt->mpkt_type;
-   fprintf(stderr, "{.mpkt_magic = %u, .mpkt_type = %s, ",
+   fprintf(stderr, "{.mpkt_magic = %u, .mpkt_type = %s, .mpkt_flags = %#x, ",
            pkt->mpkt_magic, (type >= 0 && type < MPKT_NTYPES) ?
-           packet_type_strs[type] : "<invalid type>");
+           packet_type_strs[type] : "<invalid type>", pkt->mpkt_flags);
    switch (type) {
    case MPKT_CONNECT:
       print_connect(&pkt->mpkt_un.mpkt_connect);
@@ -8,11 +8,26 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/stat.h>
 
 #include "middfs-rsrc.h"
+#include "middfs-payload.h"
 
 #define MPKT_MAGIC 1800
 
+/* Packet flags */
+#define MPKT_F_ACCEPT_LZ 0x1 /* sender can receive compressed packets */
+#define MPKT_F_LZ        0x2 /* payload is compressed (or, when sending, may be compressed) */
+#define MPKT_F_CRC       0x4 /* packet is followed by its CRC32C */
+#define MPKT_F_ACCEPT_STREAM 0x8 /* request: sender can receive a streamed response */
+#define MPKT_F_MORE      0x10 /* response: more packets of this response follow */
+
+/* A streamed READ response is a sequence of MRSP_DATA packets, each carrying
+ * at most MPKT_STREAM_CHUNK bytes of consecutive data; all but the last
+ * have MPKT_F_MORE set. An error after the first chunk ends the stream with an
+ * MRSP_ERROR packet. */
+#define MPKT_STREAM_CHUNK (64 * 1024)
+
 enum middfs_packet_type
   {MPKT_NONE,
    MPKT_CONNECT,
@@ -39,6 +54,10 @@ enum middfs_request_type
    MREQ_READ,
    MREQ_WRITE,
    MREQ_READDIR,
+   MREQ_READDIRPLUS, /* readdir with the attributes of each entry */
+   MREQ_FSYNC,
+   MREQ_RELEASE,     /* end lease on file opened by MREQ_OPEN */
+   MREQ_UTIMENS,     /* set access & modification times */
    MREQ_NTYPES /* counts number of types */
   };
 
@@ -51,39 +70,66 @@ struct middfs_request {
   struct rsrc mreq_rsrc;
 
   /* request-specific members */
-   int32_t mreq_mode;    /* access, chmod, create, open */
+   int32_t mreq_mode;    /* access, chmod, create, open, fsync (datasync) */
+   uint64_t mreq_handle; /* read, write, fsync, release; 0 if file isn't leased */
    uint64_t mreq_size; /* readlink, truncate, read, write */
    struct rsrc mreq_to;    /* symlink, rename */
    uint64_t mreq_off;  /* read, write */
+   struct timespec mreq_times[2]; /* utimens: atime, mtime, as for utimensat(2) */
    void *mreq_data; /* write */
+   struct payload *mreq_payload; /* write; owns _mreq_data_ if not NULL */
   
-  /* (none): getattr, unlink, getattr, rmdir, readdir */
+  /* (none): getattr, unlink, getattr, rmdir, readdir, readdirplus */
 };
 bool req_has_mode(enum middfs_request_type type);
 bool req_has_size(enum middfs_request_type type);
 bool req_has_to(enum middfs_request_type type);
 bool req_has_off(enum middfs_request_type type);
 bool req_has_data(enum middfs_request_type type);
+bool req_has_handle(enum middfs_request_type type);
+bool req_has_times(enum middfs_request_type type);
 
 struct middfs_stat {
    uint32_t mstat_mode;
    uint64_t mstat_size;
    uint64_t mstat_blocks;
    uint64_t mstat_blksize;
+   int64_t mstat_mtime;       /* seconds since the epoch */
+   uint32_t mstat_mtime_nsec; /* ... plus nanoseconds */
+   int64_t mstat_atime;
+   uint32_t mstat_atime_nsec;
+   int64_t mstat_ctime;
+   uint32_t mstat_ctime_nsec;
+   uint64_t mstat_dev;        /* device & inode number on the owner's host, */
+   uint64_t mstat_ino;        /* which together identify the file there */
+   uint32_t mstat_nlink;
+   uint32_t mstat_uid;
+   uint32_t mstat_gid;
+};
+
+/* struct middfs_handle -- reply to MREQ_OPEN. The owner keeps the file open
+ * until the requester sends MREQ_RELEASE or stops using the handle for a
+ * while (see lease_timeout), so that reads & writes needn't reopen it. */
+struct middfs_handle {
+   uint64_t mh_id;              /* 0 if the owner couldn't keep the file open */
+   struct middfs_stat mh_stat;  /* attributes as of the open */
 };
 
 struct middfs_data {
    void *mdata_buf;
    uint64_t mdata_nbytes;
+   struct payload *mdata_payload; /* owns _mdata_buf_ if not NULL */
 };
 
 struct middfs_dirent {
    char *mde_name;
    int32_t mde_mode;
+   struct middfs_stat mde_stat; /* if _mdir_plus_; mstat_mode is 0 if unknown */
 };
 
 struct middfs_dir {
    uint64_t mdir_count;             /* number of directory entries */
+   bool mdir_plus;                  /* entries carry attributes (readdirplus) */
    struct middfs_dirent *mdir_ents; /* array of directory entries */
 };
 
@@ -93,6 +139,7 @@ enum middfs_response_type
     MRSP_STAT,
     MRSP_DIR,
     MRSP_ERROR,
+    MRSP_HANDLE,
     MRSP_NTYPES
    };
 
@@ -104,6 +151,7 @@ struct middfs_response {
       int32_t mrsp_error;                     /* error */
       struct middfs_stat mrsp_stat;           /* getattr */
       struct middfs_dir mrsp_dir;             /* readdir */
+      struct middfs_handle mrsp_handle;       /* open */
    } mrsp_un;
 };
 
@@ -123,31 +171,56 @@ struct middfs_disconnect {
   int dummy;
 };
 
+struct middfs_dict;
+struct arena;
+
 struct middfs_packet {
   uint32_t mpkt_magic;
   enum middfs_packet_type mpkt_type;
+  uint32_t mpkt_flags; /* MPKT_F_* */
   union {
     struct middfs_request mpkt_request;
      struct middfs_response mpkt_response;
     struct middfs_connect mpkt_connect;
      // struct middfs_disconnect mpk_disconnect;
   } mpkt_un;
+
+   /* Connection dictionary used to (de)serialize owner, requester and path
+    * strings. Not serialized itself; set by the sender/receiver before
+    * (de)serializing. May be NULL. */
+   struct middfs_dict *mpkt_dict;
+
+   /* Arena from which deserialize_pkt() allocates the packet's strings and
+    * directory entries. Not serialized; set by the receiver. May be NULL, in
+    * which case they are malloc(3)ed. Payloads are never in the arena. */
+   struct arena *mpkt_arena;
 };
 
 void packet_error(struct middfs_packet *pkt, int error);
 
 void request_init(struct middfs_request *req, enum middfs_request_type type,
-                  const struct rsrc *rsrc);
+                  const char *requester, const struct rsrc *rsrc);
 void response_init(struct middfs_response *rsp, enum middfs_response_type type);
 int connect_init(struct middfs_connect *conn);
 void packet_init(struct middfs_packet *pkt, enum middfs_packet_type type);
+void packet_set_lz(struct middfs_packet *pkt, bool accept, uint32_t peer_flags);
+void packet_set_crc(struct middfs_packet *pkt, bool crc);
+struct payload *packet_payload(const struct middfs_packet *pkt);
 void response_error(struct middfs_response *rsp, int error);
+void stat_init(struct middfs_stat *mstat, const struct stat *st);
+
+void request_free(struct middfs_request *req);
+void response_free(struct middfs_response *rsp);
+void packet_free(struct middfs_packet *pkt);
 
 /* PRINTING FUNCTIONS */
+extern const char *req_type_strs[MREQ_NTYPES];
+extern const char *rsp_type_strs[MRSP_NTYPES];
 void print_request(const struct middfs_request *req);
 void print_response(const struct middfs_response *rsp);
 void print_data(const struct middfs_data *data);
 void print_stat(const struct middfs_stat *st);
+void print_handle(const struct middfs_handle *handle);
 void print_dirent(const struct middfs_dirent *de);
 void print_dir(const struct middfs_dir *dir);
 void print_connect(const struct middfs_connect *conn);
@@ -9,11 +9,18 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <pthread.h>
 
 #include "middfs-util.h"
 #include "middfs-serial.h"
 #include "middfs-rsrc.h"
 #include "middfs-pkt.h"
+#include "middfs-dict.h"
+#include "middfs-buf.h"
+#include "middfs-lz.h"
+#include "middfs-crc.h"
+#include "middfs-payload.h"
+#include "middfs-arena.h"
 
 
 /* SERIALIZATION FUNCTIONS 
@@ -45,6 +52,15 @@
  *       (Note that 1. and 2. do NOT describe the same values).
  */
 
+/* Arena of the packet being deserialized by deserialize_pkt() on this
+ * thread, or NULL if its members are to be malloc(3)ed. */
+static _Thread_local struct arena *deserial_arena;
+
+/* deserial_alloc() -- allocate memory for a deserialized string or array */
+static void *deserial_alloc(size_t size) {
+  return deserial_arena ? arena_alloc(deserial_arena, size) : malloc(size);
+}
+
 
 
 /* variable list:  offset, memblen */
@@ -188,11 +204,11 @@ size_t deserialize_enum(const void *buf, size_t nbytes,
 size_t serialize_str(const char *str, void *buf, size_t nbytes) {
   size_t len;
   
-  len = strnlen(str, nbytes);
+  len = strlen(str); /* needed even if there's no room, to size the packet */
   
   /* copy string, if there's room  */
   if (len < nbytes) {
-    strcpy(buf, str);
+    memcpy(buf, str, len + 1);
   }
   
   return len + 1;
@@ -218,11 +234,12 @@ size_t deserialize_str(const void *buf, size_t nbytes,
 
   /* allocate string */
   if (len < nbytes) {
-    char *str = strdup((const char *) buf_);
+    char *str = deserial_alloc(len + 1);
     if (str == NULL) {
       *errp = errno;
       return 0;
     }
+    memcpy(str, buf_, len + 1);
     *strp = str;
   } else {
     len = nbytes + 1; /* indicate more bytes required */
@@ -231,6 +248,160 @@ size_t deserialize_str(const void *buf, size_t nbytes,
   return len + 1;
 }
 
+/* serialize_strn() -- serialize the first _len_ bytes of _str_ as a
+ *                     NUL-terminated string */
+static size_t serialize_strn(const char *str, size_t len, void *buf, size_t nbytes) {
+  if (len < nbytes) {
+    memcpy(buf, str, len);
+    ((char *) buf)[len] = '\0';
+  }
+
+  return len + 1;
+}
+
+/* Dictionary string opcodes
+ * A dictionary string is encoded as one of
+ *   DSTR_LIT <str>               -- no dictionary, or prefix too short
+ *   DSTR_NEW <prefix> <suffix>   -- prefix is added to the dictionary
+ *   DSTR_REF <id> <suffix>       -- prefix is dictionary entry <id>
+ * where <str>, <prefix> and <suffix> are NUL-terminated and <id> is one byte.
+ */
+enum dstr_op {DSTR_LIT, DSTR_NEW, DSTR_REF};
+
+/* serialize_dstr() -- serialize string, compressing its first _prefix_len_
+ *                     bytes against connection dictionary _dict_
+ * ARGS:
+ *  - str: string to serialize
+ *  - prefix_len: length of the part of _str_ that is worth remembering
+ *    (e.g. the whole owner name, or the parent directory of a path)
+ *  - dict: connection dictionary (may be NULL)
+ */
+size_t serialize_dstr(const char *str, size_t prefix_len, struct middfs_dict *dict,
+                      void *buf, size_t nbytes) {
+  uint8_t *buf_ = (uint8_t *) buf;
+  size_t used = 0;
+  int op = DSTR_LIT;
+  int id = -1;
+
+  if (dict != NULL && prefix_len >= MIDDFS_DICT_MINLEN) {
+    if ((id = dict_find(dict, str, prefix_len)) >= 0) {
+      op = DSTR_REF;
+    } else {
+      op = DSTR_NEW;
+      dict_stage(dict, str, prefix_len);
+    }
+  }
+
+  used += serialize_enum(&op, buf_ + used, sizerem(nbytes, used));
+
+  switch (op) {
+  case DSTR_NEW:
+    used += serialize_strn(str, prefix_len, buf_ + used, sizerem(nbytes, used));
+    used += serialize_str(str + prefix_len, buf_ + used, sizerem(nbytes, used));
+    break;
+
+  case DSTR_REF:
+    used += serialize_enum(&id, buf_ + used, sizerem(nbytes, used));
+    used += serialize_str(str + prefix_len, buf_ + used, sizerem(nbytes, used));
+    break;
+
+  case DSTR_LIT:
+  default:
+    used += serialize_str(str, buf_ + used, sizerem(nbytes, used));
+    break;
+  }
+
+  return used;
+}
+
+/* dstr_join() -- allocate concatenation of prefix and suffix */
+static char *dstr_join(const char *prefix, size_t prefix_len, const char *suffix,
+                       size_t suffix_len) {
+  char *str;
+
+  if ((str = deserial_alloc(prefix_len + suffix_len + 1)) != NULL) {
+    memcpy(str, prefix, prefix_len);
+    memcpy(str + prefix_len, suffix, suffix_len + 1);
+  }
+
+  return str;
+}
+
+size_t deserialize_dstr(const void *buf, size_t nbytes, char **strp,
+                        struct middfs_dict *dict, int *errp) {
+  const uint8_t *buf_ = (const uint8_t *) buf;
+  size_t used = 0;
+  int op;
+  const char *prefix;
+  size_t prefix_len;
+
+  /* bail on previous error */
+  if (*errp) {
+    return 0;
+  }
+
+  used += deserialize_enum(buf_ + used, sizerem(nbytes, used), &op, errp);
+  if (used > nbytes) {
+    return used;
+  }
+
+  switch (op) {
+  case DSTR_LIT:
+    return used + deserialize_str(buf_ + used, sizerem(nbytes, used), strp, errp);
+
+  case DSTR_NEW:
+    prefix = (const char *) buf_ + used;
+    if ((prefix_len = strnlen(prefix, sizerem(nbytes, used))) == sizerem(nbytes, used)) {
+      return nbytes + 1; /* need more bytes */
+    }
+    used += prefix_len + 1;
+    if (dict != NULL) {
+      dict_stage(dict, prefix, prefix_len);
+    }
+    break;
+
+  case DSTR_REF:
+    {
+      int id;
+      used += deserialize_enum(buf_ + used, sizerem(nbytes, used), &id, errp);
+      if (used > nbytes) {
+        return used;
+      }
+      if (dict == NULL || (prefix = dict_get(dict, id, &prefix_len)) == NULL) {
+        *errp = EPROTO; /* reference to unknown entry */
+        return 0;
+      }
+    }
+    break;
+
+  default:
+    *errp = EPROTO;
+    return 0;
+  }
+
+  /* deserialize suffix */
+  const char *suffix = (const char *) buf_ + used;
+  size_t suffix_len;
+  if ((suffix_len = strnlen(suffix, sizerem(nbytes, used))) == sizerem(nbytes, used)) {
+    return nbytes + 1; /* need more bytes */
+  }
+  used += suffix_len + 1;
+
+  if ((*strp = dstr_join(prefix, prefix_len, suffix, suffix_len)) == NULL) {
+    *errp = errno;
+    return 0;
+  }
+
+  return used;
+}
+
+/* path_prefix_len() -- length of the parent directory part of _path_,
+ *                      including the trailing '/' */
+static size_t path_prefix_len(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return (slash == NULL) ? 0 : slash - path + 1;
+}
+
 size_t serialize_uint32(const uint32_t uint, void *buf,
 			size_t nbytes) {
   /* TODO: write serialize_uint deserialize_uint */
@@ -270,52 +441,53 @@ size_t deserialize_int32(const void *buf, size_t nbytes,
 
 size_t serialize_rsrc(const struct rsrc *rsrc, void *buf,
 		      size_t nbytes) { 
-  return
-    serialize_struct((const void *) rsrc, buf, nbytes, 2,
-		     offsetof(struct rsrc, mr_owner), serialize_strp,
-		     offsetof(struct rsrc, mr_path), serialize_strp
-		     );
+  return serialize_rsrc_dict(rsrc, NULL, buf, nbytes);
 }
 
+size_t serialize_rsrc_dict(const struct rsrc *rsrc, struct middfs_dict *dict,
+                           void *buf, size_t nbytes) {
+  uint8_t *buf_ = (uint8_t *) buf;
+  size_t used = 0;
 
-size_t deserialize_rsrc(const void *buf, size_t nbytes,
-			struct rsrc *rsrc, int *errp) {
+  used += serialize_dstr(rsrc->mr_owner, strlen(rsrc->mr_owner), dict,
+                         buf_ + used, sizerem(nbytes, used));
+  used += serialize_dstr(rsrc->mr_path, path_prefix_len(rsrc->mr_path), dict,
+                         buf_ + used, sizerem(nbytes, used));
 
-#if 1
+  return used;
+}
 
-  return
-    deserialize_struct(buf, nbytes, rsrc, errp, 2,
-		       offsetof(struct rsrc,
-				mr_owner), deserialize_str,
-		       offsetof(struct rsrc,
-				mr_path), deserialize_str
-		       );
-		       
-			    
+size_t deserialize_rsrc(const void *buf, size_t nbytes,
+			struct rsrc *rsrc, int *errp) {
+  return deserialize_rsrc_dict(buf, nbytes, rsrc, NULL, errp);
+}
 
-  
-#else
-  
-  const uint8_t *buf_ = (const void *) buf;
+size_t deserialize_rsrc_dict(const void *buf, size_t nbytes, struct rsrc *rsrc,
+                             struct middfs_dict *dict, int *errp) {
+  const uint8_t *buf_ = (const uint8_t *) buf;
   size_t used = 0;
-  
+
   /* bail on previous error */
   if (*errp) {
     return 0;
   }
-  
-  used += deserialize_str(buf_ + used, sizerem(nbytes, used),
-			  &rsrc->mr_owner, errp);
-  used += deserialize_str(buf_ + used, sizerem(nbytes, used),
-			  &rsrc->mr_path, errp);
-  
-  return *errp ? 0 : used;
 
-#endif
+  used += deserialize_dstr(buf_ + used, sizerem(nbytes, used), &rsrc->mr_owner, dict, errp);
+  if (used > nbytes) {
+    return used;
+  }
+  used += deserialize_dstr(buf_ + used, sizerem(nbytes, used), &rsrc->mr_path, dict, errp);
+
+  return *errp ? 0 : used;
 }
 
 size_t serialize_request(const struct middfs_request *req, void *buf,
 			 size_t nbytes) {
+  return serialize_request_dict(req, NULL, buf, nbytes);
+}
+
+size_t serialize_request_dict(const struct middfs_request *req, struct middfs_dict *dict,
+                              void *buf, size_t nbytes) {
   uint8_t *buf_ = (uint8_t *) buf;
   size_t used = 0;
   enum middfs_request_type type = req->mreq_type;
@@ -323,10 +495,10 @@ size_t serialize_request(const struct middfs_request *req, void *buf,
   /* serialize shared members */
   used += serialize_uint32((uint32_t) type, buf_ + used,
 			   sizerem(nbytes, used));
-  used += serialize_str(req->mreq_requester, buf_ + used,
-			sizerem(nbytes, used));
-  used += serialize_rsrc(&req->mreq_rsrc, buf_ + used,
-			 sizerem(nbytes, used));
+  used += serialize_dstr(req->mreq_requester, strlen(req->mreq_requester), dict,
+                         buf_ + used, sizerem(nbytes, used));
+  used += serialize_rsrc_dict(&req->mreq_rsrc, dict, buf_ + used,
+                              sizerem(nbytes, used));
 
 
   /* serialize request-specific members */
@@ -336,6 +508,11 @@ size_t serialize_request(const struct middfs_request *req, void *buf,
      used += serialize_int32((int32_t) req->mreq_mode, buf_ + used, sizerem(nbytes, used));
   }
 
+  /* serialize _handle_ */
+  if (req_has_handle(type)) {
+     used += serialize_uint64(req->mreq_handle, buf_ + used, sizerem(nbytes, used));
+  }
+
   /* serialize _size_ */
   if (req_has_size(type)) {
      used += serialize_uint64((int32_t) req->mreq_size, buf_ + used, sizerem(nbytes, used));
@@ -343,7 +520,7 @@ size_t serialize_request(const struct middfs_request *req, void *buf,
 
   /* serialize _to_ */
   if (req_has_to(type)) {
-    used += serialize_rsrc(&req->mreq_to, buf_ + used, sizerem(nbytes, used));
+    used += serialize_rsrc_dict(&req->mreq_to, dict, buf_ + used, sizerem(nbytes, used));
   }
 
   /* serilaize _off_ */
@@ -351,6 +528,14 @@ size_t serialize_request(const struct middfs_request *req, void *buf,
      used += serialize_uint64((int32_t) req->mreq_off, buf_ + used, sizerem(nbytes, used));
   }
 
+  /* serialize _times_ */
+  if (req_has_times(type)) {
+     for (int i = 0; i < 2; ++i) {
+        used += serialize_int64(req->mreq_times[i].tv_sec, buf_ + used, sizerem(nbytes, used));
+        used += serialize_int64(req->mreq_times[i].tv_nsec, buf_ + used, sizerem(nbytes, used));
+     }
+  }
+
   /* serialize _data_ */
   if (req_has_data(type)) {
      if (sizerem(nbytes, used) >= req->mreq_size) {
@@ -364,6 +549,11 @@ size_t serialize_request(const struct middfs_request *req, void *buf,
 
 size_t deserialize_request(const void *buf, size_t nbytes,
 			   struct middfs_request *req, int *errp) {
+  return deserialize_request_dict(buf, nbytes, req, NULL, errp);
+}
+
+size_t deserialize_request_dict(const void *buf, size_t nbytes, struct middfs_request *req,
+                                struct middfs_dict *dict, int *errp) {
   const uint8_t *buf_ = (const uint8_t *) buf;
   size_t used = 0;
 
@@ -374,10 +564,13 @@ size_t deserialize_request(const void *buf, size_t nbytes,
 
   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used),
 			     (uint32_t *) &req->mreq_type, errp);
-  used += deserialize_str(buf_ + used, sizerem(nbytes, used),
-			  &req->mreq_requester, errp);
-  used += deserialize_rsrc(buf_ + used, sizerem(nbytes, used),
-			   &req->mreq_rsrc, errp);
+  used += deserialize_dstr(buf_ + used, sizerem(nbytes, used),
+                           &req->mreq_requester, dict, errp);
+  if (used > nbytes) {
+    return used;
+  }
+  used += deserialize_rsrc_dict(buf_ + used, sizerem(nbytes, used),
+                                &req->mreq_rsrc, dict, errp);
 
   /* stop if already exceeded allowance */
   if (used > nbytes) {
@@ -389,15 +582,26 @@ size_t deserialize_request(const void *buf, size_t nbytes,
   if (req_has_mode(type)) {
     used += deserialize_int32(buf_ + used, sizerem(nbytes, used), &req->mreq_mode, errp);
   }
+  if (req_has_handle(type)) {
+     used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &req->mreq_handle, errp);
+  }
   if (req_has_size(type)) {
      used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &req->mreq_size, errp);
   }
   if (req_has_to(type)) {
-    used += deserialize_rsrc(buf_ + used, sizerem(nbytes, used), &req->mreq_to, errp);
+    used += deserialize_rsrc_dict(buf_ + used, sizerem(nbytes, used), &req->mreq_to, dict, errp);
   }
   if (req_has_off(type)) {
     used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &req->mreq_off, errp);
   }
+  if (req_has_times(type)) {
+     for (int i = 0; i < 2; ++i) {
+        int64_t sec, nsec;
+        used += deserialize_int64(buf_ + used, sizerem(nbytes, used), &sec, errp);
+        used += deserialize_int64(buf_ + used, sizerem(nbytes, used), &nsec, errp);
+        req->mreq_times[i] = (struct timespec) {.tv_sec = sec, .tv_nsec = nsec};
+     }
+  }
 
   /* stop if already exceeded allowance */
   if (used > nbytes) {
@@ -406,10 +610,11 @@ size_t deserialize_request(const void *buf, size_t nbytes,
   
   if (req_has_data(type)) {
      if (sizerem(nbytes, used) >= req->mreq_size) {
-        if ((req->mreq_data = memdup(buf_ + used, req->mreq_size)) == NULL) {
+        if ((req->mreq_payload = payload_dup(buf_ + used, req->mreq_size)) == NULL) {
            *errp = 1;
            return 0;
         }
+        req->mreq_data = req->mreq_payload->pl_data;
      }
      used += req->mreq_size;
   }
@@ -417,35 +622,209 @@ size_t deserialize_request(const void *buf, size_t nbytes,
   return *errp ? 0 : used;
 }
 
+/* serialize_pkt_body() -- serialize the type-specific part of a packet */
+static size_t serialize_pkt_body(const struct middfs_packet *pkt, void *buf, size_t nbytes) {
+  switch (pkt->mpkt_type) {
+  case MPKT_REQUEST:
+     return serialize_request_dict(&pkt->mpkt_un.mpkt_request, pkt->mpkt_dict, buf, nbytes);
+
+  case MPKT_RESPONSE:
+     return serialize_rsp(&pkt->mpkt_un.mpkt_response, buf, nbytes);
+    
+  case MPKT_CONNECT:
+     return serialize_connect(&pkt->mpkt_un.mpkt_connect, buf, nbytes);
+     
+  case MPKT_DISCONNECT:
+  case MPKT_NONE:  
+  default:
+    /* TODO -- there aren't any fields to deserialize yet. */
+    return 0;
+  }
+}
+
+static size_t deserialize_pkt_body(const void *buf, size_t nbytes, struct middfs_packet *pkt,
+                                   int *errp) {
+  switch (pkt->mpkt_type) {
+  case MPKT_REQUEST:
+     return deserialize_request_dict(buf, nbytes, &pkt->mpkt_un.mpkt_request, pkt->mpkt_dict,
+                                     errp);
+
+  case MPKT_RESPONSE:
+     return deserialize_rsp(buf, nbytes, &pkt->mpkt_un.mpkt_response, errp);
+    
+  case MPKT_CONNECT:
+     return deserialize_connect(buf, nbytes, &pkt->mpkt_un.mpkt_connect, errp);
+    
+  case MPKT_DISCONNECT:
+  case MPKT_NONE:  
+  default:
+     /* TODO -- there aren't any fields to deserialize yet. */
+     return 0;
+  }
+}
+
+/* pkt_lz_eligible() -- whether the packet carries a payload worth compressing,
+ * i.e. file data (read responses, write requests) or a directory listing. */
+static bool pkt_lz_eligible(const struct middfs_packet *pkt) {
+  switch (pkt->mpkt_type) {
+  case MPKT_REQUEST:
+    return pkt->mpkt_un.mpkt_request.mreq_type == MREQ_WRITE;
+  case MPKT_RESPONSE:
+    return pkt->mpkt_un.mpkt_response.mrsp_type == MRSP_DATA ||
+      pkt->mpkt_un.mpkt_response.mrsp_type == MRSP_DIR;
+  default:
+    return false;
+  }
+}
+
+/* Scratch buffer holding the uncompressed body of a compressed packet.
+ * Kept around between packets so that it only grows a few times; it is
+ * freed when the thread exits. */
+static _Thread_local struct buffer lz_scratch;
+static _Thread_local bool lz_scratch_registered;
+
+static pthread_key_t lz_scratch_key;
+static pthread_once_t lz_scratch_key_once = PTHREAD_ONCE_INIT;
+
+/* lz_scratch_exit() -- free thread's scratch buffer (called on thread exit,
+ * e.g. when FUSE retires an idle worker) */
+static void lz_scratch_exit(void *arg) {
+  buffer_delete(&lz_scratch);
+  buffer_init(&lz_scratch);
+  lz_scratch_registered = false;
+}
+
+static void lz_scratch_key_init(void) {
+  pthread_key_create(&lz_scratch_key, lz_scratch_exit);
+}
+
+/* lz_scratch_resize() -- grow scratch buffer to at least _size_ bytes
+ * RETV: 0 on success; negated error code on error.
+ */
+static int lz_scratch_resize(size_t size) {
+  if (buffer_size(&lz_scratch) >= size) {
+    return 0;
+  }
+  if (!lz_scratch_registered) {
+    pthread_once(&lz_scratch_key_once, lz_scratch_key_init);
+    pthread_setspecific(lz_scratch_key, &lz_scratch);
+    lz_scratch_registered = true;
+  }
+  return buffer_resize(&lz_scratch, size);
+}
+
+/* serialize_pkt_lz() -- serialize packet body into the scratch buffer
+ * RETV: the body's size; 0 on allocation error.
+ */
+static size_t serialize_pkt_lz(const struct middfs_packet *pkt) {
+  size_t used;
+
+  while ((used = serialize_pkt_body(pkt, lz_scratch.begin, buffer_size(&lz_scratch)))
+         > buffer_size(&lz_scratch)) {
+    if (pkt->mpkt_dict != NULL) {
+      dict_rollback(pkt->mpkt_dict);
+    }
+    if (lz_scratch_resize(used) < 0) {
+      return 0;
+    }
+  }
+
+  return used;
+}
+
+/* Packet framing
+ * A packet is encoded as
+ *   <magic> <type> <flags> <body size> <body>
+ * or, if MPKT_F_LZ is set in <flags>,
+ *   <raw size> <compressed size> <compressed body>
+ * in place of <body size> <body>, so the length of the whole packet is
+ * known from its header. Only eligible bodies (see pkt_lz_eligible()) of
+ * LZ_MIN_SIZE to LZ_MAX_SIZE bytes are compressed, and only when the sender
+ * sets MPKT_F_LZ (see packet_set_lz()) and compression saves at least 1/8
+ * of the body.
+ * If MPKT_F_CRC is set in <flags>, the packet is followed by the CRC32C of
+ * all of the above, which the receiver checks before parsing the body.
+ */
 size_t serialize_pkt(const struct middfs_packet *pkt, void *buf,
 			size_t nbytes) {
   uint8_t *buf_ = (uint8_t *) buf;
   size_t used = 0;
+  uint32_t flags = pkt->mpkt_flags & ~MPKT_F_LZ;
+  size_t rawlen = 0;
+
+  /* discard dictionary strings staged by a previous, incomplete attempt */
+  if (pkt->mpkt_dict != NULL) {
+    dict_rollback(pkt->mpkt_dict);
+  }
 
   used += serialize_uint32((uint32_t) pkt->mpkt_magic, buf_ + used,
 			   sizerem(nbytes, used));
   used += serialize_uint32((uint32_t) pkt->mpkt_type, buf_ + used,
 			   sizerem(nbytes, used));
 
-  switch (pkt->mpkt_type) {
-  case MPKT_REQUEST:
-     used += serialize_request(&pkt->mpkt_un.mpkt_request,
-                               buf_ + used, sizerem(nbytes, used));
-    break;
+  /* size the body without writing it out, so that a buffer too small for the
+   * packet costs neither serializing nor compressing it */
+  if ((pkt->mpkt_flags & MPKT_F_LZ) && pkt_lz_eligible(pkt)) {
+    const size_t crclen = (flags & MPKT_F_CRC) ? sizeof(uint32_t) : 0;
 
-  case MPKT_RESPONSE:
-     used += serialize_rsp(&pkt->mpkt_un.mpkt_response, buf_ + used, sizerem(nbytes, used));
-     break;
+    rawlen = serialize_pkt_body(pkt, NULL, 0);
+    if (pkt->mpkt_dict != NULL) {
+      dict_rollback(pkt->mpkt_dict);
+    }
+    if (rawlen > LZ_MAX_SIZE) {
+      rawlen = 0; /* too large for the receiver to decompress */
+    }
+
+    /* a compressed body is never larger than the raw one */
+    if (rawlen >= LZ_MIN_SIZE &&
+        sizerem(nbytes, used) < sizeof(uint32_t) + sizeof(uint64_t) + rawlen + crclen) {
+      return used + sizeof(uint32_t) + sizeof(uint64_t) + rawlen + crclen;
+    }
+  }
+
+  if (rawlen >= LZ_MIN_SIZE && serialize_pkt_lz(pkt) == rawlen) {
+    const size_t lzhdr = sizeof(uint32_t) + 2 * sizeof(uint64_t); /* flags & sizes */
+    struct lz_stats delta = {0};
+    uint64_t start = lz_clock_ns();
+    ssize_t clen = lz_compress(lz_scratch.begin, rawlen, buf_ + used + lzhdr,
+                               rawlen - rawlen / 8 - 2 * sizeof(uint64_t));
+    delta.ns_compress = lz_clock_ns() - start;
+
+    if (clen >= 0) {
+      used += serialize_uint32(flags | MPKT_F_LZ, buf_ + used, sizerem(nbytes, used));
+      used += serialize_uint64(rawlen, buf_ + used, sizerem(nbytes, used));
+      used += serialize_uint64(clen, buf_ + used, sizerem(nbytes, used));
+      used += clen;
+      delta.frames_compressed = 1;
+      delta.bytes_raw = rawlen;
+      delta.bytes_compressed = clen;
+    } else {
+      /* didn't compress well enough, so send it raw */
+      used += serialize_uint32(flags, buf_ + used, sizerem(nbytes, used));
+      used += serialize_uint64(rawlen, buf_ + used, sizerem(nbytes, used));
+      memcpy(buf_ + used, lz_scratch.begin, rawlen);
+      used += rawlen;
+      delta.frames_skipped = 1;
+    }
+    lz_stats_add(&delta);
     
-  case MPKT_CONNECT:
-     used += serialize_connect(&pkt->mpkt_un.mpkt_connect, buf_ + used, sizerem(nbytes, used));
-     break;
-     
-  case MPKT_DISCONNECT:
-  case MPKT_NONE:  
-  default:
-    /* TODO -- there aren't any fields to deserialize yet. */
-    break;
+  } else {
+    used += serialize_uint32(flags, buf_ + used, sizerem(nbytes, used));
+    size_t lenoff = used; /* body size goes here once it's known */
+    used += sizeof(uint64_t);
+    size_t bodylen = serialize_pkt_body(pkt, buf_ + used, sizerem(nbytes, used));
+    serialize_uint64(bodylen, buf_ + lenoff, sizerem(nbytes, lenoff));
+    used += bodylen;
+  }
+
+  if (flags & MPKT_F_CRC) {
+    uint32_t crc = (used <= nbytes) ? crc32c(0, buf_, used) : 0;
+    used += serialize_uint32(crc, buf_ + used, sizerem(nbytes, used));
+  }
+
+  /* packet was written out in full, so the other end will see the staged strings */
+  if (pkt->mpkt_dict != NULL && used <= nbytes) {
+    dict_commit(pkt->mpkt_dict);
   }
  
   return used;
@@ -453,54 +832,239 @@ size_t serialize_pkt(const struct middfs_packet *pkt, void *buf,
 }
 
 
-size_t deserialize_pkt(const void *buf, size_t nbytes,
-		       struct middfs_packet *pkt, int *errp) {
+/* serialize_pkt_head() -- serialize uncompressed packet but for its payload
+ * ARGS:
+ *  - pkt: packet whose data is a payload (see packet_payload())
+ *  - buf, nbytes: buffer to serialize into
+ *  - headlenp: where to store the offset in the packet of the payload,
+ *    which is the end of the packet but for its CRC, if any
+ * RETV: the number of bytes written (or needed, if more than _nbytes_), not
+ *       counting the payload.
+ * NOTE: This lets the payload be written out from where it is, rather than
+ *       copied into the packet (see middfs_sockend_serialize()).
+ */
+size_t serialize_pkt_head(const struct middfs_packet *pkt, void *buf, size_t nbytes,
+                          size_t *headlenp) {
+  uint8_t *buf_ = (uint8_t *) buf;
+  const struct payload *pl = packet_payload(pkt);
+  const uint32_t flags = pkt->mpkt_flags & ~MPKT_F_LZ;
+  size_t used = 0;
+  size_t bodylen;
+
+  if (pkt->mpkt_dict != NULL) {
+    dict_rollback(pkt->mpkt_dict);
+  }
+
+  used += serialize_uint32((uint32_t) pkt->mpkt_magic, buf_ + used,
+			   sizerem(nbytes, used));
+  used += serialize_uint32((uint32_t) pkt->mpkt_type, buf_ + used,
+			   sizerem(nbytes, used));
+  used += serialize_uint32(flags, buf_ + used, sizerem(nbytes, used));
+
+  bodylen = serialize_pkt_body(pkt, NULL, 0);
+  if (pkt->mpkt_dict != NULL) {
+    dict_rollback(pkt->mpkt_dict);
+  }
+  used += serialize_uint64(bodylen, buf_ + used, sizerem(nbytes, used));
+
+  /* the data is the last member of the body, so leaving no room for it
+   * serializes everything before it */
+  if (pl != NULL) {
+    bodylen -= pl->pl_len;
+  }
+  serialize_pkt_body(pkt, buf_ + used, smin(sizerem(nbytes, used), bodylen));
+  used += bodylen;
+  *headlenp = used;
+
+  if (flags & MPKT_F_CRC) {
+    uint32_t crc = (used <= nbytes) ? crc32c(0, buf_, used) : 0;
+    if (pl != NULL) {
+      crc = crc32c(crc, pl->pl_data, pl->pl_len);
+    }
+    used += serialize_uint32(crc, buf_ + used, sizerem(nbytes, used));
+  }
+
+  if (pkt->mpkt_dict != NULL && used <= nbytes) {
+    dict_commit(pkt->mpkt_dict);
+  }
+
+  return used;
+}
+
+
+/* pkt_crc_ok() -- check the CRC32C following the first _len_ bytes of a packet */
+static bool pkt_crc_ok(const uint8_t *buf, size_t len) {
+  uint32_t crc;
+  int err = 0;
+
+  deserialize_uint32(buf + len, sizeof(crc), &crc, &err);
+  return crc == crc32c(0, buf, len);
+}
+
+/* deserialize_pkt_arena() -- deserialize packet, with members allocated
+ *                            as set up by deserialize_pkt() */
+static size_t deserialize_pkt_arena(const void *buf, size_t nbytes,
+                                    struct middfs_packet *pkt, int *errp) {
   const uint8_t *buf_ = (const void *) buf;
   size_t used = 0;
-  
-  if (*errp) {
-    return 0;
+
+  /* discard dictionary strings staged by a previous, incomplete attempt */
+  if (pkt->mpkt_dict != NULL) {
+    dict_rollback(pkt->mpkt_dict);
   }
   
   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used),
                              &pkt->mpkt_magic, errp);
   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used),
                              (uint32_t *) &pkt->mpkt_type, errp);
+  used += deserialize_uint32(buf_ + used, sizerem(nbytes, used),
+                             &pkt->mpkt_flags, errp);
 
   if (nbytes < used || *errp) {
      return used;
   }
-  
-  switch (pkt->mpkt_type) {
-  case MPKT_REQUEST:
-     used += deserialize_request(buf_ + used, sizerem(nbytes, used),
-                                 &pkt->mpkt_un.mpkt_request, errp);
-     break;
 
-  case MPKT_RESPONSE:
-     used += deserialize_rsp(buf_ + used, sizerem(nbytes, used),
-                             &pkt->mpkt_un.mpkt_response, errp);
-     break;
-    
-  case MPKT_CONNECT:
-    used += deserialize_connect(buf_ + used, sizerem(nbytes, used),
-				&pkt->mpkt_un.mpkt_connect, errp);
-    break;
-    
-  case MPKT_DISCONNECT:
-  case MPKT_NONE:  
-  default:
-     /* TODO -- there aren't any fields to deserialize yet. */
-     break;
+  const size_t crclen = (pkt->mpkt_flags & MPKT_F_CRC) ? sizeof(uint32_t) : 0;
+  if (pkt->mpkt_flags & MPKT_F_LZ) {
+     uint64_t rawlen, clen;
+
+     used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &rawlen, errp);
+     used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &clen, errp);
+     if (nbytes < used) {
+        return used;
+     }
+     if (clen > SIZE_MAX / 2) {
+        *errp = EPROTO;
+        return 0;
+     }
+     if (sizerem(nbytes, used) < clen + crclen) {
+        return used + clen + crclen; /* wait for entire compressed body */
+     }
+
+     /* check the checksum before feeding the body to the decompressor */
+     if (crclen > 0 && !pkt_crc_ok(buf_, used + clen)) {
+        *errp = EIO;
+        return 0;
+     }
+
+     /* reject sizes no valid encoder could have produced, before sizing
+      * the scratch buffer by them */
+     if (rawlen > LZ_MAX_SIZE || rawlen / 255 > clen) {
+        *errp = EPROTO;
+        return 0;
+     }
+     if (lz_scratch_resize(rawlen) < 0) {
+        *errp = ENOMEM;
+        return 0;
+     }
+
+     struct lz_stats delta = {0};
+     uint64_t start = lz_clock_ns();
+     if (lz_decompress(buf_ + used, clen, lz_scratch.begin, rawlen) < 0) {
+        *errp = EPROTO;
+        return 0;
+     }
+     delta.ns_decompress = lz_clock_ns() - start;
+     delta.frames_decompressed = 1;
+     lz_stats_add(&delta);
+     used += clen;
+
+     if (deserialize_pkt_body(lz_scratch.begin, rawlen, pkt, errp) != rawlen) {
+        if (*errp == 0) {
+           *errp = EPROTO; /* body doesn't match its advertised size */
+        }
+        return 0;
+     }
+  } else {
+     uint64_t bodylen;
+
+     used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &bodylen, errp);
+     if (nbytes < used) {
+        return used;
+     }
+     if (bodylen > SIZE_MAX / 2) {
+        *errp = EPROTO;
+        return 0;
+     }
+     if (sizerem(nbytes, used) < bodylen + crclen) {
+        return used + bodylen + crclen; /* wait for entire body */
+     }
+
+     /* check the checksum before trusting any of the body's sizes */
+     if (crclen > 0 && !pkt_crc_ok(buf_, used + bodylen)) {
+        *errp = EIO;
+        return 0;
+     }
+
+     if (deserialize_pkt_body(buf_ + used, bodylen, pkt, errp) != bodylen) {
+        if (*errp == 0) {
+           *errp = EPROTO; /* body doesn't match its advertised size */
+        }
+        return 0;
+     }
+     used += bodylen;
   }
 
   if (*errp) {
      return 0;
   }
+  used += crclen;
+
+  /* packet is complete, so commit staged strings while they're still in _buf_
+   * (or the scratch buffer) */
+  if (pkt->mpkt_dict != NULL && dict_commit(pkt->mpkt_dict) < 0) {
+     *errp = ENOMEM;
+     return 0;
+  }
+
+  return used;
+}
+
+size_t deserialize_pkt(const void *buf, size_t nbytes,
+		       struct middfs_packet *pkt, int *errp) {
+  size_t used;
+  
+  if (*errp) {
+    return 0;
+  }
+
+  deserial_arena = pkt->mpkt_arena;
+  used = deserialize_pkt_arena(buf, nbytes, pkt, errp);
+  deserial_arena = NULL;
 
   return used;
 }
 
+/* deserialize_pkt_len() -- peek at the header of a packet
+ * ARGS:
+ *  - buf, nbytes: beginning of packet
+ *  - pkt: where to store the magic, type and flags of the packet
+ *  - rawlenp: where to store the size of the (decompressed) body
+ * RETV: the length of the whole packet if its header has been received;
+ *       0 otherwise.
+ */
+size_t deserialize_pkt_len(const void *buf, size_t nbytes, struct middfs_packet *pkt,
+                           uint64_t *rawlenp) {
+  const uint8_t *buf_ = (const uint8_t *) buf;
+  uint64_t bodylen;
+  int err = 0;
+  size_t used = 0;
+
+  used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &pkt->mpkt_magic, &err);
+  used += deserialize_uint32(buf_ + used, sizerem(nbytes, used),
+                             (uint32_t *) &pkt->mpkt_type, &err);
+  used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &pkt->mpkt_flags, &err);
+  used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), rawlenp, &err);
+  bodylen = *rawlenp;
+  if ((pkt->mpkt_flags & MPKT_F_LZ) && used <= nbytes) {
+    used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &bodylen, &err);
+  }
+  if (used > nbytes || err || bodylen > SIZE_MAX / 2) {
+    return 0;
+  }
+
+  return used + bodylen + ((pkt->mpkt_flags & MPKT_F_CRC) ? sizeof(uint32_t) : 0);
+}
 
 
 size_t serialize_uint64(const uint64_t uint, void *buf,
@@ -581,6 +1145,12 @@ size_t serialize_rsp(const struct middfs_response *rsp, void *buf, size_t nbytes
       /* serialize error */
       used += serialize_int32(rsp->mrsp_un.mrsp_error, buf_ + used, sizerem(nbytes, used));
       break;
+
+   case MRSP_HANDLE:
+      used += serialize_uint64(rsp->mrsp_un.mrsp_handle.mh_id, buf_ + used, sizerem(nbytes, used));
+      used += serialize_stat(&rsp->mrsp_un.mrsp_handle.mh_stat, buf_ + used,
+                             sizerem(nbytes, used));
+      break;
       
    default:
       abort();
@@ -623,6 +1193,13 @@ size_t deserialize_rsp(const void *buf, size_t nbytes, struct middfs_response *r
    case MRSP_ERROR:
       used += deserialize_int32(buf_ + used, sizerem(nbytes, used), &rsp->mrsp_un.mrsp_error, errp);
       break;
+
+   case MRSP_HANDLE:
+      used += deserialize_uint64(buf_ + used, sizerem(nbytes, used),
+                                 &rsp->mrsp_un.mrsp_handle.mh_id, errp);
+      used += deserialize_stat(buf_ + used, sizerem(nbytes, used),
+                               &rsp->mrsp_un.mrsp_handle.mh_stat, errp);
+      break;
       
    default:
       abort();
@@ -659,6 +1236,17 @@ size_t serialize_stat(const struct middfs_stat *st, void *buf, size_t nbytes) {
    used += serialize_uint64(st->mstat_size, buf_ + used, sizerem(nbytes, used));
    used += serialize_uint64(st->mstat_blocks, buf_ + used, sizerem(nbytes, used));
    used += serialize_uint64(st->mstat_blksize, buf_ + used, sizerem(nbytes, used));
+   used += serialize_int64(st->mstat_mtime, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(st->mstat_mtime_nsec, buf_ + used, sizerem(nbytes, used));
+   used += serialize_int64(st->mstat_atime, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(st->mstat_atime_nsec, buf_ + used, sizerem(nbytes, used));
+   used += serialize_int64(st->mstat_ctime, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(st->mstat_ctime_nsec, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint64(st->mstat_dev, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint64(st->mstat_ino, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(st->mstat_nlink, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(st->mstat_uid, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(st->mstat_gid, buf_ + used, sizerem(nbytes, used));
    
    return used;
 }
@@ -671,6 +1259,17 @@ size_t deserialize_stat(const void *buf, size_t nbytes, struct middfs_stat *st,
    used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &st->mstat_size, errp);
    used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &st->mstat_blocks, errp);
    used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &st->mstat_blksize, errp);
+   used += deserialize_int64(buf_ + used, sizerem(nbytes, used), &st->mstat_mtime, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &st->mstat_mtime_nsec, errp);
+   used += deserialize_int64(buf_ + used, sizerem(nbytes, used), &st->mstat_atime, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &st->mstat_atime_nsec, errp);
+   used += deserialize_int64(buf_ + used, sizerem(nbytes, used), &st->mstat_ctime, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &st->mstat_ctime_nsec, errp);
+   used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &st->mstat_dev, errp);
+   used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &st->mstat_ino, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &st->mstat_nlink, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &st->mstat_uid, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &st->mstat_gid, errp);
 
    return used;
 }
@@ -703,11 +1302,11 @@ size_t deserialize_data(const void *buf, size_t nbytes, struct middfs_data *data
    }
    
    if (sizerem(nbytes, used) >= data->mdata_nbytes && data->mdata_nbytes > 0) {
-      if ((data->mdata_buf = malloc(data->mdata_nbytes)) == NULL) {
+      if ((data->mdata_payload = payload_dup(buf_ + used, data->mdata_nbytes)) == NULL) {
          *errp = 1;
          return 0;
       }
-      memcpy(data->mdata_buf, buf_ + used, data->mdata_nbytes);
+      data->mdata_buf = data->mdata_payload->pl_data;
    }
    used += data->mdata_nbytes;
 
@@ -720,10 +1319,15 @@ size_t serialize_dir(const struct middfs_dir *dir, void *buf, size_t nbytes) {
 
    /* serialize dirent count */
    used += serialize_uint64(dir->mdir_count, buf_ + used, sizerem(nbytes, used));
+   used += serialize_uint32(dir->mdir_plus, buf_ + used, sizerem(nbytes, used));
 
-   /* serialize entries */
+   /* serialize entries, followed by their attributes for readdirplus */
    for (uint64_t i = 0; i < dir->mdir_count; ++i) {
       used += serialize_dirent(&dir->mdir_ents[i], buf_ + used, sizerem(nbytes, used));
+      if (dir->mdir_plus) {
+         used += serialize_stat(&dir->mdir_ents[i].mde_stat, buf_ + used,
+                                sizerem(nbytes, used));
+      }
    }
 
    return used;
@@ -733,22 +1337,35 @@ size_t deserialize_dir(const void *buf, size_t nbytes, struct middfs_dir *dir, i
    const uint8_t *buf_ = (const uint8_t *) buf;
    size_t used = 0;
 
+   uint32_t plus;
+
    used += deserialize_uint64(buf_ + used, sizerem(nbytes, used), &dir->mdir_count, errp);
+   used += deserialize_uint32(buf_ + used, sizerem(nbytes, used), &plus, errp);
+   dir->mdir_plus = plus;
 
    if (*errp || used > nbytes) {
       return used;
    }
 
    /* allocate dirent array */
+   if (dir->mdir_count > sizerem(nbytes, used)) {
+      return used + dir->mdir_count; /* each entry takes at least one byte */
+   }
    if (dir->mdir_ents == NULL) {
-      if ((dir->mdir_ents = calloc(dir->mdir_count, sizeof(*dir->mdir_ents))) == NULL) {
+      size_t size = dir->mdir_count * sizeof(*dir->mdir_ents);
+      if ((dir->mdir_ents = deserial_alloc(size)) == NULL) {
          *errp = 1;
          return 0;
       }
+      memset(dir->mdir_ents, 0, size);
    }
 
    for (uint64_t i = 0; i < dir->mdir_count; ++i) {
       used += deserialize_dirent(buf_ + used, sizerem(nbytes, used), &dir->mdir_ents[i], errp);
+      if (dir->mdir_plus) {
+         used += deserialize_stat(buf_ + used, sizerem(nbytes, used),
+                                  &dir->mdir_ents[i].mde_stat, errp);
+      }
    }
 
    return used;
@@ -11,6 +11,7 @@
 #include "middfs-serial.h"
 #include "middfs-rsrc.h"
 #include "middfs-pkt.h"
+#include "middfs-dict.h"
 
 #define PKT_DEBUG 1
 
@@ -54,12 +55,22 @@ size_t serialize_strp(const char **str, void *buf, size_t nbytes);
 size_t deserialize_str(const void *buf, size_t nbytes,
 		       char **strp, int *errp);
 
+size_t serialize_dstr(const char *str, size_t prefix_len, struct middfs_dict *dict,
+                      void *buf, size_t nbytes);
+size_t deserialize_dstr(const void *buf, size_t nbytes, char **strp,
+                        struct middfs_dict *dict, int *errp);
+
 size_t serialize_rsrc(const struct rsrc *rsrc, void *buf,
 		      size_t nbytes);
 
 size_t deserialize_rsrc(const void *buf, size_t nbytes,
 			struct rsrc *rsrc, int *errp);
 
+size_t serialize_rsrc_dict(const struct rsrc *rsrc, struct middfs_dict *dict,
+                           void *buf, size_t nbytes);
+size_t deserialize_rsrc_dict(const void *buf, size_t nbytes, struct rsrc *rsrc,
+                             struct middfs_dict *dict, int *errp);
+
 size_t serialize_uint32(const uint32_t uint, void *buf,
 			size_t nbytes);
 
@@ -92,11 +103,20 @@ size_t serialize_request(const struct middfs_request *req, void *buf,
 size_t deserialize_request(const void *buf, size_t nbytes,
 			   struct middfs_request *req, int *errp);
 
+size_t serialize_request_dict(const struct middfs_request *req, struct middfs_dict *dict,
+                              void *buf, size_t nbytes);
+size_t deserialize_request_dict(const void *buf, size_t nbytes, struct middfs_request *req,
+                                struct middfs_dict *dict, int *errp);
+
 size_t serialize_pkt(const struct middfs_packet *pkt, void *buf,
 		     size_t nbytes);
+size_t serialize_pkt_head(const struct middfs_packet *pkt, void *buf, size_t nbytes,
+                          size_t *headlenp);
   
 size_t deserialize_pkt(const void *buf, size_t nbytes,
 		       struct middfs_packet *pkt, int *errp);
+size_t deserialize_pkt_len(const void *buf, size_t nbytes, struct middfs_packet *pkt,
+                           uint64_t *rawlenp);
 
 size_t serialize_enum(int *e, void *buf,
 		      size_t nbytes);
@@ -9,20 +9,31 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/uio.h>
 
 #include "middfs-util.h"
 #include "middfs-sock.h"
 
+/* The socket table is a slot map: sockets live in _slots_, which are
+ * recycled through a free list, and _live_ lists the slots in use so that
+ * iteration skips free slots. Removing a socket moves the last entry of
+ * _live_ into its place, so iterating over _live_ from the end visits every
+ * socket exactly once even if the current one is removed.
+ * Each slot has a generation counter, incremented whenever a socket is added
+ * to or removed from it, so a stale struct middfs_sockid never refers to a
+ * socket that has since reused its slot. */
+
 /* middfs_socks_init() -- initialize the _socks_ struct for use
  * by other middfs_socks_* functions
  * ARGS:
  *  - socks: pointer to socket struct to be initialized 
- * RETV: 0 on success; -1 on error
  */
 void middfs_socks_init(struct middfs_socks *socks) {
-   socks->sockinfos = NULL;
-   socks->count = 0;
+   socks->slots = NULL;
    socks->len = 0;
+   socks->live = NULL;
+   socks->count = 0;
+   socks->free = -1;
 }
 
 /* middfs_socks_delete() -- destroy a socket list
@@ -34,97 +45,132 @@ int middfs_socks_delete(struct middfs_socks *socks) {
   int retv = 0;
 
   /* close any open sockets */
-  for (int i = 0; i < socks->count; ++i) {
-    if (middfs_socks_remove(i, socks) < 0) {
+  for (int i = socks->count - 1; i >= 0; --i) {
+    if (middfs_socks_remove(middfs_socks_at(i, socks), socks) < 0) {
       retv = -1;
     }
   }
   
-  free(socks->sockinfos);
+  free(socks->slots);
+  free(socks->live);
+  middfs_socks_init(socks);
   
   return retv;
 }
 
-/* middfs_socks_resize() -- resize a middfs_socks struct
+/* middfs_socks_resize() -- grow a middfs_socks struct
  * ARGS:
  *  - newlen: new number of sockets to accomodate
  *  - socks: struct to operate on
  * RETV: 0 on success; -1 on error
  */
-int middfs_socks_resize(nfds_t newlen, struct middfs_socks *socks) {
+int middfs_socks_resize(int newlen, struct middfs_socks *socks) {
   void *ptr;
 
-  /* realloc sockinfos array */
-  if ((ptr = realloc(socks->sockinfos,
-		     newlen * sizeof(*socks->sockinfos))) == NULL) {
+  assert(newlen >= socks->len);
+
+  /* realloc arrays */
+  if ((ptr = realloc(socks->slots, newlen * sizeof(*socks->slots))) == NULL) {
     return -1;
   }
-  
-  socks->sockinfos = ptr;
+  socks->slots = ptr;
+  if ((ptr = realloc(socks->live, newlen * sizeof(*socks->live))) == NULL) {
+    return -1;
+  }
+  socks->live = ptr;
+
+  /* add new slots to free list */
+  for (int slot = newlen - 1; slot >= socks->len; --slot) {
+    socks->slots[slot].gen = 0;
+    socks->slots[slot].link = socks->free;
+    socks->free = slot;
+  }
   socks->len = newlen;
 
   return 0;
 }
 
-
-int middfs_socks_add(const struct middfs_sockinfo *sockinfo, struct middfs_socks *socks) {
+/* middfs_socks_add() -- add socket to socket table
+ * ARGS:
+ *  - sockinfo: socket to add (copied)
+ *  - socks: socket table
+ *  - idp: where to store the handle of the new socket (may be NULL)
+ * RETV: 0 on success; -1 on error
+ */
+int middfs_socks_add(const struct middfs_sockinfo *sockinfo, struct middfs_socks *socks,
+                     struct middfs_sockid *idp) {
   /* resize if necessary */
-  if (socks->count == socks->len) {
-    nfds_t new_len = MAX(2 * socks->len, 16);
-    if (middfs_socks_resize(new_len, socks) < 0) {
-      return -1;
-    }
+  if (socks->free < 0 && middfs_socks_resize(MAX(2 * socks->len, 16), socks) < 0) {
+    return -1;
   }
-  
-  socks->sockinfos[socks->count] = *sockinfo;
-  ++socks->count;
 
-  return 0;
-}
+  /* take slot from free list */
+  int slot = socks->free;
+  struct middfs_sockslot *sockslot = &socks->slots[slot];
+  socks->free = sockslot->link;
 
-int middfs_socks_remove(nfds_t index, struct middfs_socks *socks) {
-  int retv = 0;
-  
-  assert(index < socks->count);
+  sockslot->info = *sockinfo;
+  ++sockslot->gen;
+  sockslot->link = socks->count;
+  socks->live[socks->count++] = slot;
 
-  if (middfs_sockinfo_delete(&socks->sockinfos[index]) < 0) {
-     retv = -1;
+  if (idp != NULL) {
+    *idp = (struct middfs_sockid) {.slot = slot, .gen = sockslot->gen};
   }
 
-  return retv;
+  return 0;
 }
 
-/* middfs_socks_pack() -- pack open sockets to beginning of array
+/* middfs_socks_remove() -- close socket and remove it from socket table
  * ARGS:
- *  - socks: socket array
- * RETV: the number of open sockets in the array; -1 on error
+ *  - id: handle of socket to remove
+ *  - socks: socket table
+ * RETV: 0 on success; -1 on error (the socket is removed nonetheless)
  */
-int middfs_socks_pack(struct middfs_socks *socks) {
-  int nopen = 0;
+int middfs_socks_remove(struct middfs_sockid id, struct middfs_socks *socks) {
+  int retv = 0;
+  struct middfs_sockinfo *info;
 
-  for (int closed_index = 0; closed_index < socks->count; ++closed_index) {
+  if ((info = middfs_socks_get(id, socks)) == NULL) {
+    return 0; /* already removed */
+  }
 
-     if (!middfs_sockinfo_isopen(&socks->sockinfos[closed_index])) {
+  if (middfs_sockinfo_delete(info) < 0) {
+     retv = -1;
+  }
 
-        for (int open_index = closed_index + 1; open_index < socks->count; ++open_index) {
+  /* move last live socket into the removed socket's place */
+  struct middfs_sockslot *sockslot = &socks->slots[id.slot];
+  int last = socks->live[--socks->count];
+  socks->live[sockslot->link] = last;
+  socks->slots[last].link = sockslot->link;
 
-           if (middfs_sockinfo_isopen(&socks->sockinfos[open_index])) {
-              middfs_sockinfo_move(&socks->sockinfos[closed_index], &socks->sockinfos[open_index]);
-              break;
-           }
-	
-        }
-    } else {
-        
-      ++nopen;
-      
-    }
-     
-  }
+  /* return slot to free list */
+  ++sockslot->gen;
+  sockslot->link = socks->free;
+  socks->free = id.slot;
 
-  socks->count = nopen;
+  return retv;
+}
+
+/* middfs_socks_get() -- look up socket by handle
+ * RETV: the socket; NULL if it has been removed.
+ * NOTE: The pointer is only valid until the next middfs_socks_add().
+ */
+struct middfs_sockinfo *middfs_socks_get(struct middfs_sockid id,
+                                         const struct middfs_socks *socks) {
+  if (id.slot >= (uint32_t) socks->len || socks->slots[id.slot].gen != id.gen ||
+      id.gen % 2 == 0) {
+    return NULL;
+  }
+  return &socks->slots[id.slot].info;
+}
 
-  return nopen;
+/* middfs_socks_at() -- get handle of the _index_-th live socket
+ * (0 <= _index_ < _socks->count_) */
+struct middfs_sockid middfs_socks_at(int index, const struct middfs_socks *socks) {
+  int slot = socks->live[index];
+  return (struct middfs_sockid) {.slot = slot, .gen = socks->slots[slot].gen};
 }
 
 
@@ -140,8 +186,8 @@ ssize_t middfs_socks_pollfds(struct pollfd *pfds, size_t nfds, struct middfs_soc
   size_t nfds_used = 0;
   int err = 0;
   
-  for (size_t i = 0; i < socks->count; ++i) {
-    struct middfs_sockinfo *info = &socks->sockinfos[i];
+  for (int i = 0; i < socks->count; ++i) {
+    struct middfs_sockinfo *info = &socks->slots[socks->live[i]].info;
     nfds_used += middfs_sockinfo_pollfds(pfds + nfds_used, sizerem(nfds, nfds_used), info, &err);
   }
 
@@ -174,7 +220,9 @@ int middfs_socks_poll(struct middfs_socks *socks) {
   middfs_socks_pollfds(pfds, nfds, socks);
   
   /* poll on array */
-  if ((poll(pfds, nfds, -1)) < 0) {
+  /* NOTE: An interrupted poll just reports no events, so that the caller
+   *       gets a chance to act on the signal. */
+  if ((poll(pfds, nfds, -1)) < 0 && errno != EINTR) {
     perror("poll");
     goto cleanup;
   }
@@ -197,6 +245,12 @@ int middfs_socks_poll(struct middfs_socks *socks) {
 int middfs_sockinfo_init(enum middfs_socktype type, int fd_in, int fd_out,
 			 struct middfs_sockinfo *info) {
   info->type = type;
+  info->peer_flags = 0;
+  info->revents = 0;
+  info->stream = (struct middfs_stream) {.fd = -1};
+  info->reject = 0;
+  info->discard = 0;
+  info->admitted = false;
   switch (type) {
   case MFD_NONE:
      info->state = MSS_NONE;
@@ -218,6 +272,10 @@ int middfs_sockinfo_init(enum middfs_socktype type, int fd_in, int fd_out,
 
 int middfs_sockinfo_delete(struct middfs_sockinfo *info) {
   info->type = MFD_NONE;
+  if (info->stream.fd >= 0) {
+     close(info->stream.fd);
+     info->stream.fd = -1;
+  }
   middfs_sockend_delete(&info->in);
   middfs_sockend_delete(&info->out);
   return 0;
@@ -243,10 +301,13 @@ size_t middfs_sockinfo_pollfds(struct pollfd *pfds, size_t nfds, struct middfs_s
 
   enum middfs_sockstate st = info->state;
 
-  if (st == MSS_LSTN || st == MSS_REQRD || st == MSS_RSPFWD) {
+  info->in.revents = info->out.revents = NULL;
+  if (st == MSS_LSTN || st == MSS_REQRD ||
+      (st == MSS_RSPFWD && middfs_sockinfo_relay_ready(info))) {
      used += middfs_sockend_pollfd(&pfds[used], sizerem(nfds, used), POLLIN, &info->in, errp);
   }
-  if (st == MSS_RSPWR || st == MSS_REQFWD) {
+  if (st == MSS_RSPWR || st == MSS_REQFWD ||
+      (st == MSS_RSPFWD && middfs_sockend_used(&info->out) > 0)) {
      used += middfs_sockend_pollfd(&pfds[used], sizerem(nfds, used), POLLOUT, &info->out, errp);
   }
   
@@ -264,16 +325,9 @@ size_t middfs_sockinfo_pollfds(struct pollfd *pfds, size_t nfds, struct middfs_s
  *       then only one will be processed. The others will be caught with the next poll(2). 
  */
 int middfs_sockinfo_check(struct middfs_sockinfo *info) {
-   enum middfs_sockstate st = info->state;
-   int revents_in = 0;
-   int revents_out = 0;
-
-   if (st == MSS_LSTN || st == MSS_REQRD || st == MSS_RSPFWD) {
-      revents_in = middfs_sockend_check(&info->in);
-   }
-   if (st == MSS_RSPWR || st == MSS_REQFWD) {
-      revents_out = middfs_sockend_check(&info->out);
-   }
+   /* only ends polled by middfs_sockinfo_pollfds() have events */
+   int revents_in = middfs_sockend_check(&info->in);
+   int revents_out = middfs_sockend_check(&info->out);
   
   if (revents_in < 0 || revents_out < 0) {
     return -1;
@@ -291,10 +345,11 @@ int middfs_sockinfo_check(struct middfs_sockinfo *info) {
 int middfs_socks_check(struct middfs_socks *socks) {
   int nready = 0;
 
-  for (int i = 0; i < socks->count; ++i) {
+  for (int i = socks->count - 1; i >= 0; --i) {
+    struct middfs_sockid id = middfs_socks_at(i, socks);
     int revents;
-    if ((revents = middfs_sockinfo_check(&socks->sockinfos[i])) < 0) {
-      middfs_socks_remove(i, socks); /* delete entry */
+    if ((revents = middfs_sockinfo_check(middfs_socks_get(id, socks))) < 0) {
+      middfs_socks_remove(id, socks); /* delete entry */
     } else if (revents > 0) {
       ++nready;
     }
@@ -310,11 +365,26 @@ int middfs_socks_check(struct middfs_socks *socks) {
 void middfs_sockend_init(int fd, struct middfs_sockend *sockend) {
   sockend->fd = fd;
   buffer_init(&sockend->buf);
+  sockend->splices = NULL;
+  sockend->nsplices = 0;
+  sockend->maxsplices = 0;
+  sockend->spliced = 0;
+  dict_init(&sockend->dict);
+  arena_init(&sockend->arena);
   sockend->revents = NULL;
 }
 
 int middfs_sockend_delete(struct middfs_sockend *sockend) {
   buffer_delete(&sockend->buf);
+  for (size_t i = 0; i < sockend->nsplices; ++i) {
+     payload_unref(sockend->splices[i].pl);
+  }
+  free(sockend->splices);
+  sockend->splices = NULL;
+  sockend->nsplices = sockend->maxsplices = 0;
+  sockend->spliced = 0;
+  dict_reset(&sockend->dict);
+  arena_delete(&sockend->arena);
   if (sockend->fd >= 0) {
      int fd = sockend->fd;
      sockend->fd = -1;
@@ -325,11 +395,143 @@ int middfs_sockend_delete(struct middfs_sockend *sockend) {
   return 0;
 }
 
+/* middfs_sockend_serialize() -- serialize packet to be written to sockend
+ * ARGS:
+ *  - pkt: packet to serialize
+ *  - sockend: sockend whose buffer to append the packet to
+ * RETV: the number of bytes queued; -1 on error.
+ * NOTE: The payload of an uncompressed packet (see packet_payload()) isn't
+ *       copied into the buffer but written out from where it is by
+ *       middfs_sockend_write(), which holds a reference to it until then.
+ */
+ssize_t middfs_sockend_serialize(const struct middfs_packet *pkt,
+                                 struct middfs_sockend *sockend) {
+   struct buffer *buf = &sockend->buf;
+   struct payload *pl = packet_payload(pkt);
+   struct middfs_splice *splice;
+   size_t used, headlen, before;
+   size_t rem = buffer_rem(buf);
+
+   /* a compressed payload is copied anyway */
+   if (pl == NULL || (pkt->mpkt_flags & MPKT_F_LZ)) {
+      return buffer_serialize(pkt, (serialize_f) serialize_pkt, buf);
+   }
+
+   if (sockend->nsplices == sockend->maxsplices) {
+      size_t newmax = sockend->maxsplices ? sockend->maxsplices * 2 : 4;
+      struct middfs_splice *newsplices;
+      if ((newsplices = realloc(sockend->splices, newmax * sizeof(*newsplices))) == NULL) {
+         return -1;
+      }
+      sockend->splices = newsplices;
+      sockend->maxsplices = newmax;
+   }
+
+   while ((used = serialize_pkt_head(pkt, buf->ptr, rem, &headlen)) > rem) {
+      if (buffer_reserve(buf, used) < 0) {
+         return -1;
+      }
+      rem = buffer_rem(buf);
+   }
+
+   /* the payload goes after the head, which follows the last splice */
+   before = buffer_used(buf) + headlen;
+   for (size_t i = 0; i < sockend->nsplices; ++i) {
+      before -= sockend->splices[i].before;
+   }
+   buffer_advance(buf, used);
+
+   splice = &sockend->splices[sockend->nsplices++];
+   splice->before = before;
+   splice->pl = payload_ref(pl);
+   splice->data = pl->pl_data;
+   splice->len = pl->pl_len;
+   sockend->spliced += pl->pl_len;
+
+   return used + pl->pl_len;
+}
+
+/* Maximum number of I/O vector elements written at once by
+ * middfs_sockend_write() */
+#define MIDDFS_SOCKEND_IOV 16
+
+/* middfs_sockend_write() -- write once from sockend's buffer and the
+ *                           payloads spliced into it, as much as possible
+ * RETV: see write(2)
+ */
+ssize_t middfs_sockend_write(struct middfs_sockend *sockend) {
+   struct buffer *buf = &sockend->buf;
+   struct iovec iov[MIDDFS_SOCKEND_IOV];
+   int iovcnt = 0;
+   size_t off = 0;
+   size_t i;
+   ssize_t bytes_written;
+   size_t rem;
+
+   if (sockend->nsplices == 0) {
+      return buffer_write(sockend->fd, buf);
+   }
+
+   for (i = 0; i < sockend->nsplices && iovcnt + 2 <= MIDDFS_SOCKEND_IOV; ++i) {
+      const struct middfs_splice *splice = &sockend->splices[i];
+      if (splice->before > 0) {
+         iov[iovcnt].iov_base = (uint8_t *) buf->begin + off;
+         iov[iovcnt].iov_len = splice->before;
+         ++iovcnt;
+         off += splice->before;
+      }
+      iov[iovcnt].iov_base = (void *) splice->data;
+      iov[iovcnt].iov_len = splice->len;
+      ++iovcnt;
+   }
+   if (i == sockend->nsplices && buffer_used(buf) > off && iovcnt < MIDDFS_SOCKEND_IOV) {
+      iov[iovcnt].iov_base = (uint8_t *) buf->begin + off;
+      iov[iovcnt].iov_len = buffer_used(buf) - off;
+      ++iovcnt;
+   }
+
+   if ((bytes_written = writev(sockend->fd, iov, iovcnt)) < 0) {
+      return -1;
+   }
+
+   /* consume bytes written, in the order they were written */
+   rem = bytes_written;
+   while (rem > 0 && sockend->nsplices > 0) {
+      struct middfs_splice *splice = &sockend->splices[0];
+      size_t n = smin(rem, splice->before);
+      buffer_shift(buf, n);
+      splice->before -= n;
+      rem -= n;
+
+      n = smin(rem, splice->len);
+      splice->data += n;
+      splice->len -= n;
+      sockend->spliced -= n;
+      rem -= n;
+
+      if (splice->before > 0 || splice->len > 0) {
+         break;
+      }
+      payload_unref(splice->pl);
+      memmove(&sockend->splices[0], &sockend->splices[1],
+              (--sockend->nsplices) * sizeof(*splice));
+   }
+   buffer_shift(buf, rem);
+
+   return bytes_written;
+}
+
+/* middfs_sockend_used() -- number of bytes left to write to sockend,
+ * including spliced payloads */
+size_t middfs_sockend_used(const struct middfs_sockend *sockend) {
+   return buffer_used(&sockend->buf) + sockend->spliced;
+}
+
 int middfs_sockend_check(struct middfs_sockend *sockend) {
    int revents;
    int fd = sockend->fd;
    
-  if (fd < 0) {
+  if (fd < 0 || sockend->revents == NULL) {
      return 0; /* ignore */
   }
 
@@ -385,9 +587,8 @@ bool middfs_sockinfo_isopen(const struct middfs_sockinfo *sockinfo) {
 }
 
 
-void middfs_sockinfo_move(struct middfs_sockinfo *dst, struct middfs_sockinfo *src) {
-   *dst = *src;
-   if (dst != src) {
-      middfs_sockinfo_init(MFD_NONE, -1, -1, src); /* initialize to ``closed'' sockinfo struct */
-   }
+/* middfs_sockinfo_relay_ready() -- whether a socket relaying a response
+ * may read more from its source, i.e. its relay window isn't full. */
+bool middfs_sockinfo_relay_ready(const struct middfs_sockinfo *sockinfo) {
+   return middfs_sockend_used(&sockinfo->out) < MIDDFS_RELAY_WINDOW;
 }
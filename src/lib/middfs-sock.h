@@ -6,8 +6,13 @@
 #define __MIDDFS_SOCK_H
 
 #include <poll.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #include "middfs-buf.h"
+#include "middfs-dict.h"
+#include "middfs-arena.h"
+#include "middfs-pkt.h"
 
 /* middfs_fd_e -- enum describing type of socket */
 enum middfs_socktype
@@ -29,20 +34,54 @@ enum middfs_sockstate
    MSS_NTYPES
   };
 
+/* struct middfs_splice -- payload written out from where it is, between
+ * bytes of a sockend's buffer (see middfs_sockend_serialize()) */
+struct middfs_splice {
+  size_t before;       /* bytes of the buffer written before the payload
+                        * (and after the previous splice) */
+  struct payload *pl;  /* reference held until the payload is written */
+  const uint8_t *data; /* rest of the payload to write */
+  size_t len;
+};
+
 struct middfs_sockend {
   int fd;
   struct buffer buf;
+  struct middfs_splice *splices; /* payloads to write along with _buf_, in order */
+  size_t nsplices;
+  size_t maxsplices;
+  size_t spliced;                /* bytes of payloads left to write */
+  struct middfs_dict dict; /* dictionary for packets passing through this end */
+  struct arena arena;      /* members of the packet last received on this end */
 
   /* Temporary Members */
   const short *revents; /* used by middfs_sockinfo_pollfd() */
 };
 
+/* Maximum number of bytes queued for the destination of a relayed response
+ * (MSS_RSPFWD); reading from the source pauses while the window is full. */
+#define MIDDFS_RELAY_WINDOW (256 * 1024)
+
+/* struct middfs_stream -- streamed response being sent by a responder
+ * (see MPKT_STREAM_CHUNK) */
+struct middfs_stream {
+  int fd;       /* file being read; -1 if not streaming */
+  uint64_t off; /* offset of the next chunk */
+  uint64_t rem; /* bytes left to send */
+};
+
 /* struct middfs_sockinfo -- information about socket
  * NOTE: currently contains singleton member, but included
  * for future extendability. */
 struct middfs_sockinfo {
   enum middfs_socktype type;
   enum middfs_sockstate state;
+  uint32_t peer_flags; /* flags of the last packet received from the requester;
+                        * responses to it are compressed/checksummed likewise */
+  struct middfs_stream stream;
+  int reject;       /* error the current request was rejected with; 0 if none */
+  uint64_t discard; /* bytes of the rejected request still to be skipped */
+  bool admitted;    /* whether the request being received was admitted (see pkt_admit()) */
 
   struct middfs_sockend in;
   struct middfs_sockend out;
@@ -50,10 +89,27 @@ struct middfs_sockinfo {
   int revents; /* combined revents mask */
 };
 
+/* struct middfs_sockid -- handle of a socket in a socket table
+ * A handle stays safe to use after its socket has been removed, even once the
+ * socket's slot has been reused: middfs_socks_get() then returns NULL. */
+struct middfs_sockid {
+  uint32_t slot;
+  uint32_t gen;
+};
+
+struct middfs_sockslot {
+  struct middfs_sockinfo info;
+  uint32_t gen; /* generation of slot; odd while in use */
+  int link;     /* in use: index into _live_; free: next free slot (-1 if none) */
+};
+
+/* struct middfs_socks -- socket table (see middfs-sock.c) */
 struct middfs_socks {
-  struct middfs_sockinfo *sockinfos;
-  int count;
-  int len;
+  struct middfs_sockslot *slots;
+  int len;   /* number of slots */
+  int *live; /* slots in use */
+  int count; /* number of slots in use */
+  int free;  /* first free slot (-1 if none) */
 };
 
 int middfs_sockinfo_init(enum middfs_socktype type, int fd_in, int fd_out,
@@ -64,11 +120,13 @@ int middfs_sockinfo_checkfds(struct pollfd *pfds, int *nfds_checked,
 
 void middfs_socks_init(struct middfs_socks *socks);
 int middfs_socks_delete(struct middfs_socks *socks);
-int middfs_socks_resize(nfds_t newlen, struct middfs_socks *socks);
-int middfs_socks_add(const struct middfs_sockinfo *sockinfo,
-                     struct middfs_socks *socks);
-int middfs_socks_remove(nfds_t index, struct middfs_socks *socks);
-int middfs_socks_pack(struct middfs_socks *socks);
+int middfs_socks_resize(int newlen, struct middfs_socks *socks);
+int middfs_socks_add(const struct middfs_sockinfo *sockinfo, struct middfs_socks *socks,
+                     struct middfs_sockid *idp);
+int middfs_socks_remove(struct middfs_sockid id, struct middfs_socks *socks);
+struct middfs_sockinfo *middfs_socks_get(struct middfs_sockid id,
+                                         const struct middfs_socks *socks);
+struct middfs_sockid middfs_socks_at(int index, const struct middfs_socks *socks);
 
 
 
@@ -77,6 +135,10 @@ int middfs_socks_pack(struct middfs_socks *socks);
  *********************/
 void middfs_sockend_init(int fd, struct middfs_sockend *sockend);
 int middfs_sockend_delete(struct middfs_sockend *sockend);
+ssize_t middfs_sockend_serialize(const struct middfs_packet *pkt,
+                                 struct middfs_sockend *sockend);
+ssize_t middfs_sockend_write(struct middfs_sockend *sockend);
+size_t middfs_sockend_used(const struct middfs_sockend *sockend);
 
 /* POLLING FUNCTIONS */
 
@@ -96,7 +158,6 @@ int middfs_socks_check(struct middfs_socks *socks);
 
 bool middfs_sockend_isopen(const struct middfs_sockend *sockend);
 bool middfs_sockinfo_isopen(const struct middfs_sockinfo *sockinfo);
-
-void middfs_sockinfo_move(struct middfs_sockinfo *dst, struct middfs_sockinfo *src);
+bool middfs_sockinfo_relay_ready(const struct middfs_sockinfo *sockinfo);
 
 #endif
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
@@ -48,6 +49,9 @@ int inet_connect(const char *IP_addr, int port) {
   addr.sin_port = htons(port);
 
   if (connect(sockfd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(sockfd);
+    errno = err;
     return -1; /* connect(2) error */
   }
 
@@ -14,6 +14,7 @@ struct client {
    char *username; /* username of connected client */
    char *IP;       /* IP of connected client */
    uint32_t port;  /* port number on which to connect to client responder */
+   uint32_t features; /* packet flags sent by client on connect (MPKT_F_ACCEPT_LZ, MPKT_F_CRC) */
 };
 
 struct clients {
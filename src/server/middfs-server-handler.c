@@ -23,6 +23,9 @@ static enum handler_e handle_req_wr_fin(struct middfs_sockinfo *sockinfo);
 static enum handler_e handle_rsp_rd_fin(struct middfs_sockinfo *sockinfo,
                                         const struct middfs_packet *in_pkt);
 static enum handler_e handle_rsp_wr_fin(struct middfs_sockinfo *sockinfo);
+static enum handler_e handle_rsp_fwd_fin(struct middfs_sockinfo *sockinfo,
+                                         const struct middfs_packet *hdr,
+                                         const void *pkt, size_t pktlen);
 static enum handler_e handle_req_rd_fin_root(struct middfs_sockinfo *sockinfo,
                                              const struct middfs_request *req,
                                              struct middfs_response *rsp);
@@ -82,6 +85,9 @@ static enum handler_e handle_req_rd_fin(struct middfs_sockinfo *sockinfo,
    enum handler_e retv;
    struct middfs_packet out_pkt;
 
+   /* remember whether the requester accepts compressed responses */
+   sockinfo->peer_flags = in_pkt->mpkt_flags;
+
    /* validate resource */
    const struct middfs_request *req = &in_pkt->mpkt_un.mpkt_request;
    const struct rsrc *rsrc = &req->mreq_rsrc;
@@ -99,13 +105,27 @@ static enum handler_e handle_req_rd_fin(struct middfs_sockinfo *sockinfo,
    if (retv == HS_DEL) {
       return retv;
    }
-   
-   if (buffer_serialize(&out_pkt, (serialize_f) serialize_pkt, &sockinfo->out.buf) < 0) {
-      perror("buffer_serialize");
-      return HS_DEL;
+
+   /* NOTE: _out_pkt_ is either a response to the requester or a request
+    *       forwarded to the owner, in which case the flags were set by
+    *       handle_req_rd_fin_peer(). */
+   if (sockinfo->state == MSS_RSPWR) {
+      packet_set_lz(&out_pkt, true, sockinfo->peer_flags);
+      packet_set_crc(&out_pkt, sockinfo->peer_flags & MPKT_F_CRC);
+   }
+   out_pkt.mpkt_dict = &sockinfo->out.dict;
+   retv = HS_SUC;
+   if (middfs_sockend_serialize(&out_pkt, &sockinfo->out) < 0) {
+      perror("middfs_sockend_serialize");
+      retv = HS_DEL;
+   }
+
+   /* free response generated by the server itself (e.g. root listing) */
+   if (out_pkt.mpkt_type == MPKT_RESPONSE) {
+      response_free(&out_pkt.mpkt_un.mpkt_response);
    }
       
-   return HS_SUC;
+   return retv;
 }
 
 /* handle_req_rd_fin_root() -- handle request for resources owned by root 
@@ -115,6 +135,7 @@ static enum handler_e handle_req_rd_fin_root(struct middfs_sockinfo *sockinfo,
                                              struct middfs_response *rsp) {
    switch (req->mreq_type) {
    case MREQ_READDIR:
+   case MREQ_READDIRPLUS: /* no attributes for client directories */
       response_init(rsp, MRSP_DIR);
       if (clients_readdir(&clients, &rsp->mrsp_un.mrsp_dir) < 0) {
          response_error(rsp, errno);
@@ -134,6 +155,7 @@ static enum handler_e handle_req_rd_fin_root(struct middfs_sockinfo *sockinfo,
       break;
 
    case MREQ_RENAME:
+   case MREQ_UTIMENS:
       response_error(rsp, EPERM);
       break;
       
@@ -170,7 +192,9 @@ static enum handler_e handle_req_rd_fin_peer(struct middfs_sockinfo *sockinfo,
       sockinfo->in.fd = -1;
    } else {
       sockinfo->state = MSS_REQFWD; /* exclusively forward for now. */   
-      *out_pkt = *in_pkt;
+      *out_pkt = *in_pkt; /* borrows _in_pkt_'s strings & payload until serialized */
+      packet_set_lz(out_pkt, true, recipient_info->features);
+      packet_set_crc(out_pkt, recipient_info->features & MPKT_F_CRC);
       
       /* open connection with client responder */
       if ((tmpfd = inet_connect(recipient_info->IP, recipient_info->port)) < 0) {
@@ -178,6 +202,9 @@ static enum handler_e handle_req_rd_fin_peer(struct middfs_sockinfo *sockinfo,
          return HS_DEL;
       }
       sockinfo->out.fd = tmpfd;
+
+      /* the responder starts with an empty dictionary on each new connection */
+      dict_reset(&sockinfo->out.dict);
    }
 
    return HS_SUC;
@@ -202,9 +229,40 @@ static enum handler_e handle_rsp_rd_fin(struct middfs_sockinfo *sockinfo,
                                         const struct middfs_packet *in_pkt) {
    assert(sockinfo->state == MSS_RSPFWD);
 
-   sockinfo->state = MSS_RSPWR;
-   if (buffer_serialize(in_pkt, (serialize_f) serialize_pkt, &sockinfo->out.buf) < 0) {
-      perror("buffer_serialize");
+   /* re-serialize responses that can't be forwarded as they are (see
+    * handle_rsp_fwd_fin()); _out_pkt_ borrows _in_pkt_'s payload, which is
+    * written to the requester from where it is unless compressed */
+   struct middfs_packet out_pkt = *in_pkt;
+   
+   /* keep relaying a streamed response until its last packet, appending
+    * each one to those still being written to the requester */
+   if (!(in_pkt->mpkt_flags & MPKT_F_MORE)) {
+      sockinfo->state = MSS_RSPWR;
+   }
+   /* the owner already found uncompressed responses not worth compressing */
+   packet_set_lz(&out_pkt, true, (in_pkt->mpkt_flags & MPKT_F_LZ) ? sockinfo->peer_flags : 0);
+   packet_set_crc(&out_pkt, sockinfo->peer_flags & MPKT_F_CRC);
+   out_pkt.mpkt_dict = NULL; /* responses don't use a dictionary */
+   if (middfs_sockend_serialize(&out_pkt, &sockinfo->out) < 0) {
+      perror("middfs_sockend_serialize");
+      return HS_DEL;
+   }
+
+   return HS_SUC;
+}
+
+/* handle_rsp_fwd_fin() -- forward compressed response to the requester as it
+ * was received (see struct handler_info) */
+static enum handler_e handle_rsp_fwd_fin(struct middfs_sockinfo *sockinfo,
+                                         const struct middfs_packet *hdr,
+                                         const void *pkt, size_t pktlen) {
+   assert(sockinfo->state == MSS_RSPFWD);
+
+   if (!(hdr->mpkt_flags & MPKT_F_MORE)) {
+      sockinfo->state = MSS_RSPWR;
+   }
+   if (buffer_copy(&sockinfo->out.buf, (void *) pkt, pktlen) < 0) {
+      perror("buffer_copy");
       return HS_DEL;
    }
 
@@ -214,9 +272,18 @@ static enum handler_e handle_rsp_rd_fin(struct middfs_sockinfo *sockinfo,
 static enum handler_e handle_rsp_wr_fin(struct middfs_sockinfo *sockinfo) {
    assert(sockinfo->state == MSS_RSPWR);
 
-   sockinfo->state = MSS_CLOSED; /* this socket will be closed */
+   /* close connection to responder, if the request was forwarded */
+   if (sockinfo->in.fd >= 0 && close(sockinfo->in.fd) < 0) {
+      perror("close");
+   }
+
+   /* keep the requester's connection open and wait for its next request,
+    * so that its dictionary stays valid */
+   sockinfo->state = MSS_REQRD;
+   sockinfo->in.fd = sockinfo->out.fd;
+   sockinfo->out.fd = -1;
    
-   return HS_DEL;   
+   return HS_SUC;
 }
 
 
@@ -233,6 +300,7 @@ static enum handler_e handle_connect(struct middfs_sockinfo *sockinfo,
       perror("client_create");
       return HS_DEL;
    }
+   client.features = in_pkt->mpkt_flags & (MPKT_F_ACCEPT_LZ | MPKT_F_CRC);
 
    /* insert into clients list */
    if (clients_add(&client, &clients) < 0) {
@@ -251,5 +319,6 @@ static enum handler_e handle_connect(struct middfs_sockinfo *sockinfo,
 
 struct handler_info server_hi =
   {.rd_fin = handle_pkt_rd_fin,
-   .wr_fin = handle_pkt_wr_fin
+   .wr_fin = handle_pkt_wr_fin,
+   .fwd_fin = handle_rsp_fwd_fin
   };
@@ -6,32 +6,58 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <limits.h>
+#include <signal.h>
 
 #include "lib/middfs-sock.h"
 #include "lib/middfs-conn.h"
 #include "lib/middfs-rsrc.h"
 #include "lib/middfs-util.h"
+#include "lib/middfs-lz.h"
+#include "lib/middfs-bufpool.h"
+#include "lib/middfs-mem.h"
 
 #include "server/middfs-server-handler.h"
 #include "server/middfs-client.h"
 #include "server/middfs-server.h"
 
+#define MEM_LIMIT_DEFAULT      "1G"  /* memory budget of the server */
+#define MEM_CONN_LIMIT_DEFAULT "64M" /* memory budget of a single connection */
+
 struct clients clients; /* list of connected clients */
 
+static volatile sig_atomic_t dump_stats = 0;
+
+/* handle_sigusr1() -- request a dump of the server's statistics */
+static void handle_sigusr1(int sig) {
+   dump_stats = 1;
+}
+
 int main(int argc, char *argv[]) {
   int exitno = 0;
   char *listen_port = LISTEN_PORT_DEFAULT_STR;
+  const char *mem_limit = MEM_LIMIT_DEFAULT;
+  const char *mem_conn_limit = MEM_CONN_LIMIT_DEFAULT;
+  size_t limit, conn_limit;
   
   /* parse command-line args */
   int c;
-  char *optstring = "p:h";
-  const char *usage = "usage: %s [-p <listen-port>] <mountpoint>\n";
+  char *optstring = "p:m:c:h";
+  const char *usage =
+    "usage: %s [-p <listen-port>] [-m <memory-budget>] [-c <connection-memory-budget>]"
+    " <mountpoint>\n"
+    "Budgets are in bytes, with an optional K, M or G suffix; 0 means unlimited.\n";
   int optvalid = 1;
   while ((c = getopt(argc, argv, optstring)) >= 0) {
     switch (c) {
     case 'p':
       listen_port = optarg;
       break;
+    case 'm':
+      mem_limit = optarg;
+      break;
+    case 'c':
+      mem_conn_limit = optarg;
+      break;
     case 'h':
     case '?':
     default:
@@ -49,6 +75,12 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  if (parse_size(mem_limit, &limit) < 0 || parse_size(mem_conn_limit, &conn_limit) < 0) {
+    fprintf(stderr, usage, argv[0]);
+    return 1;
+  }
+  mem_set_limits(limit, conn_limit);
+
   /* start server for listening */
   struct middfs_socks socks;
   middfs_socks_init(&socks);
@@ -58,8 +90,24 @@ int main(int argc, char *argv[]) {
     return 2;
   }
 
+  /* dump statistics on SIGUSR1
+   * NOTE: No SA_RESTART, so that the signal interrupts poll(2). */
+  struct sigaction sa = {.sa_handler = handle_sigusr1};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+     perror("sigaction");
+     return 2;
+  }
+
   /* call server loop */
-  while (server_loop(&socks, &server_hi) >= 0) {}
+  while (server_loop(&socks, &server_hi) >= 0) {
+     if (dump_stats) {
+        dump_stats = 0;
+        print_lz_stats();
+        print_bufpool_stats();
+        print_mem_stats();
+     }
+  }
 
   /* cleanup */
   if (middfs_socks_delete(&socks) < 0) {